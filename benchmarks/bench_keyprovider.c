@@ -0,0 +1,610 @@
+/*
+ * LICENSE - TBD
+ * Copyright 2013 Jolla Ltd. <chris.adams@jollamobile.com>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "base64ed.h"
+#include "base64ed_simd.h"
+#include "chacha20.h"
+#include "keycache.h"
+#include "sailfishkeyprovider.h"
+#include "sailfishkeyprovider_iniparser.h"
+#include "xorbase64.h"
+#include "xored.h"
+
+int bench_keycache_build();
+int bench_ini_rewrite();
+int bench_base64_throughput();
+int bench_xor_throughput();
+int bench_key_decode();
+int bench_chacha20();
+int bench_decode_keys();
+
+static double elapsed_ms(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000.0
+         + (end->tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+int main(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    bench_keycache_build();
+    bench_ini_rewrite();
+    bench_base64_throughput();
+    bench_xor_throughput();
+    bench_key_decode();
+    bench_chacha20();
+    bench_decode_keys();
+
+    return 0;
+}
+
+/*
+    Builds the fragment cache over 1, 100 and 10000 synthetic
+    storedkeys.d fragments, with increasing worker pool sizes.
+*/
+static int write_fragments(const char *directory, int count)
+{
+    int i = 0;
+    for (i = 0; i < count; ++i) {
+        char path[1024];
+        FILE *stream = NULL;
+        snprintf(path, sizeof(path), "%s/%05d-bench.ini", directory, i);
+        stream = fopen(path, "w");
+        if (stream == NULL) {
+            return -1;
+        }
+        fprintf(stream,
+                "[encoding]\n"
+                "bench%d/scheme=xor\n"
+                "bench%d/key=BenchKey%d\n"
+                "\n"
+                "[encodedkeys]\n"
+                "bench%d/bench-sync/client_id=FScwMHpXSgUH\n"
+                "bench%d/bench-sync/client_secret=ZVdAQH5TTgltCm1cSk0=\n",
+                i, i, i, i, i);
+        fclose(stream);
+    }
+    return 0;
+}
+
+static void remove_fragments(const char *directory, int count)
+{
+    int i = 0;
+    for (i = 0; i < count; ++i) {
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%05d-bench.ini", directory, i);
+        unlink(path);
+    }
+    rmdir(directory);
+}
+
+int bench_keycache_build()
+{
+    int fragmentCounts[] = { 1, 100, 10000 };
+    int workerCounts[] = { 1, 2, 4, 8 };
+    int f = 0, w = 0, r = 0;
+
+    fprintf(stdout, "bench_keycache_build: best of 5, milliseconds\n");
+    fprintf(stdout, "    %10s %8s %8s %8s %8s\n",
+            "fragments", "1 thr", "2 thr", "4 thr", "8 thr");
+
+    for (f = 0; f < 3; ++f) {
+        char directory[] = "/tmp/bench_keyprovider_XXXXXX";
+        if (mkdtemp(directory) == NULL
+                || write_fragments(directory, fragmentCounts[f]) != 0) {
+            fprintf(stdout, "bench_keycache_build: unable to create fragments\n");
+            return -1;
+        }
+
+        fprintf(stdout, "    %10d", fragmentCounts[f]);
+        for (w = 0; w < 4; ++w) {
+            double best = 0.0;
+            for (r = 0; r < 5; ++r) {
+                struct timespec start, end;
+                SailfishKeyProvider_KeyCache *cache = NULL;
+                double ms = 0.0;
+
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                cache = SailfishKeyProvider_keycache_build(directory, workerCounts[w]);
+                clock_gettime(CLOCK_MONOTONIC, &end);
+
+                if (SailfishKeyProvider_keycache_count(cache) != (size_t)(4 * fragmentCounts[f])) {
+                    fprintf(stdout, "\nbench_keycache_build: unexpected entry count\n");
+                }
+                SailfishKeyProvider_keycache_free(cache);
+
+                ms = elapsed_ms(&start, &end);
+                if (r == 0 || ms < best) {
+                    best = ms;
+                }
+            }
+            fprintf(stdout, " %8.3f", best);
+        }
+        fprintf(stdout, "\n");
+
+        remove_fragments(directory, fragmentCounts[f]);
+    }
+
+    return 0;
+}
+
+/*
+    Rewrites a single value in a store of roughly 1 MB.
+*/
+int bench_ini_rewrite()
+{
+    const char *directory = "/tmp";
+    const char *filename = "/tmp/bench_keyprovider_store.ini";
+    int keyCount = 16384;
+    double best = 0.0;
+    FILE *stream = NULL;
+    struct stat st;
+    int i = 0, r = 0;
+
+    stream = fopen(filename, "w");
+    if (stream == NULL) {
+        fprintf(stdout, "bench_ini_rewrite: unable to create store\n");
+        return -1;
+    }
+    fprintf(stream, "[encoding]\n");
+    for (i = 0; i < keyCount / 2; ++i) {
+        fprintf(stream, "provider%05d/service/key=EncodingKeyValue%05d\n", i, i);
+    }
+    fprintf(stream, "\n[encodedkeys]\n");
+    for (i = 0; i < keyCount / 2; ++i) {
+        fprintf(stream, "provider%05d/service/client_id=ZVdAQH5TTgltCm1cSk0ZVdAQH5TTgltCm1cSk0=\n", i);
+    }
+    fclose(stream);
+    stat(filename, &st);
+
+    for (r = 0; r < 5; ++r) {
+        struct timespec start, end;
+        double ms = 0.0;
+        char value[32];
+        snprintf(value, sizeof(value), "RotatedValue%05d", r);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (SailfishKeyProvider_ini_write(directory, filename,
+                    "encodedkeys", "provider00100/service/client_id", value) != 0) {
+            fprintf(stdout, "bench_ini_rewrite: write failed\n");
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        ms = elapsed_ms(&start, &end);
+        if (r == 0 || ms < best) {
+            best = ms;
+        }
+    }
+
+    fprintf(stdout, "bench_ini_rewrite: %ld byte store, %d keys, best of 5: %.3f ms\n",
+            (long)st.st_size, keyCount, best);
+    unlink(filename);
+    return 0;
+}
+
+/*
+    Encodes and decodes 1 MB of random data with each base64 kernel
+    supported by this cpu.  Throughput is given in MB/s of raw data.
+*/
+int bench_base64_throughput()
+{
+    size_t dataSize = 1000000;
+    int defaultKernel = SailfishKeyProvider_base64_selected_kernel();
+    char *data = (char *)malloc(dataSize);
+    int kernel = 0, r = 0;
+    size_t i = 0;
+
+    if (data == NULL) {
+        fprintf(stdout, "bench_base64_throughput: malloc failed\n");
+        return -1;
+    }
+    for (i = 0; i < dataSize; ++i) {
+        data[i] = (char)(rand() & 0xff);
+    }
+
+    fprintf(stdout, "bench_base64_throughput: best of 5, MB/s\n");
+    fprintf(stdout, "    %10s %10s %10s\n", "kernel", "encode", "decode");
+    for (kernel = 0; kernel < SAILFISHKEYPROVIDER_BASE64_KERNEL_COUNT; ++kernel) {
+        double bestEncode = 0.0, bestDecode = 0.0;
+        if (SailfishKeyProvider_base64_select_kernel(kernel) != 0) {
+            continue;
+        }
+        for (r = 0; r < 5; ++r) {
+            struct timespec start, middle, end;
+            char *encoded = NULL, *decoded = NULL;
+            size_t encodedSize = 0;
+            double encodeMs = 0.0, decodeMs = 0.0;
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            encodedSize = SailfishKeyProvider_base64_encode(data, dataSize, &encoded);
+            clock_gettime(CLOCK_MONOTONIC, &middle);
+            if (SailfishKeyProvider_base64_decode(encoded, encodedSize, &decoded) != dataSize) {
+                fprintf(stdout, "bench_base64_throughput: round trip failed\n");
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            free(encoded);
+            free(decoded);
+
+            encodeMs = elapsed_ms(&start, &middle);
+            decodeMs = elapsed_ms(&middle, &end);
+            if (r == 0 || encodeMs < bestEncode) {
+                bestEncode = encodeMs;
+            }
+            if (r == 0 || decodeMs < bestDecode) {
+                bestDecode = decodeMs;
+            }
+        }
+        fprintf(stdout, "    %10s %10.1f %10.1f\n",
+                SailfishKeyProvider_base64_kernel_name(kernel),
+                dataSize / 1000.0 / bestEncode,
+                dataSize / 1000.0 / bestDecode);
+    }
+
+    SailfishKeyProvider_base64_select_kernel(defaultKernel);
+    free(data);
+    return 0;
+}
+
+/*
+    XORs values of 8 bytes to 1 MB with keys of 8 bytes up to the value
+    size, in place, with the keystream kernel and with the byte loop it
+    replaced.  Small values are repeated to get measurable times.
+    Throughput is given in MB/s.
+*/
+static void xor_bytewise(char *value, size_t valueLen, const char *key, size_t keyLen)
+{
+    size_t i = 0;
+    size_t keyIdx = keyLen;
+    for (i = 0; i < valueLen; ++i) {
+        keyIdx += 1;
+        if (keyIdx >= keyLen) {
+            keyIdx = 0;
+        }
+        value[i] = value[i] ^ key[keyIdx];
+    }
+}
+
+int bench_xor_throughput()
+{
+    size_t sizes[] = { 8, 64, 512, 4096, 65536, 1048576 };
+    size_t count = sizeof(sizes) / sizeof(sizes[0]);
+    size_t maxSize = sizes[count - 1];
+    char *value = (char *)malloc(maxSize);
+    char *key = (char *)malloc(maxSize);
+    size_t v = 0, k = 0, i = 0;
+    int r = 0;
+
+    if (value == NULL || key == NULL) {
+        fprintf(stdout, "bench_xor_throughput: malloc failed\n");
+        free(value);
+        free(key);
+        return -1;
+    }
+    for (i = 0; i < maxSize; ++i) {
+        value[i] = (char)(rand() & 0xff);
+        key[i] = (char)(rand() & 0xff);
+    }
+
+    fprintf(stdout, "bench_xor_throughput: best of 5, MB/s\n");
+    fprintf(stdout, "    %10s %10s %10s %10s\n", "value", "key", "bytewise", "keystream");
+    for (v = 0; v < count; ++v) {
+        size_t repeats = (16 * maxSize) / sizes[v];
+        for (k = 0; k < count && sizes[k] <= sizes[v]; ++k) {
+            double bestBytewise = 0.0, bestKeystream = 0.0;
+            for (r = 0; r < 5; ++r) {
+                struct timespec start, middle, end;
+                double bytewiseMs = 0.0, keystreamMs = 0.0;
+
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                for (i = 0; i < repeats; ++i) {
+                    xor_bytewise(value, sizes[v], key, sizes[k]);
+                }
+                clock_gettime(CLOCK_MONOTONIC, &middle);
+                for (i = 0; i < repeats; ++i) {
+                    SailfishKeyProvider_xor_inplace(value, sizes[v], key, sizes[k]);
+                }
+                clock_gettime(CLOCK_MONOTONIC, &end);
+
+                bytewiseMs = elapsed_ms(&start, &middle);
+                keystreamMs = elapsed_ms(&middle, &end);
+                if (r == 0 || bytewiseMs < bestBytewise) {
+                    bestBytewise = bytewiseMs;
+                }
+                if (r == 0 || keystreamMs < bestKeystream) {
+                    bestKeystream = keystreamMs;
+                }
+            }
+            fprintf(stdout, "    %10ld %10ld %10.1f %10.1f\n",
+                    (long)sizes[v], (long)sizes[k],
+                    repeats * sizes[v] / 1000.0 / bestBytewise,
+                    repeats * sizes[v] / 1000.0 / bestKeystream);
+        }
+    }
+
+    free(value);
+    free(key);
+    return 0;
+}
+
+/*
+    Decodes XORed, Base64 encoded values of typical key sizes and larger,
+    in two passes (Base64 then XOR, as decodeKey() used to) and fused.
+    Latency is given in nanoseconds per value.
+*/
+int bench_key_decode()
+{
+    size_t sizes[] = { 16, 40, 128, 1024, 65536 };
+    size_t count = sizeof(sizes) / sizeof(sizes[0]);
+    const char *key = "BenchKey1234";
+    size_t keySize = strlen(key);
+    size_t s = 0, i = 0;
+    int r = 0;
+
+    fprintf(stdout, "bench_key_decode: best of 5, ns per value\n");
+    fprintf(stdout, "    %10s %10s %10s\n", "value", "two pass", "fused");
+    for (s = 0; s < count; ++s) {
+        size_t repeats = (16 * 1048576) / sizes[s];
+        char *value = (char *)malloc(sizes[s]);
+        char *encoded = NULL;
+        size_t encodedSize = 0;
+        double bestTwoPass = 0.0, bestFused = 0.0;
+
+        if (value == NULL) {
+            fprintf(stdout, "bench_key_decode: malloc failed\n");
+            return -1;
+        }
+        for (i = 0; i < sizes[s]; ++i) {
+            value[i] = (char)(rand() & 0xff);
+        }
+        encodedSize = SailfishKeyProvider_xor_base64_encode(
+                &SailfishKeyProvider_base64_standard, 0,
+                value, sizes[s], key, keySize, &encoded);
+
+        for (r = 0; r < 5; ++r) {
+            struct timespec start, middle, end;
+            double twoPassMs = 0.0, fusedMs = 0.0;
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (i = 0; i < repeats; ++i) {
+                char *xored = NULL;
+                size_t xoredSize = SailfishKeyProvider_base64_decode(encoded, encodedSize, &xored);
+                char *plain = SailfishKeyProvider_xor_decode(xored, xoredSize, key, keySize);
+                free(xored);
+                free(plain);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &middle);
+            for (i = 0; i < repeats; ++i) {
+                char *plain = NULL;
+                SailfishKeyProvider_xor_base64_decode(
+                        &SailfishKeyProvider_base64_standard, 0,
+                        encoded, encodedSize, key, keySize, &plain);
+                free(plain);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+
+            twoPassMs = elapsed_ms(&start, &middle);
+            fusedMs = elapsed_ms(&middle, &end);
+            if (r == 0 || twoPassMs < bestTwoPass) {
+                bestTwoPass = twoPassMs;
+            }
+            if (r == 0 || fusedMs < bestFused) {
+                bestFused = fusedMs;
+            }
+        }
+        fprintf(stdout, "    %10ld %10.1f %10.1f\n",
+                (long)sizes[s],
+                bestTwoPass * 1000000.0 / repeats,
+                bestFused * 1000000.0 / repeats);
+
+        free(encoded);
+        free(value);
+    }
+
+    return 0;
+}
+
+/*
+    Generates ChaCha20 keystream with each kernel for short values and
+    for 1 MB, in MB/s, and then compares decodeKey() latency for the
+    "xor" and "chacha20" schemes at typical key sizes, in nanoseconds
+    per value.
+*/
+int bench_chacha20()
+{
+    size_t sizes[] = { 16, 40, 128, 1024 };
+    size_t count = sizeof(sizes) / sizeof(sizes[0]);
+    size_t dataSize = 1048576;
+    int defaultKernel = SailfishKeyProvider_chacha20_selected_kernel();
+    uint8_t *data = (uint8_t *)malloc(dataSize);
+    uint8_t key[SAILFISHKEYPROVIDER_CHACHA20_KEY_SIZE];
+    uint8_t nonce[SAILFISHKEYPROVIDER_CHACHA20_NONCE_SIZE];
+    int kernel = 0, r = 0;
+    size_t s = 0, i = 0;
+
+    if (data == NULL) {
+        fprintf(stdout, "bench_chacha20: malloc failed\n");
+        return -1;
+    }
+    for (i = 0; i < dataSize; ++i) {
+        data[i] = (uint8_t)(rand() & 0xff);
+    }
+    for (i = 0; i < sizeof(key); ++i) {
+        key[i] = (uint8_t)(rand() & 0xff);
+    }
+    memset(nonce, 0, sizeof(nonce));
+
+    fprintf(stdout, "bench_chacha20: keystream, best of 5, MB/s\n");
+    fprintf(stdout, "    %10s %10s %10s %10s\n", "kernel", "40 B", "1 KB", "1 MB");
+    for (kernel = 0; kernel < SAILFISHKEYPROVIDER_CHACHA20_KERNEL_COUNT; ++kernel) {
+        size_t lengths[] = { 40, 1024, 1048576 };
+        double best[3] = { 0.0, 0.0, 0.0 };
+        size_t l = 0;
+        if (SailfishKeyProvider_chacha20_select_kernel(kernel) != 0) {
+            continue;
+        }
+        for (l = 0; l < 3; ++l) {
+            size_t repeats = (16 * dataSize) / lengths[l];
+            for (r = 0; r < 5; ++r) {
+                struct timespec start, end;
+                double ms = 0.0;
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                for (i = 0; i < repeats; ++i) {
+                    SailfishKeyProvider_chacha20_xor(key, 1, nonce, data, data, lengths[l]);
+                }
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                ms = elapsed_ms(&start, &end);
+                if (r == 0 || ms < best[l]) {
+                    best[l] = ms;
+                }
+            }
+            best[l] = repeats * lengths[l] / 1000.0 / best[l];
+        }
+        fprintf(stdout, "    %10s %10.1f %10.1f %10.1f\n",
+                SailfishKeyProvider_chacha20_kernel_name(kernel),
+                best[0], best[1], best[2]);
+    }
+    SailfishKeyProvider_chacha20_select_kernel(defaultKernel);
+
+    fprintf(stdout, "bench_chacha20: decodeKey, best of 5, ns per value\n");
+    fprintf(stdout, "    %10s %10s %10s\n", "value", "xor", "chacha20");
+    for (s = 0; s < count; ++s) {
+        const char *schemes[] = { "xor", "chacha20" };
+        double best[2] = { 0.0, 0.0 };
+        size_t repeats = (4 * dataSize) / sizes[s];
+        char *value = (char *)malloc(sizes[s] + 1);
+        int m = 0;
+
+        if (value == NULL) {
+            fprintf(stdout, "bench_chacha20: malloc failed\n");
+            free(data);
+            return -1;
+        }
+        for (i = 0; i < sizes[s]; ++i) {
+            value[i] = (char)('a' + rand() % 26);
+        }
+        value[sizes[s]] = '\0';
+
+        for (m = 0; m < 2; ++m) {
+            char *encoded = NULL;
+            if (SailfishKeyProvider_encodeKey(value, schemes[m], "BenchKey1234", &encoded) != 0) {
+                fprintf(stdout, "bench_chacha20: %s encode failed\n", schemes[m]);
+                continue;
+            }
+            for (r = 0; r < 5; ++r) {
+                struct timespec start, end;
+                double ms = 0.0;
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                for (i = 0; i < repeats; ++i) {
+                    char *plain = NULL;
+                    SailfishKeyProvider_decodeKey(encoded, schemes[m], "BenchKey1234", &plain);
+                    free(plain);
+                }
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                ms = elapsed_ms(&start, &end);
+                if (r == 0 || ms < best[m]) {
+                    best[m] = ms;
+                }
+            }
+            free(encoded);
+        }
+        fprintf(stdout, "    %10ld %10.1f %10.1f\n",
+                (long)sizes[s],
+                best[0] * 1000000.0 / repeats,
+                best[1] * 1000000.0 / repeats);
+        free(value);
+    }
+
+    free(data);
+    return 0;
+}
+
+/*
+    Decodes batches of short "xor" keys, of 16 to 48 characters, one at
+    a time with decodeKey() and all together with decodeKeys().
+    Latency is given in nanoseconds per key.
+*/
+int bench_decode_keys()
+{
+    size_t counts[] = { 16, 256, 4096 };
+    size_t maxCount = counts[sizeof(counts) / sizeof(counts[0]) - 1];
+    char **encoded = (char **)malloc(maxCount * sizeof(char *));
+    size_t *offsets = (size_t *)malloc((maxCount + 1) * sizeof(size_t));
+    char value[49];
+    size_t c = 0, i = 0, j = 0;
+    int r = 0;
+
+    if (encoded == NULL || offsets == NULL) {
+        fprintf(stdout, "bench_decode_keys: malloc failed\n");
+        free(encoded);
+        free(offsets);
+        return -1;
+    }
+    for (i = 0; i < maxCount; ++i) {
+        size_t size = 16 + rand() % 33;
+        for (j = 0; j < size; ++j) {
+            value[j] = (char)('a' + rand() % 26);
+        }
+        value[size] = '\0';
+        SailfishKeyProvider_encodeKey(value, "xor", "BenchKey1234", &encoded[i]);
+    }
+
+    fprintf(stdout, "bench_decode_keys: best of 5, ns per key\n");
+    fprintf(stdout, "    %10s %10s %10s\n", "keys", "one by one", "batch");
+    for (c = 0; c < sizeof(counts) / sizeof(counts[0]); ++c) {
+        size_t repeats = (4 * maxCount) / counts[c];
+        double bestSingle = 0.0, bestBatch = 0.0;
+        for (r = 0; r < 5; ++r) {
+            struct timespec start, middle, end;
+            double singleMs = 0.0, batchMs = 0.0;
+            size_t n = 0;
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (n = 0; n < repeats; ++n) {
+                for (i = 0; i < counts[c]; ++i) {
+                    char *plain = NULL;
+                    SailfishKeyProvider_decodeKey(encoded[i], "xor", "BenchKey1234", &plain);
+                    free(plain);
+                }
+            }
+            clock_gettime(CLOCK_MONOTONIC, &middle);
+            for (n = 0; n < repeats; ++n) {
+                char *arena = NULL;
+                SailfishKeyProvider_decodeKeys((const char * const *)encoded, counts[c],
+                                               "xor", "BenchKey1234", &arena, offsets);
+                free(arena);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+
+            singleMs = elapsed_ms(&start, &middle);
+            batchMs = elapsed_ms(&middle, &end);
+            if (r == 0 || singleMs < bestSingle) {
+                bestSingle = singleMs;
+            }
+            if (r == 0 || batchMs < bestBatch) {
+                bestBatch = batchMs;
+            }
+        }
+        fprintf(stdout, "    %10ld %10.1f %10.1f\n",
+                (long)counts[c],
+                bestSingle * 1000000.0 / (repeats * counts[c]),
+                bestBatch * 1000000.0 / (repeats * counts[c]));
+    }
+
+    for (i = 0; i < maxCount; ++i) {
+        free(encoded[i]);
+    }
+    free(encoded);
+    free(offsets);
+    return 0;
+}
@@ -0,0 +1,13 @@
+TEMPLATE=app
+TARGET=bench_keyprovider
+TARGETPATH = /opt/tests/libsailfishkeyprovider
+target.path = $$TARGETPATH
+
+CONFIG -= qt
+MOC_DIR = $$PWD/../.moc
+OBJECTS_DIR = $$PWD/../.obj
+
+include($$PWD/../lib/lib.pri)
+SOURCES += bench_keyprovider.c
+
+INSTALLS += target
@@ -25,6 +25,8 @@
 #ifndef SAILFISHKEYPROVIDER_H
 #define SAILFISHKEYPROVIDER_H
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -42,12 +44,25 @@ int SailfishKeyProvider_storedKey(
                     const char * encodedKeyName,
                     char ** storedKey);
 
+int SailfishKeyProvider_removeKey(
+                    const char * providerName,
+                    const char * serviceName,
+                    const char * keyName);
+
 int SailfishKeyProvider_decodeKey(
                     const char * encodedKeyValue,
                     const char * decodingScheme,
                     const char * decodingKey,
                     char ** decodedKey);
 
+int SailfishKeyProvider_decodeKeys(
+                    const char * const * encodedKeyValues,
+                    size_t count,
+                    const char * decodingScheme,
+                    const char * decodingKey,
+                    char ** decodedKeys,
+                    size_t * offsets);
+
 int SailfishKeyProvider_encodeKey(
                     const char * keyValue,
                     const char * encodingScheme,
@@ -0,0 +1,167 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Jolla Ltd.
+** Contact: Chris Adams <chris.adams@jollamobile.com>
+** All rights reserved.
+**
+** You may use this file under the terms of the GNU Lesser General
+** Public License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Public License for more details.
+**
+****************************************************************************/
+
+#ifndef SAILFISHKEYPROVIDER_CONTEXT_H
+#define SAILFISHKEYPROVIDER_CONTEXT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/* A key store, as seen by one user of the library.  The context resolves
+   the paths of the store once, and keeps each ini file it reads parsed
+   until the file changes, so that repeated lookups only stat the files.
+   A context may be used from any number of threads at once.
+
+   SailfishKeyProvider_storedKey() and the other free functions use a
+   default context, created on first use for the home directory which
+   $HOME names at that time. */
+typedef struct SailfishKeyProvider_Context SailfishKeyProvider_Context;
+
+/* Allocates the memory the context owns: its paths and parsed files.
+   Strings returned to the caller are always allocated with malloc(). */
+typedef struct SailfishKeyProvider_Allocator {
+    void * (*allocate)(void * userData, size_t size);
+    void (*release)(void * userData, void * pointer);
+    void * userData;
+} SailfishKeyProvider_Allocator;
+
+typedef struct SailfishKeyProvider_ContextStats {
+    uint64_t lookups;
+    uint64_t stores;
+    uint64_t removals;
+    uint64_t cacheHits;   /* ini files found parsed and unchanged */
+    uint64_t cacheMisses; /* ini files which had to be parsed */
+    size_t cachedFiles;
+    size_t cachedBytes;
+} SailfishKeyProvider_ContextStats;
+
+/* Returns a context for the key store of $HOME, or NULL on failure.
+   A NULL \a allocator selects malloc() and free(). */
+SailfishKeyProvider_Context * SailfishKeyProvider_context_create(
+                    const SailfishKeyProvider_Allocator * allocator);
+
+/* Returns a context for the key store in \a home, the home directory
+   of any user, or NULL on failure */
+SailfishKeyProvider_Context * SailfishKeyProvider_context_create_for_home(
+                    const char * home,
+                    const SailfishKeyProvider_Allocator * allocator);
+
+void SailfishKeyProvider_context_destroy(
+                    SailfishKeyProvider_Context * context);
+
+/* As SailfishKeyProvider_storedKey() and friends, within \a context */
+int SailfishKeyProvider_context_storedKey(
+                    SailfishKeyProvider_Context * context,
+                    const char * providerName,
+                    const char * serviceName,
+                    const char * keyName,
+                    char ** storedKey);
+
+int SailfishKeyProvider_context_storeKey(
+                    SailfishKeyProvider_Context * context,
+                    const char * providerName,
+                    const char * serviceName,
+                    const char * encodedKeyName,
+                    const char * encodedValue,
+                    const char * encodingScheme,
+                    const char * encodingKey);
+
+int SailfishKeyProvider_context_removeKey(
+                    SailfishKeyProvider_Context * context,
+                    const char * providerName,
+                    const char * serviceName,
+                    const char * keyName);
+
+void SailfishKeyProvider_context_stats(
+                    SailfishKeyProvider_Context * context,
+                    SailfishKeyProvider_ContextStats * stats);
+
+/* As SailfishKeyProvider_storedKey() and friends, for the key store in
+   \a home, or in the home directory of the user \a uid.  A service which
+   acts for several users can call these from any thread without
+   touching $HOME.  The library keeps a context for each store, and
+   discards the least recently used ones when their memory would exceed
+   the limit set with SailfishKeyProvider_set_store_cache_limit(). */
+int SailfishKeyProvider_home_storedKey(
+                    const char * home,
+                    const char * providerName,
+                    const char * serviceName,
+                    const char * keyName,
+                    char ** storedKey);
+
+int SailfishKeyProvider_home_storeKey(
+                    const char * home,
+                    const char * providerName,
+                    const char * serviceName,
+                    const char * encodedKeyName,
+                    const char * encodedValue,
+                    const char * encodingScheme,
+                    const char * encodingKey);
+
+int SailfishKeyProvider_home_removeKey(
+                    const char * home,
+                    const char * providerName,
+                    const char * serviceName,
+                    const char * keyName);
+
+int SailfishKeyProvider_user_storedKey(
+                    uid_t uid,
+                    const char * providerName,
+                    const char * serviceName,
+                    const char * keyName,
+                    char ** storedKey);
+
+int SailfishKeyProvider_user_storeKey(
+                    uid_t uid,
+                    const char * providerName,
+                    const char * serviceName,
+                    const char * encodedKeyName,
+                    const char * encodedValue,
+                    const char * encodingScheme,
+                    const char * encodingKey);
+
+int SailfishKeyProvider_user_removeKey(
+                    uid_t uid,
+                    const char * providerName,
+                    const char * serviceName,
+                    const char * keyName);
+
+/* Bounds the memory of the contexts kept for the functions above, 1 MiB
+   by default.  The most recently used store is always kept, although
+   its parsed files are dropped if it alone exceeds the limit. */
+void SailfishKeyProvider_set_store_cache_limit(
+                    size_t bytes);
+
+/* Returns the number of stores kept, and their memory in \a bytes */
+size_t SailfishKeyProvider_store_cache_usage(
+                    size_t * bytes);
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SAILFISHKEYPROVIDER_CONTEXT_H */
@@ -63,6 +63,22 @@ int SailfishKeyProvider_ini_write_multiple(
                     const char * keys,
                     const char * values,
                     const char * separator);
+
+int SailfishKeyProvider_ini_remove(
+                    const char * filename, /* must include full path */
+                    const char * section,
+                    const char * key);     /* NULL removes the whole section */
+
+/* Writers hold an exclusive lock on "<filename>.lock" for each update.
+   When enabled, readers wait for a shared lock on it as well, so that
+   they never see an update half applied.  Disabled by default. */
+void SailfishKeyProvider_ini_set_read_locking(
+                    int enabled);
+
+/* When enabled, each update is flushed to storage with fdatasync()
+   before the writer returns.  Disabled by default. */
+void SailfishKeyProvider_ini_set_durable(
+                    int enabled);
 #ifdef __cplusplus
 }
 #endif
@@ -21,17 +21,67 @@
 #ifndef SAILFISHKEYPROVIDER_PROCESSMUTEX_H
 #define SAILFISHKEYPROVIDER_PROCESSMUTEX_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#define SAILFISHKEYPROVIDER_LOCK_WAIT_BUCKETS 24
+
+/* Lock statistics of this process, summed over every lock of one kind
+   ("ProcessMutex", "StripedProcessMutex" or "Semaphore") on one path.
+   Bucket i of the histogram counts contended waits of [2^i, 2^(i+1))
+   microseconds; the first and last buckets also count any shorter and
+   longer waits. */
+typedef struct SailfishKeyProvider_LockStats {
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t totalWaitNs;
+    uint64_t maxWaitNs;
+    uint64_t waitHistogram[SAILFISHKEYPROVIDER_LOCK_WAIT_BUCKETS];
+} SailfishKeyProvider_LockStats;
+
+/* Returns 0 and fills in \a stats if a lock of \a kind was created on
+   \a path, or -1 if not */
+int SailfishKeyProvider_lock_stats(
+                    const char * kind,
+                    const char * path,
+                    SailfishKeyProvider_LockStats * stats);
+
+/* Writes the statistics of every lock to \a stream, one line each */
+void SailfishKeyProvider_lock_stats_dump(
+                    FILE * stream);
+
+void SailfishKeyProvider_lock_stats_reset(void);
+
+/* Statistics are collected unless disabled */
+void SailfishKeyProvider_lock_stats_set_enabled(
+                    int enabled);
 #ifdef __cplusplus
+}
+#endif
 
-#include <stddef.h>
+#ifdef __cplusplus
 
 namespace Sailfish {
 
 namespace KeyProvider {
 
+struct LockStatistics;
+
 class Semaphore
 {
 public:
+    // Adds value to the semaphore at index, or waits for it to be zero if
+    // value is zero.  The adjustment is undone if the process exits.
+    struct Operation {
+        size_t index;
+        int value;
+    };
+
     Semaphore(const char *identifier, int initial);
     Semaphore(const char *identifier, size_t count, const int *initialValues);
     ~Semaphore();
@@ -41,27 +91,129 @@ public:
     bool decrement(size_t index = 0, bool wait = true, size_t timeoutMs = 0);
     bool increment(size_t index = 0, bool wait = true, size_t timeoutMs = 0);
 
+    // Performs all of the operations atomically, in one system call: the
+    // call waits until every operation can proceed, and then applies them all
+    bool operate(const Operation *operations, size_t count, bool wait = true, size_t timeoutMs = 0);
+    // As operate(), waiting no later than a CLOCK_MONOTONIC deadline
+    bool operateUntil(const Operation *operations, size_t count, const struct timespec &deadline);
+
     int value(size_t index = 0) const;
 
 private:
+    friend class ProcessMutex;
+
+    // Keys the array on the path with the given ftok() proj_id
+    Semaphore(const char *identifier, size_t count, const int *initialValues, int projectId);
+
+    bool operate(const Operation *operations, size_t count, bool wait, const struct timespec *deadline);
     void error(const char *msg, int error);
 
     char *m_identifier;
     int m_id;
+    LockStatistics *m_stats;
 };
 
+struct SharedLockData;
+
 class ProcessMutex
 {
-    Semaphore m_semaphore;
-    bool m_initialProcess;
-
 public:
+    enum Backend {
+        // SysV semaphore array keyed on the path; every operation is a syscall
+        SemaphoreBackend,
+        // Robust futex in a shared memory object keyed on the path; uncontended
+        // operations stay in userspace.  Must be unlocked by the locking thread.
+        SharedMemoryBackend
+    };
+
     explicit ProcessMutex(const char *path);
+    ProcessMutex(const char *path, Backend backend);
+    ~ProcessMutex();
 
+    Backend backend() const;
+
+    // Exclusive locking, for writers.  The timed variants give up with
+    // errno set to ETIMEDOUT once timeoutMs has elapsed, or the deadline on
+    // CLOCK_MONOTONIC has passed; a timeout of zero tries once.
     bool lock();
+    bool tryLockFor(size_t timeoutMs);
+    bool tryLockUntil(const struct timespec &deadline);
     bool unlock();
     bool isLocked() const;
+
+    // Shared locking, for readers.  Any number of processes may hold the
+    // lock shared at once; waiting writers take precedence over new readers.
+    // With SharedMemoryBackend the lock is taken exclusively.
+    bool lockShared();
+    bool unlockShared();
+
     bool isInitialProcess() const;
+
+private:
+    ProcessMutex(const ProcessMutex &);
+    ProcessMutex &operator=(const ProcessMutex &);
+
+    void init(const char *path);
+    bool acquire(const struct timespec *deadline);
+
+    Backend m_backend;
+    Semaphore *m_semaphore;
+    SharedLockData *m_shared;
+    LockStatistics *m_stats;
+    bool m_initialProcess;
+};
+
+// A set of independent exclusive locks on one path, selected by a hash of
+// a name, so that unrelated writers don't serialize on a single lock.
+// lockAll() takes every stripe, for operations on everything at once.
+class StripedProcessMutex
+{
+public:
+    explicit StripedProcessMutex(const char *path, size_t stripes = 16,
+                                 ProcessMutex::Backend backend = ProcessMutex::SemaphoreBackend);
+    ~StripedProcessMutex();
+
+    bool isValid() const;
+    size_t stripeCount() const;
+    size_t stripe(const char *name) const;
+
+    bool lock(const char *name);
+    bool unlock(const char *name);
+    bool lockAll();
+    bool unlockAll();
+
+private:
+    StripedProcessMutex(const StripedProcessMutex &);
+    StripedProcessMutex &operator=(const StripedProcessMutex &);
+
+    bool adjust(size_t first, size_t count, int value);
+
+    ProcessMutex::Backend m_backend;
+    char *m_identifier;
+    size_t m_count;
+    int m_id;
+    SharedLockData *m_shared;
+    LockStatistics *m_stats;
+};
+
+// Holds a ProcessMutex locked for the lifetime of the locker
+class ProcessMutexLocker
+{
+public:
+    explicit ProcessMutexLocker(ProcessMutex *mutex);
+    ProcessMutexLocker(ProcessMutex *mutex, size_t timeoutMs);
+    ~ProcessMutexLocker();
+
+    // False if the mutex could not be locked, or has been unlocked
+    bool isLocked() const;
+    void unlock();
+
+private:
+    ProcessMutexLocker(const ProcessMutexLocker &);
+    ProcessMutexLocker &operator=(const ProcessMutexLocker &);
+
+    ProcessMutex *m_mutex;
+    bool m_locked;
 };
 
 } /* KeyProvider */
@@ -0,0 +1,110 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Jolla Ltd.
+** Contact: Chris Adams <chris.adams@jollamobile.com>
+** All rights reserved.
+**
+** You may use this file under the terms of the GNU Lesser General
+** Public License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Public License for more details.
+**
+****************************************************************************/
+
+#ifndef SAILFISHKEYPROVIDER_SCHEMES_H
+#define SAILFISHKEYPROVIDER_SCHEMES_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+typedef struct SailfishKeyProvider_Scheme SailfishKeyProvider_Scheme;
+
+/* An encoding scheme, as named by the "scheme" entries of the key store.
+   Values and keys are null-terminated C-strings, and each function
+   returns 0 on success or -1 on failure.  The caller owns the strings
+   returned through \a encoded and \a decoded and must free() them. */
+struct SailfishKeyProvider_Scheme {
+    const char * name;
+    const void * data; /* for the scheme's own use */
+
+    int (*encode)(const SailfishKeyProvider_Scheme * scheme,
+                  const char * value,
+                  const char * key,
+                  char ** encoded);
+    int (*decode)(const SailfishKeyProvider_Scheme * scheme,
+                  const char * encodedValue,
+                  const char * key,
+                  char ** decoded);
+
+    /* optional, may be NULL: decodes \a value over itself */
+    int (*decode_inplace)(const SailfishKeyProvider_Scheme * scheme,
+                          char * value,
+                          const char * key);
+    /* optional, may be NULL: decodes \a count values with the same key;
+       on failure no values are returned */
+    int (*decode_batch)(const SailfishKeyProvider_Scheme * scheme,
+                        const char * const * encodedValues,
+                        size_t count,
+                        const char * key,
+                        char ** decoded);
+    /* optional, may be NULL: decodes \a count values with the same key
+       into one allocation, \see SailfishKeyProvider_scheme_decode_arena() */
+    int (*decode_arena)(const SailfishKeyProvider_Scheme * scheme,
+                        const char * const * encodedValues,
+                        size_t count,
+                        const char * key,
+                        char ** arena,
+                        size_t * offsets);
+};
+
+int SailfishKeyProvider_scheme_register(
+                    const SailfishKeyProvider_Scheme * scheme);
+
+uint32_t SailfishKeyProvider_scheme_hash(
+                    const char * name);
+
+const SailfishKeyProvider_Scheme * SailfishKeyProvider_scheme_find(
+                    const char * name);
+
+const SailfishKeyProvider_Scheme * SailfishKeyProvider_scheme_find_hashed(
+                    uint32_t hash,
+                    const char * name);
+
+int SailfishKeyProvider_scheme_decode_inplace(
+                    const SailfishKeyProvider_Scheme * scheme,
+                    char * value,
+                    const char * key);
+
+int SailfishKeyProvider_scheme_decode_batch(
+                    const SailfishKeyProvider_Scheme * scheme,
+                    const char * const * encodedValues,
+                    size_t count,
+                    const char * key,
+                    char ** decoded);
+
+int SailfishKeyProvider_scheme_decode_arena(
+                    const SailfishKeyProvider_Scheme * scheme,
+                    const char * const * encodedValues,
+                    size_t count,
+                    const char * key,
+                    char ** arena,
+                    size_t * offsets);
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SAILFISHKEYPROVIDER_SCHEMES_H */
@@ -4,17 +4,41 @@ INCLUDEPATH += \
 
 HEADERS += \
     $$PWD/include/sailfishkeyprovider.h \
+    $$PWD/include/sailfishkeyprovider_context.h \
     $$PWD/include/sailfishkeyprovider_iniparser.h \
     $$PWD/include/sailfishkeyprovider_processmutex.h \
+    $$PWD/include/sailfishkeyprovider_schemes.h \
     $$PWD/src/base64ed.h \
+    $$PWD/src/base64ed_simd.h \
+    $$PWD/src/chacha20.h \
+    $$PWD/src/context.h \
+    $$PWD/src/dispatch.h \
+    $$PWD/src/iniparser.h \
+    $$PWD/src/keycache.h \
+    $$PWD/src/keystorelock.h \
+    $$PWD/src/xorbase64.h \
     $$PWD/src/xored.h
 
 SOURCES += \
     $$PWD/src/sailfishkeyprovider.c \
     $$PWD/src/base64ed.c \
+    $$PWD/src/base64ed_simd.c \
+    $$PWD/src/chacha20.c \
+    $$PWD/src/context.c \
+    $$PWD/src/dispatch.c \
     $$PWD/src/xored.c \
+    $$PWD/src/xorbase64.c \
     $$PWD/src/iniparser.c \
-    $$PWD/src/processmutex.cpp
+    $$PWD/src/keycache.c \
+    $$PWD/src/schemes.c \
+    $$PWD/src/stores.c \
+    $$PWD/src/processmutex.cpp \
+    $$PWD/src/keystorelock.cpp
+
+LIBS += -lpthread -lrt
+
+# Stores user keys in one file per provider, rather than a single file
+!no_sharded_keystore: DEFINES += SAILFISHKEYPROVIDER_SHARDED_KEYSTORE
 
 OTHER_FILES += \
     $$PWD/pkgconfig/libsailfishkeyprovider.pc
@@ -4,6 +4,9 @@ TARGET = $$qtLibraryTarget($$TARGET)
 TARGETPATH = $$[QT_INSTALL_LIBS]
 target.path = $$TARGETPATH
 
+# The major version is the soname: bump it whenever the ABI breaks
+isEmpty(VERSION): VERSION = 2.0.0
+
 CONFIG -= qt
 CONFIG += create_pc create_prl no_install_prl
 MOC_DIR = $$PWD/../.moc
@@ -14,8 +17,10 @@ include($$PWD/lib.pri)
 includes.path = /usr/include/libsailfishkeyprovider
 includes.files = \
     $$PWD/include/sailfishkeyprovider.h \
+    $$PWD/include/sailfishkeyprovider_context.h \
     $$PWD/include/sailfishkeyprovider_iniparser.h \
-    $$PWD/include/sailfishkeyprovider_processmutex.h
+    $$PWD/include/sailfishkeyprovider_processmutex.h \
+    $$PWD/include/sailfishkeyprovider_schemes.h
 
 packageconfig.path = $$[QT_INSTALL_LIBS]/pkgconfig
 packageconfig.files = $$PWD/pkgconfig/libsailfishkeyprovider.pc
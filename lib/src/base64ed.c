@@ -25,99 +25,150 @@
 /*
     Base64 encoding and decoding functions
 
-    Note that this code isn't intended to be particularly performant,
-    but rather simple to understand and robust.
+    The block loops below are the simple, robust reference
+    implementation.  Long inputs are mostly handled by the vectorised
+    kernels in base64ed_simd.c, and the loops finish off the rest.
+
+    Both the standard alphabet and the URL and filename safe alphabet of
+    RFC 4648 are supported, with or without padding.  The alphabets only
+    differ in their last two characters, and the tables for each are
+    generated at compile time from those two characters.
 */
 
 #include "base64ed.h"
+#include "base64ed_simd.h"
 
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
-static const char b64_charset[] = {
-    'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H',
-    'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P',
-    'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X',
-    'Y', 'Z', 'a', 'b', 'c', 'd', 'e', 'f',
-    'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n',
-    'o', 'p', 'q', 'r', 's', 't', 'u', 'v',
-    'w', 'x', 'y', 'z', '0', '1', '2', '3',
-    '4', '5', '6', '7', '8', '9', '+', '/'
+/* character for the 6 bit value i */
+#define B64_CHAR(i, c62, c63)                                   \
+    ((i) < 26 ? 'A' + (i) :                                     \
+     (i) < 52 ? 'a' + (i) - 26 :                                \
+     (i) < 62 ? '0' + (i) - 52 :                                \
+     (i) == 62 ? (c62) : (c63))
+#define B64_CHARSET_4(i, c62, c63)                              \
+    B64_CHAR((i), c62, c63), B64_CHAR((i)+1, c62, c63),         \
+    B64_CHAR((i)+2, c62, c63), B64_CHAR((i)+3, c62, c63)
+#define B64_CHARSET_16(i, c62, c63)                             \
+    B64_CHARSET_4((i), c62, c63), B64_CHARSET_4((i)+4, c62, c63),   \
+    B64_CHARSET_4((i)+8, c62, c63), B64_CHARSET_4((i)+12, c62, c63)
+#define B64_CHARSET(c62, c63)                                   \
+    B64_CHARSET_16(0, c62, c63), B64_CHARSET_16(16, c62, c63),  \
+    B64_CHARSET_16(32, c62, c63), B64_CHARSET_16(48, c62, c63)
+
+/* 6 bit value of the character c; 0xFF marks characters outside the charset */
+#define B64_VALUE(c, c62, c63)                                  \
+    ((c) >= 'A' && (c) <= 'Z' ? (c) - 'A' :                     \
+     (c) >= 'a' && (c) <= 'z' ? (c) - 'a' + 26 :                \
+     (c) >= '0' && (c) <= '9' ? (c) - '0' + 52 :                \
+     (c) == (c62) ? 62 : (c) == (c63) ? 63 : 0xFF)
+#define B64_REVERSE_4(c, c62, c63)                              \
+    B64_VALUE((c), c62, c63), B64_VALUE((c)+1, c62, c63),       \
+    B64_VALUE((c)+2, c62, c63), B64_VALUE((c)+3, c62, c63)
+#define B64_REVERSE_16(c, c62, c63)                             \
+    B64_REVERSE_4((c), c62, c63), B64_REVERSE_4((c)+4, c62, c63),   \
+    B64_REVERSE_4((c)+8, c62, c63), B64_REVERSE_4((c)+12, c62, c63)
+#define B64_REVERSE_64(c, c62, c63)                             \
+    B64_REVERSE_16((c), c62, c63), B64_REVERSE_16((c)+16, c62, c63),    \
+    B64_REVERSE_16((c)+32, c62, c63), B64_REVERSE_16((c)+48, c62, c63)
+#define B64_REVERSE(c62, c63)                                   \
+    B64_REVERSE_64(0, c62, c63), B64_REVERSE_64(64, c62, c63),  \
+    B64_REVERSE_64(128, c62, c63), B64_REVERSE_64(192, c62, c63)
+
+static const char b64_standard_charset[64] = { B64_CHARSET('+', '/') };
+static const uint8_t b64_standard_reverse[256] = { B64_REVERSE('+', '/') };
+static const char b64_url_charset[64] = { B64_CHARSET('-', '_') };
+static const uint8_t b64_url_reverse[256] = { B64_REVERSE('-', '_') };
+
+const SailfishKeyProvider_base64_alphabet SailfishKeyProvider_base64_standard = {
+    b64_standard_charset,
+    b64_standard_reverse
 };
 
-static const uint8_t b64_reverse[] = {
-    0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,     /*   0 -   7 */
-    0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,     /*   8 -  15 */
-    0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,     /*  16 -  23 */
-    0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,     /*  24 -  31 */
-    0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,     /*  32 -  39 */
-    0x0, 0x0, 0x0,  62, 0x0, 0x0, 0x0,  63,     /*  40 -  47 */
-     52,  53,  54,  55,  56,  57,  58,  59,     /*  48 -  55 */
-     60,  61, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,     /*  56 -  63 */
-    0x0,   0,   1,   2,   3,   4,   5,   6,     /*  64 -  71 */
-      7,   8,   9,  10,  11,  12,  13,  14,     /*  72 -  79 */
-     15,  16,  17,  18,  19,  20,  21,  22,     /*  80 -  87 */
-     23,  24,  25, 0x0, 0x0, 0x0, 0x0, 0x0,     /*  88 -  95 */
-    0x0,  26,  27,  28,  29,  30,  31,  32,     /*  96 - 103 */
-     33,  34,  35,  36,  37,  38,  39,  40,     /* 104 - 111 */
-     41,  42,  43,  44,  45,  46,  47,  48,     /* 112 - 119 */
-     49,  50,  51, 0x0, 0x0, 0x0, 0x0, 0x0,     /* 120 - 127 */
-    0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,     /* 128 - 135 */
-    0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,     /* 136 - 143 */
-    0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,     /* 144 - 151 */
-    0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,     /* 152 - 159 */
-    0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,     /* 160 - 167 */
-    0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,     /* 168 - 175 */
-    0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,     /* 176 - 183 */
-    0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,     /* 184 - 191 */
-    0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,     /* 192 - 199 */
-    0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,     /* 200 - 207 */
-    0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,     /* 208 - 215 */
-    0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,     /* 216 - 223 */
-    0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,     /* 224 - 231 */
-    0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,     /* 232 - 239 */
-    0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,     /* 240 - 247 */
-    0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0      /* 248 - 255 */
+const SailfishKeyProvider_base64_alphabet SailfishKeyProvider_base64_url = {
+    b64_url_charset,
+    b64_url_reverse
 };
 
+static void encode_block(const char *charset, const uint8_t *data, char *encoded)
+{
+    uint32_t block = (data[0] << 16) | (data[1] << 8) | data[2];
+    encoded[0] = charset[((block>>18) & 0x3F)];
+    encoded[1] = charset[((block>>12) & 0x3F)];
+    encoded[2] = charset[((block>>6 ) & 0x3F)];
+    encoded[3] = charset[( block      & 0x3F)];
+}
+
 /*
-    Encodes the given \a data with Base64 encoding.
-    Returns the size of the \a encoded_data on success,
-    or 0 on error.
+    Returns the exact size of the Base64 encoding of \a data_size bytes,
+    including padding, and not including a null terminator.
 */
-size_t SailfishKeyProvider_base64_encode(
-                    const char *data,
-                    size_t data_size,
-                    char **encoded_data)
+size_t SailfishKeyProvider_base64_encoded_length(size_t data_size)
 {
-    size_t remaining_size = data_size;
-    const char *curr_data = data;
-    char *curr_encoded = 0;
-    uint32_t block = 0;
-    size_t encoded_size = 0;
-    uint8_t overrides = 0x0;
+    return 4 * ((data_size + 2) / 3);
+}
 
-    /* ensure the input arguments are valid */
-    if (encoded_data == NULL || data_size == 0 || data == NULL) {
-        fprintf(stderr,
-                "%s\n",
-                "SailfishKeyProvider_base64_encode: invalid arguments");
-        return 0;
+/*
+    As SailfishKeyProvider_base64_encoded_length(), but without padding
+    if \a flags contains SAILFISHKEYPROVIDER_BASE64_NO_PADDING.
+*/
+size_t SailfishKeyProvider_base64_encoded_length_flags(size_t data_size, int flags)
+{
+    if (flags & SAILFISHKEYPROVIDER_BASE64_NO_PADDING) {
+        return (4 * data_size + 2) / 3;
     }
+    return SailfishKeyProvider_base64_encoded_length(data_size);
+}
 
-    /* calculate the size of encoded data and allocate buffer */
-    encoded_size = (4 * ((data_size + 2) / 3)) + 1;
-    curr_encoded = (char *)malloc(encoded_size);
-    *encoded_data = curr_encoded;
-    if (curr_encoded == NULL) {
-        fprintf(stderr,
-                "%s\n",
-                "SailfishKeyProvider_base64_encode: malloc failed");
+/*
+    Returns the exact size of the data decoded from the \a encoded_size
+    bytes of \a encoded_data, taking any padding into account, or 0 if
+    \a encoded_size is not a valid length for encoded data.
+*/
+size_t SailfishKeyProvider_base64_decoded_length(
+                    const char *encoded_data,
+                    size_t encoded_size)
+{
+    if (encoded_size == 0 || encoded_size % 4 == 1 || encoded_data == NULL) {
         return 0;
+    } else if (encoded_size % 4) {
+        /* unpadded: the last 2 or 3 characters encode 1 or 2 bytes */
+        return 3 * (encoded_size / 4) + encoded_size % 4 - 1;
+    }
+    return 3 * (encoded_size / 4)
+         - (encoded_data[encoded_size-1] == '=')
+         - (encoded_data[encoded_size-1] == '=' && encoded_data[encoded_size-2] == '=');
+}
+
+/*
+    Encodes the \a data_size bytes of \a data, which must be non-zero,
+    into \a encoded using the given \a alphabet.
+    Returns the number of characters written.
+*/
+static size_t encode_chunks(
+                    const SailfishKeyProvider_base64_alphabet *alphabet,
+                    int flags,
+                    const char *data,
+                    size_t data_size,
+                    char *encoded)
+{
+    const char *charset = alphabet->charset;
+    const uint8_t *curr_data = (const uint8_t *)data;
+    char *curr_encoded = encoded;
+    size_t remaining_size = data_size;
+    uint8_t block[3] = { 0, 0, 0 };
+
+    /* encode whole blocks with the vectorised kernel, if any */
+    {
+        size_t consumed = SailfishKeyProvider_base64_encode_blocks(
+                alphabet, curr_data, data_size, curr_encoded);
+        curr_data += consumed;
+        curr_encoded += (consumed / 3) * 4;
+        remaining_size -= consumed;
     }
-    memset(curr_encoded, 0, encoded_size);
 
     /*
         Algorithm:
@@ -129,163 +180,567 @@ size_t SailfishKeyProvider_base64_encode(
 
         If the input data size doesn't divide cleanly by 3, right-pad
         it with zero-bytes until it does.  Overwrite pad bytes in the
-        output with '=' characters.
+        output with '=' characters, or drop them if padding is not used.
     */
-    while (remaining_size > 0) {
-        block = 0;
-        if (remaining_size == 1) {
-            block = ((*((uint8_t*)(curr_data))) << 16);
-            overrides = 0x2;
-            remaining_size = 0;
-        } else if (remaining_size == 2) {
-            block = ((*((uint8_t*)(curr_data  ))) << 16)
-                  | ((*((uint8_t*)(curr_data+1))) << 8);
-            overrides = 0x1;
-            remaining_size = 0;
+    while (remaining_size >= 3) {
+        encode_block(charset, curr_data, curr_encoded);
+        curr_data += 3;
+        curr_encoded += 4;
+        remaining_size -= 3;
+    }
+
+    if (remaining_size > 0) {
+        char last[4];
+        memcpy(block, curr_data, remaining_size);
+        encode_block(charset, block, last);
+        if (flags & SAILFISHKEYPROVIDER_BASE64_NO_PADDING) {
+            memcpy(curr_encoded, last, remaining_size + 1);
+            curr_encoded += remaining_size + 1;
         } else {
-            block = ((*((uint8_t*)(curr_data  ))) << 16)
-                  | ((*((uint8_t*)(curr_data+1))) << 8)
-                  | ((*((uint8_t*)(curr_data+2))));
-            remaining_size -= 3;
+            last[3] = '=';
+            if (remaining_size == 1) {
+                last[2] = '=';
+            }
+            memcpy(curr_encoded, last, 4);
+            curr_encoded += 4;
         }
+    }
 
-        /* look up the printable char from the base 64 character set  */
-        curr_encoded[0] = b64_charset[((block>>18) & 0x3F)];
-        curr_encoded[1] = b64_charset[((block>>12) & 0x3F)];
-        curr_encoded[2] = b64_charset[((block>>6 ) & 0x3F)];
-        curr_encoded[3] = b64_charset[( block      & 0x3F)];
+    return curr_encoded - encoded;
+}
 
-        curr_data += 3;
+/*
+    Decodes the \a encoded_size bytes of \a encoded_data, which must have
+    a valid length, into the decoded_length() bytes of \a decoded using
+    the given \a alphabet.  Each output byte is written only after the
+    input bytes it is decoded from have been read, so \a decoded may be
+    the same buffer as \a encoded_data.
+    Returns 0 on success, or -1 if the data contains characters
+    that aren't in the base64 charset.
+*/
+static int decode_chunks(
+                    const SailfishKeyProvider_base64_alphabet *alphabet,
+                    int flags,
+                    const char *encoded_data,
+                    size_t encoded_size,
+                    char *decoded)
+{
+    const uint8_t *reverse = alphabet->reverse;
+    const uint8_t *curr_encoded = (const uint8_t *)encoded_data;
+    uint8_t *curr_decoded = (uint8_t *)decoded;
+    size_t remaining_size = encoded_size;
+    size_t last_size = (encoded_size % 4) ? encoded_size % 4 : 4;
+    size_t significant = last_size;
+    uint8_t invalid = 0;
+    uint32_t block = 0;
+    uint8_t b1 = 0, b2 = 0, b3 = 0, b4 = 0; /* block bytes */
+
+    /* decode all but the last (possibly padded or partial) chunk with
+       the vectorised kernel, if any.  It stops at invalid data, which
+       is then found by the loop below. */
+    {
+        size_t consumed = SailfishKeyProvider_base64_decode_blocks(
+                alphabet, encoded_data, encoded_size - last_size, curr_decoded);
+        curr_encoded += consumed;
+        curr_decoded += (consumed / 4) * 3;
+        remaining_size -= consumed;
+    }
+
+    /*
+        Algorithm:
+
+        Grab a 4 byte chunk, and use each byte as an index into the reverse
+        lookup table.  The value at that index in the reverse lookup table
+        will be a 6 bit value, or 0xFF for characters outside the charset;
+        these are accumulated and checked once, at the end.  Concatenate
+        the 4 x 6 bit indexes into a single 24 bit block, and split it
+        into 3 decoded bytes.
+    */
+    while (remaining_size > last_size) {
+        b1 = reverse[curr_encoded[0]];
+        b2 = reverse[curr_encoded[1]];
+        b3 = reverse[curr_encoded[2]];
+        b4 = reverse[curr_encoded[3]];
+        invalid |= b1 | b2 | b3 | b4;
+
+        block = (b1 << 18) | (b2 << 12) | (b3 << 6) | b4;
+        curr_decoded[0] = (uint8_t)(block >> 16);
+        curr_decoded[1] = (uint8_t)(block >> 8);
+        curr_decoded[2] = (uint8_t)(block);
+
+        remaining_size -= 4;
         curr_encoded += 4;
+        curr_decoded += 3;
     }
 
-    /* if we padded the block, we need to override the pad chars */
-    curr_encoded -= 4;
-    if (overrides == 0x1) {
-        curr_encoded[3] = '=';
-    } else if (overrides == 0x2) {
-        curr_encoded[3] = '=';
-        curr_encoded[2] = '=';
+    /*
+        If the last byte or two bytes of the encoded data is '=' then
+        they are padding bytes.  These, and the characters missing from
+        unpadded data, are decoded as zeros into the 24 bit block, and
+        the bytes they produce are not written.
+    */
+    if (last_size == 4 && !(flags & SAILFISHKEYPROVIDER_BASE64_NO_PADDING)) {
+        significant -= (curr_encoded[3] == '=')
+                     + (curr_encoded[2] == '=' && curr_encoded[3] == '=');
+    }
+    b1 = reverse[curr_encoded[0]];
+    b2 = reverse[curr_encoded[1]];
+    b3 = (significant > 2) ? reverse[curr_encoded[2]] : 0;
+    b4 = (significant > 3) ? reverse[curr_encoded[3]] : 0;
+    invalid |= b1 | b2 | b3 | b4;
+
+    block = (b1 << 18) | (b2 << 12) | (b3 << 6) | b4;
+    curr_decoded[0] = (uint8_t)(block >> 16);
+    if (significant > 2) {
+        curr_decoded[1] = (uint8_t)(block >> 8);
+    }
+    if (significant > 3) {
+        curr_decoded[2] = (uint8_t)(block);
     }
 
-    return encoded_size - 1; /* minus the null terminator */
+    return (invalid & 0x80) ? -1 : 0;
 }
 
 /*
-    Decodes the given \a encoded_data from Base64 encoding.
+    Returns the size of the data which the \a encoded_size characters of
+    \a encoded_data decode to with the given \a flags, or 0 if that is
+    not a valid length.
+*/
+size_t SailfishKeyProvider_base64_decoded_length_flags(
+                    const char *encoded_data,
+                    size_t encoded_size,
+                    int flags)
+{
+    if (!(flags & SAILFISHKEYPROVIDER_BASE64_NO_PADDING)) {
+        return (encoded_size % 4) ? 0
+                : SailfishKeyProvider_base64_decoded_length(encoded_data, encoded_size);
+    } else if (encoded_data != NULL && encoded_size % 4 == 0) {
+        /* '=' is just an invalid character when padding is not used */
+        return 3 * (encoded_size / 4);
+    }
+    return SailfishKeyProvider_base64_decoded_length(encoded_data, encoded_size);
+}
+
+/*
+    Encodes the \a data_size bytes of \a data into the caller's
+    \a encoded buffer, which must hold
+    SailfishKeyProvider_base64_encoded_length_flags() characters.
+    No null terminator is written.
+    Returns the number of characters written, or 0 on error.
+*/
+size_t SailfishKeyProvider_base64_encode_into(
+                    const SailfishKeyProvider_base64_alphabet *alphabet,
+                    int flags,
+                    const char *data,
+                    size_t data_size,
+                    char *encoded)
+{
+    if (alphabet == NULL || data == NULL || data_size == 0 || encoded == NULL) {
+        return 0;
+    }
+    return encode_chunks(alphabet, flags, data, data_size, encoded);
+}
+
+/*
+    Decodes the \a encoded_size bytes of \a encoded_data into the
+    caller's \a decoded buffer, which must hold
+    SailfishKeyProvider_base64_decoded_length_flags() bytes, and may be
+    the same buffer as \a encoded_data.  No null terminator is written.
+    Returns the number of bytes written, or 0 on error.
+*/
+size_t SailfishKeyProvider_base64_decode_into(
+                    const SailfishKeyProvider_base64_alphabet *alphabet,
+                    int flags,
+                    const char *encoded_data,
+                    size_t encoded_size,
+                    char *decoded)
+{
+    size_t decoded_size = SailfishKeyProvider_base64_decoded_length_flags(
+            encoded_data, encoded_size, flags);
+    if (alphabet == NULL || decoded_size == 0 || decoded == NULL
+            || decode_chunks(alphabet, flags, encoded_data, encoded_size, decoded) != 0) {
+        return 0;
+    }
+    return decoded_size;
+}
+
+/*
+    Encodes the given \a data with Base64 encoding, using the given
+    \a alphabet.  If \a flags contains SAILFISHKEYPROVIDER_BASE64_NO_PADDING
+    the encoded data is not padded with '=' characters.
+    Returns the size of the \a encoded_data on success,
+    or 0 on error.
+*/
+size_t SailfishKeyProvider_base64_encode_alphabet(
+                    const SailfishKeyProvider_base64_alphabet *alphabet,
+                    int flags,
+                    const char *data,
+                    size_t data_size,
+                    char **encoded_data)
+{
+    size_t encoded_size = 0;
+    char *encoded = NULL;
+
+    /* ensure the input arguments are valid */
+    if (alphabet == NULL || encoded_data == NULL || data_size == 0 || data == NULL) {
+        fprintf(stderr,
+                "%s\n",
+                "SailfishKeyProvider_base64_encode: invalid arguments");
+        return 0;
+    }
+
+    /* calculate the size of encoded data and allocate buffer */
+    encoded_size = SailfishKeyProvider_base64_encoded_length_flags(data_size, flags);
+    encoded = (char *)malloc(encoded_size + 1);
+    *encoded_data = encoded;
+    if (encoded == NULL) {
+        fprintf(stderr,
+                "%s\n",
+                "SailfishKeyProvider_base64_encode: malloc failed");
+        return 0;
+    }
+
+    encode_chunks(alphabet, flags, data, data_size, encoded);
+    encoded[encoded_size] = '\0';
+    return encoded_size;
+}
+
+/*
+    Encodes the given \a data with standard, padded, Base64 encoding.
+    Returns the size of the \a encoded_data on success,
+    or 0 on error.
+*/
+size_t SailfishKeyProvider_base64_encode(
+                    const char *data,
+                    size_t data_size,
+                    char **encoded_data)
+{
+    return SailfishKeyProvider_base64_encode_alphabet(
+                &SailfishKeyProvider_base64_standard, 0,
+                data, data_size, encoded_data);
+}
+
+/*
+    Decodes the given \a encoded_data from Base64 encoding, using the
+    given \a alphabet.  If \a flags contains
+    SAILFISHKEYPROVIDER_BASE64_NO_PADDING the encoded data must not be
+    padded, otherwise its size must be a multiple of 4.
     Returns the size of the \a decoded_data on success,
     or 0 on error.
 */
-size_t SailfishKeyProvider_base64_decode(
+size_t SailfishKeyProvider_base64_decode_alphabet(
+                    const SailfishKeyProvider_base64_alphabet *alphabet,
+                    int flags,
                     const char *encoded_data,
                     size_t encoded_size,
                     char **decoded_data)
 {
-    size_t decoded_size = (3 * (encoded_size / 4)) + 1; /* incl null term */
-    size_t remaining_size = encoded_size;
-    const char *curr_encoded = encoded_data;
-    char *curr_decoded = 0;
-    uint32_t paddings = 0;
-    uint32_t block = 0;
-    uint8_t b1 = 0, b2 = 0, b3 = 0, b4 = 0; /* block bytes */
-    uint8_t c1 = 0, c2 = 0, c3 = 0, c4 = 0; /* chunk bytes */
+    size_t decoded_size = SailfishKeyProvider_base64_decoded_length_flags(
+            encoded_data, encoded_size, flags);
+    char *decoded = NULL;
 
     /* check for invalid inputs */
-    if (encoded_size == 0 || encoded_size % 4
-            || encoded_data == NULL || decoded_data == NULL) {
+    if (alphabet == NULL || decoded_size == 0 || decoded_data == NULL) {
         fprintf(stderr,
                 "%s\n",
                 "SailfishKeyProvider_base64_decode: invalid arguments");
         return 0;
     }
 
-    /* detect if padding chars exist */
-    if (encoded_data[encoded_size-2] == '=') {
-        paddings = 2;
-    } else if (encoded_data[encoded_size-1] == '=') {
-        paddings = 1;
-    }
-
-    /* allocate buffer for decoded data */
-    curr_decoded = (char *)malloc(decoded_size);
-    *decoded_data = curr_decoded;
-    if (curr_decoded == NULL) {
+    /* allocate buffer for decoded data, plus null terminator */
+    decoded = (char *)malloc(decoded_size + 1);
+    *decoded_data = decoded;
+    if (decoded == NULL) {
         /* unable to allocate buffer */
         fprintf(stderr,
                 "%s\n",
                 "SailfishKeyProvider_base64_decode: malloc failed");
         return 0;
     }
-    memset(curr_decoded, 0, decoded_size);
 
-    /*
-        Algorithm:
+    if (decode_chunks(alphabet, flags, encoded_data, encoded_size, decoded) != 0) {
+        /* the encoded data contains characters
+           that aren't in the base64 charset */
+        fprintf(stderr,
+                "%s: %.*s\n",
+                "SailfishKeyProvider_base64_decode: invalid data",
+                (int)encoded_size, encoded_data);
+        free(decoded);
+        *decoded_data = NULL;
+        return 0;
+    }
 
-        Grab a 4 byte chunk, and use each byte as an index into the reverse
-        lookup table.  The value at that index in the reverse lookup table
-        will be a 6 bit value.  Concatenate the 4 x 6 bit indexes into a
-        single 24 bit block, and split it into 3 decoded bytes.
+    decoded[decoded_size] = '\0';
+    return decoded_size;
+}
 
-        If the last byte or two bytes of the encoded data is '=' then
-        they are padding bytes.  These are overwritten with zeros for
-        decoding into the 24 bit block, but then only the zeroth byte
-        in that block gets appended to the decoded data buffer.
-    */
-    while (remaining_size > 0) {
-        /* grab 4 byte chunk of encoded data */
-        c1 = (uint8_t)(curr_encoded[0]);
-        c2 = (uint8_t)(curr_encoded[1]);
-        c3 = (uint8_t)(curr_encoded[2]);
-        c4 = (uint8_t)(curr_encoded[3]);
-
-        /* undo any padding */
-        if (remaining_size == 4) {
-            if (paddings == 2) {
-                c3 = 'A';
-                c4 = 'A';
-            } else if (paddings == 1) {
-                c4 = 'A';
-            }
-        }
+/*
+    Decodes the given \a encoded_data from standard, padded, Base64 encoding.
+    Returns the size of the \a decoded_data on success,
+    or 0 on error.
+*/
+size_t SailfishKeyProvider_base64_decode(
+                    const char *encoded_data,
+                    size_t encoded_size,
+                    char **decoded_data)
+{
+    return SailfishKeyProvider_base64_decode_alphabet(
+                &SailfishKeyProvider_base64_standard, 0,
+                encoded_data, encoded_size, decoded_data);
+}
+
+/*
+    Decodes the given \a data from Base64 encoding with the given
+    \a alphabet and \a flags, writing the decoded bytes over the start
+    of \a data itself.  No memory is allocated, and the result is not
+    null terminated.  On error, the contents of \a data are unspecified.
+    Returns the size of the decoded data on success, or 0 on error.
+*/
+size_t SailfishKeyProvider_base64_decode_inplace_alphabet(
+                    const SailfishKeyProvider_base64_alphabet *alphabet,
+                    int flags,
+                    char *data,
+                    size_t data_size)
+{
+    size_t decoded_size = SailfishKeyProvider_base64_decoded_length_flags(data, data_size, flags);
+
+    if (alphabet == NULL || decoded_size == 0) {
+        fprintf(stderr,
+                "%s\n",
+                "SailfishKeyProvider_base64_decode_inplace: invalid arguments");
+        return 0;
+    }
+
+    if (decode_chunks(alphabet, flags, data, data_size, data) != 0) {
+        fprintf(stderr,
+                "%s\n",
+                "SailfishKeyProvider_base64_decode_inplace: invalid data");
+        return 0;
+    }
+
+    return decoded_size;
+}
 
-        /* use each byte to look up a 6 bit index from reverse table */
-        b1 = b64_reverse[c1];
-        b2 = b64_reverse[c2];
-        b3 = b64_reverse[c3];
-        b4 = b64_reverse[c4];
-
-        /* check that the encoded data is valid */
-        if ((b1 == 0x0 && c1 != 'A') ||
-            (b2 == 0x0 && c2 != 'A') ||
-            (b3 == 0x0 && c3 != 'A') ||
-            (b4 == 0x0 && c4 != 'A')) {
-            /* the encoded data contains characters
-               that aren't in the base64 charset */
-            fprintf(stderr,
-                    "%s: %s\n",
-                    "SailfishKeyProvider_base64_decode: invalid data",
-                    encoded_data);
-            free(*decoded_data);
-            *decoded_data = NULL;
+/*
+    Decodes the given \a data from standard, padded, Base64 encoding
+    in place; see SailfishKeyProvider_base64_decode_inplace_alphabet().
+*/
+size_t SailfishKeyProvider_base64_decode_inplace(
+                    char *data,
+                    size_t data_size)
+{
+    return SailfishKeyProvider_base64_decode_inplace_alphabet(
+                &SailfishKeyProvider_base64_standard, 0,
+                data, data_size);
+}
+
+/*
+    Streaming encoder and decoder
+
+    These accept the data in arbitrarily sized pieces, and write into
+    buffers provided by the caller, so that large values need never be
+    held in memory at once.  Whole blocks are handed to the vectorised
+    kernels, and only the partial blocks at the boundaries between the
+    pieces are carried over in the state.
+*/
+
+/*
+    Initialises the \a encoder state, ready for the first update.
+*/
+void SailfishKeyProvider_base64_encode_init(
+                    SailfishKeyProvider_base64_encoder *encoder)
+{
+    encoder->pending_size = 0;
+}
+
+/*
+    Encodes the next \a data_size bytes of \a data into \a encoded, which
+    must have room for SAILFISHKEYPROVIDER_BASE64_ENCODE_UPDATE_SIZE(data_size)
+    bytes.  Bytes which don't make up a whole block are kept until the
+    next update.  The output is not null terminated.
+    Returns the number of bytes written to \a encoded.
+*/
+size_t SailfishKeyProvider_base64_encode_update(
+                    SailfishKeyProvider_base64_encoder *encoder,
+                    const char *data,
+                    size_t data_size,
+                    char *encoded)
+{
+    const uint8_t *curr_data = (const uint8_t *)data;
+    size_t remaining_size = data_size;
+    size_t encoded_size = 0;
+    size_t consumed = 0;
+
+    /* complete the block left over from the previous update */
+    if (encoder->pending_size > 0) {
+        while (encoder->pending_size < 3 && remaining_size > 0) {
+            encoder->pending[encoder->pending_size++] = *curr_data++;
+            remaining_size--;
+        }
+        if (encoder->pending_size < 3) {
             return 0;
         }
+        encode_block(b64_standard_charset, encoder->pending, encoded);
+        encoded_size = 4;
+        encoder->pending_size = 0;
+    }
 
-        /* construct a 24 bit block from the 4 x 6 bit indexes */
-        block = (b1 << 18) | (b2 << 12) | (b3 << 6) | b4;
+    consumed = SailfishKeyProvider_base64_encode_blocks(
+            &SailfishKeyProvider_base64_standard,
+            curr_data, remaining_size, encoded + encoded_size);
+    curr_data += consumed;
+    encoded_size += (consumed / 3) * 4;
+    remaining_size -= consumed;
+
+    while (remaining_size >= 3) {
+        encode_block(b64_standard_charset, curr_data, encoded + encoded_size);
+        curr_data += 3;
+        encoded_size += 4;
+        remaining_size -= 3;
+    }
+
+    memcpy(encoder->pending, curr_data, remaining_size);
+    encoder->pending_size = remaining_size;
+    return encoded_size;
+}
+
+/*
+    Encodes the bytes left over from the last update into \a encoded,
+    which must have room for 4 bytes, padding them as necessary.
+    Returns the number of bytes written to \a encoded.
+*/
+size_t SailfishKeyProvider_base64_encode_final(
+                    SailfishKeyProvider_base64_encoder *encoder,
+                    char *encoded)
+{
+    uint8_t block[3] = { 0, 0, 0 };
+    size_t pending_size = encoder->pending_size;
+
+    if (pending_size == 0) {
+        return 0;
+    }
+
+    memcpy(block, encoder->pending, pending_size);
+    encode_block(b64_standard_charset, block, encoded);
+    encoded[3] = '=';
+    if (pending_size == 1) {
+        encoded[2] = '=';
+    }
+    encoder->pending_size = 0;
+    return 4;
+}
 
-        /* break the block into 3 decoded bytes - ignore padding */
-        curr_decoded[0] = (char)((block >> 16) & 0xFF);
-        if (remaining_size != 4 || paddings == 0) {
-            curr_decoded[1] = (char)((block >> 8) & 0xFF);
-            curr_decoded[2] = (char)((block >> 0) & 0xFF);
-        } else if (remaining_size == 4 && paddings == 1) {
-            curr_decoded[1] = (char)((block >> 8) & 0xFF);
+/*
+    Initialises the \a decoder state, ready for the first update.
+    If \a flags contains SAILFISHKEYPROVIDER_BASE64_SKIP_WHITESPACE,
+    whitespace anywhere in the input (such as the line breaks in MIME
+    or PEM encoded data) is ignored, otherwise it is invalid.
+*/
+void SailfishKeyProvider_base64_decode_init(
+                    SailfishKeyProvider_base64_decoder *decoder,
+                    int flags)
+{
+    decoder->pending_size = 0;
+    decoder->padding = 0;
+    decoder->finished = 0;
+    decoder->flags = flags;
+}
+
+/*
+    Decodes the next \a encoded_size bytes of \a encoded_data into
+    \a decoded, which must have room for
+    SAILFISHKEYPROVIDER_BASE64_DECODE_UPDATE_SIZE(encoded_size) bytes,
+    and sets \a decoded_size to the number of bytes written.  Characters
+    which don't make up a whole chunk are kept until the next update.
+    Returns 0 on success, or -1 if the data is invalid.
+*/
+int SailfishKeyProvider_base64_decode_update(
+                    SailfishKeyProvider_base64_decoder *decoder,
+                    const char *encoded_data,
+                    size_t encoded_size,
+                    char *decoded,
+                    size_t *decoded_size)
+{
+    size_t i = 0;
+    size_t out = 0;
+
+    *decoded_size = 0;
+    while (i < encoded_size) {
+        uint8_t c = 0;
+
+        /* hand whole chunks to the vectorised kernel, which stops at
+           anything (padding, whitespace, ...) it does not handle */
+        if (decoder->pending_size == 0 && !decoder->finished) {
+            size_t consumed = SailfishKeyProvider_base64_decode_blocks(
+                    &SailfishKeyProvider_base64_standard,
+                    encoded_data + i, encoded_size - i, (uint8_t *)decoded + out);
+            i += consumed;
+            out += (consumed / 4) * 3;
+            if (i == encoded_size) {
+                break;
+            }
         }
 
-        remaining_size -= 4;
-        curr_encoded += 4;
-        curr_decoded += 3;
+        c = (uint8_t)encoded_data[i++];
+        if ((decoder->flags & SAILFISHKEYPROVIDER_BASE64_SKIP_WHITESPACE)
+                && (c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f')) {
+            continue;
+        } else if (decoder->finished) {
+            /* nothing may follow the padded final chunk */
+            goto invalid_data;
+        } else if (c == '=') {
+            /* padding may only replace the last one or two characters */
+            if (decoder->pending_size < 2) {
+                goto invalid_data;
+            }
+            decoder->padding++;
+            c = 0;
+        } else if (decoder->padding > 0
+                || b64_standard_reverse[c] == 0xFF) {
+            goto invalid_data;
+        } else {
+            c = b64_standard_reverse[c];
+        }
+
+        decoder->pending[decoder->pending_size++] = c;
+        if (decoder->pending_size == 4) {
+            uint32_t block = (decoder->pending[0] << 18) | (decoder->pending[1] << 12)
+                           | (decoder->pending[2] << 6) | decoder->pending[3];
+            decoded[out++] = (char)((block >> 16) & 0xFF);
+            if (decoder->padding < 2) {
+                decoded[out++] = (char)((block >> 8) & 0xFF);
+            }
+            if (decoder->padding < 1) {
+                decoded[out++] = (char)(block & 0xFF);
+            }
+            decoder->finished = (decoder->padding > 0);
+            decoder->pending_size = 0;
+        }
     }
 
-    return decoded_size - paddings - 1; /* minus the null terminator */
+    *decoded_size = out;
+    return 0;
+
+invalid_data:
+    *decoded_size = out;
+    fprintf(stderr,
+            "%s\n",
+            "SailfishKeyProvider_base64_decode_update: invalid data");
+    return -1;
+}
+
+/*
+    Checks that the data passed to the \a decoder ended on a whole chunk.
+    Returns 0 on success, or -1 if the data was truncated.
+*/
+int SailfishKeyProvider_base64_decode_final(
+                    SailfishKeyProvider_base64_decoder *decoder)
+{
+    if (decoder->pending_size != 0) {
+        fprintf(stderr,
+                "%s\n",
+                "SailfishKeyProvider_base64_decode_final: truncated data");
+        return -1;
+    }
+    return 0;
 }
@@ -31,6 +31,42 @@
 #ifdef __cplusplus
 extern "C" {
 #endif
+/* A Base64 alphabet: the 64 characters in value order, and the value of
+   each of the 256 possible characters, with 0xFF for those not in it */
+typedef struct SailfishKeyProvider_base64_alphabet {
+    const char *charset;
+    const uint8_t *reverse;
+} SailfishKeyProvider_base64_alphabet;
+
+/* The standard ("+/") and URL and filename safe ("-_") alphabets of RFC 4648 */
+extern const SailfishKeyProvider_base64_alphabet SailfishKeyProvider_base64_standard;
+extern const SailfishKeyProvider_base64_alphabet SailfishKeyProvider_base64_url;
+
+/* Incremental encoder state; see SailfishKeyProvider_base64_encode_init() */
+typedef struct SailfishKeyProvider_base64_encoder {
+    uint8_t pending[3];
+    size_t pending_size;
+} SailfishKeyProvider_base64_encoder;
+
+/* Incremental decoder state; see SailfishKeyProvider_base64_decode_init() */
+typedef struct SailfishKeyProvider_base64_decoder {
+    uint8_t pending[4];
+    size_t pending_size;
+    int padding;
+    int finished;
+    int flags;
+} SailfishKeyProvider_base64_decoder;
+
+/* Decoder flags */
+#define SAILFISHKEYPROVIDER_BASE64_SKIP_WHITESPACE 0x1
+
+/* Encoder and decoder flag for the _alphabet variants: no '=' padding */
+#define SAILFISHKEYPROVIDER_BASE64_NO_PADDING 0x2
+
+/* Most output which an update with \a size bytes of input may produce */
+#define SAILFISHKEYPROVIDER_BASE64_ENCODE_UPDATE_SIZE(size) (4 * (((size) + 2) / 3))
+#define SAILFISHKEYPROVIDER_BASE64_DECODE_UPDATE_SIZE(size) (3 * (((size) + 3) / 4))
+
 size_t SailfishKeyProvider_base64_encode(
                     const char *data,
                     size_t data_size,
@@ -40,6 +76,87 @@ size_t SailfishKeyProvider_base64_decode(
                     const char *encoded_data,
                     size_t encoded_size,
                     char **decoded_data);
+
+size_t SailfishKeyProvider_base64_encode_alphabet(
+                    const SailfishKeyProvider_base64_alphabet *alphabet,
+                    int flags,
+                    const char *data,
+                    size_t data_size,
+                    char **encoded_data);
+
+size_t SailfishKeyProvider_base64_decode_alphabet(
+                    const SailfishKeyProvider_base64_alphabet *alphabet,
+                    int flags,
+                    const char *encoded_data,
+                    size_t encoded_size,
+                    char **decoded_data);
+
+size_t SailfishKeyProvider_base64_encode_into(
+                    const SailfishKeyProvider_base64_alphabet *alphabet,
+                    int flags,
+                    const char *data,
+                    size_t data_size,
+                    char *encoded);
+
+size_t SailfishKeyProvider_base64_decode_into(
+                    const SailfishKeyProvider_base64_alphabet *alphabet,
+                    int flags,
+                    const char *encoded_data,
+                    size_t encoded_size,
+                    char *decoded);
+
+size_t SailfishKeyProvider_base64_encoded_length(
+                    size_t data_size);
+
+size_t SailfishKeyProvider_base64_encoded_length_flags(
+                    size_t data_size,
+                    int flags);
+
+size_t SailfishKeyProvider_base64_decoded_length(
+                    const char *encoded_data,
+                    size_t encoded_size);
+
+size_t SailfishKeyProvider_base64_decoded_length_flags(
+                    const char *encoded_data,
+                    size_t encoded_size,
+                    int flags);
+
+size_t SailfishKeyProvider_base64_decode_inplace(
+                    char *data,
+                    size_t data_size);
+
+size_t SailfishKeyProvider_base64_decode_inplace_alphabet(
+                    const SailfishKeyProvider_base64_alphabet *alphabet,
+                    int flags,
+                    char *data,
+                    size_t data_size);
+
+void SailfishKeyProvider_base64_encode_init(
+                    SailfishKeyProvider_base64_encoder *encoder);
+
+size_t SailfishKeyProvider_base64_encode_update(
+                    SailfishKeyProvider_base64_encoder *encoder,
+                    const char *data,
+                    size_t data_size,
+                    char *encoded);
+
+size_t SailfishKeyProvider_base64_encode_final(
+                    SailfishKeyProvider_base64_encoder *encoder,
+                    char *encoded);
+
+void SailfishKeyProvider_base64_decode_init(
+                    SailfishKeyProvider_base64_decoder *decoder,
+                    int flags);
+
+int SailfishKeyProvider_base64_decode_update(
+                    SailfishKeyProvider_base64_decoder *decoder,
+                    const char *encoded_data,
+                    size_t encoded_size,
+                    char *decoded,
+                    size_t *decoded_size);
+
+int SailfishKeyProvider_base64_decode_final(
+                    SailfishKeyProvider_base64_decoder *decoder);
 #ifdef __cplusplus
 }
 #endif
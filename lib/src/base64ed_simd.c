@@ -0,0 +1,564 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Jolla Ltd.
+** Contact: Chris Adams <chris.adams@jollamobile.com>
+** All rights reserved.
+**
+** You may use this file under the terms of the GNU Lesser General
+** Public License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Public License for more details.
+**
+****************************************************************************/
+
+
+/*
+    Vectorised Base64 kernels
+
+    The kernels only ever handle whole blocks in the middle of the data,
+    and never read or write beyond the buffers they are given; the tail
+    (and any padding) is left to the scalar code in base64ed.c, which
+    remains the reference implementation.
+
+    The kernel is chosen when the library is loaded, from those which the
+    cpu supports (see dispatch.c).  The x86 kernels follow the pshufb based approach described by
+    Wojciech Mula and Daniel Lemire.  Alphabets only differ in their last
+    two characters, so the kernels translate letters and digits with
+    constant tables and patch in the alphabet's characters for 62 and 63.
+*/
+
+#include "base64ed_simd.h"
+#include "dispatch.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BASE64ED_SIMD_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__)
+#define BASE64ED_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+typedef size_t (*base64_encode_kernel)(
+        const SailfishKeyProvider_base64_alphabet *, const uint8_t *, size_t, char *);
+typedef size_t (*base64_decode_kernel)(
+        const SailfishKeyProvider_base64_alphabet *, const char *, size_t, uint8_t *);
+
+static size_t encode_scalar(const SailfishKeyProvider_base64_alphabet *alphabet,
+                            const uint8_t *data, size_t data_size, char *encoded)
+{
+    (void)alphabet;
+    (void)data;
+    (void)data_size;
+    (void)encoded;
+    return 0; /* everything is left to the reference implementation */
+}
+
+static size_t decode_scalar(const SailfishKeyProvider_base64_alphabet *alphabet,
+                            const char *encoded, size_t encoded_size, uint8_t *decoded)
+{
+    (void)alphabet;
+    (void)encoded;
+    (void)encoded_size;
+    (void)decoded;
+    return 0;
+}
+
+#ifdef BASE64ED_SIMD_X86
+/* Splits each group of 3 bytes into 4 x 6 bit indexes, one per byte */
+__attribute__((target("ssse3,sse4.1")))
+static __m128i encode_split_128(__m128i in)
+{
+    __m128i t0 = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)),
+                                 _mm_set1_epi32(0x04000040));
+    __m128i t1 = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)),
+                                 _mm_set1_epi32(0x01000010));
+    return _mm_or_si128(t0, t1);
+}
+
+/* Offset from index to character, selected by index range */
+__attribute__((target("ssse3,sse4.1")))
+static __m128i encode_offsets_128(const SailfishKeyProvider_base64_alphabet *alphabet)
+{
+    return _mm_setr_epi8(
+            'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+            '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+            (char)(alphabet->charset[62] - 62), (char)(alphabet->charset[63] - 63),
+            'A', 0, 0);
+}
+
+__attribute__((target("ssse3,sse4.1")))
+static __m128i encode_translate_128(__m128i indexes, __m128i offsets)
+{
+    __m128i range = _mm_subs_epu8(indexes, _mm_set1_epi8(51));
+    __m128i upper = _mm_cmpgt_epi8(_mm_set1_epi8(26), indexes);
+    range = _mm_or_si128(range, _mm_and_si128(upper, _mm_set1_epi8(13)));
+    return _mm_add_epi8(_mm_shuffle_epi8(offsets, range), indexes);
+}
+
+__attribute__((target("ssse3,sse4.1")))
+static size_t encode_sse41(const SailfishKeyProvider_base64_alphabet *alphabet,
+                           const uint8_t *data, size_t data_size, char *encoded)
+{
+    const __m128i offsets = encode_offsets_128(alphabet);
+    const __m128i gather = _mm_setr_epi8(
+            1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+    size_t i = 0;
+
+    /* each iteration loads 16 bytes, of which 12 are encoded */
+    for (i = 0; data_size - i >= 16; i += 12) {
+        __m128i in = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i indexes = encode_split_128(_mm_shuffle_epi8(in, gather));
+        _mm_storeu_si128((__m128i *)(encoded + (i / 3) * 4), encode_translate_128(indexes, offsets));
+    }
+    return i;
+}
+
+/* The characters for 62 and 63, and the shifts which translate them */
+typedef struct decode_specials_128 {
+    __m128i c62, c63, shift62, shift63;
+} decode_specials_128;
+
+__attribute__((target("ssse3,sse4.1")))
+static decode_specials_128 decode_specials_init_128(
+        const SailfishKeyProvider_base64_alphabet *alphabet)
+{
+    decode_specials_128 specials;
+    specials.c62 = _mm_set1_epi8(alphabet->charset[62]);
+    specials.c63 = _mm_set1_epi8(alphabet->charset[63]);
+    specials.shift62 = _mm_set1_epi8((char)(62 - alphabet->charset[62]));
+    specials.shift63 = _mm_set1_epi8((char)(63 - alphabet->charset[63]));
+    return specials;
+}
+
+__attribute__((target("ssse3,sse4.1")))
+static __m128i decode_translate_128(__m128i in, const decode_specials_128 *specials,
+                                    __m128i *invalid)
+{
+    const __m128i shifts = _mm_setr_epi8(
+            0, 0, 0, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    /* bit n of masks[low nibble] is set if high nibble n is a letter or digit */
+    const __m128i masks = _mm_setr_epi8(
+            (char)0xa8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8,
+            (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf0, 0x50,
+            0x50, 0x50, 0x50, 0x50);
+    const __m128i bits = _mm_setr_epi8(
+            0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char)0x80,
+            0, 0, 0, 0, 0, 0, 0, 0);
+    __m128i high = _mm_and_si128(_mm_srli_epi32(in, 4), _mm_set1_epi8(0x0f));
+    __m128i low = _mm_and_si128(in, _mm_set1_epi8(0x0f));
+    __m128i is62 = _mm_cmpeq_epi8(in, specials->c62);
+    __m128i is63 = _mm_cmpeq_epi8(in, specials->c63);
+    __m128i shift = _mm_blendv_epi8(_mm_shuffle_epi8(shifts, high), specials->shift62, is62);
+    __m128i valid = _mm_and_si128(_mm_shuffle_epi8(masks, low), _mm_shuffle_epi8(bits, high));
+    shift = _mm_blendv_epi8(shift, specials->shift63, is63);
+    *invalid = _mm_andnot_si128(_mm_or_si128(is62, is63),
+                                _mm_cmpeq_epi8(valid, _mm_setzero_si128()));
+    return _mm_add_epi8(in, shift);
+}
+
+__attribute__((target("ssse3,sse4.1")))
+static size_t decode_sse41(const SailfishKeyProvider_base64_alphabet *alphabet,
+                           const char *encoded, size_t encoded_size, uint8_t *decoded)
+{
+    const decode_specials_128 specials = decode_specials_init_128(alphabet);
+    const __m128i pack = _mm_setr_epi8(
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    size_t i = 0;
+
+    /* each iteration decodes 16 bytes and stores 16, of which 12 are
+       kept; 24 remaining bytes guarantee room for the spare 4 */
+    for (i = 0; encoded_size - i >= 24; i += 16) {
+        __m128i in = _mm_loadu_si128((const __m128i *)(encoded + i));
+        __m128i invalid;
+        __m128i values = decode_translate_128(in, &specials, &invalid);
+        if (_mm_movemask_epi8(invalid) != 0) {
+            break;
+        }
+        values = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+        values = _mm_madd_epi16(values, _mm_set1_epi32(0x00011000));
+        _mm_storeu_si128((__m128i *)(decoded + (i / 4) * 3), _mm_shuffle_epi8(values, pack));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static __m256i encode_split_256(__m256i in)
+{
+    __m256i t0 = _mm256_mulhi_epu16(_mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00)),
+                                    _mm256_set1_epi32(0x04000040));
+    __m256i t1 = _mm256_mullo_epi16(_mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0)),
+                                    _mm256_set1_epi32(0x01000010));
+    return _mm256_or_si256(t0, t1);
+}
+
+__attribute__((target("avx2")))
+static __m256i encode_translate_256(__m256i indexes, __m256i offsets)
+{
+    __m256i range = _mm256_subs_epu8(indexes, _mm256_set1_epi8(51));
+    __m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indexes);
+    range = _mm256_or_si256(range, _mm256_and_si256(upper, _mm256_set1_epi8(13)));
+    return _mm256_add_epi8(_mm256_shuffle_epi8(offsets, range), indexes);
+}
+
+__attribute__((target("avx2")))
+static size_t encode_avx2(const SailfishKeyProvider_base64_alphabet *alphabet,
+                          const uint8_t *data, size_t data_size, char *encoded)
+{
+    const __m256i offsets = _mm256_broadcastsi128_si256(encode_offsets_128(alphabet));
+    const __m256i gather = _mm256_setr_epi8(
+            1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+            1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+    size_t i = 0;
+
+    /* each iteration loads 12 bytes into each lane, reading 28 */
+    for (i = 0; data_size - i >= 28; i += 24) {
+        __m256i in = _mm256_inserti128_si256(
+                _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(data + i))),
+                _mm_loadu_si128((const __m128i *)(data + i + 12)), 1);
+        __m256i indexes = encode_split_256(_mm256_shuffle_epi8(in, gather));
+        _mm256_storeu_si256((__m256i *)(encoded + (i / 3) * 4), encode_translate_256(indexes, offsets));
+    }
+
+    /* finish with the narrower kernel */
+    return i + encode_sse41(alphabet, data + i, data_size - i, encoded + (i / 3) * 4);
+}
+
+typedef struct decode_specials_256 {
+    __m256i c62, c63, shift62, shift63;
+} decode_specials_256;
+
+__attribute__((target("avx2")))
+static decode_specials_256 decode_specials_init_256(
+        const SailfishKeyProvider_base64_alphabet *alphabet)
+{
+    decode_specials_256 specials;
+    specials.c62 = _mm256_set1_epi8(alphabet->charset[62]);
+    specials.c63 = _mm256_set1_epi8(alphabet->charset[63]);
+    specials.shift62 = _mm256_set1_epi8((char)(62 - alphabet->charset[62]));
+    specials.shift63 = _mm256_set1_epi8((char)(63 - alphabet->charset[63]));
+    return specials;
+}
+
+__attribute__((target("avx2")))
+static __m256i decode_translate_256(__m256i in, const decode_specials_256 *specials,
+                                    __m256i *invalid)
+{
+    const __m256i shifts = _mm256_setr_epi8(
+            0, 0, 0, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+            0, 0, 0, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i masks = _mm256_setr_epi8(
+            (char)0xa8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8,
+            (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf0, 0x50,
+            0x50, 0x50, 0x50, 0x50,
+            (char)0xa8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8,
+            (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf0, 0x50,
+            0x50, 0x50, 0x50, 0x50);
+    const __m256i bits = _mm256_setr_epi8(
+            0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char)0x80,
+            0, 0, 0, 0, 0, 0, 0, 0,
+            0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char)0x80,
+            0, 0, 0, 0, 0, 0, 0, 0);
+    __m256i high = _mm256_and_si256(_mm256_srli_epi32(in, 4), _mm256_set1_epi8(0x0f));
+    __m256i low = _mm256_and_si256(in, _mm256_set1_epi8(0x0f));
+    __m256i is62 = _mm256_cmpeq_epi8(in, specials->c62);
+    __m256i is63 = _mm256_cmpeq_epi8(in, specials->c63);
+    __m256i shift = _mm256_blendv_epi8(_mm256_shuffle_epi8(shifts, high),
+                                       specials->shift62, is62);
+    __m256i valid = _mm256_and_si256(_mm256_shuffle_epi8(masks, low),
+                                     _mm256_shuffle_epi8(bits, high));
+    shift = _mm256_blendv_epi8(shift, specials->shift63, is63);
+    *invalid = _mm256_andnot_si256(_mm256_or_si256(is62, is63),
+                                   _mm256_cmpeq_epi8(valid, _mm256_setzero_si256()));
+    return _mm256_add_epi8(in, shift);
+}
+
+__attribute__((target("avx2")))
+static size_t decode_avx2(const SailfishKeyProvider_base64_alphabet *alphabet,
+                          const char *encoded, size_t encoded_size, uint8_t *decoded)
+{
+    const decode_specials_256 specials = decode_specials_init_256(alphabet);
+    const __m256i pack = _mm256_setr_epi8(
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+    size_t i = 0;
+
+    /* each iteration decodes 32 bytes and stores 32, of which 24 are
+       kept; 44 remaining bytes guarantee room for the spare 8 */
+    for (i = 0; encoded_size - i >= 44; i += 32) {
+        __m256i in = _mm256_loadu_si256((const __m256i *)(encoded + i));
+        __m256i invalid;
+        __m256i values = decode_translate_256(in, &specials, &invalid);
+        if (_mm256_movemask_epi8(invalid) != 0) {
+            break;
+        }
+        values = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+        values = _mm256_madd_epi16(values, _mm256_set1_epi32(0x00011000));
+        values = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(values, pack), lanes);
+        _mm256_storeu_si256((__m256i *)(decoded + (i / 4) * 3), values);
+    }
+
+    return i + decode_sse41(alphabet, encoded + i, encoded_size - i, decoded + (i / 4) * 3);
+}
+#endif /* BASE64ED_SIMD_X86 */
+
+#ifdef BASE64ED_SIMD_NEON
+static size_t encode_neon(const SailfishKeyProvider_base64_alphabet *alphabet,
+                          const uint8_t *data, size_t data_size, char *encoded)
+{
+    const uint8x16x4_t table = vld1q_u8_x4((const uint8_t *)alphabet->charset);
+    const uint8x16_t mask6 = vdupq_n_u8(0x3f);
+    size_t i = 0;
+
+    /* 48 bytes are de-interleaved into three vectors, encoded as 64 */
+    for (i = 0; data_size - i >= 48; i += 48) {
+        uint8x16x3_t in = vld3q_u8(data + i);
+        uint8x16x4_t out;
+        out.val[0] = vshrq_n_u8(in.val[0], 2);
+        out.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[0], 4), vshrq_n_u8(in.val[1], 4)), mask6);
+        out.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[1], 2), vshrq_n_u8(in.val[2], 6)), mask6);
+        out.val[3] = vandq_u8(in.val[2], mask6);
+        out.val[0] = vqtbl4q_u8(table, out.val[0]);
+        out.val[1] = vqtbl4q_u8(table, out.val[1]);
+        out.val[2] = vqtbl4q_u8(table, out.val[2]);
+        out.val[3] = vqtbl4q_u8(table, out.val[3]);
+        vst4q_u8((uint8_t *)encoded + (i / 3) * 4, out);
+    }
+    return i;
+}
+
+static size_t decode_neon(const SailfishKeyProvider_base64_alphabet *alphabet,
+                          const char *encoded, size_t encoded_size, uint8_t *decoded)
+{
+    /* values of characters 0 - 63 and 64 - 127; 0xff marks invalid ones */
+    const uint8x16x4_t lower = vld1q_u8_x4(alphabet->reverse);
+    const uint8x16x4_t upper = vld1q_u8_x4(alphabet->reverse + 64);
+    const uint8x16_t offset = vdupq_n_u8(64);
+    const uint8x16_t highBit = vdupq_n_u8(0x80);
+    size_t i = 0;
+    int k = 0;
+
+    /* 64 characters are de-interleaved into four vectors, decoded as 48.
+       Out of range table indexes produce zero, so each character is
+       looked up in both halves of the table and the results combined. */
+    for (i = 0; encoded_size - i >= 64; i += 64) {
+        uint8x16x4_t in = vld4q_u8((const uint8_t *)encoded + i);
+        uint8x16x3_t out;
+        uint8x16_t invalid = vdupq_n_u8(0);
+        for (k = 0; k < 4; ++k) {
+            uint8x16_t value = vorrq_u8(vqtbl4q_u8(lower, in.val[k]),
+                                        vqtbl4q_u8(upper, vsubq_u8(in.val[k], offset)));
+            invalid = vorrq_u8(invalid, vorrq_u8(value, vandq_u8(in.val[k], highBit)));
+            in.val[k] = value;
+        }
+        if (vmaxvq_u8(invalid) > 63) {
+            break;
+        }
+        out.val[0] = vorrq_u8(vshlq_n_u8(in.val[0], 2), vshrq_n_u8(in.val[1], 4));
+        out.val[1] = vorrq_u8(vshlq_n_u8(in.val[1], 4), vshrq_n_u8(in.val[2], 2));
+        out.val[2] = vorrq_u8(vshlq_n_u8(in.val[2], 6), in.val[3]);
+        vst3q_u8(decoded + (i / 4) * 3, out);
+    }
+    return i;
+}
+#endif /* BASE64ED_SIMD_NEON */
+
+static const char * const kernel_names[SAILFISHKEYPROVIDER_BASE64_KERNEL_COUNT] = {
+    "scalar", "sse4.1", "avx2", "neon"
+};
+
+static base64_encode_kernel selected_encode = encode_scalar;
+static base64_decode_kernel selected_decode = decode_scalar;
+static int selected_kernel = SAILFISHKEYPROVIDER_BASE64_KERNEL_SCALAR;
+
+int SailfishKeyProvider_base64_kernel_supported(int kernel)
+{
+    unsigned int features = SailfishKeyProvider_dispatch_cpu_features();
+    switch (kernel) {
+        case SAILFISHKEYPROVIDER_BASE64_KERNEL_SCALAR:
+            return 1;
+#ifdef BASE64ED_SIMD_X86
+        case SAILFISHKEYPROVIDER_BASE64_KERNEL_SSE41:
+            return (features & SAILFISHKEYPROVIDER_CPU_SSE41) != 0;
+        case SAILFISHKEYPROVIDER_BASE64_KERNEL_AVX2:
+            return (features & SAILFISHKEYPROVIDER_CPU_AVX2) != 0;
+#endif
+#ifdef BASE64ED_SIMD_NEON
+        case SAILFISHKEYPROVIDER_BASE64_KERNEL_NEON:
+            return (features & SAILFISHKEYPROVIDER_CPU_NEON) != 0;
+#endif
+        default:
+            (void)features;
+            return 0;
+    }
+}
+
+static void set_kernel(int kernel)
+{
+    switch (kernel) {
+#ifdef BASE64ED_SIMD_X86
+        case SAILFISHKEYPROVIDER_BASE64_KERNEL_SSE41:
+            selected_encode = encode_sse41;
+            selected_decode = decode_sse41;
+            break;
+        case SAILFISHKEYPROVIDER_BASE64_KERNEL_AVX2:
+            selected_encode = encode_avx2;
+            selected_decode = decode_avx2;
+            break;
+#endif
+#ifdef BASE64ED_SIMD_NEON
+        case SAILFISHKEYPROVIDER_BASE64_KERNEL_NEON:
+            selected_encode = encode_neon;
+            selected_decode = decode_neon;
+            break;
+#endif
+        default:
+            kernel = SAILFISHKEYPROVIDER_BASE64_KERNEL_SCALAR;
+            selected_encode = encode_scalar;
+            selected_decode = decode_scalar;
+            break;
+    }
+    selected_kernel = kernel;
+}
+
+/*
+    Checks the \a kernel against a plain table driven translation of a
+    fixed corpus, in both alphabets: whatever it encodes must match, and
+    whatever it decodes must give back the original bytes, stopping
+    short of a character outside the alphabet.
+    Returns 0 if it agrees, or -1 otherwise.
+*/
+static int self_test(int kernel)
+{
+    const SailfishKeyProvider_base64_alphabet *alphabets[] = {
+        &SailfishKeyProvider_base64_standard,
+        &SailfishKeyProvider_base64_url
+    };
+    int previous = selected_kernel;
+    uint8_t data[240], decoded[240];
+    char encoded[320];
+    uint32_t seed = 2463534242u;
+    size_t a = 0, i = 0;
+    int retn = 0;
+
+    for (i = 0; i < sizeof(data); ++i) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        data[i] = (uint8_t)seed;
+    }
+
+    set_kernel(kernel);
+    for (a = 0; a < sizeof(alphabets) / sizeof(alphabets[0]) && retn == 0; ++a) {
+        const SailfishKeyProvider_base64_alphabet *alphabet = alphabets[a];
+        size_t consumed = selected_encode(alphabet, data, sizeof(data), encoded);
+        size_t encoded_size = consumed / 3 * 4;
+
+        if (consumed % 3 != 0 || consumed > sizeof(data)) {
+            retn = -1;
+            break;
+        }
+        for (i = 0; i < consumed; i += 3) {
+            uint32_t triple = ((uint32_t)data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+            const char *quad = encoded + i / 3 * 4;
+            if (quad[0] != alphabet->charset[(triple >> 18) & 0x3f]
+                    || quad[1] != alphabet->charset[(triple >> 12) & 0x3f]
+                    || quad[2] != alphabet->charset[(triple >> 6) & 0x3f]
+                    || quad[3] != alphabet->charset[triple & 0x3f]) {
+                retn = -1;
+                break;
+            }
+        }
+        if (retn != 0 || encoded_size == 0) {
+            continue;
+        }
+
+        consumed = selected_decode(alphabet, encoded, encoded_size, decoded);
+        if (consumed % 4 != 0 || consumed > encoded_size
+                || memcmp(decoded, data, consumed / 4 * 3) != 0) {
+            retn = -1;
+            break;
+        }
+
+        /* a stray '=' two thirds of the way in must stop the kernel */
+        encoded[encoded_size / 3 * 2] = '=';
+        consumed = selected_decode(alphabet, encoded, encoded_size, decoded);
+        if (consumed > encoded_size / 3 * 2
+                || memcmp(decoded, data, consumed / 4 * 3) != 0) {
+            retn = -1;
+        }
+    }
+
+    set_kernel(previous);
+    return retn;
+}
+
+const SailfishKeyProvider_dispatch_family SailfishKeyProvider_base64_family = {
+    "base64",
+    SAILFISHKEYPROVIDER_BASE64_KERNEL_COUNT,
+    SailfishKeyProvider_base64_kernel_supported,
+    self_test,
+    set_kernel,
+    SailfishKeyProvider_base64_kernel_name
+};
+
+/*
+    Overrides the kernel chosen for this cpu, for testing and benchmarking.
+    Returns 0 on success, or -1 if the \a kernel is not supported.
+*/
+int SailfishKeyProvider_base64_select_kernel(int kernel)
+{
+    if (!SailfishKeyProvider_base64_kernel_supported(kernel)) {
+        return -1;
+    }
+    set_kernel(kernel);
+    return 0;
+}
+
+int SailfishKeyProvider_base64_selected_kernel()
+{
+    return selected_kernel;
+}
+
+const char * SailfishKeyProvider_base64_kernel_name(int kernel)
+{
+    if (kernel < 0 || kernel >= SAILFISHKEYPROVIDER_BASE64_KERNEL_COUNT) {
+        return NULL;
+    }
+    return kernel_names[kernel];
+}
+
+size_t SailfishKeyProvider_base64_encode_blocks(
+                    const SailfishKeyProvider_base64_alphabet *alphabet,
+                    const uint8_t *data,
+                    size_t data_size,
+                    char *encoded)
+{
+    return selected_encode(alphabet, data, data_size, encoded);
+}
+
+size_t SailfishKeyProvider_base64_decode_blocks(
+                    const SailfishKeyProvider_base64_alphabet *alphabet,
+                    const char *encoded,
+                    size_t encoded_size,
+                    uint8_t *decoded)
+{
+    return selected_decode(alphabet, encoded, encoded_size, decoded);
+}
@@ -0,0 +1,77 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Jolla Ltd.
+** Contact: Chris Adams <chris.adams@jollamobile.com>
+** All rights reserved.
+**
+** You may use this file under the terms of the GNU Lesser General
+** Public License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Public License for more details.
+**
+****************************************************************************/
+
+
+#ifndef BASE64ED_SIMD_H
+#define BASE64ED_SIMD_H
+
+#include "base64ed.h"
+#include "dispatch.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/* Kernels which may be selected, if the cpu supports them */
+#define SAILFISHKEYPROVIDER_BASE64_KERNEL_SCALAR 0
+#define SAILFISHKEYPROVIDER_BASE64_KERNEL_SSE41  1
+#define SAILFISHKEYPROVIDER_BASE64_KERNEL_AVX2   2
+#define SAILFISHKEYPROVIDER_BASE64_KERNEL_NEON   3
+#define SAILFISHKEYPROVIDER_BASE64_KERNEL_COUNT  4
+
+/* Encodes as many whole 3 byte blocks from the start of \a data as the
+   selected kernel handles, using the given \a alphabet, and returns the
+   number of bytes consumed.  4/3 times that many bytes of \a encoded
+   are written. */
+size_t SailfishKeyProvider_base64_encode_blocks(
+                    const SailfishKeyProvider_base64_alphabet *alphabet,
+                    const uint8_t *data,
+                    size_t data_size,
+                    char *encoded);
+
+/* Decodes as many whole 4 byte chunks from the start of \a encoded as
+   the selected kernel handles, and returns the number of bytes consumed.
+   3/4 times that many bytes of \a decoded are produced, although a
+   kernel may use all of the first 3 * (encoded_size / 4) bytes as
+   scratch space.  Decoding stops early at invalid data (including
+   padding and whitespace), which is left for the caller to handle. */
+size_t SailfishKeyProvider_base64_decode_blocks(
+                    const SailfishKeyProvider_base64_alphabet *alphabet,
+                    const char *encoded,
+                    size_t encoded_size,
+                    uint8_t *decoded);
+
+extern const SailfishKeyProvider_dispatch_family SailfishKeyProvider_base64_family;
+
+int SailfishKeyProvider_base64_kernel_supported(int kernel);
+int SailfishKeyProvider_base64_select_kernel(int kernel);
+int SailfishKeyProvider_base64_selected_kernel();
+const char * SailfishKeyProvider_base64_kernel_name(int kernel);
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BASE64ED_SIMD_H */
@@ -0,0 +1,545 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Jolla Ltd.
+** Contact: Chris Adams <chris.adams@jollamobile.com>
+** All rights reserved.
+**
+** You may use this file under the terms of the GNU Lesser General
+** Public License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Public License for more details.
+**
+****************************************************************************/
+
+/*
+    ChaCha20 stream cipher
+
+    The block function and the layout of its state follow RFC 8439.  The
+    scalar kernel generates one block at a time and is the reference
+    implementation; the vector kernels run the rounds for four or eight
+    consecutive blocks side by side, one block per vector lane, and then
+    transpose the lanes back into keystream order.  Whole groups of
+    blocks go to the selected kernel and any remainder to narrower ones,
+    so that short values do not pay for keystream they never use.
+
+    The kernel is chosen when the library is loaded, from those which the
+    cpu supports (see dispatch.c).
+*/
+
+#include "chacha20.h"
+#include "dispatch.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && !defined(__clang__) \
+        && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define CHACHA20_VECTOR
+#if defined(__x86_64__) || defined(__i386__)
+#define CHACHA20_VECTOR_AVX2
+#endif
+#endif
+
+#define CHACHA20_ROUNDS 20
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+/* Works on scalars and on vectors of uint32_t alike */
+#define QUARTERROUND(a, b, c, d)                    \
+    a += b; d ^= a; d = ROTL32(d, 16);              \
+    c += d; b ^= c; b = ROTL32(b, 12);              \
+    a += b; d ^= a; d = ROTL32(d, 8);               \
+    c += d; b ^= c; b = ROTL32(b, 7)
+
+#define DOUBLEROUND(x)                                      \
+    QUARTERROUND(x[0], x[4], x[8],  x[12]);                 \
+    QUARTERROUND(x[1], x[5], x[9],  x[13]);                 \
+    QUARTERROUND(x[2], x[6], x[10], x[14]);                 \
+    QUARTERROUND(x[3], x[7], x[11], x[15]);                 \
+    QUARTERROUND(x[0], x[5], x[10], x[15]);                 \
+    QUARTERROUND(x[1], x[6], x[11], x[12]);                 \
+    QUARTERROUND(x[2], x[7], x[8],  x[13]);                 \
+    QUARTERROUND(x[3], x[4], x[9],  x[14])
+
+/* Kernels XOR all of the input with the keystream starting at the
+   state's block counter */
+typedef void (*chacha20_kernel)(const uint32_t *, const uint8_t *, uint8_t *, size_t);
+
+static uint32_t load32_le(const uint8_t *p)
+{
+    return (uint32_t)p[0]
+         | ((uint32_t)p[1] << 8)
+         | ((uint32_t)p[2] << 16)
+         | ((uint32_t)p[3] << 24);
+}
+
+static void store32_le(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static void state_init(uint32_t state[16],
+                       const uint8_t key[SAILFISHKEYPROVIDER_CHACHA20_KEY_SIZE],
+                       uint32_t counter,
+                       const uint8_t nonce[SAILFISHKEYPROVIDER_CHACHA20_NONCE_SIZE])
+{
+    int i = 0;
+
+    state[0] = 0x61707865; /* "expand 32-byte k" */
+    state[1] = 0x3320646e;
+    state[2] = 0x79622d32;
+    state[3] = 0x6b206574;
+    for (i = 0; i < 8; ++i) {
+        state[4 + i] = load32_le(key + 4 * i);
+    }
+    state[12] = counter;
+    for (i = 0; i < 3; ++i) {
+        state[13 + i] = load32_le(nonce + 4 * i);
+    }
+}
+
+static void xor_keystream(uint8_t *out, const uint8_t *in, const uint8_t *keystream, size_t size)
+{
+    size_t i = 0;
+    for (i = 0; i + 8 <= size; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, in + i, 8);
+        memcpy(&b, keystream + i, 8);
+        a ^= b;
+        memcpy(out + i, &a, 8);
+    }
+    for (; i < size; ++i) {
+        out[i] = in[i] ^ keystream[i];
+    }
+}
+
+static void block_scalar(const uint32_t state[16], uint8_t block[SAILFISHKEYPROVIDER_CHACHA20_BLOCK_SIZE])
+{
+    uint32_t x[16];
+    int i = 0;
+
+    memcpy(x, state, sizeof(x));
+    for (i = 0; i < CHACHA20_ROUNDS; i += 2) {
+        DOUBLEROUND(x);
+    }
+    for (i = 0; i < 16; ++i) {
+        store32_le(block + 4 * i, x[i] + state[i]);
+    }
+}
+
+static void xor_scalar(const uint32_t state[16], const uint8_t *in, uint8_t *out, size_t size)
+{
+    uint32_t s[16];
+    uint8_t block[SAILFISHKEYPROVIDER_CHACHA20_BLOCK_SIZE];
+    size_t done = 0;
+
+    memcpy(s, state, sizeof(s));
+    while (done < size) {
+        size_t n = size - done;
+        if (n > sizeof(block)) {
+            n = sizeof(block);
+        }
+        block_scalar(s, block);
+        xor_keystream(out + done, in + done, block, n);
+        s[12]++;
+        done += n;
+    }
+}
+
+#ifdef CHACHA20_VECTOR
+typedef uint32_t chacha20_v4 __attribute__((vector_size(16)));
+
+static void xor_vec4(const uint32_t state[16], const uint8_t *in, uint8_t *out, size_t size)
+{
+    const chacha20_v4 lanes = { 0, 1, 2, 3 };
+    const chacha20_v4 lo = { 0, 4, 1, 5 };
+    const chacha20_v4 hi = { 2, 6, 3, 7 };
+    const chacha20_v4 lo64 = { 0, 1, 4, 5 };
+    const chacha20_v4 hi64 = { 2, 3, 6, 7 };
+    uint8_t keystream[4 * SAILFISHKEYPROVIDER_CHACHA20_BLOCK_SIZE];
+    uint32_t counter = state[12];
+    size_t done = 0;
+
+    while (done < size) {
+        chacha20_v4 s[16], x[16];
+        size_t n = size - done;
+        int i = 0;
+
+        for (i = 0; i < 16; ++i) {
+            s[i] = (chacha20_v4){ 0, 0, 0, 0 } + state[i];
+        }
+        s[12] = counter + lanes;
+        memcpy(x, s, sizeof(x));
+        for (i = 0; i < CHACHA20_ROUNDS; i += 2) {
+            DOUBLEROUND(x);
+        }
+
+        /* Lane j of x[i] is word i of block j: transpose each group of
+           four words so that every block's words are contiguous */
+        for (i = 0; i < 16; i += 4) {
+            chacha20_v4 a0 = x[i] + s[i], a1 = x[i + 1] + s[i + 1];
+            chacha20_v4 a2 = x[i + 2] + s[i + 2], a3 = x[i + 3] + s[i + 3];
+            chacha20_v4 t0 = __builtin_shuffle(a0, a1, lo);
+            chacha20_v4 t1 = __builtin_shuffle(a2, a3, lo);
+            chacha20_v4 t2 = __builtin_shuffle(a0, a1, hi);
+            chacha20_v4 t3 = __builtin_shuffle(a2, a3, hi);
+            chacha20_v4 b0 = __builtin_shuffle(t0, t1, lo64);
+            chacha20_v4 b1 = __builtin_shuffle(t0, t1, hi64);
+            chacha20_v4 b2 = __builtin_shuffle(t2, t3, lo64);
+            chacha20_v4 b3 = __builtin_shuffle(t2, t3, hi64);
+            memcpy(keystream + 0 * 64 + 4 * i, &b0, 16);
+            memcpy(keystream + 1 * 64 + 4 * i, &b1, 16);
+            memcpy(keystream + 2 * 64 + 4 * i, &b2, 16);
+            memcpy(keystream + 3 * 64 + 4 * i, &b3, 16);
+        }
+
+        if (n > sizeof(keystream)) {
+            n = sizeof(keystream);
+        }
+        xor_keystream(out + done, in + done, keystream, n);
+        counter += 4;
+        done += n;
+    }
+}
+#endif /* CHACHA20_VECTOR */
+
+#ifdef CHACHA20_VECTOR_AVX2
+typedef uint32_t chacha20_v8 __attribute__((vector_size(32)));
+
+__attribute__((target("avx2")))
+static void xor_vec8(const uint32_t state[16], const uint8_t *in, uint8_t *out, size_t size)
+{
+    const chacha20_v8 lanes = { 0, 1, 2, 3, 4, 5, 6, 7 };
+    const chacha20_v8 lo = { 0, 8, 1, 9, 4, 12, 5, 13 };
+    const chacha20_v8 hi = { 2, 10, 3, 11, 6, 14, 7, 15 };
+    const chacha20_v8 lo64 = { 0, 1, 8, 9, 4, 5, 12, 13 };
+    const chacha20_v8 hi64 = { 2, 3, 10, 11, 6, 7, 14, 15 };
+    uint8_t keystream[8 * SAILFISHKEYPROVIDER_CHACHA20_BLOCK_SIZE];
+    uint32_t counter = state[12];
+    size_t done = 0;
+
+    while (done < size) {
+        chacha20_v8 s[16], x[16];
+        size_t n = size - done;
+        int i = 0;
+
+        for (i = 0; i < 16; ++i) {
+            s[i] = (chacha20_v8){ 0, 0, 0, 0, 0, 0, 0, 0 } + state[i];
+        }
+        s[12] = counter + lanes;
+        memcpy(x, s, sizeof(x));
+        for (i = 0; i < CHACHA20_ROUNDS; i += 2) {
+            DOUBLEROUND(x);
+        }
+
+        /* As for four blocks, but within each 128-bit half, so the low
+           half of b0 ends up holding block 0 and the high half block 4 */
+        for (i = 0; i < 16; i += 4) {
+            chacha20_v8 a0 = x[i] + s[i], a1 = x[i + 1] + s[i + 1];
+            chacha20_v8 a2 = x[i + 2] + s[i + 2], a3 = x[i + 3] + s[i + 3];
+            chacha20_v8 t0 = __builtin_shuffle(a0, a1, lo);
+            chacha20_v8 t1 = __builtin_shuffle(a2, a3, lo);
+            chacha20_v8 t2 = __builtin_shuffle(a0, a1, hi);
+            chacha20_v8 t3 = __builtin_shuffle(a2, a3, hi);
+            chacha20_v8 b[4];
+            int j = 0;
+            b[0] = __builtin_shuffle(t0, t1, lo64);
+            b[1] = __builtin_shuffle(t0, t1, hi64);
+            b[2] = __builtin_shuffle(t2, t3, lo64);
+            b[3] = __builtin_shuffle(t2, t3, hi64);
+            for (j = 0; j < 4; ++j) {
+                memcpy(keystream + j * 64 + 4 * i, &b[j], 16);
+                memcpy(keystream + (j + 4) * 64 + 4 * i, (const uint8_t *)&b[j] + 16, 16);
+            }
+        }
+
+        if (n > sizeof(keystream)) {
+            n = sizeof(keystream);
+        }
+        xor_keystream(out + done, in + done, keystream, n);
+        counter += 8;
+        done += n;
+    }
+}
+#endif /* CHACHA20_VECTOR_AVX2 */
+
+static const char * const kernel_names[SAILFISHKEYPROVIDER_CHACHA20_KERNEL_COUNT] = {
+    "scalar", "4-way", "8-way"
+};
+
+static chacha20_kernel selected_xor = xor_scalar;
+static size_t selected_width = 1; /* blocks per group */
+static int selected_kernel = SAILFISHKEYPROVIDER_CHACHA20_KERNEL_SCALAR;
+
+int SailfishKeyProvider_chacha20_kernel_supported(int kernel)
+{
+    unsigned int features = SailfishKeyProvider_dispatch_cpu_features();
+    switch (kernel) {
+        case SAILFISHKEYPROVIDER_CHACHA20_KERNEL_SCALAR:
+            return 1;
+#ifdef CHACHA20_VECTOR
+        case SAILFISHKEYPROVIDER_CHACHA20_KERNEL_VEC4:
+            return 1; /* lowered to whatever the baseline target offers */
+#endif
+#ifdef CHACHA20_VECTOR_AVX2
+        case SAILFISHKEYPROVIDER_CHACHA20_KERNEL_VEC8:
+            return (features & SAILFISHKEYPROVIDER_CPU_AVX2) != 0;
+#endif
+        default:
+            (void)features;
+            return 0;
+    }
+}
+
+static void set_kernel(int kernel)
+{
+    switch (kernel) {
+#ifdef CHACHA20_VECTOR
+        case SAILFISHKEYPROVIDER_CHACHA20_KERNEL_VEC4:
+            selected_xor = xor_vec4;
+            selected_width = 4;
+            break;
+#endif
+#ifdef CHACHA20_VECTOR_AVX2
+        case SAILFISHKEYPROVIDER_CHACHA20_KERNEL_VEC8:
+            selected_xor = xor_vec8;
+            selected_width = 8;
+            break;
+#endif
+        default:
+            kernel = SAILFISHKEYPROVIDER_CHACHA20_KERNEL_SCALAR;
+            selected_xor = xor_scalar;
+            selected_width = 1;
+            break;
+    }
+    selected_kernel = kernel;
+}
+
+/*
+    Checks the \a kernel against the scalar kernel, for lengths from a
+    partial block to several groups of blocks.
+    Returns 0 if it agrees, or -1 otherwise.
+*/
+static int self_test(int kernel)
+{
+    static const uint8_t key[SAILFISHKEYPROVIDER_CHACHA20_KEY_SIZE] = {
+        0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+        0x88, 0x89, 0x8a, 0x8b, 0x8c, 0x8d, 0x8e, 0x8f,
+        0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97,
+        0x98, 0x99, 0x9a, 0x9b, 0x9c, 0x9d, 0x9e, 0x9f
+    };
+    static const uint8_t nonce[SAILFISHKEYPROVIDER_CHACHA20_NONCE_SIZE] = {
+        0x07, 0x00, 0x00, 0x00, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47
+    };
+    uint8_t data[1100], expected[1100], actual[1100];
+    uint32_t state[16];
+    int previous = selected_kernel;
+    size_t size = 0, i = 0;
+    int retn = 0;
+
+    for (i = 0; i < sizeof(data); ++i) {
+        data[i] = (uint8_t)(i * 167 + 13);
+    }
+    state_init(state, key, 0xfffffff0u, nonce); /* the counter wraps */
+    xor_scalar(state, data, expected, sizeof(data));
+
+    set_kernel(kernel);
+    for (size = 1; size <= sizeof(data) && retn == 0; size += 109) {
+        selected_xor(state, data, actual, size);
+        if (memcmp(actual, expected, size) != 0) {
+            retn = -1;
+        }
+    }
+    set_kernel(previous);
+    return retn;
+}
+
+const SailfishKeyProvider_dispatch_family SailfishKeyProvider_chacha20_family = {
+    "chacha20",
+    SAILFISHKEYPROVIDER_CHACHA20_KERNEL_COUNT,
+    SailfishKeyProvider_chacha20_kernel_supported,
+    self_test,
+    set_kernel,
+    SailfishKeyProvider_chacha20_kernel_name
+};
+
+/*
+    Overrides the kernel chosen for this cpu, for testing and benchmarking.
+    Returns 0 on success, or -1 if the \a kernel is not supported.
+*/
+int SailfishKeyProvider_chacha20_select_kernel(int kernel)
+{
+    if (!SailfishKeyProvider_chacha20_kernel_supported(kernel)) {
+        return -1;
+    }
+    set_kernel(kernel);
+    return 0;
+}
+
+int SailfishKeyProvider_chacha20_selected_kernel()
+{
+    return selected_kernel;
+}
+
+const char * SailfishKeyProvider_chacha20_kernel_name(int kernel)
+{
+    if (kernel < 0 || kernel >= SAILFISHKEYPROVIDER_CHACHA20_KERNEL_COUNT) {
+        return NULL;
+    }
+    return kernel_names[kernel];
+}
+
+void SailfishKeyProvider_chacha20_block(
+                    const uint8_t key[SAILFISHKEYPROVIDER_CHACHA20_KEY_SIZE],
+                    uint32_t counter,
+                    const uint8_t nonce[SAILFISHKEYPROVIDER_CHACHA20_NONCE_SIZE],
+                    uint8_t block[SAILFISHKEYPROVIDER_CHACHA20_BLOCK_SIZE])
+{
+    uint32_t state[16];
+    state_init(state, key, counter, nonce);
+    block_scalar(state, block);
+}
+
+void SailfishKeyProvider_chacha20_xor(
+                    const uint8_t key[SAILFISHKEYPROVIDER_CHACHA20_KEY_SIZE],
+                    uint32_t counter,
+                    const uint8_t nonce[SAILFISHKEYPROVIDER_CHACHA20_NONCE_SIZE],
+                    const uint8_t *in,
+                    uint8_t *out,
+                    size_t size)
+{
+    uint32_t state[16];
+
+    if (size == 0) {
+        return;
+    }
+    state_init(state, key, counter, nonce);
+
+    /* The selected kernel takes whole groups of blocks; a short tail is
+       cheaper in narrower groups than as part of one wide group */
+    if (selected_width > 1) {
+        size_t wide = size - size % (selected_width * SAILFISHKEYPROVIDER_CHACHA20_BLOCK_SIZE);
+        if (wide > 0) {
+            selected_xor(state, in, out, wide);
+            state[12] += (uint32_t)(wide / SAILFISHKEYPROVIDER_CHACHA20_BLOCK_SIZE);
+            in += wide;
+            out += wide;
+            size -= wide;
+        }
+    }
+#ifdef CHACHA20_VECTOR
+    if (selected_width > 4 && size > 2 * SAILFISHKEYPROVIDER_CHACHA20_BLOCK_SIZE) {
+        xor_vec4(state, in, out, size);
+        return;
+    }
+#endif
+    if (size > 0) {
+        xor_scalar(state, in, out, size);
+    }
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/*
+    HChaCha20: the rounds without the final addition, keeping the first
+    and last rows.  Keyed by \a key, it maps the 16 byte \a input to a
+    new 256-bit key.
+*/
+static void hchacha20(const uint8_t key[SAILFISHKEYPROVIDER_CHACHA20_KEY_SIZE],
+                      const uint8_t input[16],
+                      uint8_t out[SAILFISHKEYPROVIDER_CHACHA20_KEY_SIZE])
+{
+    uint32_t x[16];
+    size_t i = 0;
+
+    state_init(x, key, load32_le(input), input + 4);
+    for (i = 0; i < CHACHA20_ROUNDS; i += 2) {
+        DOUBLEROUND(x);
+    }
+    for (i = 0; i < 4; ++i) {
+        store32_le(out + 4 * i, x[i]);
+        store32_le(out + 16 + 4 * i, x[12 + i]);
+    }
+    memset(x, 0, sizeof(x));
+}
+
+/*
+    Derives the 256-bit cipher key from the given text \a passphrase.
+    A passphrase of exactly 64 hexadecimal digits is taken to be the key
+    itself.  Otherwise the passphrase is absorbed 32 bytes at a time,
+    each half of a chunk rekeying HChaCha20 from the previous key, and
+    its length is absorbed last, so that distinct passphrases give
+    distinct keys.  This is not a password hash, so passphrases must be
+    random rather than memorable.
+*/
+void SailfishKeyProvider_chacha20_derive_key(
+                    const char *passphrase,
+                    size_t passphrase_size,
+                    uint8_t key[SAILFISHKEYPROVIDER_CHACHA20_KEY_SIZE])
+{
+    static const uint8_t label[8] = {
+        's', 'a', 'i', 'l', 'f', 'i', 's', 'h'
+    };
+    uint8_t chunk[SAILFISHKEYPROVIDER_CHACHA20_KEY_SIZE];
+    uint8_t chain[SAILFISHKEYPROVIDER_CHACHA20_KEY_SIZE];
+    size_t i = 0, offset = 0;
+
+    if (passphrase_size == 2 * SAILFISHKEYPROVIDER_CHACHA20_KEY_SIZE) {
+        for (i = 0; i < SAILFISHKEYPROVIDER_CHACHA20_KEY_SIZE; ++i) {
+            int high = hex_value(passphrase[2 * i]);
+            int low = hex_value(passphrase[2 * i + 1]);
+            if (high < 0 || low < 0) {
+                break;
+            }
+            key[i] = (uint8_t)((high << 4) | low);
+        }
+        if (i == SAILFISHKEYPROVIDER_CHACHA20_KEY_SIZE) {
+            return;
+        }
+    }
+
+    /* the last chunk is padded with zeros, which the length then
+       tells apart from zeros in the passphrase itself */
+    memset(chain, 0, sizeof(chain));
+    for (offset = 0; offset < passphrase_size; offset += sizeof(chunk)) {
+        size_t size = passphrase_size - offset;
+        if (size > sizeof(chunk)) {
+            size = sizeof(chunk);
+        }
+        memset(chunk, 0, sizeof(chunk));
+        memcpy(chunk, passphrase + offset, size);
+        hchacha20(chain, chunk, chain);
+        hchacha20(chain, chunk + 16, chain);
+    }
+
+    memset(chunk, 0, sizeof(chunk));
+    for (i = 0; i < 8; ++i) {
+        chunk[i] = (uint8_t)((uint64_t)passphrase_size >> (8 * i));
+    }
+    memcpy(chunk + 8, label, sizeof(label));
+    hchacha20(chain, chunk, key);
+
+    memset(chunk, 0, sizeof(chunk));
+    memset(chain, 0, sizeof(chain));
+}
@@ -0,0 +1,79 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Jolla Ltd.
+** Contact: Chris Adams <chris.adams@jollamobile.com>
+** All rights reserved.
+**
+** You may use this file under the terms of the GNU Lesser General
+** Public License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Public License for more details.
+**
+****************************************************************************/
+
+#ifndef CHACHA20_H
+#define CHACHA20_H
+
+#include "dispatch.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#define SAILFISHKEYPROVIDER_CHACHA20_KEY_SIZE   32
+#define SAILFISHKEYPROVIDER_CHACHA20_NONCE_SIZE 12
+#define SAILFISHKEYPROVIDER_CHACHA20_BLOCK_SIZE 64
+
+/* Kernels which may be selected, if the cpu supports them */
+#define SAILFISHKEYPROVIDER_CHACHA20_KERNEL_SCALAR 0
+#define SAILFISHKEYPROVIDER_CHACHA20_KERNEL_VEC4   1 /* 4 blocks at a time */
+#define SAILFISHKEYPROVIDER_CHACHA20_KERNEL_VEC8   2 /* 8 blocks at a time */
+#define SAILFISHKEYPROVIDER_CHACHA20_KERNEL_COUNT  3
+
+/* The RFC 8439 block function: writes the 64 byte keystream block
+   for the given \a counter */
+void SailfishKeyProvider_chacha20_block(
+                    const uint8_t key[SAILFISHKEYPROVIDER_CHACHA20_KEY_SIZE],
+                    uint32_t counter,
+                    const uint8_t nonce[SAILFISHKEYPROVIDER_CHACHA20_NONCE_SIZE],
+                    uint8_t block[SAILFISHKEYPROVIDER_CHACHA20_BLOCK_SIZE]);
+
+/* Encrypts or decrypts the \a size bytes of \a in into \a out, which
+   may be the same buffer, starting from block \a counter */
+void SailfishKeyProvider_chacha20_xor(
+                    const uint8_t key[SAILFISHKEYPROVIDER_CHACHA20_KEY_SIZE],
+                    uint32_t counter,
+                    const uint8_t nonce[SAILFISHKEYPROVIDER_CHACHA20_NONCE_SIZE],
+                    const uint8_t *in,
+                    uint8_t *out,
+                    size_t size);
+
+void SailfishKeyProvider_chacha20_derive_key(
+                    const char *passphrase,
+                    size_t passphrase_size,
+                    uint8_t key[SAILFISHKEYPROVIDER_CHACHA20_KEY_SIZE]);
+
+extern const SailfishKeyProvider_dispatch_family SailfishKeyProvider_chacha20_family;
+
+int SailfishKeyProvider_chacha20_kernel_supported(int kernel);
+int SailfishKeyProvider_chacha20_select_kernel(int kernel);
+int SailfishKeyProvider_chacha20_selected_kernel();
+const char * SailfishKeyProvider_chacha20_kernel_name(int kernel);
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CHACHA20_H */
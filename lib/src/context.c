@@ -0,0 +1,646 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Jolla Ltd.
+** Contact: Chris Adams <chris.adams@jollamobile.com>
+** All rights reserved.
+**
+** You may use this file under the terms of the GNU Lesser General
+** Public License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Public License for more details.
+**
+****************************************************************************/
+
+/*
+    Key provider context
+
+    Holds what the key store functions would otherwise work out again
+    on every call: the home directory and the paths derived from it,
+    and the parsed contents of every ini file read through the context.
+
+    A parsed file is reused for as long as stat() reports the file
+    unchanged.  As file times are only as fine as the kernel's clock
+    tick, a file which was modified within a second of being parsed
+    could change again without its time changing, so it is parsed
+    afresh next time, until it has been left alone for long enough.
+*/
+
+#include "context.h"
+#include "iniparser.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CONTEXT_WRITABLE_DIRECTORY "%s/.local/share/system/privileged/Keys"
+
+struct context_entry {
+    uint32_t hash;
+    const char *section; /* point into the snapshot's strings */
+    const char *key;
+    const char *value;
+};
+
+struct SailfishKeyProvider_IniSnapshot {
+    char *path;
+    struct stat st;
+    int exists;
+    int trusted; /* unchanged since well before it was parsed */
+    int refs;    /* the context's own reference, while it is listed */
+    struct context_entry *table;
+    size_t capacity; /* always a power of two */
+    char *strings;
+    size_t bytes;
+    SailfishKeyProvider_IniSnapshot *next;
+};
+
+struct SailfishKeyProvider_Context {
+    pthread_mutex_t mutex;
+    SailfishKeyProvider_Allocator allocator;
+    char *home;
+    char *writableDirectory;
+    size_t ownBytes; /* the context and its paths */
+    SailfishKeyProvider_IniSnapshot *snapshots;
+    SailfishKeyProvider_ContextStats stats;
+};
+
+/* --------------------------------------------------------- */
+
+static void * context_default_allocate(void *userData, size_t size)
+{
+    (void)userData;
+    return malloc(size);
+}
+
+static void context_default_release(void *userData, void *pointer)
+{
+    (void)userData;
+    free(pointer);
+}
+
+static void * context_allocate(const SailfishKeyProvider_Allocator *allocator, size_t size)
+{
+    return allocator->allocate(allocator->userData, size);
+}
+
+static void context_release(const SailfishKeyProvider_Allocator *allocator, void *pointer)
+{
+    if (pointer != NULL) {
+        allocator->release(allocator->userData, pointer);
+    }
+}
+
+static char * context_strdup(const SailfishKeyProvider_Allocator *allocator, const char *string)
+{
+    size_t length = strlen(string) + 1;
+    char *copy = (char *)context_allocate(allocator, length);
+    if (copy != NULL) {
+        memcpy(copy, string, length);
+    }
+    return copy;
+}
+
+static uint32_t context_hash(const char *section, const char *key)
+{
+    /* FNV-1a over "section\0key" */
+    uint32_t hash = 2166136261u;
+    const unsigned char *p = NULL;
+    for (p = (const unsigned char *)section; *p; ++p) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    hash = (hash ^ 0) * 16777619u;
+    for (p = (const unsigned char *)key; *p; ++p) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    return hash;
+}
+
+/* --------------------------------------------------------- */
+
+/* Entries are collected as offsets, as the strings may move while
+   the file is read */
+struct context_parsed_entry {
+    size_t section;
+    size_t key;
+    size_t value;
+};
+
+struct context_parse {
+    const SailfishKeyProvider_Allocator *allocator;
+    char *strings;
+    size_t length;
+    size_t allocated;
+    struct context_parsed_entry *entries;
+    size_t count;
+    size_t entriesAllocated;
+    size_t *sections; /* every section seen so far */
+    size_t sectionCount;
+    size_t sectionsAllocated;
+    size_t section;   /* the current section, if it is read */
+    int skipping;     /* in a repeated section */
+    int failed;
+};
+
+static int context_grow(const SailfishKeyProvider_Allocator *allocator,
+                        void **data, size_t *allocated, size_t used, size_t needed, size_t size)
+{
+    size_t newAllocated = *allocated ? *allocated : 16;
+    void *newData = NULL;
+    if (used + needed <= *allocated) {
+        return 0;
+    }
+    while (newAllocated < used + needed) {
+        newAllocated *= 2;
+    }
+    newData = context_allocate(allocator, newAllocated * size);
+    if (newData == NULL) {
+        return -1;
+    }
+    if (used > 0) {
+        memcpy(newData, *data, used * size);
+    }
+    context_release(allocator, *data);
+    *data = newData;
+    *allocated = newAllocated;
+    return 0;
+}
+
+static int context_parse_string(struct context_parse *parse, const char *string, size_t *offset)
+{
+    size_t length = strlen(string) + 1;
+    if (context_grow(parse->allocator, (void **)&parse->strings, &parse->allocated,
+                     parse->length, length, 1) != 0) {
+        return -1;
+    }
+    memcpy(parse->strings + parse->length, string, length);
+    *offset = parse->length;
+    parse->length += length;
+    return 0;
+}
+
+/* Keeps what SailfishKeyProvider_ini_read() would find: the first
+   occurrence of each section, and the first value of each key in it */
+static int context_parse_entry(void *userData, const char *section, const char *key, const char *value)
+{
+    struct context_parse *parse = (struct context_parse *)userData;
+    struct context_parsed_entry *entry = NULL;
+    size_t i = 0;
+
+    if (section == NULL) {
+        return 0;
+    }
+
+    if (parse->sectionCount == 0
+            || strcmp(parse->strings + parse->sections[parse->sectionCount - 1], section) != 0) {
+        parse->skipping = 0;
+        for (i = 0; i < parse->sectionCount; ++i) {
+            if (strcmp(parse->strings + parse->sections[i], section) == 0) {
+                parse->skipping = 1;
+                break;
+            }
+        }
+        if (parse->skipping) {
+            return 0;
+        }
+        if (context_grow(parse->allocator, (void **)&parse->sections, &parse->sectionsAllocated,
+                         parse->sectionCount, 1, sizeof(size_t)) != 0
+                || context_parse_string(parse, section, &parse->section) != 0) {
+            parse->failed = 1;
+            return 1;
+        }
+        parse->sections[parse->sectionCount++] = parse->section;
+    } else if (parse->skipping) {
+        return 0;
+    }
+
+    if (context_grow(parse->allocator, (void **)&parse->entries, &parse->entriesAllocated,
+                     parse->count, 1, sizeof(struct context_parsed_entry)) != 0) {
+        parse->failed = 1;
+        return 1;
+    }
+    entry = &parse->entries[parse->count];
+    entry->section = parse->section;
+    if (context_parse_string(parse, key, &entry->key) != 0
+            || context_parse_string(parse, value, &entry->value) != 0) {
+        parse->failed = 1;
+        return 1;
+    }
+    parse->count++;
+    return 0;
+}
+
+static struct context_entry * context_find_slot(
+                    struct context_entry *table,
+                    size_t capacity,
+                    uint32_t hash,
+                    const char *section,
+                    const char *key)
+{
+    size_t mask = capacity - 1;
+    size_t i = hash & mask;
+    while (table[i].section != NULL) {
+        if (table[i].hash == hash
+                && strcmp(table[i].key, key) == 0
+                && strcmp(table[i].section, section) == 0) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return &table[i];
+}
+
+static void context_free_snapshot(
+                    const SailfishKeyProvider_Allocator *allocator,
+                    SailfishKeyProvider_IniSnapshot *snapshot)
+{
+    if (snapshot != NULL) {
+        context_release(allocator, snapshot->path);
+        context_release(allocator, snapshot->table);
+        context_release(allocator, snapshot->strings);
+        context_release(allocator, snapshot);
+    }
+}
+
+/* Parses \a filename, whose state before it was read is \a st */
+static SailfishKeyProvider_IniSnapshot * context_parse_snapshot(
+                    const SailfishKeyProvider_Allocator *allocator,
+                    const char *filename,
+                    const struct stat *st,
+                    int exists,
+                    time_t before)
+{
+    struct context_parse parse;
+    SailfishKeyProvider_IniSnapshot *snapshot = NULL;
+    size_t i = 0;
+
+    memset(&parse, 0, sizeof(parse));
+    parse.allocator = allocator;
+    snapshot = (SailfishKeyProvider_IniSnapshot *)context_allocate(
+            allocator, sizeof(SailfishKeyProvider_IniSnapshot));
+    if (snapshot == NULL) {
+        return NULL;
+    }
+    memset(snapshot, 0, sizeof(SailfishKeyProvider_IniSnapshot));
+    snapshot->path = context_strdup(allocator, filename);
+    snapshot->st = *st;
+    snapshot->exists = exists;
+    snapshot->trusted = !exists || st->st_mtime + 1 < before;
+    snapshot->refs = 1;
+
+    if (exists && SailfishKeyProvider_ini_foreach(filename, context_parse_entry, &parse) != 0) {
+        /* keep what could be read, as the reader would have seen it,
+           but try again next time */
+        snapshot->trusted = 0;
+    }
+
+    snapshot->capacity = 16;
+    while (snapshot->capacity < 2 * parse.count) {
+        snapshot->capacity *= 2;
+    }
+    snapshot->table = (struct context_entry *)context_allocate(
+            allocator, snapshot->capacity * sizeof(struct context_entry));
+    if (snapshot->path == NULL || snapshot->table == NULL || parse.failed) {
+        context_release(allocator, parse.strings);
+        context_release(allocator, parse.entries);
+        context_release(allocator, parse.sections);
+        context_free_snapshot(allocator, snapshot);
+        return NULL;
+    }
+    memset(snapshot->table, 0, snapshot->capacity * sizeof(struct context_entry));
+
+    snapshot->strings = parse.strings;
+    for (i = 0; i < parse.count; ++i) {
+        const char *section = parse.strings + parse.entries[i].section;
+        const char *key = parse.strings + parse.entries[i].key;
+        uint32_t hash = context_hash(section, key);
+        struct context_entry *slot = context_find_slot(
+                snapshot->table, snapshot->capacity, hash, section, key);
+        if (slot->section == NULL) {
+            slot->hash = hash;
+            slot->section = section;
+            slot->key = key;
+            slot->value = parse.strings + parse.entries[i].value;
+        }
+    }
+    snapshot->bytes = sizeof(SailfishKeyProvider_IniSnapshot)
+                    + strlen(filename) + 1
+                    + parse.allocated
+                    + snapshot->capacity * sizeof(struct context_entry);
+
+    context_release(allocator, parse.entries);
+    context_release(allocator, parse.sections);
+    return snapshot;
+}
+
+static int context_same_stat(const struct stat *lhs, const struct stat *rhs)
+{
+    return lhs->st_dev == rhs->st_dev
+        && lhs->st_ino == rhs->st_ino
+        && lhs->st_size == rhs->st_size
+        && lhs->st_mtim.tv_sec == rhs->st_mtim.tv_sec
+        && lhs->st_mtim.tv_nsec == rhs->st_mtim.tv_nsec
+        && lhs->st_ctim.tv_sec == rhs->st_ctim.tv_sec
+        && lhs->st_ctim.tv_nsec == rhs->st_ctim.tv_nsec;
+}
+
+/* Drops a reference, called with the context mutex held */
+static void context_unref(SailfishKeyProvider_Context *context, SailfishKeyProvider_IniSnapshot *snapshot)
+{
+    if (--snapshot->refs == 0) {
+        context_free_snapshot(&context->allocator, snapshot);
+    }
+}
+
+/* --------------------------------------------------------- */
+
+SailfishKeyProvider_IniSnapshot * SailfishKeyProvider_context_acquire_ini(
+                    SailfishKeyProvider_Context * context,
+                    const char * filename)
+{
+    SailfishKeyProvider_IniSnapshot *snapshot = NULL;
+    SailfishKeyProvider_IniSnapshot *parsed = NULL;
+    SailfishKeyProvider_IniSnapshot **link = NULL;
+    struct stat st;
+    time_t before = 0;
+    int exists = 0;
+
+    if (context == NULL || filename == NULL) {
+        return NULL;
+    }
+
+    before = time(NULL);
+    memset(&st, 0, sizeof(st));
+    exists = (stat(filename, &st) == 0);
+    if (!exists && errno != ENOENT && errno != ENOTDIR) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&context->mutex);
+    for (snapshot = context->snapshots; snapshot != NULL; snapshot = snapshot->next) {
+        if (strcmp(snapshot->path, filename) == 0) {
+            break;
+        }
+    }
+    if (snapshot != NULL && snapshot->trusted && snapshot->exists == exists
+            && (!exists || context_same_stat(&snapshot->st, &st))) {
+        snapshot->refs++;
+        context->stats.cacheHits++;
+        pthread_mutex_unlock(&context->mutex);
+        return snapshot;
+    }
+    context->stats.cacheMisses++;
+    pthread_mutex_unlock(&context->mutex);
+
+    /* parse without holding the context, which other threads may use */
+    parsed = context_parse_snapshot(&context->allocator, filename, &st, exists, before);
+    if (parsed == NULL) {
+        return NULL;
+    }
+
+    /* replace whichever snapshot is listed now; those still in use are
+       freed when they are released */
+    pthread_mutex_lock(&context->mutex);
+    for (link = &context->snapshots; *link != NULL; link = &(*link)->next) {
+        if (strcmp((*link)->path, filename) == 0) {
+            snapshot = *link;
+            *link = snapshot->next;
+            context->stats.cachedFiles--;
+            context->stats.cachedBytes -= snapshot->bytes;
+            context_unref(context, snapshot);
+            break;
+        }
+    }
+    parsed->next = context->snapshots;
+    context->snapshots = parsed;
+    context->stats.cachedFiles++;
+    context->stats.cachedBytes += parsed->bytes;
+    parsed->refs++;
+    pthread_mutex_unlock(&context->mutex);
+
+    return parsed;
+}
+
+/* Drops every parsed file; those in use are freed once released */
+void SailfishKeyProvider_context_trim(
+                    SailfishKeyProvider_Context * context)
+{
+    SailfishKeyProvider_IniSnapshot *snapshot = NULL;
+
+    pthread_mutex_lock(&context->mutex);
+    while ((snapshot = context->snapshots) != NULL) {
+        context->snapshots = snapshot->next;
+        context_unref(context, snapshot);
+    }
+    context->stats.cachedFiles = 0;
+    context->stats.cachedBytes = 0;
+    pthread_mutex_unlock(&context->mutex);
+}
+
+size_t SailfishKeyProvider_context_footprint(
+                    SailfishKeyProvider_Context * context)
+{
+    size_t bytes = 0;
+    pthread_mutex_lock(&context->mutex);
+    bytes = context->ownBytes + context->stats.cachedBytes;
+    pthread_mutex_unlock(&context->mutex);
+    return bytes;
+}
+
+void SailfishKeyProvider_context_release_ini(
+                    SailfishKeyProvider_Context * context,
+                    SailfishKeyProvider_IniSnapshot * snapshot)
+{
+    if (context != NULL && snapshot != NULL) {
+        pthread_mutex_lock(&context->mutex);
+        context_unref(context, snapshot);
+        pthread_mutex_unlock(&context->mutex);
+    }
+}
+
+char * SailfishKeyProvider_ini_snapshot_read(
+                    const SailfishKeyProvider_IniSnapshot * snapshot,
+                    const char * section,
+                    const char * key)
+{
+    const struct context_entry *slot = NULL;
+    if (snapshot == NULL || section == NULL || key == NULL) {
+        return NULL;
+    }
+    slot = context_find_slot(snapshot->table, snapshot->capacity,
+                             context_hash(section, key), section, key);
+    return slot->section != NULL ? strdup(slot->value) : NULL;
+}
+
+/* --------------------------------------------------------- */
+
+/*
+    Creates a context for the key store in the home directory of the
+    current user, as named by $HOME.  Returns NULL if $HOME is not set,
+    or on allocation failure.
+*/
+SailfishKeyProvider_Context * SailfishKeyProvider_context_create(
+                    const SailfishKeyProvider_Allocator * allocator)
+{
+    const char *home = getenv("HOME");
+    if (home == NULL) {
+        fprintf(stderr,
+                "SailfishKeyProvider_context_create: %s\n",
+                "HOME is not set");
+        return NULL;
+    }
+    return SailfishKeyProvider_context_create_for_home(home, allocator);
+}
+
+/*
+    Creates a context for the key store in the given \a home directory,
+    whichever user it belongs to.  Returns NULL on allocation failure.
+*/
+SailfishKeyProvider_Context * SailfishKeyProvider_context_create_for_home(
+                    const char * home,
+                    const SailfishKeyProvider_Allocator * allocator)
+{
+    static const SailfishKeyProvider_Allocator defaultAllocator = {
+        context_default_allocate,
+        context_default_release,
+        NULL
+    };
+    SailfishKeyProvider_Context *context = NULL;
+    size_t length = 0;
+
+    if (allocator == NULL) {
+        allocator = &defaultAllocator;
+    }
+    if (home == NULL || allocator->allocate == NULL || allocator->release == NULL) {
+        fprintf(stderr,
+                "SailfishKeyProvider_context_create_for_home: %s\n",
+                "invalid parameters");
+        return NULL;
+    }
+
+    context = (SailfishKeyProvider_Context *)context_allocate(
+            allocator, sizeof(SailfishKeyProvider_Context));
+    if (context == NULL) {
+        return NULL;
+    }
+    memset(context, 0, sizeof(SailfishKeyProvider_Context));
+    context->allocator = *allocator;
+    pthread_mutex_init(&context->mutex, NULL);
+
+    length = strlen(home) + sizeof(CONTEXT_WRITABLE_DIRECTORY);
+    context->home = context_strdup(allocator, home);
+    context->writableDirectory = (char *)context_allocate(allocator, length);
+    if (context->home == NULL || context->writableDirectory == NULL) {
+        SailfishKeyProvider_context_destroy(context);
+        return NULL;
+    }
+    snprintf(context->writableDirectory, length, CONTEXT_WRITABLE_DIRECTORY, home);
+    context->ownBytes = sizeof(SailfishKeyProvider_Context) + strlen(home) + 1 + length;
+
+    return context;
+}
+
+/* Snapshots still acquired from the context must be released first */
+void SailfishKeyProvider_context_destroy(
+                    SailfishKeyProvider_Context * context)
+{
+    SailfishKeyProvider_Allocator allocator;
+    SailfishKeyProvider_IniSnapshot *snapshot = NULL;
+
+    if (context == NULL) {
+        return;
+    }
+
+    allocator = context->allocator;
+    while ((snapshot = context->snapshots) != NULL) {
+        context->snapshots = snapshot->next;
+        context_free_snapshot(&allocator, snapshot);
+    }
+    pthread_mutex_destroy(&context->mutex);
+    context_release(&allocator, context->home);
+    context_release(&allocator, context->writableDirectory);
+    context_release(&allocator, context);
+}
+
+void SailfishKeyProvider_context_stats(
+                    SailfishKeyProvider_Context * context,
+                    SailfishKeyProvider_ContextStats * stats)
+{
+    if (stats == NULL) {
+        return;
+    }
+    if (context == NULL) {
+        memset(stats, 0, sizeof(SailfishKeyProvider_ContextStats));
+        return;
+    }
+    pthread_mutex_lock(&context->mutex);
+    *stats = context->stats;
+    pthread_mutex_unlock(&context->mutex);
+}
+
+/* --------------------------------------------------------- */
+
+static pthread_mutex_t context_default_mutex = PTHREAD_MUTEX_INITIALIZER;
+static SailfishKeyProvider_Context *context_default_instance = NULL;
+
+/* The context of the free functions, which lives as long as the process.
+   Creating it fails while HOME is unset, so a failure is not kept, and
+   a later call tries again. */
+SailfishKeyProvider_Context * SailfishKeyProvider_context_default(void)
+{
+    SailfishKeyProvider_Context *context =
+            __atomic_load_n(&context_default_instance, __ATOMIC_ACQUIRE);
+    if (context != NULL) {
+        return context;
+    }
+
+    pthread_mutex_lock(&context_default_mutex);
+    context = context_default_instance;
+    if (context == NULL) {
+        context = SailfishKeyProvider_context_create(NULL);
+        __atomic_store_n(&context_default_instance, context, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&context_default_mutex);
+    return context;
+}
+
+const char * SailfishKeyProvider_context_home(
+                    const SailfishKeyProvider_Context * context)
+{
+    return context->home;
+}
+
+const char * SailfishKeyProvider_context_writable_directory(
+                    const SailfishKeyProvider_Context * context)
+{
+    return context->writableDirectory;
+}
+
+void SailfishKeyProvider_context_count(
+                    SailfishKeyProvider_Context * context,
+                    enum SailfishKeyProvider_ContextCounter counter)
+{
+    pthread_mutex_lock(&context->mutex);
+    switch (counter) {
+        case SAILFISHKEYPROVIDER_CONTEXT_LOOKUPS: context->stats.lookups++; break;
+        case SAILFISHKEYPROVIDER_CONTEXT_STORES: context->stats.stores++; break;
+        case SAILFISHKEYPROVIDER_CONTEXT_REMOVALS: context->stats.removals++; break;
+    }
+    pthread_mutex_unlock(&context->mutex);
+}
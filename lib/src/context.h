@@ -0,0 +1,83 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Jolla Ltd.
+** Contact: Chris Adams <chris.adams@jollamobile.com>
+** All rights reserved.
+**
+** You may use this file under the terms of the GNU Lesser General
+** Public License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Public License for more details.
+**
+****************************************************************************/
+
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+#include "sailfishkeyprovider_context.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/* A parsed ini file, which stays valid until it is released even if the
+   context has since parsed the file again */
+typedef struct SailfishKeyProvider_IniSnapshot SailfishKeyProvider_IniSnapshot;
+
+enum SailfishKeyProvider_ContextCounter {
+    SAILFISHKEYPROVIDER_CONTEXT_LOOKUPS,
+    SAILFISHKEYPROVIDER_CONTEXT_STORES,
+    SAILFISHKEYPROVIDER_CONTEXT_REMOVALS
+};
+
+SailfishKeyProvider_Context * SailfishKeyProvider_context_default(void);
+
+const char * SailfishKeyProvider_context_home(
+                    const SailfishKeyProvider_Context * context);
+
+const char * SailfishKeyProvider_context_writable_directory(
+                    const SailfishKeyProvider_Context * context);
+
+void SailfishKeyProvider_context_count(
+                    SailfishKeyProvider_Context * context,
+                    enum SailfishKeyProvider_ContextCounter counter);
+
+/* Returns the current contents of \a filename, parsed as
+   SailfishKeyProvider_ini_read() would read them, or NULL on failure.
+   A file which does not exist has no contents. */
+SailfishKeyProvider_IniSnapshot * SailfishKeyProvider_context_acquire_ini(
+                    SailfishKeyProvider_Context * context,
+                    const char * filename);
+
+void SailfishKeyProvider_context_release_ini(
+                    SailfishKeyProvider_Context * context,
+                    SailfishKeyProvider_IniSnapshot * snapshot);
+
+/* Drops the parsed files of \a context, as if it were new */
+void SailfishKeyProvider_context_trim(
+                    SailfishKeyProvider_Context * context);
+
+/* The memory \a context holds, including its parsed files */
+size_t SailfishKeyProvider_context_footprint(
+                    SailfishKeyProvider_Context * context);
+
+/* The caller owns the returned value and must free() it */
+char * SailfishKeyProvider_ini_snapshot_read(
+                    const SailfishKeyProvider_IniSnapshot * snapshot,
+                    const char * section,
+                    const char * key);
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CONTEXT_H */
@@ -0,0 +1,143 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Jolla Ltd.
+** Contact: Chris Adams <chris.adams@jollamobile.com>
+** All rights reserved.
+**
+** You may use this file under the terms of the GNU Lesser General
+** Public License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Public License for more details.
+**
+****************************************************************************/
+
+/*
+    Runtime kernel dispatch
+
+    Every family of vectorised kernels (Base64, XOR and ChaCha20) is
+    resolved here, once, when the library is loaded: each family gets
+    the widest kernel the cpu supports which also passes its self test
+    against the scalar kernel.  Callers then go through a plain function
+    pointer, with no feature check or once-only guard per call.
+
+    Resolution runs from a constructor rather than from GNU indirect
+    function resolvers: those run while the library is being relocated,
+    when calls into libc (getenv(), memcmp(), even the self tests' own
+    memcpy()) are not yet safe if the process binds symbols immediately.
+    Until the constructor has run, every family uses its scalar kernel,
+    so calls from other libraries' constructors are still correct.
+*/
+
+#include "dispatch.h"
+#include "base64ed_simd.h"
+#include "chacha20.h"
+#include "xored.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#define DISPATCH_MAX_FAILURES 8
+
+static const SailfishKeyProvider_dispatch_family * const dispatch_families[] = {
+    &SailfishKeyProvider_base64_family,
+    &SailfishKeyProvider_xor_family,
+    &SailfishKeyProvider_chacha20_family
+};
+
+static int dispatch_initialised = 0;
+
+/*
+    Returns the SAILFISHKEYPROVIDER_CPU_* features of this cpu which
+    the library has kernels for.
+*/
+unsigned int SailfishKeyProvider_dispatch_cpu_features()
+{
+    unsigned int features = 0;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3") && __builtin_cpu_supports("sse4.1")) {
+        features |= SAILFISHKEYPROVIDER_CPU_SSE41;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        features |= SAILFISHKEYPROVIDER_CPU_AVX2;
+    }
+#endif
+#if defined(__aarch64__)
+    features |= SAILFISHKEYPROVIDER_CPU_NEON; /* Advanced SIMD is mandatory */
+#endif
+
+    return features;
+}
+
+/*
+    Returns 1 if the environment asks for the scalar kernels only, for
+    debugging, or 0 otherwise.
+*/
+int SailfishKeyProvider_dispatch_force_scalar()
+{
+    const char *value = getenv(SAILFISHKEYPROVIDER_FORCE_SCALAR_ENV);
+    return value != NULL && *value != '\0' && *value != '0';
+}
+
+/*
+    Resolves the kernel of every family, if that has not been done yet.
+    This is called when the library is loaded.
+*/
+void SailfishKeyProvider_dispatch_init()
+{
+    const SailfishKeyProvider_dispatch_family *failed[DISPATCH_MAX_FAILURES];
+    int failedKernel[DISPATCH_MAX_FAILURES];
+    int failures = 0, forceScalar = 0, i = 0;
+    size_t f = 0;
+
+    if (dispatch_initialised) {
+        return;
+    }
+    dispatch_initialised = 1;
+    forceScalar = SailfishKeyProvider_dispatch_force_scalar();
+
+    for (f = 0; f < sizeof(dispatch_families) / sizeof(dispatch_families[0]); ++f) {
+        const SailfishKeyProvider_dispatch_family *family = dispatch_families[f];
+        int kernel = forceScalar ? 0 : family->count - 1;
+        for (; kernel > 0; --kernel) {
+            if (!family->supported(kernel)) {
+                continue;
+            }
+            if (family->self_test(kernel) == 0) {
+                break;
+            }
+            if (failures < DISPATCH_MAX_FAILURES) {
+                failed[failures] = family;
+                failedKernel[failures] = kernel;
+                failures++;
+            }
+        }
+        family->install(kernel);
+    }
+
+    for (i = 0; i < failures; ++i) {
+        fprintf(stderr,
+                "SailfishKeyProvider_dispatch_init: %s %s kernel failed its self test\n",
+                failed[i]->name, failed[i]->kernel_name(failedKernel[i]));
+    }
+}
+
+#if defined(__GNUC__)
+__attribute__((constructor))
+static void dispatch_constructor()
+{
+    SailfishKeyProvider_dispatch_init();
+}
+#endif
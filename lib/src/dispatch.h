@@ -0,0 +1,59 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Jolla Ltd.
+** Contact: Chris Adams <chris.adams@jollamobile.com>
+** All rights reserved.
+**
+** You may use this file under the terms of the GNU Lesser General
+** Public License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Public License for more details.
+**
+****************************************************************************/
+
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/* Cpu features which kernels may depend on */
+#define SAILFISHKEYPROVIDER_CPU_SSE41 0x1
+#define SAILFISHKEYPROVIDER_CPU_AVX2  0x2
+#define SAILFISHKEYPROVIDER_CPU_NEON  0x4
+
+/* Set to a non-zero value to use only the scalar kernels */
+#define SAILFISHKEYPROVIDER_FORCE_SCALAR_ENV "SAILFISHKEYPROVIDER_FORCE_SCALAR"
+
+/* A set of interchangeable kernels, of which kernel 0 is the scalar
+   reference implementation.  Each is given the widest kernel which the
+   cpu supports and which agrees with the scalar kernel on a fixed corpus
+   when the library is loaded. */
+typedef struct SailfishKeyProvider_dispatch_family {
+    const char *name;
+    int count;
+    int (*supported)(int kernel);
+    int (*self_test)(int kernel); /* 0 if it agrees with the scalar kernel */
+    void (*install)(int kernel);
+    const char * (*kernel_name)(int kernel);
+} SailfishKeyProvider_dispatch_family;
+
+unsigned int SailfishKeyProvider_dispatch_cpu_features();
+int SailfishKeyProvider_dispatch_force_scalar();
+void SailfishKeyProvider_dispatch_init();
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DISPATCH_H */
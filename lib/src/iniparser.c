@@ -29,9 +29,17 @@
     but rather simple to understand and robust.
 
     It does not handle repeated sections.
+
+    The writer patches the existing file rather than regenerating it,
+    so comments, blank lines and unrelated keys are kept byte for byte.
+    It holds an exclusive lock on a companion lock file while it does
+    so; readers take a shared lock on it too, if read locking is enabled.
 */
 
+#define _GNU_SOURCE /* F_OFD_SETLKW */
+
 #include "sailfishkeyprovider_iniparser.h"
+#include "iniparser.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -46,6 +54,18 @@
 
 #define MAX_LINESIZE 4095
 
+/* The lock file of "name.ini" is "name.ini.lock", beside it */
+#define INI_LOCKFILE_SUFFIX ".lock"
+
+/* Open file description locks are owned by the open file rather than
+   the process, so they also exclude other threads of the same process.
+   Older systems only have process-associated locks. */
+#ifdef F_OFD_SETLKW
+#define INI_SETLKW F_OFD_SETLKW
+#else
+#define INI_SETLKW F_SETLKW
+#endif
+
 #define INFO_OK       0 /* succeeded */
 #define INFO_SKIPPED  1 /* whitespace only, or comment line */
 #define INFO_EOF      2 /* empty stream */
@@ -64,6 +84,98 @@ static const char * error_messages[] = {
 
 /* --------------------------------------------------------- */
 
+static int ini_read_locking = 0;
+
+void SailfishKeyProvider_ini_set_read_locking(int enabled)
+{
+    __atomic_store_n(&ini_read_locking, enabled ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+static int ini_durable = 0;
+
+void SailfishKeyProvider_ini_set_durable(int enabled)
+{
+    __atomic_store_n(&ini_durable, enabled ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+/*
+    Locks the lock file of \a filename, exclusively for a writer, which
+    creates the lock file if needed, or shared for a reader.  Waits for
+    the lock, and returns the descriptor which holds it, or -1 if the
+    lock file could not be opened or locked.
+*/
+static int ini_lock(const char *filename, int exclusive)
+{
+    char lockFile[1024];
+    struct flock lock;
+    int fd = -1;
+
+    if (snprintf(lockFile, sizeof(lockFile), "%s%s", filename, INI_LOCKFILE_SUFFIX)
+            >= (int)sizeof(lockFile)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    fd = exclusive
+       ? open(lockFile, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP)
+       : open(lockFile, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = exclusive ? F_WRLCK : F_RDLCK;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = 0;
+    lock.l_len = 0; /* the whole file */
+    while (fcntl(fd, INI_SETLKW, &lock) < 0) {
+        if (errno != EINTR) {
+            int error = errno;
+            close(fd);
+            errno = error;
+            return -1;
+        }
+    }
+    return fd;
+}
+
+/* Closing the descriptor releases the lock */
+static void ini_unlock(int lockFd)
+{
+    if (lockFd >= 0) {
+        close(lockFd);
+    }
+}
+
+/*
+    Opens \a filename for reading, under a shared lock if read locking
+    is enabled.  A file which has never been written through the writer
+    has no lock file, and is read without one.
+*/
+static FILE * ini_open_for_reading(const char *filename, int *lockFd)
+{
+    FILE *stream = NULL;
+
+    *lockFd = __atomic_load_n(&ini_read_locking, __ATOMIC_RELAXED)
+            ? ini_lock(filename, 0)
+            : -1;
+    stream = fopen(filename, "r");
+    if (stream == NULL) {
+        int error = errno;
+        ini_unlock(*lockFd);
+        *lockFd = -1;
+        errno = error;
+    }
+    return stream;
+}
+
+static int ini_close_for_reading(FILE *stream, int lockFd)
+{
+    int retn = fclose(stream);
+    ini_unlock(lockFd);
+    return retn;
+}
+
 void free_list_and_content(char **list)
 {
     int i = 0;
@@ -146,7 +258,6 @@ char * ini_read_line(FILE *stream, int *info)
         *info = INFO_MALLOC;
         return NULL;
     }
-    memset(buf, 0, MAX_LINESIZE + 1);
 
     /* check that we're not at EOF */
     currChar = getc(stream);
@@ -361,7 +472,9 @@ char ** ini_read_sections(FILE *stream, int *info)
     return NULL;
 }
 
-char ** ini_read_keys(FILE *stream, const char *section, int *info)
+/* Reads the keys of the given section.  If \a values is non-null, it
+   receives a list of the corresponding values in the same order. */
+char ** ini_read_keys_and_values(FILE *stream, const char *section, char ***values, int *info)
 {
     char *line = NULL;
     char *readSection = NULL;
@@ -371,7 +484,22 @@ char ** ini_read_keys(FILE *stream, const char *section, int *info)
 
     int retnSize = 1;
     char ** retn = (char**)malloc(sizeof(char*));
+    char ** retnValues = NULL;
+    if (retn == NULL) {
+        *info = INFO_MALLOC;
+        return NULL;
+    }
     retn[0] = NULL;
+    if (values != NULL) {
+        retnValues = (char**)malloc(sizeof(char*));
+        if (retnValues == NULL) {
+            free(retn);
+            *info = INFO_MALLOC;
+            return NULL;
+        }
+        retnValues[0] = NULL;
+        *values = retnValues;
+    }
 
     rewind(stream);
 
@@ -446,14 +574,31 @@ char ** ini_read_keys(FILE *stream, const char *section, int *info)
                     free(readKey);
                     free(readValue);
                     *info = INFO_MALLOC;
-                    break;
+                    goto cleanup_and_return_null;
                 }
                 retn = newList;
+                if (retnValues != NULL) {
+                    newList = (char**)realloc(retnValues,
+                            (retnSize + 1) * sizeof(char*));
+                    if (newList == NULL) {
+                        free(readKey);
+                        free(readValue);
+                        *info = INFO_MALLOC;
+                        goto cleanup_and_return_null;
+                    }
+                    retnValues = newList;
+                    *values = retnValues;
+                    retnValues[retnSize-1] = readValue;
+                    retnValues[retnSize] = NULL;
+                    readValue = NULL;
+                }
                 retn[retnSize-1] = readKey;
                 retn[retnSize] = NULL;
                 retnSize = retnSize + 1;
 
                 free(readValue);
+                readKey = NULL;
+                readValue = NULL;
                 free(line);
                 line = NULL;
                 continue;
@@ -475,10 +620,19 @@ char ** ini_read_keys(FILE *stream, const char *section, int *info)
 
 cleanup_and_return_null:
     free_list_and_content(retn);
+    if (values != NULL) {
+        free_list_and_content(retnValues);
+        *values = NULL;
+    }
     free(line);
     return NULL;
 }
 
+char ** ini_read_keys(FILE *stream, const char *section, int *info)
+{
+    return ini_read_keys_and_values(stream, section, NULL, info);
+}
+
 char * ini_read_value(
                     FILE *stream,
                     const char * section,
@@ -591,6 +745,7 @@ char ** SailfishKeyProvider_ini_sections(
                     const char * filename)
 {
     FILE *stream = NULL;
+    int lockFd = -1;
     char **existingSections = NULL;
     int info = INFO_OK;
 
@@ -601,7 +756,7 @@ char ** SailfishKeyProvider_ini_sections(
         return NULL;
     }
 
-    stream = fopen(filename, "r");
+    stream = ini_open_for_reading(filename, &lockFd);
     if (stream == NULL) {
         fprintf(stderr,
                 "SailfishKeyProvider_ini_sections: %s\n",
@@ -616,7 +771,7 @@ char ** SailfishKeyProvider_ini_sections(
                 error_messages[info]);
     }
 
-    if (fclose(stream) != 0) {
+    if (ini_close_for_reading(stream, lockFd) != 0) {
         fprintf(stderr,
                 "SailfishKeyProvider_ini_sections: %s\n",
                 "error closing ini file");
@@ -630,6 +785,7 @@ char ** SailfishKeyProvider_ini_keys(
                     const char * section)
 {
     FILE *stream = NULL;
+    int lockFd = -1;
     char **existingKeys = NULL;
     int info = INFO_OK;
 
@@ -640,7 +796,7 @@ char ** SailfishKeyProvider_ini_keys(
         return NULL;
     }
 
-    stream = fopen(filename, "r");
+    stream = ini_open_for_reading(filename, &lockFd);
     if (stream == NULL) {
         fprintf(stderr,
                 "SailfishKeyProvider_ini_keys: %s\n",
@@ -655,7 +811,7 @@ char ** SailfishKeyProvider_ini_keys(
                 error_messages[info]);
     }
 
-    if (fclose(stream) != 0) {
+    if (ini_close_for_reading(stream, lockFd) != 0) {
         fprintf(stderr,
                 "SailfishKeyProvider_ini_keys: %s\n",
                 "error closing ini file");
@@ -671,6 +827,7 @@ char * SailfishKeyProvider_ini_read(
 {
     char *retn = NULL;
     FILE *stream = NULL;
+    int lockFd = -1;
     int info = INFO_OK;
 
     if (filename == NULL || key == NULL) {
@@ -680,7 +837,7 @@ char * SailfishKeyProvider_ini_read(
         return NULL;
     }
 
-    stream = fopen(filename, "r");
+    stream = ini_open_for_reading(filename, &lockFd);
     if (stream == NULL) {
         fprintf(stderr,
                 "SailfishKeyProvider_ini_read: %s\n",
@@ -695,7 +852,7 @@ char * SailfishKeyProvider_ini_read(
                 error_messages[info]);
     }
 
-    if (fclose(stream) != 0) {
+    if (ini_close_for_reading(stream, lockFd) != 0) {
         fprintf(stderr,
                 "SailfishKeyProvider_ini_read: %s\n",
                 "error closing ini file");
@@ -710,6 +867,7 @@ char ** SailfishKeyProvider_ini_read_multiple(
                     const char * separator)
 {
     FILE *stream = NULL;
+    int lockFd = -1;
     int info = INFO_OK;
     int k = 0;
     int numKeys = 0;
@@ -732,7 +890,7 @@ char ** SailfishKeyProvider_ini_read_multiple(
         return NULL;
     }
 
-    stream = fopen(filename, "r");
+    stream = ini_open_for_reading(filename, &lockFd);
     if (stream == NULL) {
         fprintf(stderr,
                 "SailfishKeyProvider_ini_read_multiple: %s\n",
@@ -761,7 +919,7 @@ char ** SailfishKeyProvider_ini_read_multiple(
         }
     }
 
-    if (fclose(stream) != 0) {
+    if (ini_close_for_reading(stream, lockFd) != 0) {
         fprintf(stderr,
                 "SailfishKeyProvider_ini_read_multiple: %s\n",
                 "error closing ini file");
@@ -770,330 +928,743 @@ char ** SailfishKeyProvider_ini_read_multiple(
     return retnValues;
 }
 
-#define APPEND_NEWLINE_TO_BUF(buf)                                         \
-    do {                                                                   \
-        int startOfNewSpace = strlen(buf);                                 \
-        int sizeOfNewSpace = 2; /* \n \0 */                                \
-        char *rbuf = (char*)realloc(buf, startOfNewSpace + sizeOfNewSpace);\
-        if (rbuf == NULL) {                                                \
-            goto cleanup_and_return_malloc_fail;                           \
-        }                                                                  \
-        buf = rbuf;                                                        \
-        sprintf(buf+startOfNewSpace, "\n");                                \
-        buf[startOfNewSpace+sizeOfNewSpace-1] = '\0';                      \
-    } while (0)
-
-#define APPEND_COMMENT_TO_BUF(comment, buf)                                \
-    do {                                                                   \
-        int startOfNewSpace = strlen(buf);                                 \
-        int sizeOfNewSpace = strlen(comment) + 3; /* ; \n \0 */            \
-        char *rbuf = (char*)realloc(buf, startOfNewSpace + sizeOfNewSpace);\
-        if (rbuf == NULL) {                                                \
-            goto cleanup_and_return_malloc_fail;                           \
-        }                                                                  \
-        buf = rbuf;                                                        \
-        sprintf(buf+startOfNewSpace, ";%s\n", comment);                    \
-        buf[startOfNewSpace+sizeOfNewSpace-1] = '\0';                      \
-    } while (0)
-
-#define APPEND_SECTION_TO_BUF(sectionName, buf)                            \
-    do {                                                                   \
-        int startOfNewSpace = strlen(buf);                                 \
-        int sizeOfNewSpace = strlen(sectionName) + 4; /* [ ] \n \0 */      \
-        char *rbuf = (char*)realloc(buf, startOfNewSpace + sizeOfNewSpace);\
-        if (rbuf == NULL) {                                                \
-            goto cleanup_and_return_malloc_fail;                           \
-        }                                                                  \
-        buf = rbuf;                                                        \
-        sprintf(buf+startOfNewSpace, "[%s]\n", sectionName);               \
-        buf[startOfNewSpace+sizeOfNewSpace-1] = '\0';                      \
-    } while (0)
-
-#define APPEND_KEYVAL_TO_BUF(key, val, buf)                                \
-    do {                                                                   \
-        int startOfNewSpace = strlen(buf);                                 \
-        int sizeOfNewSpace = strlen(key) + 1 + strlen(val) + 1 + 1;        \
-        char *rbuf = (char*)realloc(buf, startOfNewSpace + sizeOfNewSpace);\
-        if (rbuf == NULL) {                                                \
-            goto cleanup_and_return_malloc_fail;                           \
-        }                                                                  \
-        buf = rbuf;                                                        \
-        sprintf(buf+startOfNewSpace, "%s=%s\n", key, val);                 \
-        buf[startOfNewSpace+sizeOfNewSpace-1] = '\0';                      \
-    } while (0)
-
-int SailfishKeyProvider_ini_write_multiple_impl(
-                    const char * directory,
-                    const char * filename, /* must contain full path */
-                    const char * section,
-                    const char * keys,     /* separator-separated list of keys */
-                    const char * values,   /* separator-separated list of values */
-                    const char * separator)/* if null, assume single key/value */
+/*
+    Parses the whole of \a filename in a single pass, invoking
+    \a callback for every key/value pair.  Returns 0 on success,
+    or -1 if the file could not be opened or is malformed.
+*/
+int SailfishKeyProvider_ini_foreach(
+                    const char * filename,
+                    SailfishKeyProvider_ini_entry_callback callback,
+                    void * userData)
 {
-    int createFd = -1;
-    int info = INFO_OK;
-    int i = 0, j = 0, k = 0;
-    int numKeys = 0;
-    int numValues = 0;
-    int sectionFound = 0, thisSection = 0;
-    int keyFound = 0;
     FILE *stream = NULL;
-    char **existingKeys = NULL;
-    char *currKey = NULL;
-    char **existingSections = NULL;
+    int lockFd = -1;
+    char *line = NULL;
+    char *readSection = NULL;
+    char *readKey = NULL;
+    char *readValue = NULL;
     char *currSection = NULL;
-    char *newFileData = NULL;
-    char **splitKeys = NULL;
-    char **splitValues = NULL;
+    int info = INFO_OK;
+    int retn = 0;
 
-    if (filename == NULL || section == NULL || keys == NULL || values == NULL) {
+    if (filename == NULL || callback == NULL) {
         fprintf(stderr,
-                "SailfishKeyProvider_ini_write_multiple: %s\n",
+                "SailfishKeyProvider_ini_foreach: %s\n",
                 "invalid parameters");
         return -1;
     }
 
-    if (separator != NULL) {
-        splitKeys = split_string_into_array(keys, separator, &numKeys);
-        splitValues = split_string_into_array(values, separator, &numValues);
-        if (numKeys != numValues || numKeys <= 0) {
-            fprintf(stderr,
-                    "SailfishKeyProvider_ini_write_multiple: %s\n",
-                    "unable to parse keys and values, or count mismatch");
-            goto cleanup_and_return_fail;
+    stream = ini_open_for_reading(filename, &lockFd);
+    if (stream == NULL) {
+        return -1;
+    }
+
+    while (1) {
+        line = ini_read_line(stream, &info);
+        if (info == INFO_SKIPPED) {
+            continue;
+        } else if (info == INFO_EOF) {
+            break;
+        } else if (info != INFO_OK) {
+            retn = -1;
+            break;
+        }
+
+        ini_parse_parts(line, &info, &readSection, &readKey, &readValue);
+        free(line);
+        if (info != INFO_OK) {
+            retn = -1;
+            break;
+        }
+
+        if (readSection != NULL) {
+            free(currSection);
+            currSection = readSection;
+            readSection = NULL;
+        } else {
+            int stop = callback(userData, currSection, readKey, readValue);
+            free(readKey);
+            free(readValue);
+            if (stop) {
+                break;
+            }
         }
     }
 
-    /* allocate a buffer to which we'll write file data */
-    newFileData = (char*)malloc(1);
-    if (newFileData == NULL) {
+    if (retn != 0) {
         fprintf(stderr,
-                "SailfishKeyProvider_ini_write_multiple: %s\n",
-                "unable to allocate file data buffer");
-        goto cleanup_and_return_fail;
+                "SailfishKeyProvider_ini_foreach: %s: %s\n",
+                error_messages[info],
+                filename);
     }
-    newFileData[0] = '\0';
 
-    /* first, create the directory and file if it doesn't exist. */
-    if (mkdir(directory, S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IWGRP | S_IXGRP) < 0) {
-        if (errno != EEXIST) {
-            /* The directory does not exist, and we couldn't create it */
-            fprintf(stderr,
-                    "SailfishKeyProvider_ini_write_multiple: %s\n",
-                    "unable to create writable ini directory");
-            goto cleanup_and_return_fail;
+    free(currSection);
+    if (ini_close_for_reading(stream, lockFd) != 0) {
+        fprintf(stderr,
+                "SailfishKeyProvider_ini_foreach: %s\n",
+                "error closing ini file");
+    }
+    return retn;
+}
+
+/*
+    Scratch buffer holding the bytes spliced into a file.  It tracks its
+    own length and grows geometrically, so that appending costs amortized
+    O(length appended) rather than O(length of buffer).
+*/
+struct ini_buffer {
+    char *data;
+    size_t length;
+    size_t capacity;
+};
+
+static int ini_buffer_append(struct ini_buffer *buf, const char *data, size_t length)
+{
+    size_t required = buf->length + length;
+    if (required > buf->capacity) {
+        size_t capacity = buf->capacity ? buf->capacity : 256;
+        char *newData = NULL;
+        while (capacity < required) {
+            capacity *= 2;
         }
-        /* The directory already exists; continue as we were */
+        newData = (char*)realloc(buf->data, capacity);
+        if (newData == NULL) {
+            return -1;
+        }
+        buf->data = newData;
+        buf->capacity = capacity;
+    }
+    if (length > 0) {
+        memcpy(buf->data + buf->length, data, length);
+        buf->length += length;
     }
+    return 0;
+}
 
-    createFd = open(filename, O_CREAT | O_WRONLY | O_EXCL, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
-    if (createFd < 0) {
-        if (errno != EEXIST) {
-            /* The file does not exist, but we cannot create it.
-             * This is probably a permissions error */
-            fprintf(stderr,
-                    "SailfishKeyProvider_ini_write_multiple: %s\n",
-                    "unable to create writable ini file");
-            goto cleanup_and_return_fail;
+static int ini_buffer_append_string(struct ini_buffer *buf, const char *string)
+{
+    return ini_buffer_append(buf, string, strlen(string));
+}
+
+/* Writes \a length bytes at \a offset, retrying partial writes */
+static int ini_pwrite_all(int fd, const char *data, size_t length, off_t offset)
+{
+    size_t written = 0;
+    while (written < length) {
+        ssize_t rv = pwrite(fd, data + written, length - written, offset + written);
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
         }
-        /* The file exists, we didn't need to create it */
-    } else {
-        /* having created the file, immediately close it */
-        if (close(createFd) != 0) {
-            fprintf(stderr,
-                    "SailfishKeyProvider_ini_write_multiple: %s\n",
-                    "unable to close writable ini file after creating it");
-            goto cleanup_and_return_fail;
+        written += (size_t)rv;
+    }
+    return 0;
+}
+
+static char * ini_read_all(int fd, size_t *size)
+{
+    struct stat st;
+    size_t total = 0;
+    char *data = NULL;
+
+    if (fstat(fd, &st) != 0) {
+        return NULL;
+    }
+
+    data = (char*)malloc((size_t)st.st_size + 1);
+    if (data == NULL) {
+        return NULL;
+    }
+
+    while (total < (size_t)st.st_size) {
+        ssize_t rv = pread(fd, data + total, (size_t)st.st_size - total, total);
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            free(data);
+            return NULL;
+        } else if (rv == 0) {
+            break; /* truncated underneath us */
         }
+        total += (size_t)rv;
     }
 
-    /* open the file in read mode.  We read in the entire file,
-       overwrite or add the appropriate key/value, and then close
-       the file so that we can reopen in write mode later. */
-    stream = fopen(filename, "r");
-    if (stream == NULL) {
-        fprintf(stderr,
-                "SailfishKeyProvider_ini_write_multiple: %s\n",
-                "unable to open file for read");
-        goto cleanup_and_return_fail;
+    data[total] = '\0';
+    *size = total;
+    return data;
+}
+
+/* Byte ranges of the significant parts of a raw line */
+struct ini_line {
+    int isSection;
+    size_t nameStart;  /* section name, or key */
+    size_t nameEnd;
+    size_t valueStart; /* unused for sections */
+    size_t valueEnd;
+};
+
+/*
+    Interprets the raw line [start, end) of \a data exactly as
+    ini_read_line() and ini_parse_parts() would, but reports byte
+    offsets into the file rather than copying the line.
+*/
+static int ini_scan_line(const char *data, size_t start, size_t end, struct ini_line *line)
+{
+    size_t count = end - start;
+    size_t i = 0, contentStart = 0, contentEnd = 0;
+
+    if (count == 0) {
+        return INFO_SKIPPED;
+    } else if (count >= MAX_LINESIZE) {
+        return INFO_LINESIZE;
     }
 
-    existingSections = ini_read_sections(stream, &info);
-    if (info != INFO_OK) {
-        fprintf(stderr,
-                "SailfishKeyProvider_ini_write_multiple: %s\n",
-                "unable to read existing sections");
-        if (fclose(stream) != 0) {
-            fprintf(stderr,
-                    "SailfishKeyProvider_ini_write_multiple: %s\n",
-                    "error closing ini file");
+    for (i = start; i < end; ++i) {
+        unsigned char c = (unsigned char)data[i];
+        if ((isspace(c) && i == end - 1) || c == ';') {
+            return INFO_SKIPPED;
+        } else if (!isspace(c)) {
+            break;
         }
-        goto cleanup_and_return_fail;
     }
+    contentStart = i;
 
-    currSection = existingSections[0];
-    for (i = 1; currSection != NULL; ++i) {
-        APPEND_SECTION_TO_BUF(currSection, newFileData);
-        thisSection = 0;
-        if (strcmp(currSection, section) == 0) {
-            /* key/value should be inserted into this section. */
-            sectionFound = 1;
-            thisSection = 1;
+    for (contentEnd = contentStart; contentEnd < end; ++contentEnd) {
+        if (isspace((unsigned char)data[contentEnd])
+                && contentEnd < end - 1 && data[contentEnd+1] == ';') {
+            break; /* the rest of the line is a comment */
         }
+    }
+    while (contentEnd > contentStart + 1
+            && isspace((unsigned char)data[contentEnd-1])) {
+        contentEnd--;
+    }
 
-        /* enumerate the keys in this section */
-        existingKeys = ini_read_keys(stream, currSection, &info);
-        if (info != INFO_OK) {
+    if (contentEnd - contentStart <= 2) {
+        return INFO_INVALID;
+    }
+
+    if (data[contentStart] == '[' && data[contentEnd-1] == ']') {
+        line->isSection = 1;
+        line->nameStart = contentStart + 1;
+        line->nameEnd = contentEnd - 1;
+        return INFO_OK;
+    }
+
+    for (i = contentStart + 1; i < contentEnd; ++i) {
+        if (data[i] == '=') {
+            line->isSection = 0;
+            line->nameStart = contentStart;
+            line->nameEnd = i;
+            line->valueStart = i + 1;
+            line->valueEnd = contentEnd;
+            return INFO_OK;
+        }
+    }
+
+    return INFO_INVALID;
+}
+
+/* A splice of the existing file: replace oldLength bytes at offset */
+struct ini_edit {
+    size_t offset;
+    size_t oldLength;
+    size_t textOffset; /* replacement bytes, in the scratch buffer */
+    size_t textLength;
+    size_t order;      /* keeps insertions at the same offset stable */
+};
+
+struct ini_update_state {
+    size_t sectionLength;
+    size_t keyLength;
+    int superseded;    /* a later update writes the same key */
+    int sectionSeen;
+    int inSection;
+    int keyFound;
+    int emitted;
+    int ignoreExisting; /* an earlier update removes the whole section */
+    size_t removeFrom; /* start of the section being removed */
+    size_t insertAt;   /* end of the last line of the section */
+    int needsNewline;  /* that line is the unterminated last line */
+};
+
+static int ini_compare_edits(const void *lhs, const void *rhs)
+{
+    const struct ini_edit *l = (const struct ini_edit *)lhs;
+    const struct ini_edit *r = (const struct ini_edit *)rhs;
+    if (l->offset != r->offset) {
+        return l->offset < r->offset ? -1 : 1;
+    }
+    if ((l->oldLength == 0) != (r->oldLength == 0)) {
+        /* insert before removing the lines which follow */
+        return l->oldLength == 0 ? -1 : 1;
+    }
+    return l->order < r->order ? -1 : (l->order > r->order ? 1 : 0);
+}
+
+static int ini_add_edit(
+                    struct ini_edit **edits,
+                    size_t *editCount,
+                    size_t *editsAllocated,
+                    size_t offset,
+                    size_t oldLength,
+                    size_t textOffset,
+                    size_t textLength)
+{
+    if (*editCount == *editsAllocated) {
+        size_t allocated = *editsAllocated ? 2 * *editsAllocated : 8;
+        struct ini_edit *newEdits = (struct ini_edit *)realloc(
+                *edits, allocated * sizeof(struct ini_edit));
+        if (newEdits == NULL) {
+            return -1;
+        }
+        *edits = newEdits;
+        *editsAllocated = allocated;
+    }
+    (*edits)[*editCount].offset = offset;
+    (*edits)[*editCount].oldLength = oldLength;
+    (*edits)[*editCount].textOffset = textOffset;
+    (*edits)[*editCount].textLength = textLength;
+    (*edits)[*editCount].order = *editCount;
+    *editCount += 1;
+    return 0;
+}
+
+/*
+    Applies the given \a updates to \a filename, creating the file (and
+    \a directory) if necessary.  Existing values are patched in place and
+    new keys are inserted at the end of their section; every other byte
+    of the file, including comments and blank lines, is preserved.
+
+    An update with a NULL value removes the key, and an update with a
+    NULL key removes the whole section.  Removals apply to every
+    occurrence of the section, and never create the file.
+
+    If every update replaces an existing value with one of the same
+    length, only those values are rewritten.  Otherwise the file is
+    rewritten from the first changed byte onwards.
+
+    Returns 0 on success, -1 on failure.
+*/
+int SailfishKeyProvider_ini_write_updates(
+                    const char * directory,
+                    const char * filename,
+                    const SailfishKeyProvider_ini_update * updates,
+                    int count)
+{
+    int fd = -1;
+    int lockFd = -1;
+    int retn = -1;
+    int info = INFO_OK;
+    int i = 0, u = 0;
+    int sameLength = 1;
+    int removalsOnly = 1;
+    int empty = 0, terminated = 0;
+    char *data = NULL;
+    size_t size = 0;
+    size_t pos = 0;
+    struct ini_update_state *states = NULL;
+    struct ini_edit *edits = NULL;
+    size_t editCount = 0, editsAllocated = 0;
+    struct ini_buffer text = { NULL, 0, 0 };
+    struct ini_buffer tail = { NULL, 0, 0 };
+    size_t e = 0;
+
+    if (filename == NULL || updates == NULL || count <= 0) {
+        fprintf(stderr,
+                "SailfishKeyProvider_ini_write_updates: %s\n",
+                "invalid parameters");
+        return -1;
+    }
+    for (u = 0; u < count; ++u) {
+        if (updates[u].section == NULL || (updates[u].key == NULL && updates[u].value != NULL)) {
             fprintf(stderr,
-                    "SailfishKeyProvider_ini_write_multiple: %s\n",
-                    "unable to read existing keys");
-            if (fclose(stream) != 0) {
-                fprintf(stderr,
-                        "SailfishKeyProvider_ini_write_multiple: %s\n",
-                        "error closing ini file");
+                    "SailfishKeyProvider_ini_write_updates: %s\n",
+                    "invalid parameters");
+            return -1;
+        }
+        if (updates[u].value != NULL) {
+            removalsOnly = 0;
+        }
+    }
+
+    /* first, create the directory and file if they don't exist. */
+    if (directory != NULL
+            && mkdir(directory, S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IWGRP | S_IXGRP) < 0
+            && errno != EEXIST) {
+        /* The directory does not exist, and we couldn't create it */
+        fprintf(stderr,
+                "SailfishKeyProvider_ini_write_updates: %s\n",
+                "unable to create writable ini directory");
+        return -1;
+    }
+
+    /* exclude other writers for the whole read-merge-write, so that
+       concurrent updates are applied one after the other, not lost.
+       Only a missing directory, where nothing can be written, is left
+       to the open() below to report. */
+    lockFd = ini_lock(filename, 1);
+    if (lockFd < 0 && errno != ENOENT) {
+        fprintf(stderr,
+                "SailfishKeyProvider_ini_write_updates: %s\n",
+                "unable to lock writable ini file");
+        return -1;
+    }
+
+    fd = open(filename, removalsOnly ? O_RDWR : O_RDWR | O_CREAT,
+              S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (fd < 0 && removalsOnly && errno == ENOENT) {
+        /* nothing to remove */
+        ini_unlock(lockFd);
+        return 0;
+    } else if (fd < 0) {
+        fprintf(stderr,
+                "SailfishKeyProvider_ini_write_updates: %s\n",
+                "unable to open writable ini file");
+        ini_unlock(lockFd);
+        return -1;
+    }
+
+    data = ini_read_all(fd, &size);
+    states = (struct ini_update_state *)calloc(count, sizeof(struct ini_update_state));
+    if (data == NULL || states == NULL) {
+        fprintf(stderr,
+                "SailfishKeyProvider_ini_write_updates: %s\n",
+                "unable to read existing file");
+        goto cleanup_and_return;
+    }
+
+    for (u = 0; u < count; ++u) {
+        states[u].sectionLength = strlen(updates[u].section);
+        states[u].keyLength = updates[u].key ? strlen(updates[u].key) : 0;
+        for (i = 0; i < count; ++i) {
+            if (i == u || strcmp(updates[u].section, updates[i].section) != 0) {
+                continue;
+            }
+            if (i > u && (updates[i].key == NULL
+                    || (updates[u].key != NULL && strcmp(updates[u].key, updates[i].key) == 0))) {
+                states[u].superseded = 1;
+                break;
+            } else if (i < u && updates[i].key == NULL) {
+                /* written into a fresh copy of the removed section */
+                states[u].ignoreExisting = 1;
             }
-            goto cleanup_and_return_fail;
         }
+    }
 
-        /* for each old key/value either overwrite the key/value with the new one,
-         * or just append that old key/value if no new key/value is given for it */
-        currKey = existingKeys[0];
-        keyFound = 0;
-        for (j = 1; currKey != NULL; ++j) {
-            if (separator != NULL) {
-                /* multiple keys/values mode, the keys+values args are arrays */
-                for (k = 0; k != numKeys; ++k) {
-                    if (thisSection == 1 && strcmp(currKey, splitKeys[k]) == 0) {
-                        /* we need to replace this key/value with the new value */
-                        keyFound = 1;
-                        APPEND_KEYVAL_TO_BUF(currKey, splitValues[k], newFileData);
+    /* single pass over the existing file, locating the values to patch
+       and the end of each section which is being added to */
+    while (pos < size) {
+        struct ini_line line;
+        size_t lineEnd = pos;
+        size_t nextLine = 0;
+        while (lineEnd < size && data[lineEnd] != '\n') {
+            lineEnd++;
+        }
+        nextLine = lineEnd < size ? lineEnd + 1 : lineEnd;
+
+        info = ini_scan_line(data, pos, lineEnd, &line);
+        if (info == INFO_OK && line.isSection) {
+            size_t nameLength = line.nameEnd - line.nameStart;
+            for (u = 0; u < count; ++u) {
+                int matches = (states[u].sectionLength == nameLength
+                        && memcmp(updates[u].section, data + line.nameStart, nameLength) == 0);
+                if (states[u].superseded || states[u].ignoreExisting) {
+                    continue;
+                } else if (updates[u].key == NULL) {
+                    /* every occurrence of a removed section is dropped */
+                    if (states[u].inSection) {
+                        sameLength = 0;
+                        if (ini_add_edit(&edits, &editCount, &editsAllocated,
+                                states[u].removeFrom, pos - states[u].removeFrom, 0, 0) != 0) {
+                            info = INFO_MALLOC;
+                            break;
+                        }
                     }
-                }
-                if (!keyFound) {
-                    /* just append this pre-existing key/value */
-                    char *currVal = ini_read_value(stream, currSection, currKey, &info);
-                    APPEND_KEYVAL_TO_BUF(currKey, currVal, newFileData);
-                    free(currVal);
-                }
-            } else {
-                /* Single key/value mode, the keys+values args are single values */
-                if (thisSection == 1 && strcmp(currKey, keys) == 0) {
-                    /* we need to replace this key/value with the new value */
-                    keyFound = 1;
-                    APPEND_KEYVAL_TO_BUF(currKey, values, newFileData);
+                    states[u].inSection = matches;
+                    states[u].removeFrom = pos;
+                } else if (updates[u].value == NULL) {
+                    /* as are removed keys, wherever they appear */
+                    states[u].inSection = matches;
                 } else {
-                    /* just append this pre-existing key/value */
-                    char *currVal = ini_read_value(stream, currSection, currKey, &info);
-                    APPEND_KEYVAL_TO_BUF(currKey, currVal, newFileData);
-                    free(currVal);
+                    states[u].inSection = 0;
+                    if (matches && !states[u].sectionSeen) {
+                        /* only the first occurrence of a section is read */
+                        states[u].sectionSeen = 1;
+                        states[u].inSection = 1;
+                        states[u].insertAt = nextLine;
+                        states[u].needsNewline = (lineEnd == size);
+                    }
                 }
             }
-            currKey = existingKeys[j];
-            keyFound = 0;
-        }
-
-        /* then find any new key/value which isn't represented in the existingKeys
-         * and append it to the .ini file */
-        if (thisSection == 1) {
-            /* reached the end of the section and haven't found this new key/value; append it. */
-            if (separator != NULL) {
-                /* multiple key/values given, check whether each one exists */
-                for (k = 0; k != numKeys; ++k) {
-                    keyFound = 0;
-                    for (j = 0; existingKeys[j] != NULL; ++j) {
-                        if (strcmp(existingKeys[j], splitKeys[k]) == 0) {
-                            keyFound = 1;
+            if (info != INFO_OK) {
+                break;
+            }
+        } else if (info == INFO_OK) {
+            size_t keyLength = line.nameEnd - line.nameStart;
+            for (u = 0; u < count; ++u) {
+                if (!states[u].inSection || updates[u].key == NULL) {
+                    continue;
+                }
+                if (updates[u].value == NULL) {
+                    if (states[u].keyLength == keyLength
+                            && memcmp(updates[u].key, data + line.nameStart, keyLength) == 0) {
+                        sameLength = 0;
+                        if (ini_add_edit(&edits, &editCount, &editsAllocated,
+                                         pos, nextLine - pos, 0, 0) != 0) {
+                            info = INFO_MALLOC;
                             break;
                         }
                     }
-                    if (!keyFound) {
-                        APPEND_KEYVAL_TO_BUF(splitKeys[k], splitValues[k], newFileData);
-                    }
+                    continue;
                 }
-            } else {
-                /* single key/value given, check whether it already exists */
-                keyFound = 0;
-                for (j = 0; existingKeys[j] != NULL; ++j) {
-                    if (strcmp(existingKeys[j], keys) == 0) {
-                        keyFound = 1;
+                states[u].insertAt = nextLine;
+                states[u].needsNewline = (lineEnd == size);
+                if (states[u].keyLength == keyLength
+                        && memcmp(updates[u].key, data + line.nameStart, keyLength) == 0) {
+                    size_t valueLength = strlen(updates[u].value);
+                    states[u].keyFound = 1;
+                    if (valueLength != line.valueEnd - line.valueStart) {
+                        sameLength = 0;
+                    }
+                    if (ini_add_edit(&edits, &editCount, &editsAllocated,
+                                     line.valueStart, line.valueEnd - line.valueStart,
+                                     text.length, valueLength) != 0
+                            || ini_buffer_append(&text, updates[u].value, valueLength) != 0) {
+                        info = INFO_MALLOC;
                         break;
                     }
                 }
-                if (!keyFound) {
-                    APPEND_KEYVAL_TO_BUF(keys, values, newFileData);
-                }
             }
+            if (info != INFO_OK) {
+                break;
+            }
+        } else if (info != INFO_SKIPPED) {
+            break;
+        }
+
+        info = INFO_OK;
+        pos = nextLine;
+    }
+
+    if (info != INFO_OK) {
+        fprintf(stderr,
+                "SailfishKeyProvider_ini_write_updates: %s: %s\n",
+                "unable to parse existing file",
+                error_messages[info]);
+        goto cleanup_and_return;
+    }
+
+    /* a removed section which runs to the end of the file */
+    for (u = 0; u < count; ++u) {
+        if (updates[u].key == NULL && states[u].inSection) {
+            sameLength = 0;
+            if (ini_add_edit(&edits, &editCount, &editsAllocated,
+                             states[u].removeFrom, size - states[u].removeFrom, 0, 0) != 0) {
+                goto cleanup_and_return_malloc_fail;
+            }
+        }
+    }
+
+    /* append new keys to the end of existing sections */
+    empty = (size == 0);
+    terminated = (empty || data[size-1] == '\n');
+    for (u = 0; u < count; ++u) {
+        size_t start = text.length;
+        if (states[u].superseded || updates[u].value == NULL
+                || !states[u].sectionSeen || states[u].keyFound) {
+            continue;
+        }
+        if (states[u].needsNewline && !terminated) {
+            /* the first insertion after an unterminated last line ends it */
+            if (ini_buffer_append(&text, "\n", 1) != 0) {
+                goto cleanup_and_return_malloc_fail;
+            }
+            terminated = 1;
+        }
+        if (ini_buffer_append_string(&text, updates[u].key) != 0
+                || ini_buffer_append(&text, "=", 1) != 0
+                || ini_buffer_append_string(&text, updates[u].value) != 0
+                || ini_buffer_append(&text, "\n", 1) != 0
+                || ini_add_edit(&edits, &editCount, &editsAllocated,
+                                states[u].insertAt, 0, start, text.length - start) != 0) {
+            goto cleanup_and_return_malloc_fail;
         }
+        sameLength = 0;
+    }
 
-        free_list_and_content(existingKeys);
-        APPEND_NEWLINE_TO_BUF(newFileData);
-        currSection = existingSections[i];
+    /* and create the sections which don't exist yet, at the end of the file */
+    for (u = 0; u < count; ++u) {
+        size_t start = text.length;
+        if (states[u].superseded || updates[u].value == NULL
+                || states[u].sectionSeen || states[u].emitted) {
+            continue;
+        }
+        if (!terminated && ini_buffer_append(&text, "\n", 1) != 0) {
+            goto cleanup_and_return_malloc_fail;
+        }
+        if ((!empty && ini_buffer_append(&text, "\n", 1) != 0)
+                || ini_buffer_append(&text, "[", 1) != 0
+                || ini_buffer_append_string(&text, updates[u].section) != 0
+                || ini_buffer_append(&text, "]\n", 2) != 0) {
+            goto cleanup_and_return_malloc_fail;
+        }
+        for (i = u; i < count; ++i) {
+            if (states[i].superseded || updates[i].value == NULL || states[i].sectionSeen
+                    || strcmp(updates[u].section, updates[i].section) != 0) {
+                continue;
+            }
+            states[i].emitted = 1;
+            if (ini_buffer_append_string(&text, updates[i].key) != 0
+                    || ini_buffer_append(&text, "=", 1) != 0
+                    || ini_buffer_append_string(&text, updates[i].value) != 0
+                    || ini_buffer_append(&text, "\n", 1) != 0) {
+                goto cleanup_and_return_malloc_fail;
+            }
+        }
+        if (ini_add_edit(&edits, &editCount, &editsAllocated,
+                         size, 0, start, text.length - start) != 0) {
+            goto cleanup_and_return_malloc_fail;
+        }
+        sameLength = 0;
+        terminated = 1;
+        empty = 0;
     }
 
-    free_list_and_content(existingSections);
+    if (editCount == 0) {
+        retn = 0;
+        goto cleanup_and_return;
+    }
 
-    /* if the section doesn't already exist, we need to create it */
-    if (sectionFound == 0) {
-        APPEND_SECTION_TO_BUF(section, newFileData);
-        if (separator != NULL) {
-            for (k = 0; k < numKeys; k++) {
-                APPEND_KEYVAL_TO_BUF(splitKeys[k], splitValues[k], newFileData);
+    if (sameLength) {
+        /* fast path: every value keeps its length, so patch it in place */
+        for (e = 0; e < editCount; ++e) {
+            if (ini_pwrite_all(fd, text.data + edits[e].textOffset,
+                               edits[e].textLength, edits[e].offset) != 0) {
+                fprintf(stderr,
+                        "SailfishKeyProvider_ini_write_updates: %s\n",
+                        "error writing ini file");
+                goto cleanup_and_return;
             }
-        } else {
-            APPEND_KEYVAL_TO_BUF(keys, values, newFileData);
         }
+        retn = 0;
+        goto cleanup_and_return;
     }
 
-    free_array_and_content(splitKeys, numKeys);
-    free_array_and_content(splitValues, numValues);
+    /* splice the edits into the file, rewriting from the first one */
+    qsort(edits, editCount, sizeof(struct ini_edit), ini_compare_edits);
+    pos = edits[0].offset;
+    for (e = 0; e < editCount; ++e) {
+        if (ini_buffer_append(&tail, data + pos, edits[e].offset - pos) != 0
+                || ini_buffer_append(&tail, text.data + edits[e].textOffset,
+                                     edits[e].textLength) != 0) {
+            goto cleanup_and_return_malloc_fail;
+        }
+        pos = edits[e].offset + edits[e].oldLength;
+    }
+    if (pos < size && ini_buffer_append(&tail, data + pos, size - pos) != 0) {
+        goto cleanup_and_return_malloc_fail;
+    }
 
-    /* now close the file, reopen in write mode, and write the new data */
-    if (fclose(stream) != 0) {
+    if (ini_pwrite_all(fd, tail.data, tail.length, edits[0].offset) != 0
+            || ftruncate(fd, edits[0].offset + tail.length) != 0) {
         fprintf(stderr,
-                "SailfishKeyProvider_ini_write_multiple: %s\n",
-                "error closing ini file prior to write");
-        free(newFileData);
-        return -1;
+                "SailfishKeyProvider_ini_write_updates: %s\n",
+                "error writing ini file");
+        goto cleanup_and_return;
     }
 
-    stream = fopen(filename, "w");
-    if (stream == NULL) {
+    retn = 0;
+    goto cleanup_and_return;
+
+cleanup_and_return_malloc_fail:
+    fprintf(stderr,
+            "SailfishKeyProvider_ini_write_updates: %s\n",
+            "malloc failed during update");
+cleanup_and_return:
+    if (retn == 0 && editCount > 0
+            && __atomic_load_n(&ini_durable, __ATOMIC_RELAXED)
+            && fdatasync(fd) != 0) {
         fprintf(stderr,
-                "SailfishKeyProvider_ini_write_multiple: %s\n",
-                "error opening ini file in write mode");
-        free(newFileData);
-        return -1;
+                "SailfishKeyProvider_ini_write_updates: %s\n",
+                "error flushing ini file");
+        retn = -1;
     }
+    if (close(fd) != 0) {
+        fprintf(stderr,
+                "SailfishKeyProvider_ini_write_updates: %s\n",
+                "error closing ini file after write");
+        retn = -1;
+    }
+    ini_unlock(lockFd);
+    free(data);
+    free(states);
+    free(edits);
+    free(text.data);
+    free(tail.data);
+    return retn;
+}
 
-    fprintf(stream, "%s", newFileData);
-    free(newFileData);
+int SailfishKeyProvider_ini_write_multiple_impl(
+                    const char * directory,
+                    const char * filename, /* must contain full path */
+                    const char * section,
+                    const char * keys,     /* separator-separated list of keys */
+                    const char * values,   /* separator-separated list of values */
+                    const char * separator)/* if null, assume single key/value */
+{
+    int retn = -1;
+    int k = 0;
+    int numKeys = 0;
+    int numValues = 0;
+    char **splitKeys = NULL;
+    char **splitValues = NULL;
+    SailfishKeyProvider_ini_update *updates = NULL;
 
-    if (fclose(stream) != 0) {
+    if (filename == NULL || section == NULL || keys == NULL || values == NULL) {
         fprintf(stderr,
                 "SailfishKeyProvider_ini_write_multiple: %s\n",
-                "error closing ini file after write");
+                "invalid parameters");
         return -1;
     }
 
-    /* success */
-    return 0;
+    if (separator == NULL) {
+        SailfishKeyProvider_ini_update update = { section, keys, values };
+        return SailfishKeyProvider_ini_write_updates(directory, filename, &update, 1);
+    }
 
-cleanup_and_return_malloc_fail:
-    fprintf(stderr,
-            "SailfishKeyProvider_ini_write_multiple: %s\n",
-            "malloc failed during file regeneration");
-cleanup_and_return_fail:
-    if (stream != NULL && fclose(stream) != 0) {
+    splitKeys = split_string_into_array(keys, separator, &numKeys);
+    splitValues = split_string_into_array(values, separator, &numValues);
+    if (numKeys != numValues || numKeys <= 0) {
         fprintf(stderr,
                 "SailfishKeyProvider_ini_write_multiple: %s\n",
-                "error closing ini file after failed write");
+                "unable to parse keys and values, or count mismatch");
+    } else {
+        updates = (SailfishKeyProvider_ini_update *)malloc(
+                numKeys * sizeof(SailfishKeyProvider_ini_update));
+        if (updates == NULL) {
+            fprintf(stderr,
+                    "SailfishKeyProvider_ini_write_multiple: %s\n",
+                    "malloc failed");
+        } else {
+            for (k = 0; k < numKeys; ++k) {
+                updates[k].section = section;
+                updates[k].key = splitKeys[k];
+                updates[k].value = splitValues[k];
+            }
+            retn = SailfishKeyProvider_ini_write_updates(
+                        directory, filename, updates, numKeys);
+        }
     }
+
+    free(updates);
     free_array_and_content(splitKeys, numKeys);
     free_array_and_content(splitValues, numValues);
-    free_list_and_content(existingKeys);
-    free_list_and_content(existingSections);
-    free(newFileData);
-    return -1;
+    return retn;
 }
 
 int SailfishKeyProvider_ini_write(
@@ -1118,3 +1689,25 @@ int SailfishKeyProvider_ini_write_multiple(
     return SailfishKeyProvider_ini_write_multiple_impl(
                 directory, filename, section, keys, values, separator);
 }
+
+/*
+    Removes the given \a key from \a section of \a filename, or the whole
+    section if \a key is NULL.
+
+    Returns 0 on success (including if there was nothing to remove),
+    -1 on failure.
+*/
+int SailfishKeyProvider_ini_remove(
+                    const char * filename, /* must contain full path */
+                    const char * section,
+                    const char * key)
+{
+    SailfishKeyProvider_ini_update update = { section, key, NULL };
+    if (filename == NULL || section == NULL) {
+        fprintf(stderr,
+                "SailfishKeyProvider_ini_remove: %s\n",
+                "invalid parameters");
+        return -1;
+    }
+    return SailfishKeyProvider_ini_write_updates(NULL, filename, &update, 1);
+}
@@ -0,0 +1,63 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Jolla Ltd.
+** Contact: Chris Adams <chris.adams@jollamobile.com>
+** All rights reserved.
+**
+** You may use this file under the terms of the GNU Lesser General
+** Public License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Public License for more details.
+**
+****************************************************************************/
+
+#ifndef INIPARSER_H
+#define INIPARSER_H
+
+#include "sailfishkeyprovider_iniparser.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/* Called once per key/value pair, in file order.  The section is NULL
+   for keys which precede the first section header.  Returning non-zero
+   stops the enumeration. */
+typedef int (*SailfishKeyProvider_ini_entry_callback)(
+                    void * userData,
+                    const char * section,
+                    const char * key,
+                    const char * value);
+
+/* A NULL value removes the key, and a NULL key removes the section */
+typedef struct SailfishKeyProvider_ini_update {
+    const char * section;
+    const char * key;
+    const char * value;
+} SailfishKeyProvider_ini_update;
+
+int SailfishKeyProvider_ini_write_updates(
+                    const char * directory,
+                    const char * filename, /* must include full path */
+                    const SailfishKeyProvider_ini_update * updates,
+                    int count);
+
+int SailfishKeyProvider_ini_foreach(
+                    const char * filename,
+                    SailfishKeyProvider_ini_entry_callback callback,
+                    void * userData);
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* INIPARSER_H */
@@ -0,0 +1,663 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Jolla Ltd.
+** Contact: Chris Adams <chris.adams@jollamobile.com>
+** All rights reserved.
+**
+** You may use this file under the terms of the GNU Lesser General
+** Public License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Public License for more details.
+**
+****************************************************************************/
+
+/*
+    In-memory view of a directory of .ini fragments
+
+    Every fragment in the directory is parsed once, on a small pool of
+    worker threads, and the results are merged into a single hash table.
+    Fragments are merged in file name order, and the first fragment
+    which defines a given section/key wins; the same precedence the
+    library has always applied when walking the directory.
+*/
+
+#include "keycache.h"
+#include "iniparser.h"
+#include "sailfishkeyprovider_schemes.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#define KEYCACHE_MAX_WORKERS 8
+#define KEYCACHE_MIN_FRAGMENTS_PER_WORKER 16
+
+struct keycache_entry {
+    uint32_t hash;
+    char *section; /* section, key and value share one allocation */
+    char *key;
+    char *value;
+    const SailfishKeyProvider_Scheme *scheme; /* value resolved as a scheme name */
+};
+
+struct keycache_fragment {
+    char *path;
+    struct keycache_entry *entries;
+    size_t count;
+    size_t allocated;
+    int failed;
+};
+
+struct SailfishKeyProvider_KeyCache {
+    struct keycache_entry *table;
+    size_t capacity; /* always a power of two */
+    size_t count;
+    uint64_t stamp;  /* of the fragments it was built from */
+    time_t newest;   /* latest modification of any of those fragments */
+};
+
+struct keycache_job {
+    struct keycache_fragment *fragments;
+    size_t count;
+    size_t next; /* accessed atomically by the workers */
+};
+
+/* --------------------------------------------------------- */
+
+static uint32_t keycache_hash(const char *section, const char *key)
+{
+    /* FNV-1a over "section\0key" */
+    uint32_t hash = 2166136261u;
+    const unsigned char *p = NULL;
+    for (p = (const unsigned char *)section; *p; ++p) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    hash = (hash ^ 0) * 16777619u;
+    for (p = (const unsigned char *)key; *p; ++p) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    return hash;
+}
+
+static int keycache_fragment_append(
+                    void *userData,
+                    const char *section,
+                    const char *key,
+                    const char *value)
+{
+    struct keycache_fragment *fragment = (struct keycache_fragment *)userData;
+    struct keycache_entry *entry = NULL;
+    size_t sectionLength = 0, keyLength = 0, valueLength = 0;
+    char *blob = NULL;
+
+    if (section == NULL) {
+        /* keys outside of any section can never be looked up */
+        return 0;
+    }
+
+    if (fragment->count == fragment->allocated) {
+        size_t allocated = fragment->allocated ? 2 * fragment->allocated : 16;
+        struct keycache_entry *entries = (struct keycache_entry *)realloc(
+                fragment->entries, allocated * sizeof(struct keycache_entry));
+        if (entries == NULL) {
+            fragment->failed = 1;
+            return 1;
+        }
+        fragment->entries = entries;
+        fragment->allocated = allocated;
+    }
+
+    sectionLength = strlen(section);
+    keyLength = strlen(key);
+    valueLength = strlen(value);
+    blob = (char *)malloc(sectionLength + keyLength + valueLength + 3);
+    if (blob == NULL) {
+        fragment->failed = 1;
+        return 1;
+    }
+    memcpy(blob, section, sectionLength + 1);
+    memcpy(blob + sectionLength + 1, key, keyLength + 1);
+    memcpy(blob + sectionLength + keyLength + 2, value, valueLength + 1);
+
+    entry = &fragment->entries[fragment->count++];
+    entry->hash = keycache_hash(section, key);
+    entry->section = blob;
+    entry->key = blob + sectionLength + 1;
+    entry->value = blob + sectionLength + keyLength + 2;
+    entry->scheme = NULL;
+    return 0;
+}
+
+static void keycache_fragment_parse(struct keycache_fragment *fragment)
+{
+    if (SailfishKeyProvider_ini_foreach(
+                fragment->path, keycache_fragment_append, fragment) != 0) {
+        /* an unreadable fragment contributes whatever it had so far,
+           just as the sequential lookups would have seen it */
+        fragment->failed = 1;
+    }
+}
+
+static void * keycache_worker(void *arg)
+{
+    struct keycache_job *job = (struct keycache_job *)arg;
+    while (1) {
+        size_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (i >= job->count) {
+            break;
+        }
+        keycache_fragment_parse(&job->fragments[i]);
+    }
+    return NULL;
+}
+
+static int keycache_compare_paths(const void *lhs, const void *rhs)
+{
+    const struct keycache_fragment *l = (const struct keycache_fragment *)lhs;
+    const struct keycache_fragment *r = (const struct keycache_fragment *)rhs;
+    return strcmp(l->path, r->path);
+}
+
+static struct keycache_fragment * keycache_list_fragments(
+                    const char *directory,
+                    size_t *count)
+{
+    DIR *dir = NULL;
+    struct dirent *ent = NULL;
+    struct keycache_fragment *fragments = NULL;
+    size_t allocated = 0;
+    size_t directoryLength = strlen(directory);
+    int needsSeparator = (directoryLength > 0 && directory[directoryLength-1] != '/');
+
+    *count = 0;
+    if ((dir = opendir(directory)) == NULL) {
+        return NULL;
+    }
+
+    while ((ent = readdir(dir)) != NULL) {
+        char *path = NULL;
+        size_t nameLength = 0;
+        if (ent->d_name[0] == '.') {
+            continue; /* ".", ".." and hidden files */
+        }
+        if (ent->d_type != DT_REG && ent->d_type != DT_LNK && ent->d_type != DT_UNKNOWN) {
+            continue;
+        }
+
+        if (*count == allocated) {
+            size_t newAllocated = allocated ? 2 * allocated : 16;
+            struct keycache_fragment *newFragments = (struct keycache_fragment *)realloc(
+                    fragments, newAllocated * sizeof(struct keycache_fragment));
+            if (newFragments == NULL) {
+                break;
+            }
+            fragments = newFragments;
+            allocated = newAllocated;
+        }
+
+        nameLength = strlen(ent->d_name);
+        path = (char *)malloc(directoryLength + needsSeparator + nameLength + 1);
+        if (path == NULL) {
+            break;
+        }
+        memcpy(path, directory, directoryLength);
+        if (needsSeparator) {
+            path[directoryLength] = '/';
+        }
+        memcpy(path + directoryLength + needsSeparator, ent->d_name, nameLength + 1);
+
+        memset(&fragments[*count], 0, sizeof(struct keycache_fragment));
+        fragments[*count].path = path;
+        *count += 1;
+    }
+    closedir(dir);
+
+    if (*count > 1) {
+        qsort(fragments, *count, sizeof(struct keycache_fragment), keycache_compare_paths);
+    }
+    return fragments;
+}
+
+/* Digests the name, identity, size and times of every fragment, so that
+   a fragment edited in place is noticed as well as one added or removed */
+static uint64_t keycache_fragments_stamp(const struct keycache_fragment *fragments, size_t count,
+                                         time_t *newest)
+{
+    uint64_t stamp = 14695981039346656037ull;
+    size_t i = 0;
+
+    *newest = 0;
+    for (i = 0; i < count; ++i) {
+        struct stat st;
+        uint64_t fields[7];
+        const unsigned char *p = NULL;
+        size_t j = 0;
+
+        memset(&st, 0, sizeof(st));
+        if (stat(fragments[i].path, &st) != 0) {
+            memset(&st, 0, sizeof(st));
+        }
+        fields[0] = (uint64_t)st.st_dev;
+        fields[1] = (uint64_t)st.st_ino;
+        fields[2] = (uint64_t)st.st_size;
+        fields[3] = (uint64_t)st.st_mtim.tv_sec;
+        fields[4] = (uint64_t)st.st_mtim.tv_nsec;
+        fields[5] = (uint64_t)st.st_ctim.tv_sec;
+        fields[6] = (uint64_t)st.st_ctim.tv_nsec;
+        if (st.st_mtime > *newest) {
+            *newest = st.st_mtime;
+        }
+        if (st.st_ctime > *newest) {
+            *newest = st.st_ctime;
+        }
+
+        /* FNV-1a over the path, with its terminator, and the fields */
+        for (p = (const unsigned char *)fragments[i].path; ; ++p) {
+            stamp = (stamp ^ *p) * 1099511628211ull;
+            if (*p == '\0') {
+                break;
+            }
+        }
+        for (p = (const unsigned char *)fields, j = 0; j < sizeof(fields); ++j) {
+            stamp = (stamp ^ p[j]) * 1099511628211ull;
+        }
+    }
+    return stamp;
+}
+
+static void keycache_free_fragment_list(struct keycache_fragment *fragments, size_t count)
+{
+    size_t i = 0;
+    for (i = 0; i < count; ++i) {
+        free(fragments[i].path);
+    }
+    free(fragments);
+}
+
+static int keycache_default_workers(size_t fragmentCount)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t workers = fragmentCount / KEYCACHE_MIN_FRAGMENTS_PER_WORKER;
+    if (cpus < 1) {
+        cpus = 1;
+    }
+    if (workers > (size_t)cpus) {
+        workers = (size_t)cpus;
+    }
+    if (workers > KEYCACHE_MAX_WORKERS) {
+        workers = KEYCACHE_MAX_WORKERS;
+    }
+    return workers < 1 ? 1 : (int)workers;
+}
+
+static void keycache_parse_fragments(
+                    struct keycache_fragment *fragments,
+                    size_t count,
+                    int workers)
+{
+    pthread_t threads[KEYCACHE_MAX_WORKERS];
+    struct keycache_job job;
+    int started = 0;
+    int i = 0;
+
+    if (workers <= 0) {
+        workers = keycache_default_workers(count);
+    }
+    if (workers > KEYCACHE_MAX_WORKERS) {
+        workers = KEYCACHE_MAX_WORKERS;
+    }
+    if ((size_t)workers > count) {
+        workers = (int)count;
+    }
+
+    job.fragments = fragments;
+    job.count = count;
+    job.next = 0;
+
+    /* the calling thread is one of the workers */
+    for (i = 1; i < workers; ++i) {
+        if (pthread_create(&threads[started], NULL, keycache_worker, &job) != 0) {
+            break;
+        }
+        started++;
+    }
+    keycache_worker(&job);
+    for (i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+static struct keycache_entry * keycache_find_slot(
+                    struct keycache_entry *table,
+                    size_t capacity,
+                    uint32_t hash,
+                    const char *section,
+                    const char *key)
+{
+    size_t mask = capacity - 1;
+    size_t i = hash & mask;
+    while (table[i].section != NULL) {
+        if (table[i].hash == hash
+                && strcmp(table[i].key, key) == 0
+                && strcmp(table[i].section, section) == 0) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return &table[i];
+}
+
+/*
+    Parses every fragment in the given \a directory and returns the
+    merged view, or NULL if the directory cannot be read.  Up to
+    \a workers threads are used for parsing.
+*/
+SailfishKeyProvider_KeyCache * SailfishKeyProvider_keycache_build(
+                    const char * directory,
+                    int workers)
+{
+    SailfishKeyProvider_KeyCache *cache = NULL;
+    struct keycache_fragment *fragments = NULL;
+    size_t fragmentCount = 0;
+    size_t totalEntries = 0;
+    size_t i = 0, j = 0;
+    uint64_t stamp = 0;
+    time_t newest = 0;
+
+    if (directory == NULL) {
+        return NULL;
+    }
+
+    fragments = keycache_list_fragments(directory, &fragmentCount);
+    if (fragments == NULL && fragmentCount == 0) {
+        DIR *dir = opendir(directory);
+        if (dir == NULL) {
+            return NULL;
+        }
+        closedir(dir); /* empty directory */
+    }
+
+    /* stamped before parsing, so that an edit made meanwhile is seen */
+    stamp = keycache_fragments_stamp(fragments, fragmentCount, &newest);
+    keycache_parse_fragments(fragments, fragmentCount, workers);
+
+    for (i = 0; i < fragmentCount; ++i) {
+        totalEntries += fragments[i].count;
+    }
+
+    cache = (SailfishKeyProvider_KeyCache *)calloc(1, sizeof(SailfishKeyProvider_KeyCache));
+    if (cache != NULL) {
+        cache->stamp = stamp;
+        cache->newest = newest;
+        cache->capacity = 16;
+        while (cache->capacity < 2 * totalEntries) {
+            cache->capacity *= 2;
+        }
+        cache->table = (struct keycache_entry *)calloc(
+                cache->capacity, sizeof(struct keycache_entry));
+        if (cache->table == NULL) {
+            free(cache);
+            cache = NULL;
+        }
+    }
+
+    if (cache == NULL) {
+        fprintf(stderr,
+                "SailfishKeyProvider_keycache_build: %s\n",
+                "malloc failed");
+    }
+
+    /* merge in file name order; the first definition wins */
+    for (i = 0; i < fragmentCount; ++i) {
+        struct keycache_fragment *fragment = &fragments[i];
+        for (j = 0; j < fragment->count; ++j) {
+            struct keycache_entry *entry = &fragment->entries[j];
+            struct keycache_entry *slot = NULL;
+            if (cache != NULL) {
+                slot = keycache_find_slot(cache->table, cache->capacity,
+                                          entry->hash, entry->section, entry->key);
+            }
+            if (slot != NULL && slot->section == NULL) {
+                *slot = *entry;
+                cache->count++;
+            } else {
+                free(entry->section);
+            }
+        }
+        free(fragment->entries);
+        free(fragment->path);
+    }
+    free(fragments);
+
+    return cache;
+}
+
+void SailfishKeyProvider_keycache_free(
+                    SailfishKeyProvider_KeyCache * cache)
+{
+    size_t i = 0;
+    if (cache == NULL) {
+        return;
+    }
+    for (i = 0; i < cache->capacity; ++i) {
+        free(cache->table[i].section);
+    }
+    free(cache->table);
+    free(cache);
+}
+
+size_t SailfishKeyProvider_keycache_count(
+                    const SailfishKeyProvider_KeyCache * cache)
+{
+    return cache ? cache->count : 0;
+}
+
+/*
+    Returns the value of \a key within \a section, or NULL if no
+    fragment defines it.  The returned pointer is owned by the cache.
+*/
+const char * SailfishKeyProvider_keycache_lookup(
+                    const SailfishKeyProvider_KeyCache * cache,
+                    const char * section,
+                    const char * key)
+{
+    const struct keycache_entry *slot = NULL;
+    if (cache == NULL || section == NULL || key == NULL) {
+        return NULL;
+    }
+
+    slot = keycache_find_slot(cache->table, cache->capacity,
+                              keycache_hash(section, key), section, key);
+    return slot->section != NULL ? slot->value : NULL;
+}
+
+/* --------------------------------------------------------- */
+
+/* The process-wide view of the static fragment directory.  It is
+   rebuilt whenever a fragment is added, removed, replaced or edited in
+   place.  Adding or removing one changes the directory, which is seen
+   at once; an edit in place is only seen by listing the directory and
+   stat()ing each fragment, which is done at most once a second, and on
+   every read while a fragment was modified too recently to be trusted,
+   as the ini snapshots of a context do. */
+#define KEYCACHE_REVALIDATE_INTERVAL 1 /* seconds */
+
+static pthread_mutex_t keycache_global_mutex = PTHREAD_MUTEX_INITIALIZER;
+static SailfishKeyProvider_KeyCache *keycache_global = NULL;
+static char *keycache_global_directory = NULL;
+static struct stat keycache_global_dir_stat;
+static struct timespec keycache_global_checked; /* CLOCK_MONOTONIC */
+static int keycache_global_trusted = 0;
+
+static int keycache_same_dir_stat(const struct stat *lhs, const struct stat *rhs)
+{
+    return lhs->st_dev == rhs->st_dev
+        && lhs->st_ino == rhs->st_ino
+        && lhs->st_mtim.tv_sec == rhs->st_mtim.tv_sec
+        && lhs->st_mtim.tv_nsec == rhs->st_mtim.tv_nsec
+        && lhs->st_ctim.tv_sec == rhs->st_ctim.tv_sec
+        && lhs->st_ctim.tv_nsec == rhs->st_ctim.tv_nsec;
+}
+
+/* Whether the global view may be used without checking its fragments */
+static int keycache_global_fresh(const char *directory, const struct stat *dirStat,
+                                 const struct timespec *now)
+{
+    return keycache_global != NULL
+        && keycache_global_trusted
+        && strcmp(keycache_global_directory, directory) == 0
+        && keycache_same_dir_stat(&keycache_global_dir_stat, dirStat)
+        && (now->tv_sec - keycache_global_checked.tv_sec) * 1000000000L
+            + (now->tv_nsec - keycache_global_checked.tv_nsec)
+            < KEYCACHE_REVALIDATE_INTERVAL * 1000000000L;
+}
+
+/* Whether the fragments of \a directory still match the global view.
+   The latest modification among them is returned through \a newest. */
+static int keycache_global_current(const char *directory, time_t *newest)
+{
+    struct keycache_fragment *fragments = NULL;
+    size_t count = 0;
+    uint64_t stamp = 0;
+
+    if (keycache_global == NULL
+            || keycache_global_directory == NULL
+            || strcmp(keycache_global_directory, directory) != 0) {
+        return 0;
+    }
+    fragments = keycache_list_fragments(directory, &count);
+    stamp = keycache_fragments_stamp(fragments, count, newest);
+    keycache_free_fragment_list(fragments, count);
+    return stamp == keycache_global->stamp;
+}
+
+/* Rebuilds the global view if \a directory is not the one it was built
+   from, or has changed since.  A failed build is not kept, so the next
+   read tries again.  Called with the global mutex held. */
+static void keycache_global_refresh(const char *directory, const struct stat *dirStat)
+{
+    struct timespec now;
+    time_t before = time(NULL);
+    time_t newest = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (keycache_global_fresh(directory, dirStat, &now)) {
+        return;
+    }
+
+    if (!keycache_global_current(directory, &newest)) {
+        SailfishKeyProvider_keycache_free(keycache_global);
+        free(keycache_global_directory);
+        keycache_global = SailfishKeyProvider_keycache_build(directory, 0);
+        keycache_global_directory = keycache_global ? strdup(directory) : NULL;
+        if (keycache_global_directory == NULL) {
+            SailfishKeyProvider_keycache_free(keycache_global);
+            keycache_global = NULL;
+            return;
+        }
+        newest = keycache_global->newest;
+    }
+
+    /* a fragment modified within the last second may be modified again
+       without its times changing, so it is checked until it settles */
+    keycache_global_dir_stat = *dirStat;
+    keycache_global_checked = now;
+    keycache_global_trusted = (newest + 1 < before);
+}
+
+/*
+    Reads \a key within \a section from the cached view of
+    \a directory, building or refreshing it as required.
+    The caller owns the returned value and must free() it.
+*/
+char * SailfishKeyProvider_keycache_read(
+                    const char * directory,
+                    const char * section,
+                    const char * key)
+{
+    struct stat dirStat;
+    const char *value = NULL;
+    char *retn = NULL;
+
+    if (directory == NULL || section == NULL || key == NULL) {
+        return NULL;
+    }
+
+    if (stat(directory, &dirStat) != 0) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&keycache_global_mutex);
+    keycache_global_refresh(directory, &dirStat);
+
+    value = SailfishKeyProvider_keycache_lookup(keycache_global, section, key);
+    if (value != NULL) {
+        retn = strdup(value);
+    }
+    pthread_mutex_unlock(&keycache_global_mutex);
+
+    return retn;
+}
+
+/*
+    As SailfishKeyProvider_keycache_read(), for a value which names an
+    encoding scheme.  The scheme is also returned through \a scheme, or
+    NULL if it is not registered; it is resolved once per cached entry,
+    rather than every time the entry is read.
+*/
+char * SailfishKeyProvider_keycache_read_scheme(
+                    const char * directory,
+                    const char * section,
+                    const char * key,
+                    const SailfishKeyProvider_Scheme ** scheme)
+{
+    struct stat dirStat;
+    struct keycache_entry *slot = NULL;
+    char *retn = NULL;
+
+    *scheme = NULL;
+    if (directory == NULL || section == NULL || key == NULL) {
+        return NULL;
+    }
+
+    if (stat(directory, &dirStat) != 0) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&keycache_global_mutex);
+    keycache_global_refresh(directory, &dirStat);
+
+    if (keycache_global != NULL) {
+        slot = keycache_find_slot(keycache_global->table, keycache_global->capacity,
+                                  keycache_hash(section, key), section, key);
+    }
+    if (slot != NULL && slot->section != NULL) {
+        if (slot->scheme == NULL) {
+            slot->scheme = SailfishKeyProvider_scheme_find(slot->value);
+        }
+        *scheme = slot->scheme;
+        retn = strdup(slot->value);
+    }
+    pthread_mutex_unlock(&keycache_global_mutex);
+
+    return retn;
+}
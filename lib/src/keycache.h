@@ -0,0 +1,67 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Jolla Ltd.
+** Contact: Chris Adams <chris.adams@jollamobile.com>
+** All rights reserved.
+**
+** You may use this file under the terms of the GNU Lesser General
+** Public License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Public License for more details.
+**
+****************************************************************************/
+
+#ifndef KEYCACHE_H
+#define KEYCACHE_H
+
+#include "sailfishkeyprovider_schemes.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+typedef struct SailfishKeyProvider_KeyCache SailfishKeyProvider_KeyCache;
+
+SailfishKeyProvider_KeyCache * SailfishKeyProvider_keycache_build(
+                    const char * directory,
+                    int workers); /* 0 selects a default pool size */
+
+void SailfishKeyProvider_keycache_free(
+                    SailfishKeyProvider_KeyCache * cache);
+
+size_t SailfishKeyProvider_keycache_count(
+                    const SailfishKeyProvider_KeyCache * cache);
+
+const char * SailfishKeyProvider_keycache_lookup(
+                    const SailfishKeyProvider_KeyCache * cache,
+                    const char * section,
+                    const char * key);
+
+char * SailfishKeyProvider_keycache_read(
+                    const char * directory,
+                    const char * section,
+                    const char * key);
+
+char * SailfishKeyProvider_keycache_read_scheme(
+                    const char * directory,
+                    const char * section,
+                    const char * key,
+                    const SailfishKeyProvider_Scheme ** scheme);
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KEYCACHE_H */
@@ -0,0 +1,461 @@
+/*
+ * Copyright (C) 2017 Jolla Ltd. and/or its subsidiary(-ies).
+ *
+ * Contributors: Matt Vogt <matthew.vogt@jollamobile.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "keystorelock.h"
+
+#include "sailfishkeyprovider_processmutex.h"
+#include "iniparser.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+namespace {
+
+using Sailfish::KeyProvider::ProcessMutex;
+using Sailfish::KeyProvider::StripedProcessMutex;
+
+// Updates waiting to be written by a group commit, in shared memory
+// beside the store lock.  A slot is written by the process which queued
+// it, and taken over by whichever writer of the same file next holds its
+// stripe; the queue mutex guards the slot states.  Each user has a queue
+// of their own, so a leader only ever writes updates of its own user.
+// A slot is Abandoned when its owner gave up while a leader was writing
+// it; the leader, or the next one to hold the stripe, frees it.
+enum CommitState { CommitFree = 0, CommitPending, CommitClaimed, CommitDone, CommitAbandoned };
+
+static const size_t commitSlots = 16;
+static const size_t commitPayloadSize = 2032;
+
+struct CommitSlot
+{
+    uint32_t state;
+    int32_t result;
+    pid_t owner;
+    uid_t ownerUid;
+    uint32_t stripe;
+    uint32_t count;
+    uint32_t length;
+    char payload[commitPayloadSize]; // the file name, then each update
+};
+
+struct CommitQueue
+{
+    CommitSlot slots[commitSlots];
+};
+
+// Each update is a flags byte followed by its section, key and value
+enum { UpdateHasKey = 1, UpdateHasValue = 2 };
+
+// One lock per key store directory used by the process, kept for its
+// lifetime.  A directory whose lock could not be created is kept too,
+// without a mutex, so that it is not retried and reported on every write.
+struct StoreLock
+{
+    char *directory;
+    StripedProcessMutex *mutex;
+    ProcessMutex *queueMutex;
+    CommitQueue *queue;
+    StoreLock *next;
+};
+
+pthread_mutex_t storeLocksMutex = PTHREAD_MUTEX_INITIALIZER;
+StoreLock *storeLocks = 0;
+
+// An all-zero queue is empty, so whichever process creates the object
+// needs only to size it.  The queue is private to the effective user: an
+// object of the same name which somebody else created is not used.
+CommitQueue *mapCommitQueue(const char *directory)
+{
+    struct stat st;
+    if (stat(directory, &st) == -1)
+        return 0;
+
+    char name[112];
+    snprintf(name, sizeof(name), "/sailfishkeyprovider-%llx-%llx-commits-%u",
+             static_cast<unsigned long long>(st.st_dev),
+             static_cast<unsigned long long>(st.st_ino),
+             static_cast<unsigned>(geteuid()));
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd == -1)
+        return 0;
+
+    struct stat shm;
+    if (fstat(fd, &shm) == -1
+            || shm.st_uid != geteuid()
+            || fchmod(fd, S_IRUSR | S_IWUSR) == -1
+            || (shm.st_size < static_cast<off_t>(sizeof(CommitQueue))
+                && ftruncate(fd, sizeof(CommitQueue)) == -1)) {
+        close(fd);
+        return 0;
+    }
+
+    void *addr = mmap(0, sizeof(CommitQueue), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    return addr == MAP_FAILED ? 0 : static_cast<CommitQueue *>(addr);
+}
+
+// Returns the lock of directory, or null if it could not be created
+StoreLock *storeLockEntry(const char *directory)
+{
+    pthread_mutex_lock(&storeLocksMutex);
+
+    StoreLock *lock = storeLocks;
+    while (lock && strcmp(lock->directory, directory) != 0) {
+        lock = lock->next;
+    }
+
+    if (!lock) {
+        lock = static_cast<StoreLock *>(calloc(1, sizeof(StoreLock)));
+        if (lock) {
+            lock->directory = strdup(directory);
+        }
+        if (!lock || !lock->directory) {
+            free(lock);
+            pthread_mutex_unlock(&storeLocksMutex);
+            return 0;
+        }
+
+        // The lock is keyed on the directory, as the ini writer would create it
+        if (mkdir(directory, S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IWGRP | S_IXGRP) == 0
+                || errno == EEXIST) {
+            StripedProcessMutex *mutex = new StripedProcessMutex(directory, 16, ProcessMutex::SharedMemoryBackend);
+            if (mutex->isValid()) {
+                lock->mutex = mutex;
+
+                // Without a queue, or if its mutex can't be taken, writers
+                // fall back to writing one at a time
+                lock->queueMutex = new ProcessMutex(directory, ProcessMutex::SharedMemoryBackend);
+                lock->queue = mapCommitQueue(directory);
+            } else {
+                delete mutex;
+            }
+        }
+        if (!lock->mutex) {
+            fprintf(stderr,
+                    "SailfishKeyProvider_keystore: %s %s\n",
+                    "unable to create key store lock for", directory);
+        }
+
+        lock->next = storeLocks;
+        storeLocks = lock;
+    }
+
+    pthread_mutex_unlock(&storeLocksMutex);
+    return lock->mutex ? lock : 0;
+}
+
+StripedProcessMutex *storeLock(const char *directory)
+{
+    StoreLock *lock = storeLockEntry(directory);
+    return lock ? lock->mutex : 0;
+}
+
+bool appendString(CommitSlot *slot, const char *string)
+{
+    size_t length = strlen(string) + 1;
+    if (slot->length + length > commitPayloadSize)
+        return false;
+    memcpy(slot->payload + slot->length, string, length);
+    slot->length += length;
+    return true;
+}
+
+bool serializeUpdates(CommitSlot *slot, const char *filename,
+                      const SailfishKeyProvider_ini_update *updates, int count)
+{
+    slot->length = 0;
+    slot->count = count;
+    if (!appendString(slot, filename))
+        return false;
+
+    for (int i = 0; i < count; ++i) {
+        if (slot->length == commitPayloadSize)
+            return false;
+        slot->payload[slot->length++] = (updates[i].key ? UpdateHasKey : 0)
+                                      | (updates[i].value ? UpdateHasValue : 0);
+        if (!appendString(slot, updates[i].section)
+                || (updates[i].key && !appendString(slot, updates[i].key))
+                || (updates[i].value && !appendString(slot, updates[i].value)))
+            return false;
+    }
+    return true;
+}
+
+// The updates point into payload, which must outlive them
+void deserializeUpdates(const char *payload, uint32_t count, SailfishKeyProvider_ini_update *updates)
+{
+    const char *p = payload + strlen(payload) + 1;
+    for (uint32_t i = 0; i < count; ++i) {
+        char flags = *p++;
+        updates[i].section = p;
+        p += strlen(p) + 1;
+        updates[i].key = 0;
+        updates[i].value = 0;
+        if (flags & UpdateHasKey) {
+            updates[i].key = p;
+            p += strlen(p) + 1;
+        }
+        if (flags & UpdateHasValue) {
+            updates[i].value = p;
+            p += strlen(p) + 1;
+        }
+    }
+}
+
+bool ownerExited(const CommitSlot *slot)
+{
+    return slot->owner != 0 && kill(slot->owner, 0) == -1 && errno == ESRCH;
+}
+
+// Returns the slot holding the updates, or -1 if they must be written directly
+int enqueue(StoreLock *lock, size_t stripe, const char *filename,
+            const SailfishKeyProvider_ini_update *updates, int count)
+{
+    if (!lock->queue || !lock->queueMutex->lock())
+        return -1;
+
+    int index = -1;
+    for (size_t i = 0; i < commitSlots && index == -1; ++i) {
+        CommitSlot *slot = &lock->queue->slots[i];
+        // A slot whose owner died before collecting its result is free too
+        if (slot->state == CommitFree
+                || ((slot->state == CommitPending || slot->state == CommitDone)
+                    && ownerExited(slot))) {
+            index = i;
+        }
+    }
+    if (index != -1) {
+        CommitSlot *slot = &lock->queue->slots[index];
+        if (serializeUpdates(slot, filename, updates, count)) {
+            slot->owner = getpid();
+            slot->ownerUid = geteuid();
+            slot->stripe = stripe;
+            slot->result = -1;
+            slot->state = CommitPending;
+        } else {
+            slot->state = CommitFree;
+            index = -1;
+        }
+    }
+
+    lock->queueMutex->unlock();
+    return index;
+}
+
+// Frees a slot of ours without the queue mutex, when it can't be taken.
+// With the stripe held, no other writer may claim the slot meanwhile.
+int withdraw(CommitSlot *own)
+{
+    int result = -1;
+    if (__atomic_load_n(&own->state, __ATOMIC_ACQUIRE) == CommitDone) {
+        result = own->result;
+    }
+    __atomic_store_n(&own->state, static_cast<uint32_t>(CommitFree), __ATOMIC_RELEASE);
+    return result;
+}
+
+// Takes back the updates in slot index from the queue, when the stripe
+// could not be taken.  Returns true, with the result, if a leader has
+// already written them; otherwise they are left for the caller to write.
+bool abandonQueued(StoreLock *lock, int index, int *result)
+{
+    CommitSlot *own = &lock->queue->slots[index];
+    uint32_t state = CommitPending;
+    bool written = false;
+
+    if (lock->queueMutex->lock()) {
+        state = own->state;
+        if (state == CommitDone) {
+            *result = own->result;
+            written = true;
+        }
+        // A leader writing the slot still owns it, and frees it when done
+        own->state = (state == CommitClaimed) ? CommitAbandoned : CommitFree;
+        lock->queueMutex->unlock();
+    } else if (!__atomic_compare_exchange_n(&own->state, &state, static_cast<uint32_t>(CommitFree),
+                                            false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        if (state == CommitDone) {
+            *result = own->result;
+            written = true;
+            __atomic_store_n(&own->state, static_cast<uint32_t>(CommitFree), __ATOMIC_RELEASE);
+        } else {
+            __atomic_store_n(&own->state, static_cast<uint32_t>(CommitAbandoned), __ATOMIC_RELEASE);
+        }
+    }
+    return written;
+}
+
+// Called with the stripe held, once the updates in slot index are queued:
+// either an earlier leader has written them, or this writer becomes the
+// leader, and writes every update queued for the file at once.
+int commitQueued(StoreLock *lock, size_t stripe, const char *directory, int index)
+{
+    CommitQueue *queue = lock->queue;
+    CommitSlot *own = &queue->slots[index];
+    const uid_t uid = geteuid();
+
+    if (!lock->queueMutex->lock())
+        return withdraw(own);
+
+    if (own->state == CommitDone) {
+        int result = own->result;
+        own->state = CommitFree;
+        lock->queueMutex->unlock();
+        return result;
+    }
+
+    // Claim our own updates, followed by those of everyone waiting behind
+    // us.  Claimed slots left by a leader which died are taken over, as
+    // nobody else may hold the stripe.  Slots of another user are never
+    // written, whatever put them in the queue.
+    int claimed[commitSlots];
+    size_t claimedCount = 0;
+    size_t total = 0;
+    size_t length = 0;
+    for (size_t n = 0; n < commitSlots; ++n) {
+        size_t i = (index + n) % commitSlots;
+        CommitSlot *slot = &queue->slots[i];
+        if (slot->state == CommitAbandoned && slot->stripe == stripe) {
+            // whichever leader held the stripe before us has finished
+            slot->state = CommitFree;
+            continue;
+        }
+        if ((slot->state == CommitPending || slot->state == CommitClaimed)
+                && slot->ownerUid == uid
+                && slot->stripe == stripe
+                && strcmp(slot->payload, own->payload) == 0) {
+            slot->state = CommitClaimed;
+            claimed[claimedCount++] = i;
+            total += slot->count;
+            length += slot->length;
+        }
+    }
+
+    // Copy the updates out, so that the queue is not held during the write
+    char *payloads = static_cast<char *>(malloc(length));
+    SailfishKeyProvider_ini_update *updates = static_cast<SailfishKeyProvider_ini_update *>(
+            malloc(total * sizeof(SailfishKeyProvider_ini_update)));
+    int result = -1;
+    if (payloads && updates) {
+        char *payload = payloads;
+        SailfishKeyProvider_ini_update *update = updates;
+        for (size_t c = 0; c < claimedCount; ++c) {
+            CommitSlot *slot = &queue->slots[claimed[c]];
+            memcpy(payload, slot->payload, slot->length);
+            deserializeUpdates(payload, slot->count, update);
+            payload += slot->length;
+            update += slot->count;
+        }
+    }
+    lock->queueMutex->unlock();
+
+    if (payloads && updates) {
+        // Later updates supersede earlier ones, as if written in turn
+        result = SailfishKeyProvider_ini_write_updates(directory, payloads, updates, total);
+    }
+    free(payloads);
+    free(updates);
+
+    if (lock->queueMutex->lock()) {
+        for (size_t c = 0; c < claimedCount; ++c) {
+            CommitSlot *slot = &queue->slots[claimed[c]];
+            slot->result = result;
+            slot->state = (slot == own || slot->state == CommitAbandoned)
+                    ? CommitFree : CommitDone;
+        }
+        lock->queueMutex->unlock();
+    } else {
+        // The others find their slots still claimed, and write them again
+        withdraw(own);
+    }
+    return result;
+}
+
+}
+
+int SailfishKeyProvider_keystore_lock(
+                    const char * directory,
+                    const char * providerName)
+{
+    StripedProcessMutex *mutex = directory ? storeLock(directory) : 0;
+    if (!mutex) {
+        return -1;
+    }
+
+    bool locked = providerName ? mutex->lock(providerName) : mutex->lockAll();
+    return locked ? 0 : -1;
+}
+
+void SailfishKeyProvider_keystore_unlock(
+                    const char * directory,
+                    const char * providerName)
+{
+    StripedProcessMutex *mutex = directory ? storeLock(directory) : 0;
+    if (mutex) {
+        if (providerName) {
+            mutex->unlock(providerName);
+        } else {
+            mutex->unlockAll();
+        }
+    }
+}
+
+int SailfishKeyProvider_keystore_write_updates(
+                    const char * directory,
+                    const char * providerName,
+                    const char * filename,
+                    const SailfishKeyProvider_ini_update * updates,
+                    int count)
+{
+    StoreLock *lock = (directory && providerName) ? storeLockEntry(directory) : 0;
+    if (!lock) {
+        return SailfishKeyProvider_ini_write_updates(directory, filename, updates, count);
+    }
+
+    size_t stripe = lock->mutex->stripe(providerName);
+    int index = (filename && updates && count > 0)
+            ? enqueue(lock, stripe, filename, updates, count) : -1;
+
+    // A leader may only take over the queue while holding the stripe
+    int result = -1;
+    if (!lock->mutex->lock(providerName)) {
+        if (index == -1 || !abandonQueued(lock, index, &result)) {
+            result = SailfishKeyProvider_ini_write_updates(directory, filename, updates, count);
+        }
+        return result;
+    }
+    result = (index != -1)
+            ? commitQueued(lock, stripe, directory, index)
+            : SailfishKeyProvider_ini_write_updates(directory, filename, updates, count);
+    lock->mutex->unlock(providerName);
+    return result;
+}
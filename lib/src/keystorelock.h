@@ -0,0 +1,64 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Jolla Ltd.
+** Contact: Chris Adams <chris.adams@jollamobile.com>
+** All rights reserved.
+**
+** You may use this file under the terms of the GNU Lesser General
+** Public License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Public License for more details.
+**
+****************************************************************************/
+
+#ifndef KEYSTORELOCK_H
+#define KEYSTORELOCK_H
+
+#include "iniparser.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/* Serializes writers of the key store in \a directory across processes
+   and threads.  Writers for one provider take only the lock stripe of
+   \a providerName, so writers for other providers proceed in parallel;
+   a NULL \a providerName takes every stripe, for changes to the whole
+   store.  The directory is created if it does not exist.
+   Returns 0 if the lock was taken, -1 otherwise. */
+int SailfishKeyProvider_keystore_lock(
+                    const char * directory,
+                    const char * providerName);
+
+void SailfishKeyProvider_keystore_unlock(
+                    const char * directory,
+                    const char * providerName);
+
+/* Applies \a updates to \a filename, the file of \a providerName in the
+   key store in \a directory, as SailfishKeyProvider_ini_write_updates()
+   does, under the lock of the provider.  Writers which arrive while the
+   file is being written queue their updates, and the first of them to
+   take the lock writes every queued update for the file at once: one
+   rewrite, and one flush when durable, for the whole group.  Each writer
+   returns the result of the write which applied its own updates. */
+int SailfishKeyProvider_keystore_write_updates(
+                    const char * directory,
+                    const char * providerName,
+                    const char * filename,
+                    const SailfishKeyProvider_ini_update * updates,
+                    int count);
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KEYSTORELOCK_H */
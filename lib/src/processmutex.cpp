@@ -21,11 +21,17 @@
 #include "sailfishkeyprovider_processmutex.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/sem.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -46,12 +52,32 @@ void semaphoreError(const char *msg, const char *id, int error)
     fprintf(stderr, "semaphore error: %s %s: %s %d\n", msg, id, ::strerror(error), error);
 }
 
-int semaphoreInit(const char *id, size_t count, const int *initialValues)
+// How long an attaching process waits for the creator to initialize a
+// semaphore array before giving up on it
+static const int initRetries = 1000;
+static const long initRetryNs = 1000 * 1000;
+
+void initDelay()
+{
+    struct timespec delay = { 0, initRetryNs };
+    ::nanosleep(&delay, 0);
+}
+
+// Semaphore, ProcessMutex and StripedProcessMutex arrays each use their
+// own ftok() proj_id, so all of them can be keyed on one path.  An array
+// which changes size needs a new proj_id: semget() refuses to attach to
+// an existing array with fewer semaphores than requested, which would
+// leave every process started after an upgrade unable to lock.
+static const int semaphoreProjectId = 2;
+static const int stripesProjectId = 3;
+static const int processMutexProjectId = 4; // was 2, with three semaphores
+
+int semaphoreInit(const char *id, size_t count, const int *initialValues, int projectId = semaphoreProjectId)
 {
     int rv = -1;
+    bool created = false;
 
-    // It doesn't matter what proj_id we use, there are no other ftok uses on this ID
-    key_t key = ::ftok(id, 2);
+    key_t key = ::ftok(id, projectId);
 
     rv = ::semget(key, count, 0);
     if (rv == -1) {
@@ -70,73 +96,561 @@ int semaphoreInit(const char *id, size_t count, const int *initialValues)
                     semaphoreError("Unable to create semaphore", id, errno);
                 }
             } else {
-                // Set the initial value
-                for (size_t i = 0; i < count; ++i) {
-                    union semun arg = { 0 };
-                    arg.val = *initialValues++;
-
-                    int status = ::semctl(rv, static_cast<int>(i), SETVAL, arg);
-                    if (status == -1) {
-                        rv = -1;
-                        semaphoreError("Unable to initialize semaphore", id, errno);
-                    }
-                }
+                created = true;
             }
         }
     }
 
+    if (rv != -1 && created) {
+        // Set all of the initial values at once
+        unsigned short *values = static_cast<unsigned short *>(malloc(count * sizeof(unsigned short)));
+        for (size_t i = 0; values && i < count; ++i) {
+            values[i] = static_cast<unsigned short>(initialValues[i]);
+        }
+
+        union semun arg = { 0 };
+        arg.array = values;
+        if (!values || ::semctl(rv, 0, SETALL, arg) == -1) {
+            semaphoreError("Unable to initialize semaphore", id, values ? errno : ENOMEM);
+            rv = -1;
+        } else {
+            // A semop marks the array as initialized for those attaching,
+            // which the creation and SETALL above do not
+            struct sembuf ops[2];
+            ops[0].sem_num = ops[1].sem_num = 0;
+            ops[0].sem_op = 1;
+            ops[1].sem_op = -1;
+            ops[0].sem_flg = ops[1].sem_flg = 0;
+            if (::semop(rv, ops, 2) == -1) {
+                semaphoreError("Unable to initialize semaphore", id, errno);
+                rv = -1;
+            }
+        }
+        free(values);
+    } else if (rv != -1) {
+        // Don't use an array before its creator has finished initializing it
+        struct semid_ds ds;
+        union semun arg = { 0 };
+        arg.buf = &ds;
+        for (int retries = initRetries; retries > 0; --retries) {
+            if (::semctl(rv, 0, IPC_STAT, arg) == -1 || ds.sem_otime != 0)
+                break;
+            initDelay();
+        }
+    }
+
     return rv;
 }
 
-bool semaphoreIncrement(int id, size_t index, bool wait, size_t ms, int value)
+// Sets deadline to the monotonic time ms milliseconds from now
+void deadlineAfter(size_t ms, struct timespec *deadline)
+{
+    ::clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += ms / 1000;
+    deadline->tv_nsec += static_cast<long>(ms % 1000) * 1000000;
+    if (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_nsec -= 1000000000;
+        ++deadline->tv_sec;
+    }
+}
+
+// Sets remaining to the time left until deadline, or to zero if it has passed
+void timeUntil(const struct timespec *deadline, struct timespec *remaining)
+{
+    struct timespec now;
+    ::clock_gettime(CLOCK_MONOTONIC, &now);
+    remaining->tv_sec = deadline->tv_sec - now.tv_sec;
+    remaining->tv_nsec = deadline->tv_nsec - now.tv_nsec;
+    if (remaining->tv_nsec < 0) {
+        remaining->tv_nsec += 1000000000;
+        --remaining->tv_sec;
+    }
+    if (remaining->tv_sec < 0) {
+        remaining->tv_sec = 0;
+        remaining->tv_nsec = 0;
+    }
+}
+
+// Waits without limit if deadline is null.  A wait which times out
+// fails with EAGAIN, as one which would have to wait does with !wait.
+bool semaphoreOperate(int id, struct sembuf *ops, size_t count, bool wait, const struct timespec *deadline)
 {
     if (id == -1) {
         errno = 0;
         return false;
     }
 
+    for (size_t i = 0; i < count; ++i) {
+        if (!wait) {
+            ops[i].sem_flg |= IPC_NOWAIT;
+        }
+    }
+
+    do {
+        // semtimedop() takes a relative timeout, so recompute it after
+        // each interruption rather than restarting the full wait
+        struct timespec remaining;
+        if (wait && deadline) {
+            timeUntil(deadline, &remaining);
+        }
+
+        int rv = ::semtimedop(id, ops, count, (wait && deadline ? &remaining : 0));
+        if (rv == 0)
+            return true;
+    } while (errno == EINTR);
+
+    return false;
+}
+
+bool semaphoreIncrement(int id, size_t index, bool wait, size_t ms, int value)
+{
     struct sembuf op;
     op.sem_num = index;
     op.sem_op = value;
     op.sem_flg = SEM_UNDO;
-    if (!wait) {
-        op.sem_flg |= IPC_NOWAIT;
+
+    struct timespec deadline;
+    if (wait && ms > 0) {
+        deadlineAfter(ms, &deadline);
     }
 
-    struct timespec timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_nsec = ms * 1000;
+    return semaphoreOperate(id, &op, 1, wait, (wait && ms > 0 ? &deadline : 0));
+}
 
-    do {
-        int rv = ::semtimedop(id, &op, 1, (wait && ms > 0 ? &timeout : 0));
-        if (rv == 0)
+// Operation lists up to this long are converted on the stack
+static const size_t stackOperations = 8;
+
+// Index 0 once serialized attaching to the array; attaching is now a
+// single atomic operation, and the slot is merely unused
+static const int initialSemaphoreValues[] = { 1, 0, 1, 0, 0 };
+static size_t fileReadersIndex = 1;  // processes attached, not lock holders
+static size_t writeAccessIndex = 2;
+static size_t sharedHoldersIndex = 3;
+static size_t writersIndex = 4;      // writers holding or waiting for the lock
+static const size_t semaphoreCount = 5;
+
+void sharedMemoryError(const char *msg, const char *id, int error)
+{
+    fprintf(stderr, "shared memory error: %s %s: %s %d\n", msg, id, ::strerror(error), error);
+}
+
+static const uint32_t sharedLockMagic = 0x53464b4d; // "SFKM"
+
+// Bounded by the number of operations a single semop may carry (SEMOPM)
+static const size_t maxStripes = 64;
+
+// FNV-1a
+size_t stripeHash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *p = reinterpret_cast<const unsigned char *>(name); *p; ++p) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Upper bound on attempts to take a contended shared lock before sleeping
+static const int maxSpins = 100;
+
+void cpuRelax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#elif defined(__arm__) || defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// Spinning only helps if the holder can run at the same time
+bool spinningHelps()
+{
+    static const bool multiprocessor = (::sysconf(_SC_NPROCESSORS_ONLN) > 1);
+    return multiprocessor;
+}
+
+}
+
+// Statistics are kept per process, for each kind of lock and path, and
+// outlive the lock objects.  The counters are updated with relaxed atomics;
+// an uncontended acquisition costs one increment, and a contended one reads
+// the monotonic clock, which does not enter the kernel, around the wait.
+struct Sailfish::KeyProvider::LockStatistics
+{
+    const char *kind;
+    char *path;
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t totalWaitNs;
+    uint64_t maxWaitNs;
+    uint64_t waitHistogram[SAILFISHKEYPROVIDER_LOCK_WAIT_BUCKETS];
+    LockStatistics *next;
+};
+
+namespace {
+
+using Sailfish::KeyProvider::LockStatistics;
+
+pthread_mutex_t statisticsMutex = PTHREAD_MUTEX_INITIALIZER;
+LockStatistics *statistics = 0;
+int statisticsEnabled = 1;
+
+// Where a wait can only be timed, rather than observed to block, waits
+// shorter than an uncontended system call are counted as uncontended
+static const uint64_t contendedThresholdNs = 20000;
+
+const char *const semaphoreKind = "Semaphore";
+const char *const processMutexKind = "ProcessMutex";
+const char *const stripedProcessMutexKind = "StripedProcessMutex";
+
+LockStatistics *statisticsFor(const char *kind, const char *path)
+{
+    pthread_mutex_lock(&statisticsMutex);
+
+    LockStatistics *stats = statistics;
+    while (stats && (stats->kind != kind || strcmp(stats->path, path) != 0)) {
+        stats = stats->next;
+    }
+    if (!stats) {
+        stats = static_cast<LockStatistics *>(calloc(1, sizeof(LockStatistics)));
+        if (stats && !(stats->path = strdup(path))) {
+            free(stats);
+            stats = 0;
+        }
+        if (stats) {
+            stats->kind = kind;
+            stats->next = statistics;
+            statistics = stats;
+        }
+    }
+
+    pthread_mutex_unlock(&statisticsMutex);
+    return stats;
+}
+
+uint64_t monotonicNs()
+{
+    struct timespec now;
+    ::clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000000u + now.tv_nsec;
+}
+
+bool statisticsActive(LockStatistics *stats)
+{
+    return stats && __atomic_load_n(&statisticsEnabled, __ATOMIC_RELAXED);
+}
+
+void statisticsAcquired(LockStatistics *stats)
+{
+    if (statisticsActive(stats)) {
+        __atomic_fetch_add(&stats->acquisitions, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Returns the start of a wait, or 0 if it isn't to be recorded
+uint64_t statisticsWaitStart(LockStatistics *stats)
+{
+    return statisticsActive(stats) ? monotonicNs() : 0;
+}
+
+void statisticsWaited(LockStatistics *stats, uint64_t start)
+{
+    if (!stats || start == 0)
+        return;
+
+    uint64_t wait = monotonicNs() - start;
+    uint64_t us = wait / 1000;
+    int bucket = us < 2 ? 0 : 63 - __builtin_clzll(us);
+    if (bucket >= SAILFISHKEYPROVIDER_LOCK_WAIT_BUCKETS) {
+        bucket = SAILFISHKEYPROVIDER_LOCK_WAIT_BUCKETS - 1;
+    }
+
+    __atomic_fetch_add(&stats->acquisitions, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->contended, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->totalWaitNs, wait, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->waitHistogram[bucket], 1, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&stats->maxWaitNs, __ATOMIC_RELAXED);
+    while (wait > max
+            && !__atomic_compare_exchange_n(&stats->maxWaitNs, &max, wait, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// For acquisitions which could not be seen to block, only timed
+void statisticsTimed(LockStatistics *stats, uint64_t start)
+{
+    if (!stats || start == 0)
+        return;
+
+    if (monotonicNs() - start < contendedThresholdNs) {
+        __atomic_fetch_add(&stats->acquisitions, 1, __ATOMIC_RELAXED);
+    } else {
+        statisticsWaited(stats, start);
+    }
+}
+
+}
+
+// The mutex is a robust, process-shared pthread mutex, which glibc builds
+// on a futex word: uncontended lock and unlock are a single compare and
+// swap, waiters sleep in FUTEX_WAIT, and the kernel marks the word
+// FUTEX_OWNER_DIED if the holder exits, as SEM_UNDO does for semaphores.
+// The memory is a POSIX shared memory object named for the device and
+// inode of the protected path (the key ftok() uses), so like a semaphore
+// it does not outlive a reboot with a stale owner recorded in it.
+struct __attribute__((aligned(64))) Sailfish::KeyProvider::SharedLockData
+{
+    uint32_t magic; // written last by the creating process, in the first lock
+    int32_t spins;  // running average of attempts that won a contended lock
+    pthread_mutex_t mutex;
+};
+
+namespace {
+
+using Sailfish::KeyProvider::SharedLockData;
+
+// Creates, sizes and initializes the locks in the new object fd, named name
+SharedLockData *sharedLockCreate(int fd, const char *name, const char *path,
+                                 const struct stat &st, size_t count)
+{
+    const size_t size = count * sizeof(SharedLockData);
+
+    // Only the owner, and the group of the protected file if that may
+    // write it, can take the lock; the object is never world-writable
+    mode_t mode = S_IRUSR | S_IWUSR;
+    if ((st.st_mode & S_IWGRP) && ::fchown(fd, static_cast<uid_t>(-1), st.st_gid) == 0) {
+        mode |= S_IRGRP | S_IWGRP;
+    }
+    if (::fchmod(fd, mode) == -1
+            || ::ftruncate(fd, size) == -1) {
+        sharedMemoryError("Unable to size shared lock", path, errno);
+        ::shm_unlink(name);
+        return 0;
+    }
+
+    void *addr = ::mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        sharedMemoryError("Unable to map shared lock", path, errno);
+        ::shm_unlink(name);
+        return 0;
+    }
+    SharedLockData *data = static_cast<SharedLockData *>(addr);
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int rv = 0;
+    for (size_t i = 0; rv == 0 && i < count; ++i) {
+        rv = pthread_mutex_init(&data[i].mutex, &attr);
+    }
+    pthread_mutexattr_destroy(&attr);
+    if (rv != 0) {
+        sharedMemoryError("Unable to initialize shared lock", path, rv);
+        ::munmap(data, size);
+        ::shm_unlink(name);
+        return 0;
+    }
+    __atomic_store_n(&data->magic, sharedLockMagic, __ATOMIC_RELEASE);
+    return data;
+}
+
+// Maps an array of count locks, named for path and suffix.  Creation is
+// serialized by a flock() on the protected path, which is released if
+// the creator dies, so an object found uninitialized while holding it
+// was abandoned part way through, and is replaced.
+SharedLockData *sharedLockInit(const char *path, const char *suffix, size_t count, bool *created)
+{
+    const size_t size = count * sizeof(SharedLockData);
+
+    int pathFd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (pathFd == -1) {
+        sharedMemoryError("Unable to open lock path", path, errno);
+        return 0;
+    }
+
+    struct stat st;
+    if (::fstat(pathFd, &st) == -1) {
+        sharedMemoryError("Unable to stat lock path", path, errno);
+        ::close(pathFd);
+        return 0;
+    }
+
+    char name[96];
+    snprintf(name, sizeof(name), "/sailfishkeyprovider-%llx-%llx%s",
+             static_cast<unsigned long long>(st.st_dev),
+             static_cast<unsigned long long>(st.st_ino),
+             suffix);
+
+    int rv = 0;
+    while ((rv = ::flock(pathFd, LOCK_EX)) == -1 && errno == EINTR) {
+    }
+    if (rv == -1) {
+        sharedMemoryError("Unable to serialize shared lock creation", path, errno);
+        ::close(pathFd);
+        return 0;
+    }
+
+    SharedLockData *data = 0;
+    bool create = false;
+    *created = false;
+    int fd = ::shm_open(name, O_RDWR | O_CLOEXEC, 0);
+    if (fd != -1) {
+        struct stat shm;
+        void *addr = MAP_FAILED;
+        if (::fstat(fd, &shm) == 0 && shm.st_size >= static_cast<off_t>(size)) {
+            addr = ::mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        if (addr != MAP_FAILED) {
+            data = static_cast<SharedLockData *>(addr);
+            if (__atomic_load_n(&data->magic, __ATOMIC_ACQUIRE) != sharedLockMagic) {
+                ::munmap(data, size);
+                data = 0;
+            }
+        }
+        ::close(fd);
+        if (!data) {
+            // Left behind by a creator which died before initializing it
+            ::shm_unlink(name);
+            create = true;
+        }
+    } else if (errno == ENOENT) {
+        create = true;
+    } else {
+        sharedMemoryError("Unable to open shared lock", path, errno);
+    }
+
+    if (create) {
+        fd = ::shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        if (fd == -1) {
+            sharedMemoryError("Unable to create shared lock", path, errno);
+        } else {
+            data = sharedLockCreate(fd, name, path, st, count);
+            *created = (data != 0);
+            ::close(fd);
+        }
+    }
+
+    ::flock(pathFd, LOCK_UN);
+    ::close(pathFd);
+    return data;
+}
+
+bool sharedLockAcquired(SharedLockData *data, int rv)
+{
+    if (rv == EOWNERDEAD) {
+        // The previous owner died holding the lock; it is ours now
+        pthread_mutex_consistent(&data->mutex);
+        return true;
+    }
+    errno = rv;
+    return rv == 0;
+}
+
+// Retries a contended lock for a while before the caller sleeps on it.
+// As glibc's adaptive mutexes do, the spin limit follows the number of
+// attempts which recently succeeded, so a lock which is held briefly is
+// waited for in userspace while one held for long goes straight to sleep.
+// Returns true if the spin phase settled the outcome, in *acquired.
+bool sharedLockSpin(SharedLockData *data, bool *acquired)
+{
+    if (!spinningHelps())
+        return false;
+
+    int spins = __atomic_load_n(&data->spins, __ATOMIC_RELAXED);
+    int limit = 2 * spins + 10;
+    if (limit > maxSpins)
+        limit = maxSpins;
+
+    for (int count = 0; count < limit; ++count) {
+        int rv = pthread_mutex_trylock(&data->mutex);
+        if (rv != EBUSY) {
+            __atomic_store_n(&data->spins, spins + (count - spins) / 8, __ATOMIC_RELAXED);
+            *acquired = sharedLockAcquired(data, rv);
             return true;
-    } while (errno == EINTR);
+        }
+        cpuRelax();
+    }
 
+    __atomic_store_n(&data->spins, spins + (limit - spins) / 8, __ATOMIC_RELAXED);
     return false;
 }
 
-static const int initialSemaphoreValues[] = { 1, 0, 1 };
-static size_t fileOwnershipIndex = 0;
-static size_t fileReadersIndex = 1;
-static size_t writeAccessIndex = 2;
+// Waits without limit if deadline is null
+bool sharedLockAcquire(SharedLockData *data, const struct timespec *deadline, LockStatistics *stats)
+{
+    if (!data) {
+        errno = 0;
+        return false;
+    }
+
+    // Uncontended, a single compare and swap
+    int rv = pthread_mutex_trylock(&data->mutex);
+    if (rv != EBUSY) {
+        bool acquired = sharedLockAcquired(data, rv);
+        if (acquired) {
+            statisticsAcquired(stats);
+        }
+        return acquired;
+    }
+
+    uint64_t start = statisticsWaitStart(stats);
+    bool acquired = false;
+    if (!sharedLockSpin(data, &acquired)) {
+        rv = deadline
+                ? pthread_mutex_clocklock(&data->mutex, CLOCK_MONOTONIC, deadline)
+                : pthread_mutex_lock(&data->mutex);
+        acquired = sharedLockAcquired(data, rv);
+    }
+    if (acquired) {
+        statisticsWaited(stats, start);
+    }
+    return acquired;
+}
+
+bool sharedLockRelease(SharedLockData *data)
+{
+    if (!data) {
+        errno = 0;
+        return false;
+    }
+
+    int rv = pthread_mutex_unlock(&data->mutex);
+    errno = rv;
+    return rv == 0;
+}
 
 }
 
 Sailfish::KeyProvider::Semaphore::Semaphore(const char *id, int initial)
     : m_identifier(0)
     , m_id(-1)
+    , m_stats(0)
 {
     m_identifier = strdup(id);
     m_id = semaphoreInit(m_identifier, 1, &initial);
+    m_stats = statisticsFor(semaphoreKind, id);
 }
 
 Sailfish::KeyProvider::Semaphore::Semaphore(const char *id, size_t count, const int *initialValues)
     : m_identifier(0)
     , m_id(-1)
+    , m_stats(0)
 {
     m_identifier = strdup(id);
     m_id = semaphoreInit(m_identifier, count, initialValues);
+    m_stats = statisticsFor(semaphoreKind, id);
+}
+
+Sailfish::KeyProvider::Semaphore::Semaphore(const char *id, size_t count, const int *initialValues, int projectId)
+    : m_identifier(0)
+    , m_id(-1)
+    , m_stats(0)
+{
+    m_identifier = strdup(id);
+    m_id = semaphoreInit(m_identifier, count, initialValues, projectId);
+    m_stats = statisticsFor(semaphoreKind, id);
 }
 
 Sailfish::KeyProvider::Semaphore::~Semaphore()
@@ -151,19 +665,25 @@ bool Sailfish::KeyProvider::Semaphore::isValid() const
 
 bool Sailfish::KeyProvider::Semaphore::decrement(size_t index, bool wait, size_t timeoutMs)
 {
+    uint64_t start = wait ? statisticsWaitStart(m_stats) : 0;
     if (!semaphoreIncrement(m_id, index, wait, timeoutMs, -1)) {
-        if (errno != EAGAIN || wait) {
+        if (errno != EAGAIN) {
             error("Unable to decrement semaphore", errno);
         }
         return false;
     }
+    if (wait) {
+        statisticsTimed(m_stats, start);
+    } else {
+        statisticsAcquired(m_stats);
+    }
     return true;
 }
 
 bool Sailfish::KeyProvider::Semaphore::increment(size_t index, bool wait, size_t timeoutMs)
 {
     if (!semaphoreIncrement(m_id, index, wait, timeoutMs, 1)) {
-        if (errno != EAGAIN || wait) {
+        if (errno != EAGAIN) {
             error("Unable to increment semaphore", errno);
         }
         return false;
@@ -171,6 +691,51 @@ bool Sailfish::KeyProvider::Semaphore::increment(size_t index, bool wait, size_t
     return true;
 }
 
+bool Sailfish::KeyProvider::Semaphore::operate(const Operation *operations, size_t count, bool wait, size_t timeoutMs)
+{
+    struct timespec deadline;
+    if (wait && timeoutMs > 0) {
+        deadlineAfter(timeoutMs, &deadline);
+    }
+    return operate(operations, count, wait, (wait && timeoutMs > 0 ? &deadline : 0));
+}
+
+bool Sailfish::KeyProvider::Semaphore::operateUntil(const Operation *operations, size_t count, const struct timespec &deadline)
+{
+    return operate(operations, count, true, &deadline);
+}
+
+bool Sailfish::KeyProvider::Semaphore::operate(const Operation *operations, size_t count, bool wait, const struct timespec *deadline)
+{
+    struct sembuf stackOps[stackOperations];
+    struct sembuf *ops = stackOps;
+    if (count > stackOperations) {
+        ops = static_cast<struct sembuf *>(malloc(count * sizeof(struct sembuf)));
+        if (!ops) {
+            error("Unable to operate on semaphore", ENOMEM);
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        ops[i].sem_num = operations[i].index;
+        ops[i].sem_op = operations[i].value;
+        ops[i].sem_flg = SEM_UNDO;
+    }
+
+    bool rv = semaphoreOperate(m_id, ops, count, wait, deadline);
+    if (!rv && errno != EAGAIN) {
+        error("Unable to operate on semaphore", errno);
+    }
+
+    if (ops != stackOps) {
+        int savedErrno = errno;
+        free(ops);
+        errno = savedErrno;
+    }
+    return rv;
+}
+
 int Sailfish::KeyProvider::Semaphore::value(size_t index) const
 {
     if (m_id == -1)
@@ -189,41 +754,422 @@ void Sailfish::KeyProvider::Semaphore::error(const char *msg, int error)
 // attach to.  We rely on undo semantics to release locked semaphores
 // on process failure.
 Sailfish::KeyProvider::ProcessMutex::ProcessMutex(const char *path)
-    : m_semaphore(path, 3, initialSemaphoreValues)
+    : m_backend(SemaphoreBackend)
+    , m_semaphore(0)
+    , m_shared(0)
+    , m_stats(statisticsFor(processMutexKind, path))
+    , m_initialProcess(false)
+{
+    init(path);
+}
+
+Sailfish::KeyProvider::ProcessMutex::ProcessMutex(const char *path, Backend backend)
+    : m_backend(backend)
+    , m_semaphore(0)
+    , m_shared(0)
+    , m_stats(statisticsFor(processMutexKind, path))
     , m_initialProcess(false)
 {
-    if (!m_semaphore.isValid()) {
+    init(path);
+}
+
+void Sailfish::KeyProvider::ProcessMutex::init(const char *path)
+{
+    if (m_backend == SharedMemoryBackend) {
+        // The first process to connect creates the shared lock
+        m_shared = sharedLockInit(path, "", 1, &m_initialProcess);
+        if (!m_shared) {
+            m_initialProcess = false;
+            sharedMemoryError("ProcessMutex: Unable to create shared lock!", path, EAGAIN);
+        }
+        return;
+    }
+
+    m_semaphore = new Semaphore(path, semaphoreCount, initialSemaphoreValues, processMutexProjectId);
+    if (!m_semaphore->isValid()) {
         semaphoreError("ProcessMutex: Unable to create semaphore array!", path, EAGAIN);
-    } else {
-        if (!m_semaphore.decrement(fileOwnershipIndex)) {
-            semaphoreError("ProcessMutex: Unable to determine file semaphore ownership!", path, EAGAIN);
-        } else {
-            // Only the first process to connect to the semaphore is the owner
-            m_initialProcess = (m_semaphore.value(fileReadersIndex) == 0);
-            if (!m_semaphore.increment(fileReadersIndex)) {
-                semaphoreError("ProcessMutex: Unable to increment file readers semaphore!", path, EAGAIN);
-            }
-            m_semaphore.increment(fileOwnershipIndex);
+        return;
+    }
+
+    // Only the first process to connect to the semaphore is the owner.
+    // Register either as the first, if no others are attached, or as one
+    // more, if some are; each is a single atomic operation.  Retry in the
+    // unlikely event that every other process detached in between.
+    const Semaphore::Operation first[] = {
+        { fileReadersIndex, 0 },
+        { fileReadersIndex, 1 }
+    };
+    const Semaphore::Operation another[] = {
+        { fileReadersIndex, -1 },
+        { fileReadersIndex, 2 }
+    };
+    for (;;) {
+        if (m_semaphore->operate(first, 2, false)) {
+            m_initialProcess = true;
+            break;
+        }
+        if (errno == EAGAIN) {
+            if (m_semaphore->operate(another, 2, false))
+                break;
+            if (errno == EAGAIN)
+                continue;
         }
+        semaphoreError("ProcessMutex: Unable to increment file readers semaphore!", path, errno);
+        break;
     }
 }
 
+Sailfish::KeyProvider::ProcessMutex::~ProcessMutex()
+{
+    delete m_semaphore;
+    if (m_shared) {
+        ::munmap(m_shared, sizeof(SharedLockData));
+    }
+}
+
+Sailfish::KeyProvider::ProcessMutex::Backend Sailfish::KeyProvider::ProcessMutex::backend() const
+{
+    return m_backend;
+}
+
 bool Sailfish::KeyProvider::ProcessMutex::lock()
 {
-    return m_semaphore.decrement(writeAccessIndex);
+    return acquire(0);
+}
+
+bool Sailfish::KeyProvider::ProcessMutex::tryLockFor(size_t timeoutMs)
+{
+    struct timespec deadline;
+    deadlineAfter(timeoutMs, &deadline);
+    return acquire(&deadline);
+}
+
+bool Sailfish::KeyProvider::ProcessMutex::tryLockUntil(const struct timespec &deadline)
+{
+    return acquire(&deadline);
+}
+
+// Exclusive locking gives writers preference: a writer first registers
+// itself, which stops new shared holders from entering, and then waits for
+// the write lock and for the shared holders to drain in one operation.
+bool Sailfish::KeyProvider::ProcessMutex::acquire(const struct timespec *deadline)
+{
+    if (m_backend == SharedMemoryBackend)
+        return sharedLockAcquire(m_shared, deadline, m_stats);
+
+    // Uncontended, everything happens in one operation.  Spinning on
+    // semaphores would cost a syscall per attempt, so there is no spin phase.
+    const Semaphore::Operation uncontended[] = {
+        { writeAccessIndex, -1 },
+        { sharedHoldersIndex, 0 },
+        { writersIndex, 1 }
+    };
+    if (m_semaphore->operate(uncontended, 3, false)) {
+        statisticsAcquired(m_stats);
+        return true;
+    }
+    if (errno != EAGAIN)
+        return false;
+
+    uint64_t start = statisticsWaitStart(m_stats);
+    if (!m_semaphore->increment(writersIndex))
+        return false;
+
+    const Semaphore::Operation acquire[] = {
+        { writeAccessIndex, -1 },
+        { sharedHoldersIndex, 0 }
+    };
+    if (!(deadline ? m_semaphore->operateUntil(acquire, 2, *deadline)
+                   : m_semaphore->operate(acquire, 2))) {
+        int error = (errno == EAGAIN ? ETIMEDOUT : errno);
+        m_semaphore->decrement(writersIndex);
+        errno = error;
+        return false;
+    }
+    statisticsWaited(m_stats, start);
+    return true;
 }
 
 bool Sailfish::KeyProvider::ProcessMutex::unlock()
 {
-    return m_semaphore.increment(writeAccessIndex);
+    if (m_backend == SharedMemoryBackend)
+        return sharedLockRelease(m_shared);
+
+    const Semaphore::Operation release[] = {
+        { writeAccessIndex, 1 },
+        { writersIndex, -1 }
+    };
+    return m_semaphore->operate(release, 2);
+}
+
+// The shared memory backend has no crash-safe way to count shared holders,
+// so there shared locking is exclusive.
+bool Sailfish::KeyProvider::ProcessMutex::lockShared()
+{
+    if (m_backend == SharedMemoryBackend)
+        return lock();
+
+    // Wait for no writers to be registered, and enter, atomically
+    const Semaphore::Operation acquire[] = {
+        { writersIndex, 0 },
+        { sharedHoldersIndex, 1 }
+    };
+    return m_semaphore->operate(acquire, 2);
+}
+
+bool Sailfish::KeyProvider::ProcessMutex::unlockShared()
+{
+    if (m_backend == SharedMemoryBackend)
+        return unlock();
+
+    return m_semaphore->decrement(sharedHoldersIndex);
 }
 
 bool Sailfish::KeyProvider::ProcessMutex::isLocked() const
 {
-    return (m_semaphore.value(writeAccessIndex) == 0);
+    if (m_backend == SharedMemoryBackend) {
+        if (!m_shared)
+            return false;
+
+        int rv = pthread_mutex_trylock(&m_shared->mutex);
+        if (rv == EBUSY)
+            return true;
+        if (sharedLockAcquired(m_shared, rv))
+            pthread_mutex_unlock(&m_shared->mutex);
+        return false;
+    }
+    return (m_semaphore->value(writeAccessIndex) == 0);
 }
 
 bool Sailfish::KeyProvider::ProcessMutex::isInitialProcess() const
 {
     return m_initialProcess;
 }
+
+Sailfish::KeyProvider::ProcessMutexLocker::ProcessMutexLocker(ProcessMutex *mutex)
+    : m_mutex(mutex)
+    , m_locked(mutex->lock())
+{
+}
+
+Sailfish::KeyProvider::ProcessMutexLocker::ProcessMutexLocker(ProcessMutex *mutex, size_t timeoutMs)
+    : m_mutex(mutex)
+    , m_locked(mutex->tryLockFor(timeoutMs))
+{
+}
+
+Sailfish::KeyProvider::ProcessMutexLocker::~ProcessMutexLocker()
+{
+    unlock();
+}
+
+bool Sailfish::KeyProvider::ProcessMutexLocker::isLocked() const
+{
+    return m_locked;
+}
+
+void Sailfish::KeyProvider::ProcessMutexLocker::unlock()
+{
+    if (m_locked) {
+        m_mutex->unlock();
+        m_locked = false;
+    }
+}
+
+// Every stripe is an independent lock: a semaphore in one array, or a
+// robust mutex in one shared memory object.  Taking every stripe is a
+// single semop with the semaphore backend; with shared memory the
+// stripes are taken in index order, which cannot deadlock against
+// holders of single stripes.
+Sailfish::KeyProvider::StripedProcessMutex::StripedProcessMutex(const char *path, size_t stripes, ProcessMutex::Backend backend)
+    : m_backend(backend)
+    , m_identifier(strdup(path))
+    , m_count(stripes == 0 ? 1 : (stripes > maxStripes ? maxStripes : stripes))
+    , m_id(-1)
+    , m_shared(0)
+    , m_stats(statisticsFor(stripedProcessMutexKind, path))
+{
+    if (m_backend == ProcessMutex::SharedMemoryBackend) {
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), "-stripes%u", static_cast<unsigned>(m_count));
+        bool created = false;
+        m_shared = sharedLockInit(path, suffix, m_count, &created);
+        if (!m_shared) {
+            sharedMemoryError("StripedProcessMutex: Unable to create shared locks!", path, EAGAIN);
+        }
+        return;
+    }
+
+    int initialValues[maxStripes];
+    for (size_t i = 0; i < m_count; ++i) {
+        initialValues[i] = 1;
+    }
+    m_id = semaphoreInit(path, m_count, initialValues, stripesProjectId);
+    if (m_id == -1) {
+        semaphoreError("StripedProcessMutex: Unable to create semaphore array!", path, EAGAIN);
+    }
+}
+
+Sailfish::KeyProvider::StripedProcessMutex::~StripedProcessMutex()
+{
+    if (m_shared) {
+        ::munmap(m_shared, m_count * sizeof(SharedLockData));
+    }
+    free(m_identifier);
+}
+
+bool Sailfish::KeyProvider::StripedProcessMutex::isValid() const
+{
+    return m_backend == ProcessMutex::SharedMemoryBackend ? (m_shared != 0) : (m_id != -1);
+}
+
+size_t Sailfish::KeyProvider::StripedProcessMutex::stripeCount() const
+{
+    return m_count;
+}
+
+size_t Sailfish::KeyProvider::StripedProcessMutex::stripe(const char *name) const
+{
+    return stripeHash(name) % m_count;
+}
+
+bool Sailfish::KeyProvider::StripedProcessMutex::lock(const char *name)
+{
+    return adjust(stripe(name), 1, -1);
+}
+
+bool Sailfish::KeyProvider::StripedProcessMutex::unlock(const char *name)
+{
+    return adjust(stripe(name), 1, 1);
+}
+
+bool Sailfish::KeyProvider::StripedProcessMutex::lockAll()
+{
+    return adjust(0, m_count, -1);
+}
+
+bool Sailfish::KeyProvider::StripedProcessMutex::unlockAll()
+{
+    return adjust(0, m_count, 1);
+}
+
+// Takes (value -1) or releases (value 1) the stripes [first, first + count).
+// Taking every stripe counts as one acquisition.
+bool Sailfish::KeyProvider::StripedProcessMutex::adjust(size_t first, size_t count, int value)
+{
+    uint64_t start = (value < 0 && (count > 1 || m_backend != ProcessMutex::SharedMemoryBackend))
+            ? statisticsWaitStart(m_stats) : 0;
+
+    if (m_backend == ProcessMutex::SharedMemoryBackend) {
+        if (value < 0) {
+            for (size_t i = 0; i < count; ++i) {
+                if (!sharedLockAcquire(m_shared ? &m_shared[first + i] : 0, 0,
+                                       count == 1 ? m_stats : 0)) {
+                    int error = errno;
+                    while (i-- > 0) {
+                        sharedLockRelease(&m_shared[first + i]);
+                    }
+                    errno = error;
+                    return false;
+                }
+            }
+        } else {
+            for (size_t i = count; i-- > 0; ) {
+                if (!sharedLockRelease(m_shared ? &m_shared[first + i] : 0))
+                    return false;
+            }
+        }
+        statisticsTimed(m_stats, start);
+        return true;
+    }
+
+    struct sembuf ops[maxStripes];
+    for (size_t i = 0; i < count; ++i) {
+        ops[i].sem_num = first + i;
+        ops[i].sem_op = value;
+        ops[i].sem_flg = SEM_UNDO;
+    }
+    if (!semaphoreOperate(m_id, ops, count, true, 0)) {
+        semaphoreError(value < 0 ? "Unable to lock stripe" : "Unable to unlock stripe", m_identifier, errno);
+        return false;
+    }
+    statisticsTimed(m_stats, start);
+    return true;
+}
+
+int SailfishKeyProvider_lock_stats(
+                    const char * kind,
+                    const char * path,
+                    SailfishKeyProvider_LockStats * stats)
+{
+    if (!kind || !path || !stats)
+        return -1;
+
+    int rv = -1;
+    pthread_mutex_lock(&statisticsMutex);
+    for (LockStatistics *entry = statistics; entry; entry = entry->next) {
+        if (strcmp(entry->kind, kind) == 0 && strcmp(entry->path, path) == 0) {
+            stats->acquisitions = __atomic_load_n(&entry->acquisitions, __ATOMIC_RELAXED);
+            stats->contended = __atomic_load_n(&entry->contended, __ATOMIC_RELAXED);
+            stats->totalWaitNs = __atomic_load_n(&entry->totalWaitNs, __ATOMIC_RELAXED);
+            stats->maxWaitNs = __atomic_load_n(&entry->maxWaitNs, __ATOMIC_RELAXED);
+            for (int i = 0; i < SAILFISHKEYPROVIDER_LOCK_WAIT_BUCKETS; ++i) {
+                stats->waitHistogram[i] = __atomic_load_n(&entry->waitHistogram[i], __ATOMIC_RELAXED);
+            }
+            rv = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&statisticsMutex);
+    return rv;
+}
+
+void SailfishKeyProvider_lock_stats_dump(
+                    FILE * stream)
+{
+    pthread_mutex_lock(&statisticsMutex);
+    for (LockStatistics *entry = statistics; entry; entry = entry->next) {
+        SailfishKeyProvider_LockStats stats;
+        stats.acquisitions = __atomic_load_n(&entry->acquisitions, __ATOMIC_RELAXED);
+        stats.contended = __atomic_load_n(&entry->contended, __ATOMIC_RELAXED);
+        stats.totalWaitNs = __atomic_load_n(&entry->totalWaitNs, __ATOMIC_RELAXED);
+        stats.maxWaitNs = __atomic_load_n(&entry->maxWaitNs, __ATOMIC_RELAXED);
+
+        fprintf(stream, "%s %s: acquisitions %llu, contended %llu, wait total %llu us, max %llu us",
+                entry->kind, entry->path,
+                static_cast<unsigned long long>(stats.acquisitions),
+                static_cast<unsigned long long>(stats.contended),
+                static_cast<unsigned long long>(stats.totalWaitNs / 1000),
+                static_cast<unsigned long long>(stats.maxWaitNs / 1000));
+        for (int i = 0; i < SAILFISHKEYPROVIDER_LOCK_WAIT_BUCKETS; ++i) {
+            uint64_t count = __atomic_load_n(&entry->waitHistogram[i], __ATOMIC_RELAXED);
+            if (count) {
+                fprintf(stream, ", %llu us+ %llu",
+                        (i == 0 ? 0ULL : 1ULL << i), static_cast<unsigned long long>(count));
+            }
+        }
+        fputc('\n', stream);
+    }
+    pthread_mutex_unlock(&statisticsMutex);
+}
+
+void SailfishKeyProvider_lock_stats_reset(void)
+{
+    pthread_mutex_lock(&statisticsMutex);
+    for (LockStatistics *entry = statistics; entry; entry = entry->next) {
+        __atomic_store_n(&entry->acquisitions, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&entry->contended, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&entry->totalWaitNs, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&entry->maxWaitNs, 0, __ATOMIC_RELAXED);
+        for (int i = 0; i < SAILFISHKEYPROVIDER_LOCK_WAIT_BUCKETS; ++i) {
+            __atomic_store_n(&entry->waitHistogram[i], 0, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&statisticsMutex);
+}
+
+void SailfishKeyProvider_lock_stats_set_enabled(
+                    int enabled)
+{
+    __atomic_store_n(&statisticsEnabled, enabled ? 1 : 0, __ATOMIC_RELAXED);
+}
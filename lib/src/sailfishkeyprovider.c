@@ -23,24 +23,34 @@
 ****************************************************************************/
 
 #include "sailfishkeyprovider.h"
+#include "sailfishkeyprovider_context.h"
 #include "sailfishkeyprovider_iniparser.h"
+#include "sailfishkeyprovider_schemes.h"
 
 #include "base64ed.h"
+#include "context.h"
+#include "iniparser.h"
+#include "keycache.h"
+#include "keystorelock.h"
 #include "xored.h"
 
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <dirent.h>
-#include <limits.h>
+#include <unistd.h>
 
-#define STOREDKEYS_WRITABLE_DIRECTORY "%s/.local/share/system/privileged/Keys"
 #define STOREDKEYS_WRITABLE_INIFILE "%s/.local/share/system/privileged/Keys/storedkeys.ini"
+#define STOREDKEYS_WRITABLE_SHARDFILE "%s/.local/share/system/privileged/Keys/%s.ini"
+#define STOREDKEYS_MIGRATED_SUFFIX ".migrated"
 #define STOREDKEYS_STATIC_CONFIG_DIR "/usr/share/libsailfishkeyprovider/storedkeys.d/"
 #define STOREDKEYS_STATIC_INIFILE "/usr/share/libsailfishkeyprovider/storedkeys.ini"
 #define STOREDKEYS_ENCODINGSECTION "encoding"
 #define STOREDKEYS_ENCODEDKEYSSECTION "encodedkeys"
+#define STOREDKEYS_REMOVEDKEYSSECTION "removedkeys"
+#define STOREDKEYS_REMOVEDKEYS_TOMBSTONE "1"
 #define STOREDKEYS_ENCODINGSECTION_SCHEME "scheme"
 #define STOREDKEYS_ENCODINGSECTION_KEY "key"
 
@@ -63,52 +73,307 @@ char * build_ini_entry_key(const char *first, const char *second)
     return retn;
 }
 
-/* Try decode scheme from file*/
-void try_read_decoding_scheme(const char *path, const char *psSchemeKey, const char *pSchemeKey, char** scheme)
+/* Reads a value from the static fragments, trying the fallback key
+   if the primary key is not defined by any fragment */
+static char * read_static_fragments(const char *section, const char *key, const char *fallbackKey)
 {
-    *scheme = SailfishKeyProvider_ini_read(
-                path,
-                STOREDKEYS_ENCODINGSECTION,
-                psSchemeKey);
-    if (*scheme == NULL) {
-        /* try the fallback key. */
-        *scheme = SailfishKeyProvider_ini_read(
-                    path,
-                    STOREDKEYS_ENCODINGSECTION,
-                    pSchemeKey);
+    char *value = SailfishKeyProvider_keycache_read(
+                STOREDKEYS_STATIC_CONFIG_DIR,
+                section,
+                key);
+    if (value == NULL) {
+        value = SailfishKeyProvider_keycache_read(
+                    STOREDKEYS_STATIC_CONFIG_DIR,
+                    section,
+                    fallbackKey);
     }
+    return value;
 }
 
-/* Try decode key form file*/
-void try_read_decoding_key(const char *path, const char *psKeyKey, const char *pKeyKey, char** key)
+/*
+    As read_static_fragments(), for the name of an encoding scheme, which
+    is also returned already resolved through \a scheme.
+*/
+static char * read_static_fragments_scheme(
+                    const char *key,
+                    const char *fallbackKey,
+                    const SailfishKeyProvider_Scheme **scheme)
 {
-    *key = SailfishKeyProvider_ini_read(
-                path,
+    char *value = SailfishKeyProvider_keycache_read_scheme(
+                STOREDKEYS_STATIC_CONFIG_DIR,
                 STOREDKEYS_ENCODINGSECTION,
-                psKeyKey);
-    if (*key == NULL) {
-        /* try the fallback key. */
-        *key = SailfishKeyProvider_ini_read(
-                    path,
+                key,
+                scheme);
+    if (value == NULL) {
+        value = SailfishKeyProvider_keycache_read_scheme(
+                    STOREDKEYS_STATIC_CONFIG_DIR,
                     STOREDKEYS_ENCODINGSECTION,
-                    pKeyKey);
+                    fallbackKey,
+                    scheme);
     }
+    return value;
 }
 
-/* Try read key form file*/
-void try_read_encoded_key(const char *path, const char *psKeyName, const char *pKeyName, char** key)
+#ifdef SAILFISHKEYPROVIDER_SHARDED_KEYSTORE
+/*
+    Escapes a provider name for use as a shard file name.  Bytes other
+    than [A-Za-z0-9_-] are percent-encoded, as is the first byte of a
+    name which would collide with the legacy "storedkeys" file.
+*/
+static int escape_shard_name(char *name, size_t size, const char *providerName)
 {
-    *key = SailfishKeyProvider_ini_read(
-                path,
-                STOREDKEYS_ENCODEDKEYSSECTION,
-                psKeyName);
-    if (*key == NULL) {
-        /* try the fallback key. */
-        *key = SailfishKeyProvider_ini_read(
-                    path,
-                    STOREDKEYS_ENCODEDKEYSSECTION,
-                    pKeyName);
+    static const char hex[] = "0123456789ABCDEF";
+    size_t i = 0, o = 0;
+    int collides = (strcmp(providerName, "storedkeys") == 0);
+
+    for (i = 0; providerName[i] != '\0'; ++i) {
+        unsigned char c = (unsigned char)providerName[i];
+        int plain = ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+                  || (c >= '0' && c <= '9') || c == '_' || c == '-');
+        if (plain && !(collides && i == 0)) {
+            if (o + 1 >= size) {
+                return -1;
+            }
+            name[o++] = (char)c;
+        } else {
+            if (o + 3 >= size) {
+                return -1;
+            }
+            name[o++] = '%';
+            name[o++] = hex[c >> 4];
+            name[o++] = hex[c & 0xF];
+        }
+    }
+    name[o] = '\0';
+    return (o > 0) ? 0 : -1;
+}
+
+struct legacy_entry {
+    char *section;
+    char *key;
+    char *value;
+    int done;
+};
+
+struct legacy_store {
+    struct legacy_entry *entries;
+    size_t count;
+    size_t allocated;
+    int failed;
+};
+
+static int collect_legacy_entry(void *userData, const char *section, const char *key, const char *value)
+{
+    struct legacy_store *store = (struct legacy_store *)userData;
+    struct legacy_entry *entry = NULL;
+    if (section == NULL) {
+        return 0;
+    }
+    if (store->count == store->allocated) {
+        size_t allocated = store->allocated ? 2 * store->allocated : 16;
+        struct legacy_entry *entries = (struct legacy_entry *)realloc(
+                store->entries, allocated * sizeof(struct legacy_entry));
+        if (entries == NULL) {
+            store->failed = 1;
+            return 1;
+        }
+        store->entries = entries;
+        store->allocated = allocated;
+    }
+    entry = &store->entries[store->count];
+    entry->section = strdup(section);
+    entry->key = strdup(key);
+    entry->value = strdup(value);
+    entry->done = 0;
+    store->count++;
+    if (entry->section == NULL || entry->key == NULL || entry->value == NULL) {
+        store->failed = 1;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+    Moves every key of the legacy single-file store into the shard of
+    its provider, and then renames the legacy file out of the way.
+    Keys which already exist in a shard are newer, and are kept.
+*/
+static int migrate_legacy_store(const char *home, const char *directory, const char *legacyFile)
+{
+    struct legacy_store store = { NULL, 0, 0, 0 };
+    SailfishKeyProvider_ini_update *updates = NULL;
+    char migratedFile[1024];
+    size_t i = 0, j = 0;
+    int retn = 0;
+
+    if (SailfishKeyProvider_ini_foreach(legacyFile, collect_legacy_entry, &store) != 0
+            || store.failed) {
+        retn = -1;
+    } else if (store.count > 0) {
+        updates = (SailfishKeyProvider_ini_update *)malloc(
+                store.count * sizeof(SailfishKeyProvider_ini_update));
+        if (updates == NULL) {
+            retn = -1;
+        }
+    }
+
+    for (i = 0; retn == 0 && i < store.count; ++i) {
+        char shardName[256];
+        char shardFile[1024];
+        char *providerName = NULL;
+        const char *separator = strchr(store.entries[i].key, '/');
+        size_t providerLength = 0;
+        int shardExists = 0;
+        int count = 0;
+
+        if (store.entries[i].done) {
+            continue;
+        }
+        if (separator == NULL) {
+            /* not a provider key; it could never have been looked up */
+            store.entries[i].done = 1;
+            continue;
+        }
+
+        providerLength = separator - store.entries[i].key;
+        providerName = strndup(store.entries[i].key, providerLength);
+        if (providerName == NULL) {
+            retn = -1;
+            break;
+        }
+        if (escape_shard_name(shardName, sizeof(shardName), providerName) != 0) {
+            /* a provider which has no shard can no longer be used, so
+               its keys are left behind in the migrated legacy file */
+            free(providerName);
+            store.entries[i].done = 1;
+            continue;
+        }
+        free(providerName);
+        snprintf(shardFile, sizeof(shardFile),
+                 STOREDKEYS_WRITABLE_SHARDFILE,
+                 home, shardName);
+        shardExists = (access(shardFile, F_OK) == 0);
+
+        for (j = i; j < store.count; ++j) {
+            struct legacy_entry *entry = &store.entries[j];
+            if (entry->done
+                    || strncmp(entry->key, store.entries[i].key, providerLength + 1) != 0) {
+                continue;
+            }
+            entry->done = 1;
+            if (shardExists) {
+                char *existing = SailfishKeyProvider_ini_read(shardFile, entry->section, entry->key);
+                if (existing != NULL) {
+                    free(existing);
+                    continue;
+                }
+            }
+            updates[count].section = entry->section;
+            updates[count].key = entry->key;
+            updates[count].value = entry->value;
+            count++;
+        }
+
+        if (count > 0 && SailfishKeyProvider_ini_write_updates(
+                    directory, shardFile, updates, count) != 0) {
+            retn = -1;
+        }
+    }
+
+    if (retn == 0) {
+        snprintf(migratedFile, sizeof(migratedFile), "%s%s",
+                 legacyFile, STOREDKEYS_MIGRATED_SUFFIX);
+        if (rename(legacyFile, migratedFile) != 0 && access(legacyFile, F_OK) == 0) {
+            retn = -1;
+        }
+    }
+
+    if (retn != 0) {
+        fprintf(stderr,
+                "%s\n",
+                "SailfishKeyProvider: unable to migrate legacy key store");
+    }
+
+    for (i = 0; i < store.count; ++i) {
+        free(store.entries[i].section);
+        free(store.entries[i].key);
+        free(store.entries[i].value);
     }
+    free(store.entries);
+    free(updates);
+    return retn;
+}
+#endif /* SAILFISHKEYPROVIDER_SHARDED_KEYSTORE */
+
+/*
+    Resolves the writable ini file which holds the keys of the given
+    \a providerName.  With the sharded layout every provider has its
+    own file, and the legacy single file is migrated on first use.
+*/
+static void build_writable_ini_path(char *path, size_t size,
+                                    SailfishKeyProvider_Context *context,
+                                    const char *providerName)
+{
+    const char *home = SailfishKeyProvider_context_home(context);
+#ifdef SAILFISHKEYPROVIDER_SHARDED_KEYSTORE
+    const char *writableDirectory = SailfishKeyProvider_context_writable_directory(context);
+    char shardName[256];
+    struct stat st;
+    int migrated = 0;
+
+    snprintf(path, size, STOREDKEYS_WRITABLE_INIFILE, home);
+    if (stat(path, &st) == 0) {
+        /* migration writes to every shard, so it excludes all writers,
+           and another process may have completed it in the meantime */
+        if (SailfishKeyProvider_keystore_lock(writableDirectory, NULL) == 0) {
+            migrated = (stat(path, &st) != 0
+                        || migrate_legacy_store(home, writableDirectory, path) == 0);
+            SailfishKeyProvider_keystore_unlock(writableDirectory, NULL);
+        }
+        if (!migrated) {
+            /* keep using the legacy file until it can be migrated */
+            return;
+        }
+    }
+
+    /* the name was checked by valid_provider_name() */
+    escape_shard_name(shardName, sizeof(shardName), providerName);
+    snprintf(path, size, STOREDKEYS_WRITABLE_SHARDFILE, home, shardName);
+#else
+    (void)providerName;
+    snprintf(path, size, STOREDKEYS_WRITABLE_INIFILE, home);
+#endif
+}
+
+/*
+    Whether keys of the given \a providerName can be stored.  With the
+    sharded layout the name must escape to a usable file name, which
+    rules out the empty name and those longer than a file name allows.
+*/
+static int valid_provider_name(const char *providerName)
+{
+#ifdef SAILFISHKEYPROVIDER_SHARDED_KEYSTORE
+    char shardName[256];
+    return escape_shard_name(shardName, sizeof(shardName), providerName) == 0;
+#else
+    (void)providerName;
+    return 1;
+#endif
+}
+
+/*
+    Returns the name of the key store lock stripe which guards the
+    writable ini file of \a providerName.
+*/
+static const char * keystore_stripe(const char *providerName)
+{
+#ifdef SAILFISHKEYPROVIDER_SHARDED_KEYSTORE
+    return providerName;
+#else
+    /* every provider shares the one file */
+    (void)providerName;
+    return "storedkeys";
+#endif
 }
 
 /*
@@ -118,7 +383,10 @@ void try_read_encoded_key(const char *path, const char *psKeyName, const char *p
  * pointer and must free() it.
  *
  * Each argument must be a valid, null-terminated, Latin-1 or ASCII
- * C-string.  Currently, only "xor" is supported as an encoding scheme.
+ * C-string.  The built in encoding schemes are "xor" and
+ * "xor-base64url", which differ only in the base64 alphabet used, and
+ * "chacha20", which encrypts the value under a random nonce; others
+ * may be added with SailfishKeyProvider_scheme_register().
  */
 int SailfishKeyProvider_encodeKey(
                     const char * keyValue,
@@ -126,6 +394,8 @@ int SailfishKeyProvider_encodeKey(
                     const char * encodingKey,
                     char ** encodedKey)
 {
+    const SailfishKeyProvider_Scheme *scheme = NULL;
+
     if (encodedKey != NULL) {
         *encodedKey = NULL;
     }
@@ -138,8 +408,7 @@ int SailfishKeyProvider_encodeKey(
                 "%s\n",
                 "SailfishKeyProvider_encodeKey(): invalid arguments");
         return -1;
-    } else if ((strncmp(encodingScheme, "xor", 3) != 0)
-            || (strlen(encodingScheme) != 3)) {
+    } else if ((scheme = SailfishKeyProvider_scheme_find(encodingScheme)) == NULL) {
         fprintf(stderr,
                 "%s\n",
                 "SailfishKeyProvider_encodeKey(): invalid encoding scheme");
@@ -151,34 +420,42 @@ int SailfishKeyProvider_encodeKey(
                 "%s\n",
                 "SailfishKeyProvider_encodeKey(): empty arguments");
         return -1;
-    } else {
-        /* XOR encoded is actually xor encoded then base64 encoded
-           so that the returned string is a valid 7-bit ASCII c-string */
-        size_t plain_text_size = strlen(keyValue);
-        char *xor_encoded_value = SailfishKeyProvider_xor_encode(
-            keyValue,
-            plain_text_size,
-            encodingKey,
-            strlen(encodingKey));
-
-        char *b64_xor_encoded_value = 0;
-        size_t base64_encoded_size = SailfishKeyProvider_base64_encode(
-                xor_encoded_value,
-                plain_text_size,
-                &b64_xor_encoded_value);
-
-        free(xor_encoded_value);
-
-        if (base64_encoded_size > 0) {
-            *encodedKey = b64_xor_encoded_value;
-            return 0; // Success.
-        }
+    } else if (scheme->encode(scheme, keyValue, encodingKey, encodedKey) == 0) {
+        return 0; // Success.
+    }
 
+    *encodedKey = NULL;
+    fprintf(stderr,
+            "SailfishKeyProvider_encodeKey(): %s encoding failed\n",
+            scheme->name);
+    return -1;
+}
+
+/*
+ * Decodes \a encodedKeyValue with an already resolved \a scheme.
+ * \see SailfishKeyProvider_decodeKey()
+ */
+static int decode_key_with_scheme(
+                    const SailfishKeyProvider_Scheme * scheme,
+                    const char * encodedKeyValue,
+                    const char * decodingKey,
+                    char ** decodedKey)
+{
+    if (strlen(encodedKeyValue) == 0
+            || strlen(decodingKey) == 0) {
         fprintf(stderr,
                 "%s\n",
-                "SailfishKeyProvider_encodeKey(): base64 encoding failed");
+                "SailfishKeyProvider_decodeKey(): empty arguments");
         return -1;
+    } else if (scheme->decode(scheme, encodedKeyValue, decodingKey, decodedKey) == 0) {
+        return 0; // Success.
     }
+
+    *decodedKey = NULL;
+    fprintf(stderr,
+            "SailfishKeyProvider_decodeKey(): %s decoding failed\n",
+            scheme->name);
+    return -1;
 }
 
 /*
@@ -188,7 +465,8 @@ int SailfishKeyProvider_encodeKey(
  * must free() it.
  *
  * Each argument must be a valid, null-terminated, Latin-1 or ASCII
- * C-string.  Currently, only "xor" is supported as an encoding scheme.
+ * C-string.  \see SailfishKeyProvider_encodeKey() for the valid
+ * decoding schemes.
  */
 int SailfishKeyProvider_decodeKey(
                     const char * encodedKeyValue,
@@ -196,6 +474,8 @@ int SailfishKeyProvider_decodeKey(
                     const char * decodingKey,
                     char ** decodedKey)
 {
+    const SailfishKeyProvider_Scheme *scheme = NULL;
+
     if (decodedKey != NULL) {
         *decodedKey = NULL;
     }
@@ -208,48 +488,74 @@ int SailfishKeyProvider_decodeKey(
                 "%s\n",
                 "SailfishKeyProvider_decodeKey(): invalid arguments");
         return -1;
-    } else if ((strncmp(decodingScheme, "xor", 3) != 0)
-            || (strlen(decodingScheme) != 3)) {
+    } else if ((scheme = SailfishKeyProvider_scheme_find(decodingScheme)) == NULL) {
         fprintf(stderr,
                 "%s\n",
                 "SailfishKeyProvider_decodeKey(): invalid decoding scheme");
         return -1;
-    } else if (strlen(encodedKeyValue) == 0
-            || strlen(decodingScheme) == 0
-            || strlen(decodingKey) == 0) {
+    }
+
+    return decode_key_with_scheme(scheme, encodedKeyValue, decodingKey, decodedKey);
+}
+
+/*
+ * Decodes the \a count \a encodedKeyValues, which share a
+ * \a decodingScheme and \a decodingKey, in one go.  The decoded keys
+ * are returned in a single buffer, \a decodedKeys, with the i'th
+ * null-terminated key starting at \a decodedKeys + \a offsets[i].
+ * \a offsets must have room for \a count + 1 entries; the last is the
+ * size of the buffer.  Returns 0 on success or -1 if any argument is
+ * invalid or if any key fails to decode, in which case no keys are
+ * returned.  The caller owns the \a decodedKeys buffer and must free()
+ * it.
+ *
+ * This is much cheaper than calling SailfishKeyProvider_decodeKey()
+ * for each of many short keys.
+ */
+int SailfishKeyProvider_decodeKeys(
+                    const char * const * encodedKeyValues,
+                    size_t count,
+                    const char * decodingScheme,
+                    const char * decodingKey,
+                    char ** decodedKeys,
+                    size_t * offsets)
+{
+    const SailfishKeyProvider_Scheme *scheme = NULL;
+
+    if (decodedKeys != NULL) {
+        *decodedKeys = NULL;
+    }
+
+    if (encodedKeyValues == NULL
+            || decodingScheme == NULL
+            || decodingKey == NULL
+            || decodedKeys == NULL
+            || offsets == NULL) {
         fprintf(stderr,
                 "%s\n",
-                "SailfishKeyProvider_decodeKey(): empty arguments");
+                "SailfishKeyProvider_decodeKeys(): invalid arguments");
         return -1;
-    } else {
-        /* XOR encoded is actually xor encoded then base64 encoded
-           so that the returned string was a valid 7-bit ASCII c-string;
-           thus to decode it, we first decode from base64 then decode XOR */
-        size_t b64_encoded_value_size = strlen(encodedKeyValue);
-        char *xor_encoded_value = 0;
-        size_t xor_encoded_size = SailfishKeyProvider_base64_decode(
-            encodedKeyValue,
-            b64_encoded_value_size,
-            &xor_encoded_value);
-
-        if (xor_encoded_size > 0) {
-            char *plain_text_value = SailfishKeyProvider_xor_decode(
-                    xor_encoded_value,
-                    xor_encoded_size,
-                    decodingKey,
-                    strlen(decodingKey));
-
-            free(xor_encoded_value);
-            *decodedKey = plain_text_value;
-            return 0; // Success.
-        }
-
-        free(xor_encoded_value);
+    } else if ((scheme = SailfishKeyProvider_scheme_find(decodingScheme)) == NULL) {
+        fprintf(stderr,
+                "%s\n",
+                "SailfishKeyProvider_decodeKeys(): invalid decoding scheme");
+        return -1;
+    } else if (strlen(decodingKey) == 0) {
         fprintf(stderr,
                 "%s\n",
-                "SailfishKeyProvider_decodeKey(): base64 decoding failed");
+                "SailfishKeyProvider_decodeKeys(): empty arguments");
+        return -1;
+    }
+
+    if (SailfishKeyProvider_scheme_decode_arena(
+                scheme, encodedKeyValues, count, decodingKey,
+                decodedKeys, offsets) != 0) {
+        fprintf(stderr,
+                "SailfishKeyProvider_decodeKeys(): %s decoding failed\n",
+                scheme->name);
         return -1;
     }
+    return 0;
 }
 
 /*
@@ -259,7 +565,7 @@ int SailfishKeyProvider_decodeKey(
  * specified in the key storage ini file.
  *
  * Currently:
- *    - "xor" is the only valid decoding scheme
+ *    - "xor", "xor-base64url" and "chacha20" are the built in decoding schemes
  *    - valid values for the \a keyName parameter depend on the provider
  *        - Twitter uses "consumer_key","consumer_secret"
  *        - Facebook uses "client_id"
@@ -268,7 +574,8 @@ int SailfishKeyProvider_decodeKey(
  * Returns 0 if the key was retrieved successfully.
  * Returns -1 if the operation could not be completed due to invalid
  * arguments, or if an error occurs.
- * Returns 1 if no key with the given name exists.
+ * Returns 1 if no key with the given name exists, or if it has been
+ * removed with SailfishKeyProvider_removeKey().
  *
  * The caller owns the returned pointer and must free() it after use.
  *
@@ -284,7 +591,8 @@ int SailfishKeyProvider_decodeKey(
  *   free(buf); // caller owns the returned buffer and must free().
  *
  */
-int SailfishKeyProvider_storedKey(
+int SailfishKeyProvider_context_storedKey(
+                    SailfishKeyProvider_Context * context,
                     const char * providerName,
                     const char * serviceName,
                     const char * keyName,
@@ -292,6 +600,10 @@ int SailfishKeyProvider_storedKey(
 {
     char writableIniFile[1024];
 
+    /* the parsed writable and static ini files */
+    SailfishKeyProvider_IniSnapshot *writableIni = NULL;
+    SailfishKeyProvider_IniSnapshot *staticIni = NULL;
+
     /* "provider/service", "provider/service/scheme", "provider/service/key" */
     char *psKey = NULL;
     char *psSchemeKey = NULL;
@@ -308,10 +620,14 @@ int SailfishKeyProvider_storedKey(
     char *pKeyName;
 
     /* outputs read from the ini file */
+    char *tombstone = NULL;
     char *decodingScheme = NULL;
     char *decodingKey = NULL;
     char *encodedKeyValue = NULL;
 
+    /* the decoding scheme, if it was resolved along with its name */
+    const SailfishKeyProvider_Scheme *scheme = NULL;
+
     /* whether the key came from the writable or static ini file */
     int whichIni = 0; /* 0 = writable, 1 = static */
 
@@ -323,7 +639,8 @@ int SailfishKeyProvider_storedKey(
     }
 
     /* check parameters */
-    if (providerName == NULL
+    if (context == NULL
+            || providerName == NULL
             || serviceName == NULL
             || keyName == NULL
             || storedKey == NULL) {
@@ -332,6 +649,13 @@ int SailfishKeyProvider_storedKey(
                 "SailfishKeyProvider_storedKey(): error: null argument");
         return -1;
     }
+    if (!valid_provider_name(providerName)) {
+        fprintf(stderr,
+                "%s\n",
+                "SailfishKeyProvider_storedKey(): error: invalid provider name");
+        return -1;
+    }
+    SailfishKeyProvider_context_count(context, SAILFISHKEYPROVIDER_CONTEXT_LOOKUPS);
 
     /* build ini entry keys */
     psKey = build_ini_entry_key(providerName, serviceName);
@@ -342,84 +666,101 @@ int SailfishKeyProvider_storedKey(
     psKeyName = build_ini_entry_key(psKey, keyName);
     pKeyName = build_ini_entry_key(providerName, keyName);
 
-    snprintf(writableIniFile, sizeof(writableIniFile),
-             STOREDKEYS_WRITABLE_INIFILE,
-             getenv("HOME"));
+    build_writable_ini_path(writableIniFile, sizeof(writableIniFile),
+                            context, providerName);
+    writableIni = SailfishKeyProvider_context_acquire_ini(context, writableIniFile);
+
+    /* a key removed from the writable ini file hides every other layer */
+    tombstone = SailfishKeyProvider_ini_snapshot_read(
+                                        writableIni,
+                                        STOREDKEYS_REMOVEDKEYSSECTION,
+                                        psKeyName);
+    if (tombstone != NULL) {
+        SailfishKeyProvider_context_release_ini(context, writableIni);
+        free(tombstone);
+        free(psKey);
+        free(psSchemeKey);
+        free(psKeyKey);
+        free(pSchemeKey);
+        free(pKeyKey);
+        free(psKeyName);
+        free(pKeyName);
+        return 1;
+    }
 
     /* read the decoding scheme and the decoding key from .ini file */
-    decodingScheme = SailfishKeyProvider_ini_read(
-                                        writableIniFile,
+    decodingScheme = SailfishKeyProvider_ini_snapshot_read(
+                                        writableIni,
                                         STOREDKEYS_ENCODINGSECTION,
                                         psSchemeKey);
     if (decodingScheme == NULL) {
         /* try the fallback key. */
-        decodingScheme = SailfishKeyProvider_ini_read(
-                                        writableIniFile,
+        decodingScheme = SailfishKeyProvider_ini_snapshot_read(
+                                        writableIni,
                                         STOREDKEYS_ENCODINGSECTION,
                                         pSchemeKey);
     }
 
-    decodingKey = SailfishKeyProvider_ini_read(
-                                        writableIniFile,
+    decodingKey = SailfishKeyProvider_ini_snapshot_read(
+                                        writableIni,
                                         STOREDKEYS_ENCODINGSECTION,
                                         psKeyKey);
     if (decodingKey == NULL) {
         /* try the fallback key. */
-        decodingKey = SailfishKeyProvider_ini_read(
-                                        writableIniFile,
+        decodingKey = SailfishKeyProvider_ini_snapshot_read(
+                                        writableIni,
                                         STOREDKEYS_ENCODINGSECTION,
                                         pKeyKey);
     }
 
     if (decodingScheme == NULL || decodingKey == NULL) {
-        DIR *dir;
-        struct dirent *ent;
-        if ((dir = opendir (STOREDKEYS_STATIC_CONFIG_DIR)) != NULL) {
-            /* print all the files and directories within directory */
-            while ((ent = readdir (dir)) != NULL) {
-                char path[PATH_MAX] = "";
-                strcat(path, STOREDKEYS_STATIC_CONFIG_DIR);
-                strcat(path, ent->d_name);
-
-                try_read_decoding_scheme(path, psSchemeKey, pSchemeKey, &decodingScheme);
-                try_read_decoding_key(path, psKeyKey, pKeyKey, &decodingKey);
-
-                if (decodingScheme || decodingKey) {
-                    break;
-                }
-            }
-            closedir (dir);
-        }
+        /* try the static fragments, via the cached view of the directory */
+        free(decodingScheme);
+        free(decodingKey);
+        decodingScheme = read_static_fragments_scheme(
+                                        psSchemeKey,
+                                        pSchemeKey,
+                                        &scheme);
+        decodingKey = read_static_fragments(
+                                        STOREDKEYS_ENCODINGSECTION,
+                                        psKeyKey,
+                                        pKeyKey);
     }
 
     if (decodingScheme == NULL || decodingKey == NULL) {
         /* even the fallback keys were empty.  Try reading from the static .ini file */
-        decodingScheme = SailfishKeyProvider_ini_read(
-                                            STOREDKEYS_STATIC_INIFILE,
+        free(decodingScheme);
+        free(decodingKey);
+        scheme = NULL;
+        staticIni = SailfishKeyProvider_context_acquire_ini(context, STOREDKEYS_STATIC_INIFILE);
+        decodingScheme = SailfishKeyProvider_ini_snapshot_read(
+                                            staticIni,
                                             STOREDKEYS_ENCODINGSECTION,
                                             psSchemeKey);
         if (decodingScheme == NULL) {
             /* try the fallback key. */
-            decodingScheme = SailfishKeyProvider_ini_read(
-                                            STOREDKEYS_STATIC_INIFILE,
+            decodingScheme = SailfishKeyProvider_ini_snapshot_read(
+                                            staticIni,
                                             STOREDKEYS_ENCODINGSECTION,
                                             pSchemeKey);
         }
 
-        decodingKey = SailfishKeyProvider_ini_read(
-                                            STOREDKEYS_STATIC_INIFILE,
+        decodingKey = SailfishKeyProvider_ini_snapshot_read(
+                                            staticIni,
                                             STOREDKEYS_ENCODINGSECTION,
                                             psKeyKey);
         if (decodingKey == NULL) {
             /* try the fallback key. */
-            decodingKey = SailfishKeyProvider_ini_read(
-                                            STOREDKEYS_STATIC_INIFILE,
+            decodingKey = SailfishKeyProvider_ini_snapshot_read(
+                                            staticIni,
                                             STOREDKEYS_ENCODINGSECTION,
                                             pKeyKey);
         }
 
         if (decodingScheme == NULL || decodingKey == NULL) {
             /* Not found in static ini file either.  Error. */
+            SailfishKeyProvider_context_release_ini(context, writableIni);
+            SailfishKeyProvider_context_release_ini(context, staticIni);
             free(psKey);
             free(psSchemeKey);
             free(psKeyKey);
@@ -445,36 +786,25 @@ int SailfishKeyProvider_storedKey(
     free(pKeyKey);
 
     /* now read the encoded key value for the given keyName from the ini */
-    encodedKeyValue = SailfishKeyProvider_ini_read(
-                                        whichIni ? STOREDKEYS_STATIC_INIFILE : writableIniFile,
+    encodedKeyValue = SailfishKeyProvider_ini_snapshot_read(
+                                        whichIni ? staticIni : writableIni,
                                         STOREDKEYS_ENCODEDKEYSSECTION,
                                         psKeyName);
     if (encodedKeyValue == NULL) {
         /* try the fallback key. */
-        encodedKeyValue = SailfishKeyProvider_ini_read(
-                                        whichIni ? STOREDKEYS_STATIC_INIFILE : writableIniFile,
+        encodedKeyValue = SailfishKeyProvider_ini_snapshot_read(
+                                        whichIni ? staticIni : writableIni,
                                         STOREDKEYS_ENCODEDKEYSSECTION,
                                         pKeyName);
     }
+    SailfishKeyProvider_context_release_ini(context, writableIni);
+    SailfishKeyProvider_context_release_ini(context, staticIni);
 
     if (encodedKeyValue == NULL) {
-        DIR *dir;
-        struct dirent *ent;
-        if ((dir = opendir (STOREDKEYS_STATIC_CONFIG_DIR)) != NULL) {
-            /* print all the files and directories within directory */
-            while ((ent = readdir (dir)) != NULL) {
-                char path[PATH_MAX] = "";
-                strcat(path, STOREDKEYS_STATIC_CONFIG_DIR);
-                strcat(path, ent->d_name);
-
-                try_read_encoded_key(path, psKeyName, pKeyName, &encodedKeyValue);
-
-                if (encodedKeyValue) {
-                    break;
-                }
-            }
-            closedir (dir);
-        }
+        encodedKeyValue = read_static_fragments(
+                                        STOREDKEYS_ENCODEDKEYSSECTION,
+                                        psKeyName,
+                                        pKeyName);
     }
 
     if (encodedKeyValue == NULL) {
@@ -496,10 +826,19 @@ int SailfishKeyProvider_storedKey(
                 "error: empty key value");
     } else {
         /* attempt to decode it with the given scheme/key */
-        retn = SailfishKeyProvider_decodeKey(encodedKeyValue,
-                                             decodingScheme,
-                                             decodingKey,
-                                             storedKey);
+        if (scheme == NULL) {
+            scheme = SailfishKeyProvider_scheme_find(decodingScheme);
+        }
+        if (scheme == NULL) {
+            fprintf(stderr,
+                    "SailfishKeyProvider_storedKey(): %s\n",
+                    "error: invalid decoding scheme");
+        } else {
+            retn = decode_key_with_scheme(scheme,
+                                          encodedKeyValue,
+                                          decodingKey,
+                                          storedKey);
+        }
     }
 
     free(psKeyName);
@@ -510,6 +849,25 @@ int SailfishKeyProvider_storedKey(
     return retn;
 }
 
+/*
+ * Returns the stored key with the given \a keyName for the given
+ * \a providerName and \a serviceName, from the key store of $HOME.
+ * \see SailfishKeyProvider_context_storedKey()
+ */
+int SailfishKeyProvider_storedKey(
+                    const char * providerName,
+                    const char * serviceName,
+                    const char * keyName,
+                    char ** storedKey)
+{
+    return SailfishKeyProvider_context_storedKey(
+                SailfishKeyProvider_context_default(),
+                providerName,
+                serviceName,
+                keyName,
+                storedKey);
+}
+
 /*
     Stores the given \a encodedValue to the key storage ini file
     for the given \a providerName, \a serviceName, \a encodedKeyName
@@ -518,7 +876,8 @@ int SailfishKeyProvider_storedKey(
 
     Returns zero on success, -1 on failure.
 */
-int SailfishKeyProvider_storeKey(
+int SailfishKeyProvider_context_storeKey(
+                    SailfishKeyProvider_Context * context,
                     const char * providerName,
                     const char * serviceName,
                     const char * encodedKeyName,
@@ -531,10 +890,11 @@ int SailfishKeyProvider_storeKey(
     char *psSchemeKey = NULL;
     char *psKeyKey = NULL;
     char *pskKey = NULL;
-    char writableDirectory[1024];
+    const char *writableDirectory = NULL;
     char writableIniFile[1024];
 
-    if (providerName == NULL
+    if (context == NULL
+            || providerName == NULL
             || serviceName == NULL
             || encodedKeyName == NULL
             || encodedValue == NULL
@@ -545,65 +905,151 @@ int SailfishKeyProvider_storeKey(
                 "error: invalid parameters");
         return -1;
     }
+    if (!valid_provider_name(providerName)) {
+        fprintf(stderr,
+                "SailfishKeyProvider_storeKey(): %s\n",
+                "error: invalid provider name");
+        return -1;
+    }
 
     psKey = build_ini_entry_key(providerName, serviceName);
     psSchemeKey = build_ini_entry_key(psKey, STOREDKEYS_ENCODINGSECTION_SCHEME);
     psKeyKey = build_ini_entry_key(psKey, STOREDKEYS_ENCODINGSECTION_KEY);
     pskKey = build_ini_entry_key(psKey, encodedKeyName);
 
-    snprintf(writableDirectory, sizeof(writableDirectory),
-             STOREDKEYS_WRITABLE_DIRECTORY,
-             getenv("HOME"));
-    snprintf(writableIniFile, sizeof(writableIniFile),
-             STOREDKEYS_WRITABLE_INIFILE,
-             getenv("HOME"));
-
-    /* write the encoding scheme */
-    retn = SailfishKeyProvider_ini_write(
-                    writableDirectory,
-                    writableIniFile,
-                    STOREDKEYS_ENCODINGSECTION,
-                    psSchemeKey,
-                    encodingScheme);
-    if (retn == -1) {
-        fprintf(stderr,
-                "SailfishKeyProvider_storeKey(): %s\n",
-                "error: unable to write scheme");
-        goto free_keys_and_return;
+    SailfishKeyProvider_context_count(context, SAILFISHKEYPROVIDER_CONTEXT_STORES);
+    writableDirectory = SailfishKeyProvider_context_writable_directory(context);
+    build_writable_ini_path(writableIniFile, sizeof(writableIniFile),
+                            context, providerName);
+
+    /* write the encoding scheme, encoding key and encoded key value,
+       and clear any earlier removal, in a single update of the file */
+    {
+        SailfishKeyProvider_ini_update updates[] = {
+            { STOREDKEYS_ENCODINGSECTION, psSchemeKey, encodingScheme },
+            { STOREDKEYS_ENCODINGSECTION, psKeyKey, encodingKey },
+            { STOREDKEYS_ENCODEDKEYSSECTION, pskKey, encodedValue },
+            { STOREDKEYS_REMOVEDKEYSSECTION, pskKey, NULL }
+        };
+        /* only writers of the same file wait for each other, and
+           those which arrive together are written together */
+        retn = SailfishKeyProvider_keystore_write_updates(
+                        writableDirectory,
+                        keystore_stripe(providerName),
+                        writableIniFile,
+                        updates,
+                        4);
+        if (retn == -1) {
+            fprintf(stderr,
+                    "SailfishKeyProvider_storeKey(): %s\n",
+                    "error: unable to write encoded key");
+        }
     }
 
-    /* write the encoding key */
-    retn = SailfishKeyProvider_ini_write(
-                    writableDirectory,
-                    writableIniFile,
-                    STOREDKEYS_ENCODINGSECTION,
-                    psKeyKey,
-                    encodingKey);
-    if (retn == -1) {
+    free(psKey);
+    free(psSchemeKey);
+    free(psKeyKey);
+    free(pskKey);
+    return retn;
+}
+
+int SailfishKeyProvider_storeKey(
+                    const char * providerName,
+                    const char * serviceName,
+                    const char * encodedKeyName,
+                    const char * encodedValue,
+                    const char * encodingScheme,
+                    const char * encodingKey)
+{
+    return SailfishKeyProvider_context_storeKey(
+                SailfishKeyProvider_context_default(),
+                providerName,
+                serviceName,
+                encodedKeyName,
+                encodedValue,
+                encodingScheme,
+                encodingKey);
+}
+
+/*
+    Removes the key with the given \a keyName for the given
+    \a providerName and \a serviceName from the key storage ini file.
+
+    A tombstone is recorded in its place, so that a key provided by
+    the static key storage is hidden as well: SailfishKeyProvider_storedKey()
+    returns 1 for the key until it is stored again.
+
+    Returns zero on success, -1 on failure.
+*/
+int SailfishKeyProvider_context_removeKey(
+                    SailfishKeyProvider_Context * context,
+                    const char * providerName,
+                    const char * serviceName,
+                    const char * keyName)
+{
+    int retn = 0;
+    char *psKey = NULL;
+    char *pskKey = NULL;
+    const char *writableDirectory = NULL;
+    char writableIniFile[1024];
+
+    if (context == NULL
+            || providerName == NULL
+            || serviceName == NULL
+            || keyName == NULL) {
         fprintf(stderr,
-                "SailfishKeyProvider_storeKey(): %s\n",
-                "error: unable to write encoding key");
-        goto free_keys_and_return;
-    }
-
-    /* write the encoded key value */
-    retn = SailfishKeyProvider_ini_write(
-                    writableDirectory,
-                    writableIniFile,
-                    STOREDKEYS_ENCODEDKEYSSECTION,
-                    pskKey,
-                    encodedValue);
-    if (retn == -1) {
+                "SailfishKeyProvider_removeKey(): %s\n",
+                "error: invalid parameters");
+        return -1;
+    }
+    if (!valid_provider_name(providerName)) {
         fprintf(stderr,
-                "SailfishKeyProvider_storeKey(): %s\n",
-                "error: unable to write encoding key");
-        goto free_keys_and_return;
+                "SailfishKeyProvider_removeKey(): %s\n",
+                "error: invalid provider name");
+        return -1;
+    }
+
+    psKey = build_ini_entry_key(providerName, serviceName);
+    pskKey = build_ini_entry_key(psKey, keyName);
+
+    SailfishKeyProvider_context_count(context, SAILFISHKEYPROVIDER_CONTEXT_REMOVALS);
+    writableDirectory = SailfishKeyProvider_context_writable_directory(context);
+    build_writable_ini_path(writableIniFile, sizeof(writableIniFile),
+                            context, providerName);
+
+    /* drop the encoded key value and record the tombstone
+       in a single update of the file */
+    {
+        SailfishKeyProvider_ini_update updates[] = {
+            { STOREDKEYS_ENCODEDKEYSSECTION, pskKey, NULL },
+            { STOREDKEYS_REMOVEDKEYSSECTION, pskKey, STOREDKEYS_REMOVEDKEYS_TOMBSTONE }
+        };
+        retn = SailfishKeyProvider_keystore_write_updates(
+                        writableDirectory,
+                        keystore_stripe(providerName),
+                        writableIniFile,
+                        updates,
+                        2);
+        if (retn == -1) {
+            fprintf(stderr,
+                    "SailfishKeyProvider_removeKey(): %s\n",
+                    "error: unable to remove key");
+        }
     }
 
-free_keys_and_return:
     free(psKey);
-    free(psSchemeKey);
-    free(psKeyKey);
     free(pskKey);
     return retn;
 }
+
+int SailfishKeyProvider_removeKey(
+                    const char * providerName,
+                    const char * serviceName,
+                    const char * keyName)
+{
+    return SailfishKeyProvider_context_removeKey(
+                SailfishKeyProvider_context_default(),
+                providerName,
+                serviceName,
+                keyName);
+}
@@ -0,0 +1,681 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Jolla Ltd.
+** Contact: Chris Adams <chris.adams@jollamobile.com>
+** All rights reserved.
+**
+** You may use this file under the terms of the GNU Lesser General
+** Public License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Public License for more details.
+**
+****************************************************************************/
+
+/*
+    Encoding scheme registry
+
+    Schemes are kept in a small open addressed hash table, keyed by the
+    FNV-1a hash of their name.  Entries are only ever added, and each is
+    published with a single atomic store, so lookups take no lock; a
+    caller which keeps the hash of a name (or the scheme itself) need
+    not hash it again.  The built in "xor" schemes are registered the
+    first time the registry is used.
+*/
+
+#include "sailfishkeyprovider_schemes.h"
+#include "base64ed.h"
+#include "chacha20.h"
+#include "xorbase64.h"
+#include "xored.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define SCHEMES_CAPACITY 64 /* a power of two */
+
+struct scheme_slot {
+    uint32_t hash;
+    const SailfishKeyProvider_Scheme *scheme; /* published last */
+};
+
+static struct scheme_slot schemes_table[SCHEMES_CAPACITY];
+static pthread_mutex_t schemes_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t schemes_once = PTHREAD_ONCE_INIT;
+
+/* --------------------------------------------------------- */
+
+/* The xor schemes XOR the value with the repeating key, and then Base64
+   encode it so that the result is a valid 7-bit ASCII c-string.  Their
+   data is the Base64 alphabet and flags to use. */
+struct xor_scheme_data {
+    const SailfishKeyProvider_base64_alphabet *alphabet;
+    int flags;
+};
+
+static int xor_scheme_encode(
+                    const SailfishKeyProvider_Scheme *scheme,
+                    const char *value,
+                    const char *key,
+                    char **encoded)
+{
+    const struct xor_scheme_data *data = (const struct xor_scheme_data *)scheme->data;
+    return SailfishKeyProvider_xor_base64_encode(
+                data->alphabet, data->flags,
+                value, strlen(value),
+                key, strlen(key),
+                encoded) > 0 ? 0 : -1;
+}
+
+static int xor_scheme_decode(
+                    const SailfishKeyProvider_Scheme *scheme,
+                    const char *encodedValue,
+                    const char *key,
+                    char **decoded)
+{
+    const struct xor_scheme_data *data = (const struct xor_scheme_data *)scheme->data;
+    return SailfishKeyProvider_xor_base64_decode(
+                data->alphabet, data->flags,
+                encodedValue, strlen(encodedValue),
+                key, strlen(key),
+                decoded) > 0 ? 0 : -1;
+}
+
+static int xor_scheme_decode_inplace(
+                    const SailfishKeyProvider_Scheme *scheme,
+                    char *value,
+                    const char *key)
+{
+    const struct xor_scheme_data *data = (const struct xor_scheme_data *)scheme->data;
+    size_t size = SailfishKeyProvider_base64_decode_inplace_alphabet(
+                data->alphabet, data->flags, value, strlen(value));
+    if (size == 0 || SailfishKeyProvider_xor_inplace(value, size, key, strlen(key)) != 0) {
+        return -1;
+    }
+    value[size] = '\0'; /* the decoded value is always shorter */
+    return 0;
+}
+
+static int xor_scheme_decode_batch(
+                    const SailfishKeyProvider_Scheme *scheme,
+                    const char * const *encodedValues,
+                    size_t count,
+                    const char *key,
+                    char **decoded)
+{
+    const struct xor_scheme_data *data = (const struct xor_scheme_data *)scheme->data;
+    return SailfishKeyProvider_xor_base64_decode_batch(
+                data->alphabet, data->flags,
+                encodedValues, count,
+                key, strlen(key),
+                decoded);
+}
+
+static int xor_scheme_decode_arena(
+                    const SailfishKeyProvider_Scheme *scheme,
+                    const char * const *encodedValues,
+                    size_t count,
+                    const char *key,
+                    char **arena,
+                    size_t *offsets)
+{
+    const struct xor_scheme_data *data = (const struct xor_scheme_data *)scheme->data;
+    return SailfishKeyProvider_xor_base64_decode_arena(
+                data->alphabet, data->flags,
+                encodedValues, count,
+                key, strlen(key),
+                arena, offsets);
+}
+
+static const struct xor_scheme_data xor_standard_data = {
+    &SailfishKeyProvider_base64_standard, 0
+};
+
+static const struct xor_scheme_data xor_url_data = {
+    &SailfishKeyProvider_base64_url, SAILFISHKEYPROVIDER_BASE64_NO_PADDING
+};
+
+/* The chacha20 scheme encrypts the value with ChaCha20, under a key
+   derived from the text key and a random nonce, and Base64 encodes the
+   nonce followed by the ciphertext. */
+#define CHACHA20_SCHEME_COUNTER 1
+
+static int random_bytes(uint8_t *buffer, size_t size)
+{
+    size_t done = 0;
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    while (done < size) {
+        ssize_t n = read(fd, buffer + done, size - done);
+        if (n <= 0) {
+            close(fd);
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    close(fd);
+    return 0;
+}
+
+/* Deriving the cipher key costs as much as encrypting a short value, and
+   callers almost always use the same key, so each thread keeps the last
+   one it derived.  The passphrase itself is not kept: the cache is
+   matched by a SipHash-2-4 digest under a per-process random key, and
+   is wiped when the thread exits. */
+struct chacha20_scheme_key_cache {
+    int valid;
+    uint64_t digest;
+    size_t passphraseSize;
+    uint8_t cipherKey[SAILFISHKEYPROVIDER_CHACHA20_KEY_SIZE];
+};
+
+static pthread_once_t chacha20_key_cache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t chacha20_key_cache_key;
+static uint64_t chacha20_key_cache_secret[2];
+static int chacha20_key_cache_enabled = 0;
+
+static void chacha20_scheme_wipe(void *data, size_t size)
+{
+    volatile uint8_t *p = (volatile uint8_t *)data;
+    while (size-- > 0) {
+        *p++ = 0;
+    }
+}
+
+static void chacha20_key_cache_destroy(void *data)
+{
+    chacha20_scheme_wipe(data, sizeof(struct chacha20_scheme_key_cache));
+    free(data);
+}
+
+static void chacha20_key_cache_init(void)
+{
+    uint8_t secret[16];
+    size_t i = 0;
+
+    if (random_bytes(secret, sizeof(secret)) != 0
+            || pthread_key_create(&chacha20_key_cache_key, chacha20_key_cache_destroy) != 0) {
+        return;
+    }
+    for (i = 0; i < 16; ++i) {
+        chacha20_key_cache_secret[i / 8] |= (uint64_t)secret[i] << (8 * (i % 8));
+    }
+    chacha20_scheme_wipe(secret, sizeof(secret));
+    chacha20_key_cache_enabled = 1;
+}
+
+#define SIPHASH_ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPHASH_ROUND(v0, v1, v2, v3) do { \
+        v0 += v1; v1 = SIPHASH_ROTL(v1, 13); v1 ^= v0; v0 = SIPHASH_ROTL(v0, 32); \
+        v2 += v3; v3 = SIPHASH_ROTL(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = SIPHASH_ROTL(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = SIPHASH_ROTL(v1, 17); v1 ^= v2; v2 = SIPHASH_ROTL(v2, 32); \
+    } while (0)
+
+static uint64_t siphash24(const uint64_t secret[2], const char *data, size_t size)
+{
+    uint64_t v0 = secret[0] ^ 0x736f6d6570736575ull;
+    uint64_t v1 = secret[1] ^ 0x646f72616e646f6dull;
+    uint64_t v2 = secret[0] ^ 0x6c7967656e657261ull;
+    uint64_t v3 = secret[1] ^ 0x7465646279746573ull;
+    uint64_t m = 0;
+    size_t i = 0, j = 0;
+
+    for (i = 0; i + 8 <= size; i += 8) {
+        m = 0;
+        for (j = 0; j < 8; ++j) {
+            m |= (uint64_t)(uint8_t)data[i + j] << (8 * j);
+        }
+        v3 ^= m;
+        SIPHASH_ROUND(v0, v1, v2, v3);
+        SIPHASH_ROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+    m = (uint64_t)size << 56;
+    for (j = 0; i + j < size; ++j) {
+        m |= (uint64_t)(uint8_t)data[i + j] << (8 * j);
+    }
+    v3 ^= m;
+    SIPHASH_ROUND(v0, v1, v2, v3);
+    SIPHASH_ROUND(v0, v1, v2, v3);
+    v0 ^= m;
+    v2 ^= 0xff;
+    for (j = 0; j < 4; ++j) {
+        SIPHASH_ROUND(v0, v1, v2, v3);
+    }
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static void chacha20_scheme_key(const char *key, uint8_t cipherKey[SAILFISHKEYPROVIDER_CHACHA20_KEY_SIZE])
+{
+    struct chacha20_scheme_key_cache *cache = NULL;
+    size_t keySize = strlen(key);
+    uint64_t digest = 0;
+
+    pthread_once(&chacha20_key_cache_once, chacha20_key_cache_init);
+    if (chacha20_key_cache_enabled) {
+        cache = (struct chacha20_scheme_key_cache *)pthread_getspecific(chacha20_key_cache_key);
+        if (cache == NULL) {
+            cache = (struct chacha20_scheme_key_cache *)calloc(1, sizeof(*cache));
+            if (cache != NULL && pthread_setspecific(chacha20_key_cache_key, cache) != 0) {
+                free(cache);
+                cache = NULL;
+            }
+        }
+    }
+    if (cache == NULL) {
+        SailfishKeyProvider_chacha20_derive_key(key, keySize, cipherKey);
+        return;
+    }
+
+    digest = siphash24(chacha20_key_cache_secret, key, keySize);
+    if (!cache->valid || cache->passphraseSize != keySize || cache->digest != digest) {
+        SailfishKeyProvider_chacha20_derive_key(key, keySize, cache->cipherKey);
+        cache->valid = 1;
+        cache->digest = digest;
+        cache->passphraseSize = keySize;
+    }
+    memcpy(cipherKey, cache->cipherKey, SAILFISHKEYPROVIDER_CHACHA20_KEY_SIZE);
+}
+
+static int chacha20_scheme_encode(
+                    const SailfishKeyProvider_Scheme *scheme,
+                    const char *value,
+                    const char *key,
+                    char **encoded)
+{
+    uint8_t cipherKey[SAILFISHKEYPROVIDER_CHACHA20_KEY_SIZE];
+    size_t valueSize = strlen(value);
+    uint8_t *buffer = NULL;
+    int retn = -1;
+    (void)scheme;
+
+    if (valueSize == 0 || *key == '\0') {
+        fprintf(stderr,
+                "%s\n",
+                "SailfishKeyProvider_chacha20: invalid arguments");
+        return -1;
+    }
+
+    buffer = (uint8_t *)malloc(SAILFISHKEYPROVIDER_CHACHA20_NONCE_SIZE + valueSize);
+    if (buffer == NULL) {
+        return -1;
+    }
+    if (random_bytes(buffer, SAILFISHKEYPROVIDER_CHACHA20_NONCE_SIZE) != 0) {
+        fprintf(stderr,
+                "%s\n",
+                "SailfishKeyProvider_chacha20: unable to read random nonce");
+        goto cleanup;
+    }
+
+    chacha20_scheme_key(key, cipherKey);
+    SailfishKeyProvider_chacha20_xor(cipherKey, CHACHA20_SCHEME_COUNTER, buffer,
+                                     (const uint8_t *)value,
+                                     buffer + SAILFISHKEYPROVIDER_CHACHA20_NONCE_SIZE,
+                                     valueSize);
+    memset(cipherKey, 0, sizeof(cipherKey));
+
+    if (SailfishKeyProvider_base64_encode_alphabet(
+                &SailfishKeyProvider_base64_standard, 0,
+                (const char *)buffer,
+                SAILFISHKEYPROVIDER_CHACHA20_NONCE_SIZE + valueSize,
+                encoded) > 0) {
+        retn = 0;
+    }
+
+cleanup:
+    free(buffer);
+    return retn;
+}
+
+/* Decrypts the \a size bytes of nonce and ciphertext in \a buffer,
+   leaving the null terminated plaintext at its start */
+static int chacha20_scheme_decrypt(char *buffer, size_t size, const char *key)
+{
+    uint8_t cipherKey[SAILFISHKEYPROVIDER_CHACHA20_KEY_SIZE];
+    uint8_t nonce[SAILFISHKEYPROVIDER_CHACHA20_NONCE_SIZE];
+    uint8_t *ciphertext = (uint8_t *)buffer + SAILFISHKEYPROVIDER_CHACHA20_NONCE_SIZE;
+
+    if (size <= SAILFISHKEYPROVIDER_CHACHA20_NONCE_SIZE || *key == '\0') {
+        return -1;
+    }
+    size -= SAILFISHKEYPROVIDER_CHACHA20_NONCE_SIZE;
+
+    memcpy(nonce, buffer, sizeof(nonce));
+    chacha20_scheme_key(key, cipherKey);
+    SailfishKeyProvider_chacha20_xor(cipherKey, CHACHA20_SCHEME_COUNTER, nonce,
+                                     ciphertext, ciphertext, size);
+    memset(cipherKey, 0, sizeof(cipherKey));
+
+    memmove(buffer, ciphertext, size);
+    buffer[size] = '\0';
+    return 0;
+}
+
+static int chacha20_scheme_decode(
+                    const SailfishKeyProvider_Scheme *scheme,
+                    const char *encodedValue,
+                    const char *key,
+                    char **decoded)
+{
+    size_t size = 0;
+    (void)scheme;
+
+    size = SailfishKeyProvider_base64_decode_alphabet(
+                &SailfishKeyProvider_base64_standard, 0,
+                encodedValue, strlen(encodedValue),
+                decoded);
+    if (size == 0) {
+        return -1;
+    }
+    if (chacha20_scheme_decrypt(*decoded, size, key) != 0) {
+        free(*decoded);
+        *decoded = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static int chacha20_scheme_decode_inplace(
+                    const SailfishKeyProvider_Scheme *scheme,
+                    char *value,
+                    const char *key)
+{
+    size_t size = SailfishKeyProvider_base64_decode_inplace_alphabet(
+                &SailfishKeyProvider_base64_standard, 0, value, strlen(value));
+    (void)scheme;
+    if (size == 0) {
+        return -1;
+    }
+    return chacha20_scheme_decrypt(value, size, key);
+}
+
+static const SailfishKeyProvider_Scheme builtin_schemes[] = {
+    { "xor", &xor_standard_data,
+      xor_scheme_encode, xor_scheme_decode,
+      xor_scheme_decode_inplace, xor_scheme_decode_batch,
+      xor_scheme_decode_arena },
+    { "xor-base64url", &xor_url_data,
+      xor_scheme_encode, xor_scheme_decode,
+      xor_scheme_decode_inplace, xor_scheme_decode_batch,
+      xor_scheme_decode_arena },
+    { "chacha20", NULL,
+      chacha20_scheme_encode, chacha20_scheme_decode,
+      chacha20_scheme_decode_inplace, NULL, NULL }
+};
+
+/* --------------------------------------------------------- */
+
+/*
+    Returns the hash by which the scheme called \a name is found.
+*/
+uint32_t SailfishKeyProvider_scheme_hash(
+                    const char * name)
+{
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    const unsigned char *p = NULL;
+    for (p = (const unsigned char *)name; *p; ++p) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    return hash;
+}
+
+static const SailfishKeyProvider_Scheme * schemes_lookup(uint32_t hash, const char *name)
+{
+    size_t i = hash & (SCHEMES_CAPACITY - 1);
+    size_t probes = 0;
+
+    for (probes = 0; probes < SCHEMES_CAPACITY; ++probes) {
+        const SailfishKeyProvider_Scheme *scheme =
+                __atomic_load_n(&schemes_table[i].scheme, __ATOMIC_ACQUIRE);
+        if (scheme == NULL) {
+            break;
+        }
+        if (schemes_table[i].hash == hash && strcmp(scheme->name, name) == 0) {
+            return scheme;
+        }
+        i = (i + 1) & (SCHEMES_CAPACITY - 1);
+    }
+    return NULL;
+}
+
+static int schemes_insert(const SailfishKeyProvider_Scheme *scheme)
+{
+    uint32_t hash = SailfishKeyProvider_scheme_hash(scheme->name);
+    size_t i = hash & (SCHEMES_CAPACITY - 1);
+    size_t probes = 0;
+    int retn = -1;
+
+    pthread_mutex_lock(&schemes_mutex);
+    if (schemes_lookup(hash, scheme->name) == NULL) {
+        for (probes = 0; probes < SCHEMES_CAPACITY; ++probes) {
+            if (schemes_table[i].scheme == NULL) {
+                schemes_table[i].hash = hash;
+                __atomic_store_n(&schemes_table[i].scheme, scheme, __ATOMIC_RELEASE);
+                retn = 0;
+                break;
+            }
+            i = (i + 1) & (SCHEMES_CAPACITY - 1);
+        }
+    }
+    pthread_mutex_unlock(&schemes_mutex);
+
+    return retn;
+}
+
+static void schemes_register_builtins()
+{
+    size_t i = 0;
+    for (i = 0; i < sizeof(builtin_schemes) / sizeof(builtin_schemes[0]); ++i) {
+        schemes_insert(&builtin_schemes[i]);
+    }
+}
+
+/*
+    Registers the given \a scheme, which must remain valid for the
+    lifetime of the process, so that keys may be encoded and decoded
+    with it by name.  Returns 0 on success, or -1 if the scheme lacks a
+    name, an encode or a decode function, if a scheme of the same name
+    is already registered, or if the registry is full.
+*/
+int SailfishKeyProvider_scheme_register(
+                    const SailfishKeyProvider_Scheme * scheme)
+{
+    pthread_once(&schemes_once, schemes_register_builtins);
+
+    if (scheme == NULL
+            || scheme->name == NULL
+            || scheme->encode == NULL
+            || scheme->decode == NULL) {
+        fprintf(stderr,
+                "%s\n",
+                "SailfishKeyProvider_scheme_register: invalid arguments");
+        return -1;
+    }
+
+    if (schemes_insert(scheme) != 0) {
+        fprintf(stderr,
+                "SailfishKeyProvider_scheme_register: unable to register %s\n",
+                scheme->name);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Returns the scheme with the given \a name, whose hash is \a hash,
+    or NULL if there is no such scheme.
+*/
+const SailfishKeyProvider_Scheme * SailfishKeyProvider_scheme_find_hashed(
+                    uint32_t hash,
+                    const char * name)
+{
+    if (name == NULL) {
+        return NULL;
+    }
+    pthread_once(&schemes_once, schemes_register_builtins);
+    return schemes_lookup(hash, name);
+}
+
+/*
+    Returns the scheme with the given \a name, or NULL if there is no
+    such scheme.
+*/
+const SailfishKeyProvider_Scheme * SailfishKeyProvider_scheme_find(
+                    const char * name)
+{
+    if (name == NULL) {
+        return NULL;
+    }
+    return SailfishKeyProvider_scheme_find_hashed(
+                SailfishKeyProvider_scheme_hash(name), name);
+}
+
+/*
+    Decodes the null terminated \a value over itself with the given
+    \a scheme, using its in-place entry point if it has one.
+    Returns 0 on success, or -1 on failure.
+*/
+int SailfishKeyProvider_scheme_decode_inplace(
+                    const SailfishKeyProvider_Scheme * scheme,
+                    char * value,
+                    const char * key)
+{
+    char *decoded = NULL;
+    size_t size = 0;
+
+    if (scheme == NULL || value == NULL || key == NULL) {
+        return -1;
+    }
+    if (scheme->decode_inplace != NULL) {
+        return scheme->decode_inplace(scheme, value, key);
+    }
+
+    if (scheme->decode(scheme, value, key, &decoded) != 0) {
+        return -1;
+    }
+    size = strlen(decoded);
+    if (size > strlen(value)) {
+        free(decoded);
+        return -1; /* does not fit */
+    }
+    memcpy(value, decoded, size + 1);
+    free(decoded);
+    return 0;
+}
+
+/*
+    Decodes each of the \a count \a encodedValues with the given
+    \a scheme and \a key, using its batch entry point if it has one.
+    Returns 0 on success, or -1 if any value fails to decode, in which
+    case no values are returned.
+*/
+int SailfishKeyProvider_scheme_decode_batch(
+                    const SailfishKeyProvider_Scheme * scheme,
+                    const char * const * encodedValues,
+                    size_t count,
+                    const char * key,
+                    char ** decoded)
+{
+    size_t i = 0;
+
+    if (scheme == NULL || encodedValues == NULL || key == NULL || decoded == NULL) {
+        return -1;
+    }
+    if (scheme->decode_batch != NULL) {
+        return scheme->decode_batch(scheme, encodedValues, count, key, decoded);
+    }
+
+    for (i = 0; i < count; ++i) {
+        decoded[i] = NULL;
+    }
+    for (i = 0; i < count; ++i) {
+        if (encodedValues[i] == NULL
+                || scheme->decode(scheme, encodedValues[i], key, &decoded[i]) != 0) {
+            while (i > 0) {
+                --i;
+                free(decoded[i]);
+                decoded[i] = NULL;
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+    Decodes each of the \a count \a encodedValues with the given
+    \a scheme and \a key into a single allocation, using its arena entry
+    point if it has one.  Value i is null terminated and starts at
+    \a *arena + \a offsets[i]; \a offsets must have room for \a count + 1
+    entries, the last of which is the size of the arena.
+    Returns 0 on success, or -1 if any value fails to decode, in which
+    case no \a arena is returned.  The caller owns the \a arena and must
+    free() it.
+*/
+int SailfishKeyProvider_scheme_decode_arena(
+                    const SailfishKeyProvider_Scheme * scheme,
+                    const char * const * encodedValues,
+                    size_t count,
+                    const char * key,
+                    char ** arena,
+                    size_t * offsets)
+{
+    char **decoded = NULL;
+    char *packed = NULL;
+    size_t i = 0;
+
+    if (arena != NULL) {
+        *arena = NULL;
+    }
+    if (scheme == NULL || encodedValues == NULL || key == NULL
+            || arena == NULL || offsets == NULL) {
+        return -1;
+    }
+    if (scheme->decode_arena != NULL) {
+        return scheme->decode_arena(scheme, encodedValues, count, key, arena, offsets);
+    }
+
+    /* decode the values one by one, and then gather them up */
+    decoded = (char **)malloc((count + 1) * sizeof(char *));
+    if (decoded == NULL
+            || SailfishKeyProvider_scheme_decode_batch(
+                    scheme, encodedValues, count, key, decoded) != 0) {
+        free(decoded);
+        return -1;
+    }
+
+    offsets[0] = 0;
+    for (i = 0; i < count; ++i) {
+        offsets[i + 1] = offsets[i] + strlen(decoded[i]) + 1;
+    }
+    packed = (char *)malloc(offsets[count] + 1);
+    for (i = 0; i < count; ++i) {
+        if (packed != NULL) {
+            memcpy(packed + offsets[i], decoded[i], offsets[i + 1] - offsets[i]);
+        }
+        free(decoded[i]);
+    }
+    free(decoded);
+
+    *arena = packed;
+    return packed != NULL ? 0 : -1;
+}
@@ -0,0 +1,359 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Jolla Ltd.
+** Contact: Chris Adams <chris.adams@jollamobile.com>
+** All rights reserved.
+**
+** You may use this file under the terms of the GNU Lesser General
+** Public License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Public License for more details.
+**
+****************************************************************************/
+
+/*
+    Key stores of other users
+
+    A service which acts for several users names the store of each by
+    its home directory or uid.  A context is kept for every store in
+    use, most recently used first, and those used least recently are
+    destroyed once the memory of all of them exceeds the limit.  A
+    context is never destroyed while a call is using it.
+*/
+
+#include "sailfishkeyprovider_context.h"
+#include "context.h"
+
+#include <sys/types.h>
+#include <errno.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define STORES_DEFAULT_LIMIT (1024 * 1024)
+
+struct store_entry {
+    SailfishKeyProvider_Context *context;
+    char *home;
+    uid_t uid;
+    int hasUid; /* the uid the home directory was looked up for */
+    int refs;   /* calls using the context */
+    struct store_entry *prev;
+    struct store_entry *next;
+};
+
+static pthread_mutex_t stores_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct store_entry *stores_head = NULL; /* most recently used */
+static struct store_entry *stores_tail = NULL;
+static size_t stores_count = 0;
+static size_t stores_limit = STORES_DEFAULT_LIMIT;
+
+/* --------------------------------------------------------- */
+
+static void stores_unlink(struct store_entry *entry)
+{
+    if (entry->prev != NULL) {
+        entry->prev->next = entry->next;
+    } else {
+        stores_head = entry->next;
+    }
+    if (entry->next != NULL) {
+        entry->next->prev = entry->prev;
+    } else {
+        stores_tail = entry->prev;
+    }
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+static void stores_push_front(struct store_entry *entry)
+{
+    entry->prev = NULL;
+    entry->next = stores_head;
+    if (stores_head != NULL) {
+        stores_head->prev = entry;
+    } else {
+        stores_tail = entry;
+    }
+    stores_head = entry;
+}
+
+static void stores_free_entry(struct store_entry *entry)
+{
+    SailfishKeyProvider_context_destroy(entry->context);
+    free(entry->home);
+    free(entry);
+}
+
+/* Brings the stores within the limit, called with the mutex held.  The
+   least recently used stores go first, and then the parsed files of
+   those still in use or most recently used. */
+static void stores_trim(void)
+{
+    struct store_entry *entry = NULL;
+    struct store_entry *prev = NULL;
+    size_t total = 0;
+
+    for (entry = stores_head; entry != NULL; entry = entry->next) {
+        total += SailfishKeyProvider_context_footprint(entry->context);
+    }
+
+    for (entry = stores_tail; entry != NULL && total > stores_limit; entry = prev) {
+        prev = entry->prev;
+        if (entry->refs == 0 && entry != stores_head) {
+            total -= SailfishKeyProvider_context_footprint(entry->context);
+            stores_unlink(entry);
+            stores_count--;
+            stores_free_entry(entry);
+        }
+    }
+
+    for (entry = stores_tail; entry != NULL && total > stores_limit; entry = entry->prev) {
+        total -= SailfishKeyProvider_context_footprint(entry->context);
+        SailfishKeyProvider_context_trim(entry->context);
+        total += SailfishKeyProvider_context_footprint(entry->context);
+    }
+}
+
+/* Returns the store of \a home, with its context in use until it is
+   released, or NULL on failure.  Called with the mutex held. */
+static struct store_entry * stores_acquire_locked(const char *home, const uid_t *uid)
+{
+    struct store_entry *entry = NULL;
+
+    for (entry = stores_head; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->home, home) == 0) {
+            break;
+        }
+    }
+
+    if (entry == NULL) {
+        entry = (struct store_entry *)calloc(1, sizeof(struct store_entry));
+        if (entry == NULL) {
+            return NULL;
+        }
+        entry->home = strdup(home);
+        entry->context = SailfishKeyProvider_context_create_for_home(home, NULL);
+        if (entry->home == NULL || entry->context == NULL) {
+            stores_free_entry(entry);
+            return NULL;
+        }
+        stores_count++;
+    } else {
+        stores_unlink(entry);
+    }
+
+    if (uid != NULL) {
+        entry->uid = *uid;
+        entry->hasUid = 1;
+    }
+    entry->refs++;
+    stores_push_front(entry);
+    return entry;
+}
+
+static struct store_entry * stores_acquire_home(const char *home)
+{
+    struct store_entry *entry = NULL;
+
+    if (home == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&stores_mutex);
+    entry = stores_acquire_locked(home, NULL);
+    pthread_mutex_unlock(&stores_mutex);
+    return entry;
+}
+
+/* The home directory of a user is only looked up the first time */
+static struct store_entry * stores_acquire_user(uid_t uid)
+{
+    struct store_entry *entry = NULL;
+    struct passwd pwd;
+    struct passwd *result = NULL;
+    char *buffer = NULL;
+    long size = 0;
+
+    pthread_mutex_lock(&stores_mutex);
+    for (entry = stores_head; entry != NULL; entry = entry->next) {
+        if (entry->hasUid && entry->uid == uid) {
+            entry->refs++;
+            stores_unlink(entry);
+            stores_push_front(entry);
+            pthread_mutex_unlock(&stores_mutex);
+            return entry;
+        }
+    }
+    pthread_mutex_unlock(&stores_mutex);
+
+    size = sysconf(_SC_GETPW_R_SIZE_MAX);
+    if (size <= 0) {
+        size = 16384;
+    }
+    buffer = (char *)malloc(size);
+    if (buffer == NULL
+            || getpwuid_r(uid, &pwd, buffer, size, &result) != 0
+            || result == NULL
+            || pwd.pw_dir == NULL) {
+        fprintf(stderr,
+                "SailfishKeyProvider: %s %ld\n",
+                "no home directory for user",
+                (long)uid);
+        free(buffer);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&stores_mutex);
+    entry = stores_acquire_locked(pwd.pw_dir, &uid);
+    pthread_mutex_unlock(&stores_mutex);
+    free(buffer);
+    return entry;
+}
+
+static void stores_release(struct store_entry *entry)
+{
+    if (entry != NULL) {
+        pthread_mutex_lock(&stores_mutex);
+        entry->refs--;
+        stores_trim();
+        pthread_mutex_unlock(&stores_mutex);
+    }
+}
+
+/* --------------------------------------------------------- */
+
+void SailfishKeyProvider_set_store_cache_limit(
+                    size_t bytes)
+{
+    pthread_mutex_lock(&stores_mutex);
+    stores_limit = bytes;
+    stores_trim();
+    pthread_mutex_unlock(&stores_mutex);
+}
+
+size_t SailfishKeyProvider_store_cache_usage(
+                    size_t * bytes)
+{
+    struct store_entry *entry = NULL;
+    size_t count = 0;
+
+    pthread_mutex_lock(&stores_mutex);
+    count = stores_count;
+    if (bytes != NULL) {
+        *bytes = 0;
+        for (entry = stores_head; entry != NULL; entry = entry->next) {
+            *bytes += SailfishKeyProvider_context_footprint(entry->context);
+        }
+    }
+    pthread_mutex_unlock(&stores_mutex);
+    return count;
+}
+
+int SailfishKeyProvider_home_storedKey(
+                    const char * home,
+                    const char * providerName,
+                    const char * serviceName,
+                    const char * keyName,
+                    char ** storedKey)
+{
+    struct store_entry *entry = stores_acquire_home(home);
+    int retn = SailfishKeyProvider_context_storedKey(
+                entry ? entry->context : NULL,
+                providerName, serviceName, keyName, storedKey);
+    stores_release(entry);
+    return retn;
+}
+
+int SailfishKeyProvider_home_storeKey(
+                    const char * home,
+                    const char * providerName,
+                    const char * serviceName,
+                    const char * encodedKeyName,
+                    const char * encodedValue,
+                    const char * encodingScheme,
+                    const char * encodingKey)
+{
+    struct store_entry *entry = stores_acquire_home(home);
+    int retn = SailfishKeyProvider_context_storeKey(
+                entry ? entry->context : NULL,
+                providerName, serviceName, encodedKeyName,
+                encodedValue, encodingScheme, encodingKey);
+    stores_release(entry);
+    return retn;
+}
+
+int SailfishKeyProvider_home_removeKey(
+                    const char * home,
+                    const char * providerName,
+                    const char * serviceName,
+                    const char * keyName)
+{
+    struct store_entry *entry = stores_acquire_home(home);
+    int retn = SailfishKeyProvider_context_removeKey(
+                entry ? entry->context : NULL,
+                providerName, serviceName, keyName);
+    stores_release(entry);
+    return retn;
+}
+
+int SailfishKeyProvider_user_storedKey(
+                    uid_t uid,
+                    const char * providerName,
+                    const char * serviceName,
+                    const char * keyName,
+                    char ** storedKey)
+{
+    struct store_entry *entry = stores_acquire_user(uid);
+    int retn = SailfishKeyProvider_context_storedKey(
+                entry ? entry->context : NULL,
+                providerName, serviceName, keyName, storedKey);
+    stores_release(entry);
+    return retn;
+}
+
+int SailfishKeyProvider_user_storeKey(
+                    uid_t uid,
+                    const char * providerName,
+                    const char * serviceName,
+                    const char * encodedKeyName,
+                    const char * encodedValue,
+                    const char * encodingScheme,
+                    const char * encodingKey)
+{
+    struct store_entry *entry = stores_acquire_user(uid);
+    int retn = SailfishKeyProvider_context_storeKey(
+                entry ? entry->context : NULL,
+                providerName, serviceName, encodedKeyName,
+                encodedValue, encodingScheme, encodingKey);
+    stores_release(entry);
+    return retn;
+}
+
+int SailfishKeyProvider_user_removeKey(
+                    uid_t uid,
+                    const char * providerName,
+                    const char * serviceName,
+                    const char * keyName)
+{
+    struct store_entry *entry = stores_acquire_user(uid);
+    int retn = SailfishKeyProvider_context_removeKey(
+                entry ? entry->context : NULL,
+                providerName, serviceName, keyName);
+    stores_release(entry);
+    return retn;
+}
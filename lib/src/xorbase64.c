@@ -0,0 +1,452 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Jolla Ltd.
+** Contact: Chris Adams <chris.adams@jollamobile.com>
+** All rights reserved.
+**
+** You may use this file under the terms of the GNU Lesser General
+** Public License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Public License for more details.
+**
+****************************************************************************/
+
+/*
+    Fused XOR and Base64 encoding and decoding
+
+    Keys are stored XORed and then Base64 encoded.  Rather than make a
+    full pass over the value for each step, with an intermediate buffer
+    in between, the value is processed in tiles small enough to stay in
+    the L1 cache: each tile is Base64 decoded straight into the output
+    and XORed there while it is still hot (or XORed into a small stack
+    buffer and Base64 encoded from it), so the value is only written to
+    memory once, into the only allocation.
+*/
+
+#include "xorbase64.h"
+#include "xored.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+/* bytes of decoded data per tile; a multiple of 3 */
+#define XORBASE64_TILE_SIZE 3072
+#define XORBASE64_ENCODED_TILE_SIZE (XORBASE64_TILE_SIZE / 3 * 4)
+
+/*
+    XORs the given \a data with the repeating \a key, and encodes the
+    result with Base64 encoding using the given \a alphabet and \a flags.
+    Returns the size of the null terminated \a encoded_data on success,
+    or 0 on error.  The caller owns the \a encoded_data and must free() it.
+*/
+size_t SailfishKeyProvider_xor_base64_encode(
+                    const SailfishKeyProvider_base64_alphabet *alphabet,
+                    int flags,
+                    const char *data,
+                    size_t data_size,
+                    const char *key,
+                    size_t key_size,
+                    char **encoded_data)
+{
+    SailfishKeyProvider_xor_keystream keystream;
+    char tile[XORBASE64_TILE_SIZE];
+    size_t encoded_size = 0, offset = 0, written = 0;
+    char *encoded = NULL;
+
+    if (encoded_data == NULL) {
+        return 0;
+    }
+    *encoded_data = NULL;
+    if (alphabet == NULL || data == NULL || data_size == 0
+            || SailfishKeyProvider_xor_keystream_init(&keystream, key, key_size, data_size) != 0) {
+        fprintf(stderr,
+                "%s\n",
+                "SailfishKeyProvider_xor_base64_encode: invalid arguments");
+        return 0;
+    }
+
+    encoded_size = SailfishKeyProvider_base64_encoded_length_flags(data_size, flags);
+    encoded = (char *)malloc(encoded_size + 1);
+    if (encoded == NULL) {
+        fprintf(stderr,
+                "%s\n",
+                "SailfishKeyProvider_xor_base64_encode: malloc failed");
+        return 0;
+    }
+
+    /* every tile but the last is a whole number of blocks, so only
+       the last can need padding */
+    while (offset < data_size) {
+        size_t size = data_size - offset;
+        if (size > XORBASE64_TILE_SIZE) {
+            size = XORBASE64_TILE_SIZE;
+        }
+        SailfishKeyProvider_xor_keystream_apply(&keystream, tile, data + offset, size);
+        written += SailfishKeyProvider_base64_encode_into(
+                alphabet, flags, tile, size, encoded + written);
+        offset += size;
+    }
+
+    encoded[encoded_size] = '\0';
+    *encoded_data = encoded;
+    return encoded_size;
+}
+
+/*
+    Decodes \a encoded_data with the given \a keystream into \a decoded,
+    which must have room for all of it.  Returns the number of bytes
+    written, or 0 if the data is invalid.
+*/
+static size_t decode_tiles(
+                    const SailfishKeyProvider_base64_alphabet *alphabet,
+                    int flags,
+                    const char *encoded_data,
+                    size_t encoded_size,
+                    SailfishKeyProvider_xor_keystream *keystream,
+                    char *decoded)
+{
+    size_t offset = 0, written = 0;
+
+    /* padding is only valid in the last tile, so the others are
+       decoded as unpadded data, in which '=' is invalid */
+    while (offset < encoded_size) {
+        size_t size = encoded_size - offset;
+        size_t tile_size = 0;
+        int tile_flags = flags;
+        if (size > XORBASE64_ENCODED_TILE_SIZE) {
+            size = XORBASE64_ENCODED_TILE_SIZE;
+            tile_flags |= SAILFISHKEYPROVIDER_BASE64_NO_PADDING;
+        }
+        tile_size = SailfishKeyProvider_base64_decode_into(
+                alphabet, tile_flags, encoded_data + offset, size, decoded + written);
+        if (tile_size == 0) {
+            return 0;
+        }
+        SailfishKeyProvider_xor_keystream_apply(
+                keystream, decoded + written, decoded + written, tile_size);
+        written += tile_size;
+        offset += size;
+    }
+
+    return written;
+}
+
+/*
+    Decodes \a encoded_data with the given \a keystream, which must be
+    positioned at the start of the key.  \see SailfishKeyProvider_xor_base64_decode()
+*/
+static size_t decode_with_keystream(
+                    const SailfishKeyProvider_base64_alphabet *alphabet,
+                    int flags,
+                    const char *encoded_data,
+                    size_t encoded_size,
+                    SailfishKeyProvider_xor_keystream *keystream,
+                    char **decoded_data)
+{
+    size_t decoded_size = SailfishKeyProvider_base64_decoded_length_flags(
+            encoded_data, encoded_size, flags);
+    char *decoded = NULL;
+
+    *decoded_data = NULL;
+    if (decoded_size == 0) {
+        fprintf(stderr,
+                "%s\n",
+                "SailfishKeyProvider_xor_base64_decode: invalid arguments");
+        return 0;
+    }
+
+    decoded = (char *)malloc(decoded_size + 1);
+    if (decoded == NULL) {
+        fprintf(stderr,
+                "%s\n",
+                "SailfishKeyProvider_xor_base64_decode: malloc failed");
+        return 0;
+    }
+
+    if (decode_tiles(alphabet, flags, encoded_data, encoded_size,
+                     keystream, decoded) != decoded_size) {
+        fprintf(stderr,
+                "%s\n",
+                "SailfishKeyProvider_xor_base64_decode: invalid data");
+        free(decoded);
+        return 0;
+    }
+
+    decoded[decoded_size] = '\0';
+    *decoded_data = decoded;
+    return decoded_size;
+}
+
+/*
+    Decodes the given \a encoded_data from Base64 encoding using the
+    given \a alphabet and \a flags, and XORs the result with the
+    repeating \a key.  Returns the size of the null terminated
+    \a decoded_data on success, or 0 on error.  The caller owns the
+    \a decoded_data and must free() it.
+*/
+size_t SailfishKeyProvider_xor_base64_decode(
+                    const SailfishKeyProvider_base64_alphabet *alphabet,
+                    int flags,
+                    const char *encoded_data,
+                    size_t encoded_size,
+                    const char *key,
+                    size_t key_size,
+                    char **decoded_data)
+{
+    SailfishKeyProvider_xor_keystream keystream;
+
+    if (decoded_data == NULL) {
+        return 0;
+    }
+    *decoded_data = NULL;
+    if (alphabet == NULL || encoded_data == NULL
+            || SailfishKeyProvider_xor_keystream_init(&keystream, key, key_size,
+                    SailfishKeyProvider_base64_decoded_length_flags(
+                            encoded_data, encoded_size, flags)) != 0) {
+        fprintf(stderr,
+                "%s\n",
+                "SailfishKeyProvider_xor_base64_decode: invalid arguments");
+        return 0;
+    }
+
+    return decode_with_keystream(alphabet, flags, encoded_data, encoded_size,
+                                 &keystream, decoded_data);
+}
+
+/*
+    Decodes each of the \a count null terminated \a encoded_data values
+    as SailfishKeyProvider_xor_base64_decode() does, expanding the \a key
+    only once for all of them.  Returns 0 on success, or -1 if any value
+    fails to decode, in which case no \a decoded_data is returned.
+*/
+int SailfishKeyProvider_xor_base64_decode_batch(
+                    const SailfishKeyProvider_base64_alphabet *alphabet,
+                    int flags,
+                    const char * const *encoded_data,
+                    size_t count,
+                    const char *key,
+                    size_t key_size,
+                    char **decoded_data)
+{
+    SailfishKeyProvider_xor_keystream keystream;
+    size_t i = 0;
+
+    if (alphabet == NULL || encoded_data == NULL || decoded_data == NULL
+            || SailfishKeyProvider_xor_keystream_init(&keystream, key, key_size, 0) != 0) {
+        fprintf(stderr,
+                "%s\n",
+                "SailfishKeyProvider_xor_base64_decode_batch: invalid arguments");
+        return -1;
+    }
+
+    for (i = 0; i < count; ++i) {
+        decoded_data[i] = NULL;
+    }
+    for (i = 0; i < count; ++i) {
+        keystream.offset = 0;
+        if (encoded_data[i] == NULL
+                || decode_with_keystream(alphabet, flags, encoded_data[i],
+                        strlen(encoded_data[i]), &keystream, &decoded_data[i]) == 0) {
+            while (i > 0) {
+                --i;
+                free(decoded_data[i]);
+                decoded_data[i] = NULL;
+            }
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+    Decodes the whole blocks of values \a first to \a last - 1, which
+    have been packed end to end into \a packed, in one call to the
+    Base64 kernel, and then XORs each of them into its place in the
+    \a arena, followed by its last, possibly padded, block.
+    Returns 0 on success, or -1 if any value is invalid.
+*/
+static int decode_packed(
+                    const SailfishKeyProvider_base64_alphabet *alphabet,
+                    int flags,
+                    const char * const *encoded_data,
+                    const size_t *encoded_sizes,
+                    const size_t *body_sizes,
+                    size_t first,
+                    size_t last,
+                    const char *packed,
+                    size_t packed_size,
+                    SailfishKeyProvider_xor_keystream *keystream,
+                    char *arena,
+                    const size_t *offsets)
+{
+    char bodies[XORBASE64_TILE_SIZE];
+    size_t position = 0, i = 0;
+
+    /* '=' is invalid within the packed blocks, as it should be */
+    if (packed_size > 0
+            && SailfishKeyProvider_base64_decode_into(
+                    alphabet, flags | SAILFISHKEYPROVIDER_BASE64_NO_PADDING,
+                    packed, packed_size, bodies) != packed_size / 4 * 3) {
+        return -1;
+    }
+
+    for (i = first; i < last; ++i) {
+        char *value = arena + offsets[i];
+        size_t body_size = body_sizes[i] / 4 * 3;
+        size_t value_size = offsets[i + 1] - offsets[i] - 1;
+        char tail[3];
+        size_t tail_size = SailfishKeyProvider_base64_decode_into(
+                alphabet, flags,
+                encoded_data[i] + body_sizes[i], encoded_sizes[i] - body_sizes[i],
+                tail);
+        if (tail_size == 0 || body_size + tail_size != value_size) {
+            return -1;
+        }
+
+        keystream->offset = 0;
+        SailfishKeyProvider_xor_keystream_apply(keystream, value, bodies + position, body_size);
+        SailfishKeyProvider_xor_keystream_apply(keystream, value + body_size, tail, tail_size);
+        value[value_size] = '\0';
+        position += body_size;
+    }
+    return 0;
+}
+
+/*
+    Decodes each of the \a count null terminated \a encoded_data values
+    as SailfishKeyProvider_xor_base64_decode() does, into one allocation
+    rather than one per value.  Value i is null terminated and starts at
+    \a *arena + \a offsets[i], where \a offsets has \a count + 1 entries
+    and the last is the size of the arena.
+
+    The sizes of the values are gathered first, so that the arena is
+    allocated once.  Then the whole Base64 blocks of as many values as
+    fit in a tile, but for the last block of each, are packed end to end
+    and decoded in a single call to the Base64 kernel, rather than a few
+    blocks at a time; values too large to share a tile are decoded on
+    their own.
+
+    Returns 0 on success, or -1 if any value fails to decode, in which
+    case no \a arena is returned.  The caller owns the \a arena and must
+    free() it.
+*/
+int SailfishKeyProvider_xor_base64_decode_arena(
+                    const SailfishKeyProvider_base64_alphabet *alphabet,
+                    int flags,
+                    const char * const *encoded_data,
+                    size_t count,
+                    const char *key,
+                    size_t key_size,
+                    char **arena,
+                    size_t *offsets)
+{
+    SailfishKeyProvider_xor_keystream keystream;
+    char packed[XORBASE64_ENCODED_TILE_SIZE];
+    size_t *encoded_sizes = NULL, *body_sizes = NULL;
+    char *decoded = NULL;
+    size_t packed_size = 0, first = 0, i = 0;
+    int retn = -1;
+
+    if (arena != NULL) {
+        *arena = NULL;
+    }
+    if (alphabet == NULL || encoded_data == NULL || arena == NULL || offsets == NULL
+            || SailfishKeyProvider_xor_keystream_init(&keystream, key, key_size, 0) != 0) {
+        fprintf(stderr,
+                "%s\n",
+                "SailfishKeyProvider_xor_base64_decode_arena: invalid arguments");
+        return -1;
+    }
+
+    encoded_sizes = (size_t *)malloc(2 * count * sizeof(size_t) + 1);
+    if (encoded_sizes == NULL) {
+        goto malloc_failed;
+    }
+    body_sizes = encoded_sizes + count;
+
+    offsets[0] = 0;
+    for (i = 0; i < count; ++i) {
+        size_t decoded_size = 0;
+        if (encoded_data[i] == NULL) {
+            goto invalid_data;
+        }
+        encoded_sizes[i] = strlen(encoded_data[i]);
+        decoded_size = SailfishKeyProvider_base64_decoded_length_flags(
+                encoded_data[i], encoded_sizes[i], flags);
+        if (decoded_size == 0) {
+            goto invalid_data;
+        }
+        body_sizes[i] = (encoded_sizes[i] - 1) / 4 * 4;
+        offsets[i + 1] = offsets[i] + decoded_size + 1;
+    }
+
+    decoded = (char *)malloc(offsets[count] + 1);
+    if (decoded == NULL) {
+        goto malloc_failed;
+    }
+
+    for (i = 0; i < count; ++i) {
+        if (packed_size + body_sizes[i] > sizeof(packed)) {
+            if (decode_packed(alphabet, flags, encoded_data, encoded_sizes, body_sizes,
+                              first, i, packed, packed_size,
+                              &keystream, decoded, offsets) != 0) {
+                goto invalid_data;
+            }
+            first = i;
+            packed_size = 0;
+        }
+        if (body_sizes[i] > sizeof(packed)) {
+            keystream.offset = 0;
+            if (decode_tiles(alphabet, flags, encoded_data[i], encoded_sizes[i],
+                             &keystream, decoded + offsets[i])
+                    != offsets[i + 1] - offsets[i] - 1) {
+                goto invalid_data;
+            }
+            decoded[offsets[i + 1] - 1] = '\0';
+            first = i + 1;
+            continue;
+        }
+        memcpy(packed + packed_size, encoded_data[i], body_sizes[i]);
+        packed_size += body_sizes[i];
+    }
+    if (decode_packed(alphabet, flags, encoded_data, encoded_sizes, body_sizes,
+                      first, count, packed, packed_size,
+                      &keystream, decoded, offsets) != 0) {
+        goto invalid_data;
+    }
+
+    *arena = decoded;
+    decoded = NULL;
+    retn = 0;
+    goto cleanup;
+
+invalid_data:
+    fprintf(stderr,
+            "%s\n",
+            "SailfishKeyProvider_xor_base64_decode_arena: invalid data");
+    goto cleanup;
+
+malloc_failed:
+    fprintf(stderr,
+            "%s\n",
+            "SailfishKeyProvider_xor_base64_decode_arena: malloc failed");
+
+cleanup:
+    free(encoded_sizes);
+    free(decoded);
+    return retn;
+}
@@ -0,0 +1,76 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Jolla Ltd.
+** Contact: Chris Adams <chris.adams@jollamobile.com>
+** All rights reserved.
+**
+** You may use this file under the terms of the GNU Lesser General
+** Public License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public
+** License version 2.1 as published by the Free Software Foundation
+** and appearing in the file license.lgpl included in the packaging
+** of this file.
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+** Lesser General Public License for more details.
+**
+****************************************************************************/
+
+#ifndef XORBASE64_H
+#define XORBASE64_H
+
+#include "base64ed.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+size_t SailfishKeyProvider_xor_base64_encode(
+                    const SailfishKeyProvider_base64_alphabet *alphabet,
+                    int flags,
+                    const char *data,
+                    size_t data_size,
+                    const char *key,
+                    size_t key_size,
+                    char **encoded_data);
+
+size_t SailfishKeyProvider_xor_base64_decode(
+                    const SailfishKeyProvider_base64_alphabet *alphabet,
+                    int flags,
+                    const char *encoded_data,
+                    size_t encoded_size,
+                    const char *key,
+                    size_t key_size,
+                    char **decoded_data);
+
+int SailfishKeyProvider_xor_base64_decode_batch(
+                    const SailfishKeyProvider_base64_alphabet *alphabet,
+                    int flags,
+                    const char * const *encoded_data,
+                    size_t count,
+                    const char *key,
+                    size_t key_size,
+                    char **decoded_data);
+
+int SailfishKeyProvider_xor_base64_decode_arena(
+                    const SailfishKeyProvider_base64_alphabet *alphabet,
+                    int flags,
+                    const char * const *encoded_data,
+                    size_t count,
+                    const char *key,
+                    size_t key_size,
+                    char **arena,
+                    size_t *offsets);
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* XORBASE64_H */
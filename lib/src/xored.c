@@ -23,17 +23,279 @@
 ****************************************************************************/
 
 #include "xored.h"
+#include "dispatch.h"
 
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 
+/*
+    The repeating key is XORed in runs over which it is contiguous, so
+    that each run can be processed a vector at a time with no per-byte
+    wrap of the key index.  Short keys are first expanded into a
+    keystream of whole repetitions at least
+    SAILFISHKEYPROVIDER_XOR_KEYSTREAM_MIN_SIZE bytes long, so that the
+    runs are long enough to be worth it.  The runs are XORed by a kernel
+    chosen when the library is loaded (see dispatch.c).
+*/
+
+#if defined(__GNUC__)
+typedef uint8_t xor_vector __attribute__((vector_size(32)));
+#define XOR_VECTOR_SIZE 32
+#if defined(__x86_64__) || defined(__i386__)
+#define XOR_VECTOR_AVX2
+#endif
+#endif
+
+/* XORs len bytes of in with the same number of bytes of keystream into
+   out, which may be the same buffer as in */
+typedef void (*xor_kernel)(uint8_t *, const uint8_t *, const uint8_t *, size_t);
+
+static void xor_words(uint8_t *out, const uint8_t *in, const uint8_t *keystream, size_t len)
+{
+    size_t i = 0;
+
+    for (; len - i >= sizeof(uint64_t); i += sizeof(uint64_t)) {
+        uint64_t a, k;
+        memcpy(&a, in + i, sizeof(a));
+        memcpy(&k, keystream + i, sizeof(k));
+        a ^= k;
+        memcpy(out + i, &a, sizeof(a));
+    }
+
+    for (; i < len; ++i) {
+        out[i] = in[i] ^ keystream[i];
+    }
+}
+
+#ifdef XOR_VECTOR_SIZE
+/* 64 bytes per iteration; memcpy keeps the loads unaligned-safe and
+   compiles to plain vector loads and stores, as wide as the target
+   of the function this is inlined into allows */
+__attribute__((always_inline))
+static inline void xor_vectors(uint8_t *out, const uint8_t *in, const uint8_t *keystream, size_t len)
+{
+    size_t i = 0;
+
+    for (; len - i >= 2 * XOR_VECTOR_SIZE; i += 2 * XOR_VECTOR_SIZE) {
+        xor_vector a0, a1, k0, k1;
+        memcpy(&a0, in + i, XOR_VECTOR_SIZE);
+        memcpy(&a1, in + i + XOR_VECTOR_SIZE, XOR_VECTOR_SIZE);
+        memcpy(&k0, keystream + i, XOR_VECTOR_SIZE);
+        memcpy(&k1, keystream + i + XOR_VECTOR_SIZE, XOR_VECTOR_SIZE);
+        a0 ^= k0;
+        a1 ^= k1;
+        memcpy(out + i, &a0, XOR_VECTOR_SIZE);
+        memcpy(out + i + XOR_VECTOR_SIZE, &a1, XOR_VECTOR_SIZE);
+    }
+
+    xor_words(out + i, in + i, keystream + i, len - i);
+}
+
+static void xor_vector_baseline(uint8_t *out, const uint8_t *in, const uint8_t *keystream, size_t len)
+{
+    xor_vectors(out, in, keystream, len);
+}
+#endif /* XOR_VECTOR_SIZE */
+
+#ifdef XOR_VECTOR_AVX2
+__attribute__((target("avx2")))
+static void xor_vector_avx2(uint8_t *out, const uint8_t *in, const uint8_t *keystream, size_t len)
+{
+    xor_vectors(out, in, keystream, len);
+}
+#endif
+
+static const char * const kernel_names[SAILFISHKEYPROVIDER_XOR_KERNEL_COUNT] = {
+    "scalar", "vector", "avx2"
+};
+
+static xor_kernel xor_run = xor_words;
+static int selected_kernel = SAILFISHKEYPROVIDER_XOR_KERNEL_SCALAR;
+
+int SailfishKeyProvider_xor_kernel_supported(int kernel)
+{
+    unsigned int features = SailfishKeyProvider_dispatch_cpu_features();
+    switch (kernel) {
+        case SAILFISHKEYPROVIDER_XOR_KERNEL_SCALAR:
+            return 1;
+#ifdef XOR_VECTOR_SIZE
+        case SAILFISHKEYPROVIDER_XOR_KERNEL_VECTOR:
+            return 1; /* lowered to whatever the baseline target offers */
+#endif
+#ifdef XOR_VECTOR_AVX2
+        case SAILFISHKEYPROVIDER_XOR_KERNEL_AVX2:
+            return (features & SAILFISHKEYPROVIDER_CPU_AVX2) != 0;
+#endif
+        default:
+            (void)features;
+            return 0;
+    }
+}
+
+static void set_kernel(int kernel)
+{
+    switch (kernel) {
+#ifdef XOR_VECTOR_SIZE
+        case SAILFISHKEYPROVIDER_XOR_KERNEL_VECTOR:
+            xor_run = xor_vector_baseline;
+            break;
+#endif
+#ifdef XOR_VECTOR_AVX2
+        case SAILFISHKEYPROVIDER_XOR_KERNEL_AVX2:
+            xor_run = xor_vector_avx2;
+            break;
+#endif
+        default:
+            kernel = SAILFISHKEYPROVIDER_XOR_KERNEL_SCALAR;
+            xor_run = xor_words;
+            break;
+    }
+    selected_kernel = kernel;
+}
+
+/*
+    Checks the \a kernel against the scalar kernel for every length up
+    to a few vectors, at every alignment of a vector.
+    Returns 0 if it agrees, or -1 otherwise.
+*/
+static int self_test(int kernel)
+{
+    uint8_t in[200], keystream[200], expected[200], actual[200];
+    int previous = selected_kernel;
+    size_t offset = 0, len = 0, i = 0;
+    int retn = 0;
+
+    for (i = 0; i < sizeof(in); ++i) {
+        in[i] = (uint8_t)(i * 151 + 3);
+        keystream[i] = (uint8_t)(i * 89 + 41);
+    }
+
+    set_kernel(kernel);
+    for (offset = 0; offset < 32 && retn == 0; ++offset) {
+        for (len = 0; offset + len <= sizeof(in) && retn == 0; len += 7) {
+            xor_words(expected, in + offset, keystream, len);
+            xor_run(actual, in + offset, keystream, len);
+            if (memcmp(actual, expected, len) != 0) {
+                retn = -1;
+            }
+        }
+    }
+    set_kernel(previous);
+    return retn;
+}
+
+const SailfishKeyProvider_dispatch_family SailfishKeyProvider_xor_family = {
+    "xor",
+    SAILFISHKEYPROVIDER_XOR_KERNEL_COUNT,
+    SailfishKeyProvider_xor_kernel_supported,
+    self_test,
+    set_kernel,
+    SailfishKeyProvider_xor_kernel_name
+};
+
+/*
+    Overrides the kernel chosen for this cpu, for testing and benchmarking.
+    Returns 0 on success, or -1 if the \a kernel is not supported.
+*/
+int SailfishKeyProvider_xor_select_kernel(int kernel)
+{
+    if (!SailfishKeyProvider_xor_kernel_supported(kernel)) {
+        return -1;
+    }
+    set_kernel(kernel);
+    return 0;
+}
+
+int SailfishKeyProvider_xor_selected_kernel()
+{
+    return selected_kernel;
+}
+
+const char * SailfishKeyProvider_xor_kernel_name(int kernel)
+{
+    if (kernel < 0 || kernel >= SAILFISHKEYPROVIDER_XOR_KERNEL_COUNT) {
+        return NULL;
+    }
+    return kernel_names[kernel];
+}
+
+/*
+    Prepares \a keystream to XOR data with the repeating \a key, which
+    must remain valid while the keystream is used.  If the total length
+    of the data is known it may be given as \a valueLen, so that a short
+    key is only expanded as far as needed; otherwise pass 0.
+    Returns 0 on success, or -1 if the key is empty.
+*/
+int SailfishKeyProvider_xor_keystream_init(
+                    SailfishKeyProvider_xor_keystream * keystream,
+                    const char * key,
+                    size_t keyLen,
+                    size_t valueLen)
+{
+    size_t needed = SAILFISHKEYPROVIDER_XOR_KEYSTREAM_MIN_SIZE;
+
+    if (keystream == NULL || key == NULL || keyLen == 0) {
+        return -1;
+    }
+
+    keystream->keystream = (const uint8_t *)key;
+    keystream->period = keyLen;
+    keystream->offset = 0;
+
+    if (valueLen > 0 && valueLen < needed) {
+        needed = valueLen;
+    }
+    if (keyLen < needed) {
+        /* expand the key into whole repetitions; the result is
+           < 2 * SAILFISHKEYPROVIDER_XOR_KEYSTREAM_MIN_SIZE */
+        size_t period = 0;
+        while (period < needed) {
+            memcpy(keystream->expanded + period, key, keyLen);
+            period += keyLen;
+        }
+        keystream->keystream = keystream->expanded;
+        keystream->period = period;
+    }
+
+    return 0;
+}
+
+/*
+    XORs the \a len bytes of \a in with the next \a len bytes of the
+    \a keystream into \a out, which may be the same buffer as \a in.
+*/
+void SailfishKeyProvider_xor_keystream_apply(
+                    SailfishKeyProvider_xor_keystream * keystream,
+                    char * out,
+                    const char * in,
+                    size_t len)
+{
+    size_t i = 0;
+
+    while (i < len) {
+        size_t run = keystream->period - keystream->offset;
+        if (run > len - i) {
+            run = len - i;
+        }
+        xor_run((uint8_t *)out + i,
+                (const uint8_t *)in + i,
+                keystream->keystream + keystream->offset,
+                run);
+        i += run;
+        keystream->offset += run;
+        if (keystream->offset == keystream->period) {
+            keystream->offset = 0;
+        }
+    }
+}
+
 /*
     Encodes the given \a plainTextValue via bytewise XOR with the
     given \a encodingKey.  The returned buffer will have the same
-    length as the given \a ptvLen.  The caller owns the returned
-    buffer.
+    length as the given \a ptvLen, and is null terminated.  The
+    caller owns the returned buffer.
 */
 char * SailfishKeyProvider_xor_encode(
                     const char * plainTextValue,
@@ -42,25 +304,25 @@ char * SailfishKeyProvider_xor_encode(
                     size_t ekLen)
 {
     /* this function assumes that the input is xor encoded only. */
-    size_t i = 0;
-    size_t keyIdx = ekLen;
-    char * retn = (char *)malloc(ptvLen+1);
+    SailfishKeyProvider_xor_keystream keystream;
+    char * retn = NULL;
+    if (SailfishKeyProvider_xor_keystream_init(&keystream, encodingKey, ekLen, ptvLen) != 0) {
+        fprintf(stderr,
+                "%s\n",
+                "SailfishKeyProvider_xor_encode: empty key");
+        return NULL;
+    }
+
+    retn = (char *)malloc(ptvLen+1);
     if (retn == NULL) {
         fprintf(stderr,
                 "%s\n",
                 "SailfishKeyProvider_xor_encode: malloc failed");
         return NULL;
     }
-    memset(retn, 0, ptvLen+1);
 
-    for (i = 0; i < ptvLen; ++i) {
-        keyIdx += 1;
-        if (keyIdx >= ekLen) {
-            keyIdx = 0;
-        }
-
-        retn[i] = plainTextValue[i] ^ encodingKey[keyIdx];
-    }
+    SailfishKeyProvider_xor_keystream_apply(&keystream, retn, plainTextValue, ptvLen);
+    retn[ptvLen] = '\0';
 
     return retn; /* caller takes ownership and must free() */
 }
@@ -77,3 +339,27 @@ char * SailfishKeyProvider_xor_decode(
     return SailfishKeyProvider_xor_encode(
                 xorEncodedValue, xevLen, decodingKey, dkLen);
 }
+
+/*
+    XORs the \a valueLen bytes of \a value with the given \a key in
+    place, with no allocation.  Since XOR is its own inverse, this both
+    encodes and decodes.  Returns 0 on success, or -1 if the key is empty.
+*/
+int SailfishKeyProvider_xor_inplace(
+                    char * value,
+                    size_t valueLen,
+                    const char * key,
+                    size_t keyLen)
+{
+    SailfishKeyProvider_xor_keystream keystream;
+    if ((value == NULL && valueLen > 0)
+            || SailfishKeyProvider_xor_keystream_init(&keystream, key, keyLen, valueLen) != 0) {
+        fprintf(stderr,
+                "%s\n",
+                "SailfishKeyProvider_xor_inplace: invalid arguments");
+        return -1;
+    }
+
+    SailfishKeyProvider_xor_keystream_apply(&keystream, value, value, valueLen);
+    return 0;
+}
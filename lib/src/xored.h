@@ -25,12 +25,51 @@
 #ifndef XORED_H
 #define XORED_H
 
+#include "dispatch.h"
+
 #include <stdint.h>
 #include <stdlib.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
+#define SAILFISHKEYPROVIDER_XOR_KEYSTREAM_MIN_SIZE 256
+#define SAILFISHKEYPROVIDER_XOR_KEYSTREAM_MAX_SIZE (2 * SAILFISHKEYPROVIDER_XOR_KEYSTREAM_MIN_SIZE)
+
+/* Kernels which may be selected, if the cpu supports them */
+#define SAILFISHKEYPROVIDER_XOR_KERNEL_SCALAR 0
+#define SAILFISHKEYPROVIDER_XOR_KERNEL_VECTOR 1 /* baseline vector unit */
+#define SAILFISHKEYPROVIDER_XOR_KERNEL_AVX2   2
+#define SAILFISHKEYPROVIDER_XOR_KERNEL_COUNT  3
+
+/* A repeating key, expanded once so that it can be applied in long runs,
+   and the position within it; see SailfishKeyProvider_xor_keystream_init() */
+typedef struct SailfishKeyProvider_xor_keystream {
+    uint8_t expanded[SAILFISHKEYPROVIDER_XOR_KEYSTREAM_MAX_SIZE];
+    const uint8_t *keystream;
+    size_t period;
+    size_t offset;
+} SailfishKeyProvider_xor_keystream;
+
+extern const SailfishKeyProvider_dispatch_family SailfishKeyProvider_xor_family;
+
+int SailfishKeyProvider_xor_kernel_supported(int kernel);
+int SailfishKeyProvider_xor_select_kernel(int kernel);
+int SailfishKeyProvider_xor_selected_kernel();
+const char * SailfishKeyProvider_xor_kernel_name(int kernel);
+
+int SailfishKeyProvider_xor_keystream_init(
+                    SailfishKeyProvider_xor_keystream * keystream,
+                    const char * key,
+                    size_t keyLen,
+                    size_t valueLen);
+
+void SailfishKeyProvider_xor_keystream_apply(
+                    SailfishKeyProvider_xor_keystream * keystream,
+                    char * out,
+                    const char * in,
+                    size_t len);
+
 char * SailfishKeyProvider_xor_encode(
                     const char * plainTextValue,
                     size_t ptvLen,
@@ -42,6 +81,12 @@ char * SailfishKeyProvider_xor_decode(
                     size_t xevLen,
                     const char * decodingKey,
                     size_t dkLen);
+
+int SailfishKeyProvider_xor_inplace(
+                    char * value,
+                    size_t valueLen,
+                    const char * key,
+                    size_t keyLen);
 #ifdef __cplusplus
 }
 #endif
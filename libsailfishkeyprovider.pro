@@ -1,4 +1,4 @@
 TEMPLATE=subdirs
-SUBDIRS=lib src tests
+SUBDIRS=lib src tests tests/tst_processmutex benchmarks
 CONFIG += ordered
 OTHER_FILES+=rpm/libsailfishkeyprovider.spec
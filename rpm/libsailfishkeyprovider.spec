@@ -1,7 +1,7 @@
 Name:    libsailfishkeyprovider
 License: LGPLv2
 URL:     https://github.com/sailfishos/libsailfishkeyprovider
-Version: 1.0.1
+Version: 2.0.0
 Release: 1
 Source0: %{name}-%{version}.tar.bz2
 Summary: Library providing access to decoded OAuth2 keys
@@ -51,12 +51,16 @@ Better than modify the source code of and then running unit tests.
 %files devel
 %{_libdir}/libsailfishkeyprovider.so
 %{_includedir}/libsailfishkeyprovider/sailfishkeyprovider.h
+%{_includedir}/libsailfishkeyprovider/sailfishkeyprovider_context.h
 %{_includedir}/libsailfishkeyprovider/sailfishkeyprovider_iniparser.h
 %{_includedir}/libsailfishkeyprovider/sailfishkeyprovider_processmutex.h
+%{_includedir}/libsailfishkeyprovider/sailfishkeyprovider_schemes.h
 %{_libdir}/pkgconfig/libsailfishkeyprovider.pc
 
 %files tests
 /opt/tests/libsailfishkeyprovider/tst_keyprovider
+/opt/tests/libsailfishkeyprovider/tst_processmutex
+/opt/tests/libsailfishkeyprovider/bench_keyprovider
 /opt/tests/libsailfishkeyprovider/tests.xml
 
 %files keygen
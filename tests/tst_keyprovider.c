@@ -6,10 +6,26 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "sailfishkeyprovider.h"
+#include "sailfishkeyprovider_context.h"
 #include "sailfishkeyprovider_iniparser.h"
+#include "sailfishkeyprovider_processmutex.h"
+#include "sailfishkeyprovider_schemes.h"
 #include "base64ed.h"
+#include "base64ed_simd.h"
+#include "chacha20.h"
+#include "dispatch.h"
+#include "iniparser.h"
+#include "keycache.h"
+#include "keystorelock.h"
+#include "xorbase64.h"
 #include "xored.h"
 
 #define TEST_PASS 0
@@ -26,6 +42,28 @@ int test_xor_roundtrip();
 int test_key_encdec_roundtrip();
 int test_stored_key();
 int test_store_key();
+int test_keycache_fragments();
+int test_ini_preserve_format();
+int test_sharded_store();
+int test_ini_remove();
+int test_ini_remove_section();
+int test_remove_key();
+int test_b64_kernels();
+int test_b64_stream();
+int test_b64_inplace();
+int test_b64_url();
+int test_xor_inplace();
+int test_xor_base64();
+int test_scheme_registry();
+int test_chacha20();
+int test_decode_keys();
+int test_dispatch();
+int test_concurrent_store();
+int test_ini_locking();
+int test_lock_stats();
+int test_group_commit();
+int test_context();
+int test_home_stores();
 
 int generate_keys(int inputsSize, char *inputs[], char *encodingScheme, char *encodingKey);
 
@@ -45,7 +83,7 @@ int main(int argc, char *argv[])
     int passCount = 0, failCount = 0, skipCount = 0;
 
     int i = 0;
-    int testCount = 10;
+    int testCount = 32;
     int results[] = {
         test_ini_roundtrip(),
         test_b64_encode(),
@@ -56,7 +94,29 @@ int main(int argc, char *argv[])
         test_xor_roundtrip(),
         test_key_encdec_roundtrip(),
         test_stored_key(),
-        test_store_key()
+        test_store_key(),
+        test_keycache_fragments(),
+        test_ini_preserve_format(),
+        test_sharded_store(),
+        test_ini_remove(),
+        test_ini_remove_section(),
+        test_remove_key(),
+        test_b64_kernels(),
+        test_b64_stream(),
+        test_b64_inplace(),
+        test_b64_url(),
+        test_xor_inplace(),
+        test_xor_base64(),
+        test_scheme_registry(),
+        test_chacha20(),
+        test_decode_keys(),
+        test_dispatch(),
+        test_concurrent_store(),
+        test_ini_locking(),
+        test_lock_stats(),
+        test_group_commit(),
+        test_context(),
+        test_home_stores()
     };
 
     (void)argc;
@@ -701,6 +761,240 @@ int test_store_key()
     return TEST_PASS;
 }
 
+int test_keycache_fragments()
+{
+    char directory[] = "/tmp/tst_keyprovider_XXXXXX";
+    char path[1024];
+    const char *names[] = { "20-second.ini", "10-first.ini", "30-third.ini" };
+    const char *values[] = { "second", "first", "third" };
+    SailfishKeyProvider_KeyCache *cache = NULL;
+    const char *value = NULL;
+    int result = TEST_PASS;
+    int i = 0;
+
+    if (mkdtemp(directory) == NULL) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_keycache_fragments: unable to create directory");
+        return TEST_FAIL;
+    }
+
+    for (i = 0; i < 3; ++i) {
+        FILE *stream = NULL;
+        snprintf(path, sizeof(path), "%s/%s", directory, names[i]);
+        stream = fopen(path, "w");
+        if (stream == NULL) {
+            fprintf(stdout,
+                    "FAIL!    %s\n",
+                    "test_keycache_fragments: unable to write fragment");
+            return TEST_FAIL;
+        }
+        fprintf(stream,
+                "[encodedkeys]\nshared/key=%s\nunique/%s=%d\n",
+                values[i], values[i], i);
+        fclose(stream);
+    }
+
+    /* parse with more workers than fragments */
+    cache = SailfishKeyProvider_keycache_build(directory, 4);
+    if (cache == NULL || SailfishKeyProvider_keycache_count(cache) != 4) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_keycache_fragments: unexpected entry count");
+        result = TEST_FAIL;
+    } else {
+        /* the fragment which sorts first takes precedence */
+        value = SailfishKeyProvider_keycache_lookup(cache, "encodedkeys", "shared/key");
+        if (value == NULL || strcmp(value, "first") != 0) {
+            fprintf(stdout,
+                    "FAIL!    %s\n",
+                    "test_keycache_fragments: wrong fragment precedence");
+            result = TEST_FAIL;
+        }
+
+        value = SailfishKeyProvider_keycache_lookup(cache, "encodedkeys", "unique/third");
+        if (value == NULL || strcmp(value, "2") != 0) {
+            fprintf(stdout,
+                    "FAIL!    %s\n",
+                    "test_keycache_fragments: missing key");
+            result = TEST_FAIL;
+        }
+
+        value = SailfishKeyProvider_keycache_lookup(cache, "encoding", "shared/key");
+        if (value != NULL) {
+            fprintf(stdout,
+                    "FAIL!    %s\n",
+                    "test_keycache_fragments: key found in wrong section");
+            result = TEST_FAIL;
+        }
+    }
+    SailfishKeyProvider_keycache_free(cache);
+
+    /* the shared view notices a fragment edited in place, which leaves
+       the directory itself untouched */
+    if (result == TEST_PASS) {
+        char *read = SailfishKeyProvider_keycache_read(directory, "encodedkeys", "shared/key");
+        FILE *stream = NULL;
+        if (read == NULL || strcmp(read, "first") != 0) {
+            fprintf(stdout,
+                    "FAIL!    %s\n",
+                    "test_keycache_fragments: unexpected shared value");
+            result = TEST_FAIL;
+        }
+        free(read);
+
+        snprintf(path, sizeof(path), "%s/%s", directory, "10-first.ini");
+        stream = fopen(path, "r+");
+        if (stream != NULL) {
+            fprintf(stream, "[encodedkeys]\nshared/key=edited\n");
+            fflush(stream);
+            if (ftruncate(fileno(stream), ftell(stream)) != 0) {
+                result = TEST_FAIL;
+            }
+            fclose(stream);
+        }
+
+        read = SailfishKeyProvider_keycache_read(directory, "encodedkeys", "shared/key");
+        if (stream == NULL || read == NULL || strcmp(read, "edited") != 0) {
+            fprintf(stdout,
+                    "FAIL!    %s\n",
+                    "test_keycache_fragments: stale value after in-place edit");
+            result = TEST_FAIL;
+        }
+        free(read);
+    }
+
+    for (i = 0; i < 3; ++i) {
+        snprintf(path, sizeof(path), "%s/%s", directory, names[i]);
+        unlink(path);
+    }
+    rmdir(directory);
+
+    if (result == TEST_PASS) {
+        fprintf(stdout,
+                "%s\n",
+                "PASS!    test_keycache_fragments");
+    }
+    return result;
+}
+
+static char * read_file_contents(const char *filename)
+{
+    FILE *stream = fopen(filename, "r");
+    char *contents = NULL;
+    long size = 0;
+    if (stream == NULL) {
+        return NULL;
+    }
+    fseek(stream, 0, SEEK_END);
+    size = ftell(stream);
+    rewind(stream);
+    contents = (char*)calloc(size + 1, 1);
+    if (contents != NULL && fread(contents, 1, size, stream) != (size_t)size) {
+        free(contents);
+        contents = NULL;
+    }
+    fclose(stream);
+    return contents;
+}
+
+int test_ini_preserve_format()
+{
+    const char *filename = "/tmp/tst_keyprovider_format.ini";
+    const char *original =
+            "; stored keys\n"
+            "[encoding]\n"
+            "  first/key=AAAA ; comment\n"
+            "\n"
+            "second/key=BBBB\n"
+            "[encodedkeys]\n"
+            "first/value=CCCC";
+    const char *expectedSameLength =
+            "; stored keys\n"
+            "[encoding]\n"
+            "  first/key=XXXX ; comment\n"
+            "\n"
+            "second/key=YYYY\n"
+            "[encodedkeys]\n"
+            "first/value=CCCC";
+    const char *expectedSpliced =
+            "; stored keys\n"
+            "[encoding]\n"
+            "  first/key=XXXX ; comment\n"
+            "\n"
+            "second/key=Z\n"
+            "third/key=DDDD\n"
+            "[encodedkeys]\n"
+            "first/value=CCCC\n"
+            "second/value=EEEE\n"
+            "\n"
+            "[newsection]\n"
+            "first/value=\n";
+    SailfishKeyProvider_ini_update updates[] = {
+        { "encoding", "first/key", "XXXX" },
+        { "encoding", "second/key", "YYYY" }
+    };
+    SailfishKeyProvider_ini_update moreUpdates[] = {
+        { "encoding", "second/key", "Z" },
+        { "encodedkeys", "second/value", "EEEE" },
+        { "newsection", "first/value", "" },
+        { "encoding", "third/key", "DDDD" }
+    };
+    char *contents = NULL;
+    char *value = NULL;
+    FILE *stream = fopen(filename, "w");
+    if (stream == NULL) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_ini_preserve_format: unable to create file");
+        return TEST_FAIL;
+    }
+    fputs(original, stream);
+    fclose(stream);
+
+    /* same-length values are patched in place */
+    if (SailfishKeyProvider_ini_write_updates("/tmp", filename, updates, 2) != 0
+            || (contents = read_file_contents(filename)) == NULL
+            || strcmp(contents, expectedSameLength) != 0) {
+        fprintf(stdout,
+                "FAIL!    %s\n        actual: %s\n",
+                "test_ini_preserve_format: same length update",
+                contents);
+        free(contents);
+        return TEST_FAIL;
+    }
+    free(contents);
+
+    /* other updates are spliced in, leaving everything else intact */
+    if (SailfishKeyProvider_ini_write_updates("/tmp", filename, moreUpdates, 4) != 0
+            || (contents = read_file_contents(filename)) == NULL
+            || strcmp(contents, expectedSpliced) != 0) {
+        fprintf(stdout,
+                "FAIL!    %s\n        actual: %s\n",
+                "test_ini_preserve_format: spliced update",
+                contents);
+        free(contents);
+        return TEST_FAIL;
+    }
+    free(contents);
+
+    value = SailfishKeyProvider_ini_read(filename, "encoding", "first/key");
+    if (value == NULL || strcmp(value, "XXXX") != 0) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_ini_preserve_format: read back failed");
+        free(value);
+        return TEST_FAIL;
+    }
+    free(value);
+    unlink(filename);
+
+    fprintf(stdout,
+            "%s\n",
+            "PASS!    test_ini_preserve_format");
+    return TEST_PASS;
+}
+
 /*
     The following code is used to generate encoded keys
 */
@@ -734,3 +1028,1821 @@ int generate_keys(int inputsSize, char *inputs[], char *encodingScheme, char *en
 
     return inputsSize;
 }
+
+int test_sharded_store()
+{
+#ifdef SAILFISHKEYPROVIDER_SHARDED_KEYSTORE
+    char directory[512];
+    char legacyFile[768];
+    char migratedFile[1024];
+    char shardFile[1024];
+    char otherShardFile[1024];
+    char *stored_consumer_key = NULL;
+    char *value = NULL;
+    int success = 0;
+    FILE *stream = NULL;
+
+    snprintf(directory, sizeof(directory),
+             "%s/.local/share/system/privileged/Keys", getenv("HOME"));
+    snprintf(legacyFile, sizeof(legacyFile), "%s/storedkeys.ini", directory);
+    snprintf(migratedFile, sizeof(migratedFile), "%s.migrated", legacyFile);
+    snprintf(shardFile, sizeof(shardFile), "%s/tst_shard.ini", directory);
+    snprintf(otherShardFile, sizeof(otherShardFile), "%s/tst%%2Eother.ini", directory);
+
+    /* a store written by an older version, holding two providers */
+    if (SailfishKeyProvider_ini_write(directory, legacyFile,
+                "encoding", "tst_shard/scheme", "xor") != 0
+            || SailfishKeyProvider_ini_write(directory, legacyFile,
+                "encoding", "tst_shard/key", "TestKey123") != 0
+            || SailfishKeyProvider_ini_write(directory, legacyFile,
+                "encodedkeys", "tst_shard/svc/consumer_key", "FScwMHpXSgUH") != 0
+            || SailfishKeyProvider_ini_write(directory, legacyFile,
+                "encodedkeys", "tst.other/svc/consumer_key", "OTHER") != 0
+            || SailfishKeyProvider_ini_write(directory, legacyFile,
+                "encodedkeys", "/svc/consumer_key", "NOPROVIDER") != 0) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_sharded_store: unable to create legacy store");
+        return TEST_FAIL;
+    }
+
+    /* a newer shard value takes precedence over the legacy one */
+    stream = fopen(otherShardFile, "w");
+    if (stream != NULL) {
+        fputs("[encodedkeys]\ntst.other/svc/consumer_key=NEWER\n", stream);
+        fclose(stream);
+    }
+
+    success = SailfishKeyProvider_storedKey(
+            "tst_shard",
+            "svc",
+            "consumer_key",
+            &stored_consumer_key);
+    if (success != 0 || stored_consumer_key == NULL
+            || strcmp(stored_consumer_key, "ABCD12345") != 0) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_sharded_store: failed to retrieve migrated key");
+        free(stored_consumer_key);
+        return TEST_FAIL;
+    }
+    free(stored_consumer_key);
+
+    if (access(legacyFile, F_OK) == 0 || access(migratedFile, F_OK) != 0
+            || access(shardFile, F_OK) != 0) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_sharded_store: legacy store not migrated");
+        return TEST_FAIL;
+    }
+
+    value = SailfishKeyProvider_ini_read(otherShardFile, "encodedkeys", "tst.other/svc/consumer_key");
+    if (value == NULL || strcmp(value, "NEWER") != 0) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_sharded_store: legacy value overwrote newer shard value");
+        free(value);
+        return TEST_FAIL;
+    }
+    free(value);
+
+    /* a provider name which cannot name a shard is refused */
+    if (SailfishKeyProvider_storeKey("", "svc", "consumer_key",
+                                     "FScwMHpXSgUH", "xor", "TestKey123") == 0) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_sharded_store: stored a key of an empty provider");
+        return TEST_FAIL;
+    }
+
+    unlink(migratedFile);
+    unlink(shardFile);
+    unlink(otherShardFile);
+    fprintf(stdout,
+            "%s\n",
+            "PASS!    test_sharded_store");
+    return TEST_PASS;
+#else
+    fprintf(stdout,
+            "SKIPPED! %s\n",
+            "test_sharded_store: sharded key store not enabled");
+    return TEST_SKIP;
+#endif
+}
+
+int test_ini_remove()
+{
+    const char *filename = "/tmp/tst_keyprovider_remove.ini";
+    const char *original =
+            "[encoding]\n"
+            "first/key=AAAA\n"
+            "second/key=BBBB\n"
+            "\n"
+            "[removed]\n"
+            "first/key=CCCC\n"
+            "[encodedkeys]\n"
+            "first/value=DDDD\n"
+            "[removed]\n"
+            "second/key=EEEE";
+    const char *expected =
+            "[encoding]\n"
+            "second/key=BBBB\n"
+            "\n"
+            "[encodedkeys]\n"
+            "first/value=DDDD\n"
+            "second/value=FFFF\n";
+    SailfishKeyProvider_ini_update updates[] = {
+        { "encodedkeys", "second/value", "FFFF" },
+        { "encoding", "first/key", NULL }
+    };
+    char *contents = NULL;
+    FILE *stream = fopen(filename, "w");
+    if (stream == NULL) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_ini_remove: unable to create file");
+        return TEST_FAIL;
+    }
+    fputs(original, stream);
+    fclose(stream);
+
+    /* removals and writes share a single pass over the file */
+    if (SailfishKeyProvider_ini_remove(filename, "removed", NULL) != 0
+            || SailfishKeyProvider_ini_write_updates("/tmp", filename, updates, 2) != 0
+            || SailfishKeyProvider_ini_remove(filename, "missing", "first/key") != 0
+            || (contents = read_file_contents(filename)) == NULL
+            || strcmp(contents, expected) != 0) {
+        fprintf(stdout,
+                "FAIL!    %s\n        actual: %s\n",
+                "test_ini_remove: unexpected contents",
+                contents);
+        free(contents);
+        return TEST_FAIL;
+    }
+    free(contents);
+    unlink(filename);
+
+    /* removing from a file which does not exist does not create it */
+    if (SailfishKeyProvider_ini_remove(filename, "encoding", "first/key") != 0
+            || access(filename, F_OK) == 0) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_ini_remove: removal from missing file");
+        return TEST_FAIL;
+    }
+
+    fprintf(stdout,
+            "%s\n",
+            "PASS!    test_ini_remove");
+    return TEST_PASS;
+}
+
+int test_ini_remove_section()
+{
+    const char *filename = "/tmp/tst_keyprovider_remove_section.ini";
+    const char *expected = "[b]\nx=y\n";
+    char *contents = NULL;
+    FILE *stream = fopen(filename, "w");
+    if (stream == NULL) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_ini_remove_section: unable to create file");
+        return TEST_FAIL;
+    }
+    fputs("[a]\nk=v\n\n[b]\nx=y\n", stream);
+    fclose(stream);
+
+    /* a section followed by another is removed by itself */
+    if (SailfishKeyProvider_ini_remove(filename, "a", NULL) != 0
+            || (contents = read_file_contents(filename)) == NULL
+            || strcmp(contents, expected) != 0) {
+        fprintf(stdout,
+                "FAIL!    %s\n        actual: %s\n",
+                "test_ini_remove_section: unexpected contents",
+                contents);
+        free(contents);
+        unlink(filename);
+        return TEST_FAIL;
+    }
+    free(contents);
+    unlink(filename);
+
+    fprintf(stdout,
+            "%s\n",
+            "PASS!    test_ini_remove_section");
+    return TEST_PASS;
+}
+
+int test_remove_key()
+{
+    char *stored_consumer_key = NULL;
+    int success = 0;
+
+    /* removing a static key hides it */
+    if (SailfishKeyProvider_removeKey(
+                "tst_keyprovider",
+                "test_stored_key",
+                "consumer_key") != 0
+            || SailfishKeyProvider_storedKey(
+                "tst_keyprovider",
+                "test_stored_key",
+                "consumer_key",
+                &stored_consumer_key) != 1
+            || stored_consumer_key != NULL) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_remove_key: removed key still visible");
+        free(stored_consumer_key);
+        return TEST_FAIL;
+    }
+
+    /* storing it again clears the removal */
+    if (SailfishKeyProvider_storeKey(
+                "tst_keyprovider",
+                "test_stored_key",
+                "consumer_key",
+                "FScwMHpXSgUH",
+                "xor",
+                "TestKey123") != 0) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_remove_key: failed to store key");
+        return TEST_FAIL;
+    }
+    success = SailfishKeyProvider_storedKey(
+            "tst_keyprovider",
+            "test_stored_key",
+            "consumer_key",
+            &stored_consumer_key);
+    if (success != 0 || stored_consumer_key == NULL
+            || strcmp(stored_consumer_key, "ABCD12345") != 0) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_remove_key: failed to retrieve stored key");
+        free(stored_consumer_key);
+        return TEST_FAIL;
+    }
+    free(stored_consumer_key);
+
+    fprintf(stdout,
+            "%s\n",
+            "PASS!    test_remove_key");
+    return TEST_PASS;
+}
+
+/*
+    Compares each vectorised base64 kernel supported by this cpu
+    against the scalar reference, over random inputs of many sizes,
+    for both the standard and the url alphabet.
+*/
+static int compare_b64_kernel(int kernel,
+                              const SailfishKeyProvider_base64_alphabet *alphabet,
+                              int flags,
+                              const char *data,
+                              size_t data_size,
+                              int corrupt)
+{
+    char *expected_encoded = NULL, *actual_encoded = NULL;
+    char *expected_decoded = NULL, *actual_decoded = NULL;
+    size_t expected_encoded_size = 0, actual_encoded_size = 0;
+    size_t expected_decoded_size = 0, actual_decoded_size = 0;
+    int retn = -1;
+
+    SailfishKeyProvider_base64_select_kernel(SAILFISHKEYPROVIDER_BASE64_KERNEL_SCALAR);
+    expected_encoded_size = SailfishKeyProvider_base64_encode_alphabet(
+            alphabet, flags, data, data_size, &expected_encoded);
+    SailfishKeyProvider_base64_select_kernel(kernel);
+    actual_encoded_size = SailfishKeyProvider_base64_encode_alphabet(
+            alphabet, flags, data, data_size, &actual_encoded);
+    if (expected_encoded_size == 0 || actual_encoded_size != expected_encoded_size
+            || memcmp(actual_encoded, expected_encoded, expected_encoded_size) != 0) {
+        goto cleanup;
+    }
+
+    if (corrupt) {
+        /* anything outside the alphabet must be rejected, wherever it
+           is; the last two characters may legitimately be padding */
+        const char invalid[] = { '=', '+', '/', '-', '_', ' ', '\n', '.', '\x80', '\xff' };
+        size_t positions = (flags & SAILFISHKEYPROVIDER_BASE64_NO_PADDING)
+                ? expected_encoded_size : expected_encoded_size - 2;
+        size_t position = (size_t)rand() % positions;
+        char replacement = invalid[rand() % sizeof(invalid)];
+        while (memchr(alphabet->charset, replacement, 64) != NULL) {
+            replacement = invalid[rand() % sizeof(invalid)];
+        }
+        expected_encoded[position] = replacement;
+        memcpy(actual_encoded, expected_encoded, expected_encoded_size);
+    }
+
+    SailfishKeyProvider_base64_select_kernel(SAILFISHKEYPROVIDER_BASE64_KERNEL_SCALAR);
+    expected_decoded_size = SailfishKeyProvider_base64_decode_alphabet(
+            alphabet, flags, expected_encoded, expected_encoded_size, &expected_decoded);
+    SailfishKeyProvider_base64_select_kernel(kernel);
+    actual_decoded_size = SailfishKeyProvider_base64_decode_alphabet(
+            alphabet, flags, actual_encoded, actual_encoded_size, &actual_decoded);
+    if (actual_decoded_size != expected_decoded_size
+            || (corrupt && actual_decoded_size != 0)
+            || (!corrupt && (actual_decoded_size != data_size
+                    || memcmp(actual_decoded, data, data_size) != 0
+                    || memcmp(expected_decoded, data, data_size) != 0))) {
+        goto cleanup;
+    }
+
+    retn = 0;
+cleanup:
+    free(expected_encoded);
+    free(actual_encoded);
+    free(expected_decoded);
+    free(actual_decoded);
+    return retn;
+}
+
+int test_b64_kernels()
+{
+    int defaultKernel = SailfishKeyProvider_base64_selected_kernel();
+    size_t maxSize = 70000;
+    char *data = (char *)malloc(maxSize);
+    const SailfishKeyProvider_base64_alphabet *alphabets[] = {
+        &SailfishKeyProvider_base64_standard,
+        &SailfishKeyProvider_base64_url
+    };
+    int flags[] = { 0, SAILFISHKEYPROVIDER_BASE64_NO_PADDING };
+    int kernel = 0, tested = 0, a = 0;
+    size_t i = 0, size = 0;
+
+    if (data == NULL) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_b64_kernels: malloc failed");
+        return TEST_FAIL;
+    }
+
+    srand(0x5ea1f15);
+    for (kernel = 1; kernel < SAILFISHKEYPROVIDER_BASE64_KERNEL_COUNT; ++kernel) {
+        if (!SailfishKeyProvider_base64_kernel_supported(kernel)) {
+            continue;
+        }
+        tested++;
+        for (a = 0; a < 2; ++a) {
+            for (size = 1; size < maxSize; size = (size < 300) ? size + 1 : size * 3 + 1) {
+                for (i = 0; i < size; ++i) {
+                    data[i] = (char)(rand() & 0xff);
+                }
+                if (compare_b64_kernel(kernel, alphabets[a], flags[a], data, size, 0) != 0
+                        || (size < 300 && compare_b64_kernel(
+                                kernel, alphabets[a], flags[a], data, size, 1) != 0)) {
+                    fprintf(stdout,
+                            "FAIL!    test_b64_kernels: %s kernel differs at size %d (%s)\n",
+                            SailfishKeyProvider_base64_kernel_name(kernel), (int)size,
+                            a == 0 ? "standard" : "url");
+                    SailfishKeyProvider_base64_select_kernel(defaultKernel);
+                    free(data);
+                    return TEST_FAIL;
+                }
+            }
+        }
+    }
+
+    SailfishKeyProvider_base64_select_kernel(defaultKernel);
+    free(data);
+    if (tested == 0) {
+        fprintf(stdout,
+                "SKIPPED! %s\n",
+                "test_b64_kernels: no vectorised kernel supported");
+        return TEST_SKIP;
+    }
+
+    fprintf(stdout,
+            "%s\n",
+            "PASS!    test_b64_kernels");
+    return TEST_PASS;
+}
+
+/*
+    Streams random data through the incremental encoder and decoder in
+    randomly sized pieces, with and without line wrapping.
+*/
+int test_b64_stream()
+{
+    size_t dataSize = 5000;
+    char *data = (char *)malloc(dataSize);
+    char *expected = NULL;
+    char *encoded = (char *)malloc(2 * dataSize + 16);
+    char *wrapped = (char *)malloc(3 * dataSize + 16);
+    char *decoded = (char *)malloc(dataSize + 16);
+    size_t expectedSize = 0, encodedSize = 0, wrappedSize = 0, decodedSize = 0;
+    size_t i = 0, size = 0, piece = 0;
+    int round = 0;
+    SailfishKeyProvider_base64_encoder encoder;
+    SailfishKeyProvider_base64_decoder decoder;
+    const char *invalid[] = { "QUJD\nRA==", "QUJDRA==QQ==", "QUJDRA=", "QU=D", "QUJ*" };
+
+    if (data == NULL || encoded == NULL || wrapped == NULL || decoded == NULL) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_b64_stream: malloc failed");
+        goto fail;
+    }
+
+    srand(0x57ea);
+    for (round = 0; round < 30; ++round) {
+        size = (round < 10) ? (size_t)round : (size_t)rand() % dataSize;
+        for (i = 0; i < size; ++i) {
+            data[i] = (char)(rand() & 0xff);
+        }
+
+        /* encode in pieces, and compare with the one-shot encoder */
+        encodedSize = 0;
+        SailfishKeyProvider_base64_encode_init(&encoder);
+        for (i = 0; i < size; i += piece) {
+            piece = 1 + (size_t)rand() % 100;
+            if (piece > size - i) {
+                piece = size - i;
+            }
+            encodedSize += SailfishKeyProvider_base64_encode_update(
+                    &encoder, data + i, piece, encoded + encodedSize);
+        }
+        encodedSize += SailfishKeyProvider_base64_encode_final(&encoder, encoded + encodedSize);
+
+        if (size > 0) {
+            expectedSize = SailfishKeyProvider_base64_encode(data, size, &expected);
+        }
+        if (encodedSize != expectedSize
+                || (size > 0 && memcmp(encoded, expected, encodedSize) != 0)) {
+            fprintf(stdout,
+                    "FAIL!    test_b64_stream: encoding differs at size %d\n",
+                    (int)size);
+            goto fail;
+        }
+        free(expected);
+        expected = NULL;
+        expectedSize = 0;
+
+        /* wrap at 64 columns, as PEM does */
+        wrappedSize = 0;
+        for (i = 0; i < encodedSize; ++i) {
+            if (i > 0 && i % 64 == 0) {
+                wrapped[wrappedSize++] = '\r';
+                wrapped[wrappedSize++] = '\n';
+            }
+            wrapped[wrappedSize++] = encoded[i];
+        }
+        wrapped[wrappedSize++] = '\n';
+
+        /* and decode it in pieces */
+        decodedSize = 0;
+        SailfishKeyProvider_base64_decode_init(&decoder, SAILFISHKEYPROVIDER_BASE64_SKIP_WHITESPACE);
+        for (i = 0; i < wrappedSize; i += piece) {
+            size_t pieceSize = 0;
+            piece = 1 + (size_t)rand() % 100;
+            if (piece > wrappedSize - i) {
+                piece = wrappedSize - i;
+            }
+            if (SailfishKeyProvider_base64_decode_update(
+                        &decoder, wrapped + i, piece, decoded + decodedSize, &pieceSize) != 0) {
+                break;
+            }
+            decodedSize += pieceSize;
+        }
+        if (i < wrappedSize
+                || SailfishKeyProvider_base64_decode_final(&decoder) != 0
+                || decodedSize != size
+                || memcmp(decoded, data, size) != 0) {
+            fprintf(stdout,
+                    "FAIL!    test_b64_stream: decoding differs at size %d\n",
+                    (int)size);
+            goto fail;
+        }
+    }
+
+    /* whitespace (unless skipped), trailing data, truncation, misplaced
+       padding and characters outside the alphabet are all rejected */
+    for (i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i) {
+        SailfishKeyProvider_base64_decode_init(&decoder, 0);
+        if (SailfishKeyProvider_base64_decode_update(
+                    &decoder, invalid[i], strlen(invalid[i]), decoded, &decodedSize) == 0
+                && SailfishKeyProvider_base64_decode_final(&decoder) == 0) {
+            fprintf(stdout,
+                    "FAIL!    test_b64_stream: accepted invalid data: %s\n",
+                    invalid[i]);
+            goto fail;
+        }
+    }
+
+    free(data);
+    free(encoded);
+    free(wrapped);
+    free(decoded);
+    fprintf(stdout,
+            "%s\n",
+            "PASS!    test_b64_stream");
+    return TEST_PASS;
+
+fail:
+    free(data);
+    free(expected);
+    free(encoded);
+    free(wrapped);
+    free(decoded);
+    return TEST_FAIL;
+}
+
+int test_b64_inplace()
+{
+    char data[600];
+    char *encoded = NULL;
+    size_t encoded_size = 0, decoded_size = 0, size = 0, i = 0;
+    const char *invalid[] = { "QUJD", "QUJ=", "QU==", "Q===", "QUJ*", "QU=D" };
+    size_t invalid_sizes[] = { 3, 2, 1, 0, 0, 0 };
+
+    srand(0x1d9ace);
+    for (size = 1; size < sizeof(data); ++size) {
+        for (i = 0; i < size; ++i) {
+            data[i] = (char)(rand() & 0xff);
+        }
+        encoded_size = SailfishKeyProvider_base64_encode(data, size, &encoded);
+        if (encoded_size != SailfishKeyProvider_base64_encoded_length(size)
+                || SailfishKeyProvider_base64_decoded_length(encoded, encoded_size) != size) {
+            fprintf(stdout,
+                    "FAIL!    test_b64_inplace: wrong length at size %d\n",
+                    (int)size);
+            free(encoded);
+            return TEST_FAIL;
+        }
+
+        decoded_size = SailfishKeyProvider_base64_decode_inplace(encoded, encoded_size);
+        if (decoded_size != size || memcmp(encoded, data, size) != 0) {
+            fprintf(stdout,
+                    "FAIL!    test_b64_inplace: decoding differs at size %d\n",
+                    (int)size);
+            free(encoded);
+            return TEST_FAIL;
+        }
+        free(encoded);
+    }
+
+    /* padding counts towards the decoded length only at the end,
+       and anything outside the charset is rejected */
+    for (i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i) {
+        char buffer[4];
+        memcpy(buffer, invalid[i], 4);
+        decoded_size = SailfishKeyProvider_base64_decode_inplace(buffer, 4);
+        if (decoded_size != invalid_sizes[i]) {
+            fprintf(stdout,
+                    "FAIL!    test_b64_inplace: unexpected result for %s\n",
+                    invalid[i]);
+            return TEST_FAIL;
+        }
+    }
+
+    fprintf(stdout,
+            "%s\n",
+            "PASS!    test_b64_inplace");
+    return TEST_PASS;
+}
+
+/*
+    Checks the unpadded base64url variant against the RFC 4648 test
+    vectors, and round trips a key through the "xor-base64url" scheme.
+*/
+int test_b64_url()
+{
+    const char *plain[] = { "f", "fo", "foo", "foob", "fooba", "foobar", "\xfb\xff", "\xfb\xef\xbe" };
+    const char *expected[] = { "Zg", "Zm8", "Zm9v", "Zm9vYg", "Zm9vYmE", "Zm9vYmFy", "-_8", "----" };
+    const char *invalid[] = { "Zg==", "Zm9vY", "+_8", "-/8", "Zm9=" };
+    const SailfishKeyProvider_base64_alphabet *url = &SailfishKeyProvider_base64_url;
+    int flags = SAILFISHKEYPROVIDER_BASE64_NO_PADDING;
+    char *encoded = NULL, *decoded = NULL;
+    size_t encoded_size = 0, decoded_size = 0, i = 0;
+
+    for (i = 0; i < sizeof(plain) / sizeof(plain[0]); ++i) {
+        encoded_size = SailfishKeyProvider_base64_encode_alphabet(
+                url, flags, plain[i], strlen(plain[i]), &encoded);
+        if (encoded_size != strlen(expected[i]) || strcmp(encoded, expected[i]) != 0) {
+            fprintf(stdout,
+                    "FAIL!    test_b64_url: wrong encoding for %s: %s\n",
+                    expected[i], encoded);
+            free(encoded);
+            return TEST_FAIL;
+        }
+        free(encoded);
+
+        decoded_size = SailfishKeyProvider_base64_decode_alphabet(
+                url, flags, expected[i], strlen(expected[i]), &decoded);
+        if (decoded_size != strlen(plain[i]) || strcmp(decoded, plain[i]) != 0) {
+            fprintf(stdout,
+                    "FAIL!    test_b64_url: wrong decoding for %s\n",
+                    expected[i]);
+            free(decoded);
+            return TEST_FAIL;
+        }
+        free(decoded);
+    }
+
+    /* padding, impossible lengths and the standard alphabet's
+       characters are all rejected */
+    for (i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i) {
+        decoded = NULL;
+        decoded_size = SailfishKeyProvider_base64_decode_alphabet(
+                url, flags, invalid[i], strlen(invalid[i]), &decoded);
+        if (decoded_size != 0) {
+            fprintf(stdout,
+                    "FAIL!    test_b64_url: accepted invalid data %s\n",
+                    invalid[i]);
+            free(decoded);
+            return TEST_FAIL;
+        }
+    }
+
+    /* the same key through both schemes */
+    encoded = NULL;
+    decoded = NULL;
+    if (SailfishKeyProvider_encodeKey("ClientID?>>", "xor-base64url", "Secret", &encoded) != 0
+            || strpbrk(encoded, "+/=") != NULL
+            || SailfishKeyProvider_decodeKey(encoded, "xor-base64url", "Secret", &decoded) != 0
+            || strcmp(decoded, "ClientID?>>") != 0) {
+        fprintf(stdout,
+                "FAIL!    test_b64_url: xor-base64url round trip failed: %s\n",
+                encoded ? encoded : "(null)");
+        free(encoded);
+        free(decoded);
+        return TEST_FAIL;
+    }
+    free(encoded);
+    free(decoded);
+
+    fprintf(stdout,
+            "%s\n",
+            "PASS!    test_b64_url");
+    return TEST_PASS;
+}
+
+/*
+    Compares the keystream XOR, allocating and in place, against a
+    plain byte loop for many value and key sizes.
+*/
+int test_xor_inplace()
+{
+    size_t sizes[] = { 1, 2, 7, 8, 9, 31, 32, 33, 63, 64, 65, 100, 255, 256, 257,
+                       511, 512, 513, 1000, 4096, 70001 };
+    size_t count = sizeof(sizes) / sizeof(sizes[0]);
+    size_t maxSize = sizes[count - 1];
+    char *value = (char *)malloc(maxSize);
+    char *key = (char *)malloc(maxSize);
+    char *expected = (char *)malloc(maxSize);
+    size_t v = 0, k = 0, i = 0;
+    int retn = TEST_FAIL;
+
+    if (value == NULL || key == NULL || expected == NULL) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_xor_inplace: malloc failed");
+        goto cleanup;
+    }
+
+    srand(0x0a5e7);
+    for (i = 0; i < maxSize; ++i) {
+        key[i] = (char)(rand() & 0xff);
+    }
+
+    for (v = 0; v < count; ++v) {
+        for (k = 0; k < count; ++k) {
+            char *encoded = NULL;
+            for (i = 0; i < sizes[v]; ++i) {
+                value[i] = (char)(rand() & 0xff);
+                expected[i] = value[i] ^ key[i % sizes[k]];
+            }
+
+            encoded = SailfishKeyProvider_xor_encode(value, sizes[v], key, sizes[k]);
+            if (encoded == NULL || memcmp(encoded, expected, sizes[v]) != 0
+                    || encoded[sizes[v]] != '\0'
+                    || SailfishKeyProvider_xor_inplace(value, sizes[v], key, sizes[k]) != 0
+                    || memcmp(value, expected, sizes[v]) != 0) {
+                fprintf(stdout,
+                        "FAIL!    test_xor_inplace: differs for value size %d, key size %d\n",
+                        (int)sizes[v], (int)sizes[k]);
+                free(encoded);
+                goto cleanup;
+            }
+            free(encoded);
+        }
+    }
+
+    if (SailfishKeyProvider_xor_inplace(value, 1, key, 0) != -1) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_xor_inplace: accepted an empty key");
+        goto cleanup;
+    }
+
+    fprintf(stdout,
+            "%s\n",
+            "PASS!    test_xor_inplace");
+    retn = TEST_PASS;
+cleanup:
+    free(value);
+    free(key);
+    free(expected);
+    return retn;
+}
+
+/*
+    Compares the fused XOR and Base64 codec against XOR followed by
+    Base64, for values either side of the tile size.
+*/
+int test_xor_base64()
+{
+    size_t sizes[] = { 1, 2, 3, 4, 100, 3071, 3072, 3073, 6144, 6145, 10000 };
+    const char *key = "TestKey999Z+";
+    char data[10000];
+    char *fused = NULL, *expected = NULL, *xored = NULL, *decoded = NULL;
+    size_t fused_size = 0, expected_size = 0, i = 0, s = 0;
+    int a = 0;
+    const SailfishKeyProvider_base64_alphabet *alphabets[] = {
+        &SailfishKeyProvider_base64_standard,
+        &SailfishKeyProvider_base64_url
+    };
+    int flags[] = { 0, SAILFISHKEYPROVIDER_BASE64_NO_PADDING };
+
+    srand(0xf05ed);
+    for (a = 0; a < 2; ++a) {
+        for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+            for (i = 0; i < sizes[s]; ++i) {
+                data[i] = (char)(rand() & 0xff);
+            }
+            xored = SailfishKeyProvider_xor_encode(data, sizes[s], key, strlen(key));
+            expected_size = SailfishKeyProvider_base64_encode_alphabet(
+                    alphabets[a], flags[a], xored, sizes[s], &expected);
+            fused_size = SailfishKeyProvider_xor_base64_encode(
+                    alphabets[a], flags[a], data, sizes[s], key, strlen(key), &fused);
+            if (fused_size != expected_size || strcmp(fused, expected) != 0
+                    || SailfishKeyProvider_xor_base64_decode(
+                            alphabets[a], flags[a], fused, fused_size,
+                            key, strlen(key), &decoded) != sizes[s]
+                    || memcmp(decoded, data, sizes[s]) != 0
+                    || decoded[sizes[s]] != '\0') {
+                fprintf(stdout,
+                        "FAIL!    test_xor_base64: differs at size %d\n",
+                        (int)sizes[s]);
+                free(xored);
+                free(expected);
+                free(fused);
+                free(decoded);
+                return TEST_FAIL;
+            }
+
+            /* padding is only valid at the very end */
+            if (a == 0 && fused_size > 4096) {
+                char saved = fused[4000];
+                free(decoded);
+                decoded = NULL;
+                fused[4000] = '=';
+                if (SailfishKeyProvider_xor_base64_decode(
+                            alphabets[a], flags[a], fused, fused_size,
+                            key, strlen(key), &decoded) != 0 || decoded != NULL) {
+                    fprintf(stdout,
+                            "FAIL!    test_xor_base64: accepted padding at size %d\n",
+                            (int)sizes[s]);
+                    free(xored);
+                    free(expected);
+                    free(fused);
+                    free(decoded);
+                    return TEST_FAIL;
+                }
+                fused[4000] = saved;
+            }
+
+            free(xored);
+            free(expected);
+            free(fused);
+            free(decoded);
+            xored = expected = fused = decoded = NULL;
+        }
+    }
+
+    fprintf(stdout,
+            "%s\n",
+            "PASS!    test_xor_base64");
+    return TEST_PASS;
+}
+
+/*
+    Registers a trivial scheme, which reverses the value, and uses it
+    and the built in schemes through each entry point.
+*/
+static int reverse_scheme_code(
+                    const SailfishKeyProvider_Scheme *scheme,
+                    const char *value,
+                    const char *key,
+                    char **result)
+{
+    size_t size = strlen(value), i = 0;
+    (void)scheme;
+    (void)key;
+    *result = (char *)malloc(size + 1);
+    if (*result == NULL) {
+        return -1;
+    }
+    for (i = 0; i < size; ++i) {
+        (*result)[i] = value[size - 1 - i];
+    }
+    (*result)[size] = '\0';
+    return 0;
+}
+
+int test_scheme_registry()
+{
+    static const SailfishKeyProvider_Scheme reverse = {
+        "test-reverse", NULL, reverse_scheme_code, reverse_scheme_code, NULL, NULL, NULL
+    };
+    const char *encodedValues[] = { "FScwMHpXSgUH", "EAkKFwsAGiE=", "ZVdAQH5TTgltCm1cSk0=" };
+    const char *expectedValues[] = { "ABCD12345", NULL, NULL };
+    const SailfishKeyProvider_Scheme *xor = SailfishKeyProvider_scheme_find("xor");
+    char *decoded[3] = { NULL, NULL, NULL };
+    char *encoded = NULL, *single = NULL;
+    char inplace[32];
+    int i = 0;
+
+    if (xor == NULL
+            || SailfishKeyProvider_scheme_find("xor-") != NULL
+            || SailfishKeyProvider_scheme_find_hashed(
+                    SailfishKeyProvider_scheme_hash("xor-base64url"), "xor-base64url") == NULL) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_scheme_registry: built in schemes not found");
+        return TEST_FAIL;
+    }
+
+    if ((SailfishKeyProvider_scheme_find("test-reverse") == NULL
+                && SailfishKeyProvider_scheme_register(&reverse) != 0)
+            || SailfishKeyProvider_scheme_register(&reverse) != -1
+            || SailfishKeyProvider_encodeKey("abc123", "test-reverse", "k", &encoded) != 0
+            || strcmp(encoded, "321cba") != 0
+            || SailfishKeyProvider_decodeKey(encoded, "test-reverse", "k", &single) != 0
+            || strcmp(single, "abc123") != 0) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_scheme_registry: registered scheme not used");
+        free(encoded);
+        free(single);
+        return TEST_FAIL;
+    }
+    free(single);
+    single = NULL;
+
+    /* the generic in-place fallback */
+    strcpy(inplace, encoded);
+    free(encoded);
+    if (SailfishKeyProvider_scheme_decode_inplace(&reverse, inplace, "k") != 0
+            || strcmp(inplace, "abc123") != 0) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_scheme_registry: in-place fallback failed");
+        return TEST_FAIL;
+    }
+
+    /* the xor batch and in-place entry points agree with decodeKey */
+    if (SailfishKeyProvider_scheme_decode_batch(xor, encodedValues, 3, "TestKey123", decoded) != 0) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_scheme_registry: batch decode failed");
+        return TEST_FAIL;
+    }
+    for (i = 0; i < 3; ++i) {
+        int same = 0;
+        strcpy(inplace, encodedValues[i]);
+        if (SailfishKeyProvider_decodeKey(encodedValues[i], "xor", "TestKey123", &single) == 0
+                && SailfishKeyProvider_scheme_decode_inplace(xor, inplace, "TestKey123") == 0) {
+            same = strcmp(single, decoded[i]) == 0
+                && strcmp(inplace, decoded[i]) == 0
+                && (expectedValues[i] == NULL || strcmp(single, expectedValues[i]) == 0);
+        }
+        free(single);
+        single = NULL;
+        if (!same) {
+            fprintf(stdout,
+                    "FAIL!    test_scheme_registry: batch decode differs for %s\n",
+                    encodedValues[i]);
+            for (i = 0; i < 3; ++i) {
+                free(decoded[i]);
+            }
+            return TEST_FAIL;
+        }
+    }
+    for (i = 0; i < 3; ++i) {
+        free(decoded[i]);
+        decoded[i] = NULL;
+    }
+
+    /* a batch with an invalid value returns nothing */
+    encodedValues[1] = "not base64!";
+    if (SailfishKeyProvider_scheme_decode_batch(xor, encodedValues, 3, "TestKey123", decoded) != -1
+            || decoded[0] != NULL || decoded[1] != NULL || decoded[2] != NULL) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_scheme_registry: accepted an invalid batch");
+        return TEST_FAIL;
+    }
+
+    fprintf(stdout,
+            "%s\n",
+            "PASS!    test_scheme_registry");
+    return TEST_PASS;
+}
+
+static int hex_to_bytes(const char *hex, uint8_t *bytes)
+{
+    size_t i = 0;
+    unsigned int byte = 0;
+    for (i = 0; hex[2 * i] != '\0'; ++i) {
+        sscanf(hex + 2 * i, "%2x", &byte);
+        bytes[i] = (uint8_t)byte;
+    }
+    return (int)i;
+}
+
+int test_chacha20()
+{
+    /* RFC 8439, sections 2.3.2 and 2.4.2 */
+    static const char *blockHex =
+        "10f1e7e4d13b5915500fdd1fa32071c4c7d1f4c733c068030422aa9ac3d46c4e"
+        "d2826446079faa0914c2d705d98b02a2b5129cd1de164eb9cbd083e8a2503c4e";
+    static const char *cipherHex =
+        "6e2e359a2568f98041ba0728dd0d6981e97e7aec1d4360c20a27afccfd9fae0b"
+        "f91b65c5524733ab8f593dabcd62b3571639d624e65152ab8f530c359f0861d8"
+        "07ca0dbf500d6a6156a38e088a22b65e52bc514d16ccf806818ce91ab7793736"
+        "5af90bbf74a35be6b40b8eedf2785e42874d";
+    static const char *plaintext =
+        "Ladies and Gentlemen of the class of '99: If I could offer you only "
+        "one tip for the future, sunscreen would be it.";
+    const uint8_t blockNonce[12] = { 0, 0, 0, 0x09, 0, 0, 0, 0x4a, 0, 0, 0, 0 };
+    const uint8_t cipherNonce[12] = { 0, 0, 0, 0, 0, 0, 0, 0x4a, 0, 0, 0, 0 };
+    int defaultKernel = SailfishKeyProvider_chacha20_selected_kernel();
+    uint8_t key[32], expected[128], actual[1024], reference[1024], data[1024];
+    size_t plaintextSize = strlen(plaintext);
+    size_t size = 0;
+    char *encoded = NULL, *decoded = NULL;
+    char inplace[64];
+    int kernel = 0;
+    int i = 0;
+
+    for (i = 0; i < 32; ++i) {
+        key[i] = (uint8_t)i;
+    }
+    for (i = 0; i < 1024; ++i) {
+        data[i] = (uint8_t)(i * 131 + 7);
+    }
+
+    hex_to_bytes(blockHex, expected);
+    SailfishKeyProvider_chacha20_block(key, 1, blockNonce, actual);
+    if (memcmp(actual, expected, 64) != 0) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_chacha20: block function does not match RFC 8439");
+        return TEST_FAIL;
+    }
+
+    /* each kernel against the test vector, and against the scalar kernel
+       for every length up to a few groups of blocks */
+    hex_to_bytes(cipherHex, expected);
+    SailfishKeyProvider_chacha20_select_kernel(SAILFISHKEYPROVIDER_CHACHA20_KERNEL_SCALAR);
+    SailfishKeyProvider_chacha20_xor(key, 5, cipherNonce, data, reference, sizeof(reference));
+    for (kernel = 0; kernel < SAILFISHKEYPROVIDER_CHACHA20_KERNEL_COUNT; ++kernel) {
+        if (SailfishKeyProvider_chacha20_select_kernel(kernel) != 0) {
+            continue;
+        }
+        SailfishKeyProvider_chacha20_xor(key, 1, cipherNonce,
+                                         (const uint8_t *)plaintext, actual, plaintextSize);
+        if (memcmp(actual, expected, plaintextSize) != 0) {
+            fprintf(stdout,
+                    "FAIL!    test_chacha20: %s kernel does not match RFC 8439\n",
+                    SailfishKeyProvider_chacha20_kernel_name(kernel));
+            SailfishKeyProvider_chacha20_select_kernel(defaultKernel);
+            return TEST_FAIL;
+        }
+        for (size = 1; size <= sizeof(actual); size += 37) {
+            memcpy(actual, data, size);
+            SailfishKeyProvider_chacha20_xor(key, 5, cipherNonce, actual, actual, size);
+            if (memcmp(actual, reference, size) != 0) {
+                fprintf(stdout,
+                        "FAIL!    test_chacha20: %s kernel differs for %d bytes\n",
+                        SailfishKeyProvider_chacha20_kernel_name(kernel), (int)size);
+                SailfishKeyProvider_chacha20_select_kernel(defaultKernel);
+                return TEST_FAIL;
+            }
+        }
+    }
+    SailfishKeyProvider_chacha20_select_kernel(defaultKernel);
+
+    /* the scheme, with a nonce per encoding */
+    if (SailfishKeyProvider_encodeKey("ABCD12345", "chacha20", "TestKey123", &encoded) != 0
+            || SailfishKeyProvider_decodeKey(encoded, "chacha20", "TestKey123", &decoded) != 0
+            || strcmp(decoded, "ABCD12345") != 0) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_chacha20: scheme roundtrip failed");
+        free(encoded);
+        free(decoded);
+        return TEST_FAIL;
+    }
+    free(decoded);
+    decoded = NULL;
+
+    strcpy(inplace, encoded);
+    if (SailfishKeyProvider_scheme_decode_inplace(
+                SailfishKeyProvider_scheme_find("chacha20"), inplace, "TestKey123") != 0
+            || strcmp(inplace, "ABCD12345") != 0
+            || SailfishKeyProvider_encodeKey("ABCD12345", "chacha20", "TestKey123", &decoded) != 0
+            || strcmp(decoded, encoded) == 0) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_chacha20: in-place decode failed, or the nonce was reused");
+        free(encoded);
+        free(decoded);
+        return TEST_FAIL;
+    }
+    free(encoded);
+    free(decoded);
+    encoded = NULL;
+    decoded = NULL;
+
+    /* a wrong key decodes to something else, and a lone nonce fails */
+    if (SailfishKeyProvider_encodeKey("ABCD12345", "chacha20", "TestKey123", &encoded) != 0
+            || (SailfishKeyProvider_decodeKey(encoded, "chacha20", "TestKey124", &decoded) == 0
+                && strcmp(decoded, "ABCD12345") == 0)) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_chacha20: decoded with the wrong key");
+        free(encoded);
+        free(decoded);
+        return TEST_FAIL;
+    }
+    free(encoded);
+    free(decoded);
+    decoded = NULL;
+
+    if (SailfishKeyProvider_decodeKey("AAAAAAAAAAAAAAAA", "chacha20", "TestKey123", &decoded) == 0) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_chacha20: accepted a value without ciphertext");
+        free(decoded);
+        return TEST_FAIL;
+    }
+
+    /* passphrases which differ only by where a byte sits, 32 bytes
+       apart, derive different keys */
+    {
+        const char *first = "A0123456789012345678901234567890B";
+        const char *second = "B0123456789012345678901234567890A";
+        uint8_t firstKey[SAILFISHKEYPROVIDER_CHACHA20_KEY_SIZE];
+        uint8_t secondKey[SAILFISHKEYPROVIDER_CHACHA20_KEY_SIZE];
+        SailfishKeyProvider_chacha20_derive_key(first, strlen(first), firstKey);
+        SailfishKeyProvider_chacha20_derive_key(second, strlen(second), secondKey);
+        if (memcmp(firstKey, secondKey, sizeof(firstKey)) == 0) {
+            fprintf(stdout,
+                    "FAIL!    %s\n",
+                    "test_chacha20: distinct passphrases derived the same key");
+            return TEST_FAIL;
+        }
+    }
+
+    fprintf(stdout,
+            "%s\n",
+            "PASS!    test_chacha20");
+    return TEST_PASS;
+}
+
+int test_decode_keys()
+{
+    const char *schemes[] = { "xor", "xor-base64url", "chacha20" };
+    const char *invalid[] = { "EAkKFwsAGiE=", "QQ==QUJD" };
+    char *encoded[200];
+    char value[5001];
+    char *arena = NULL, *single = NULL;
+    size_t offsets[201];
+    int count = 200;
+    int s = 0, i = 0, j = 0;
+    int failed = 0;
+
+    for (s = 0; s < 3 && !failed; ++s) {
+        for (i = 0; i < count; ++i) {
+            int size = i == 100 ? 5000 : 1 + (i * 37) % 100; /* one too large to batch */
+            for (j = 0; j < size; ++j) {
+                value[j] = (char)(' ' + (i * 7 + j * 13) % 95);
+            }
+            value[size] = '\0';
+            encoded[i] = NULL;
+            SailfishKeyProvider_encodeKey(value, schemes[s], "TestKey123", &encoded[i]);
+        }
+
+        if (SailfishKeyProvider_decodeKeys((const char * const *)encoded, count,
+                    schemes[s], "TestKey123", &arena, offsets) != 0) {
+            fprintf(stdout,
+                    "FAIL!    test_decode_keys: %s decode failed\n",
+                    schemes[s]);
+            failed = 1;
+        }
+        for (i = 0; i < count && !failed; ++i) {
+            if (SailfishKeyProvider_decodeKey(encoded[i], schemes[s], "TestKey123", &single) != 0
+                    || strcmp(single, arena + offsets[i]) != 0
+                    || offsets[i + 1] - offsets[i] != strlen(single) + 1) {
+                fprintf(stdout,
+                        "FAIL!    test_decode_keys: %s differs for %s\n",
+                        schemes[s], encoded[i]);
+                failed = 1;
+            }
+            free(single);
+            single = NULL;
+        }
+        free(arena);
+        arena = NULL;
+        for (i = 0; i < count; ++i) {
+            free(encoded[i]);
+        }
+    }
+    if (failed) {
+        return TEST_FAIL;
+    }
+
+    /* padding before the last block, or a bad value anywhere, fails the lot */
+    if (SailfishKeyProvider_decodeKeys(invalid, 2, "xor", "Secret", &arena, offsets) != -1
+            || arena != NULL
+            || SailfishKeyProvider_decodeKeys(invalid, 1, "xor", "Secret", &arena, offsets) != 0
+            || strcmp(arena, "ClientID") != 0
+            || offsets[1] != 9) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_decode_keys: invalid values not handled");
+        free(arena);
+        return TEST_FAIL;
+    }
+    free(arena);
+
+    fprintf(stdout,
+            "%s\n",
+            "PASS!    test_decode_keys");
+    return TEST_PASS;
+}
+
+int test_dispatch()
+{
+    const SailfishKeyProvider_dispatch_family *families[] = {
+        &SailfishKeyProvider_base64_family,
+        &SailfishKeyProvider_xor_family,
+        &SailfishKeyProvider_chacha20_family
+    };
+    int selected[] = {
+        SailfishKeyProvider_base64_selected_kernel(),
+        SailfishKeyProvider_xor_selected_kernel(),
+        SailfishKeyProvider_chacha20_selected_kernel()
+    };
+    int defaultXor = selected[1];
+    char expected[300], actual[300];
+    int f = 0, kernel = 0, size = 0;
+
+    /* every family is already resolved, to its widest supported kernel
+       unless the scalar kernels were forced, and every kernel passes */
+    for (f = 0; f < 3; ++f) {
+        int widest = 0;
+        for (kernel = 0; kernel < families[f]->count; ++kernel) {
+            if (!families[f]->supported(kernel)) {
+                continue;
+            }
+            widest = kernel;
+            if (families[f]->self_test(kernel) != 0) {
+                fprintf(stdout,
+                        "FAIL!    test_dispatch: %s %s kernel failed its self test\n",
+                        families[f]->name, families[f]->kernel_name(kernel));
+                return TEST_FAIL;
+            }
+        }
+        if (selected[f] != (SailfishKeyProvider_dispatch_force_scalar() ? 0 : widest)) {
+            fprintf(stdout,
+                    "FAIL!    test_dispatch: %s resolved to the %s kernel\n",
+                    families[f]->name, families[f]->kernel_name(selected[f]));
+            return TEST_FAIL;
+        }
+    }
+
+    /* the xor kernels agree through the public entry points */
+    for (kernel = 0; kernel < SAILFISHKEYPROVIDER_XOR_KERNEL_COUNT; ++kernel) {
+        if (SailfishKeyProvider_xor_select_kernel(kernel) != 0) {
+            continue;
+        }
+        for (size = 1; size < 300; size += 13) {
+            int i = 0;
+            for (i = 0; i < size; ++i) {
+                expected[i] = actual[i] = (char)(i * 31 + size);
+            }
+            SailfishKeyProvider_xor_select_kernel(SAILFISHKEYPROVIDER_XOR_KERNEL_SCALAR);
+            SailfishKeyProvider_xor_inplace(expected, size, "TestKey123", 10);
+            SailfishKeyProvider_xor_select_kernel(kernel);
+            SailfishKeyProvider_xor_inplace(actual, size, "TestKey123", 10);
+            if (memcmp(expected, actual, size) != 0) {
+                fprintf(stdout,
+                        "FAIL!    test_dispatch: xor %s kernel differs for %d bytes\n",
+                        SailfishKeyProvider_xor_kernel_name(kernel), size);
+                SailfishKeyProvider_xor_select_kernel(defaultXor);
+                return TEST_FAIL;
+            }
+        }
+    }
+    SailfishKeyProvider_xor_select_kernel(defaultXor);
+
+    unsetenv(SAILFISHKEYPROVIDER_FORCE_SCALAR_ENV);
+    if (SailfishKeyProvider_dispatch_force_scalar() != 0
+            || setenv(SAILFISHKEYPROVIDER_FORCE_SCALAR_ENV, "0", 1) != 0
+            || SailfishKeyProvider_dispatch_force_scalar() != 0
+            || setenv(SAILFISHKEYPROVIDER_FORCE_SCALAR_ENV, "1", 1) != 0
+            || SailfishKeyProvider_dispatch_force_scalar() != 1) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_dispatch: environment override not recognised");
+        unsetenv(SAILFISHKEYPROVIDER_FORCE_SCALAR_ENV);
+        return TEST_FAIL;
+    }
+    unsetenv(SAILFISHKEYPROVIDER_FORCE_SCALAR_ENV);
+
+    fprintf(stdout,
+            "%s\n",
+            "PASS!    test_dispatch");
+    return TEST_PASS;
+}
+
+/*
+    Stores keys from several processes at once: two write to the same
+    provider, and two to providers of their own.  No update may be lost.
+*/
+int test_concurrent_store()
+{
+    const char *providers[] = {
+        "tst_concurrent", "tst_concurrent", "tst_concurrent_a", "tst_concurrent_b"
+    };
+    const int writers = 4;
+    const int keysPerWriter = 200;
+    char keyName[32];
+    char *storedValue = NULL;
+    int status = 0;
+    int failed = 0;
+    int w = 0, i = 0;
+    pid_t pid;
+
+    for (w = 0; w < writers; ++w) {
+        pid = fork();
+        if (pid < 0) {
+            fprintf(stdout,
+                    "FAIL!    %s\n",
+                    "test_concurrent_store: unable to fork");
+            return TEST_FAIL;
+        } else if (pid == 0) {
+            for (i = 0; i < keysPerWriter; ++i) {
+                snprintf(keyName, sizeof(keyName), "key_%d_%d", w, i);
+                if (SailfishKeyProvider_storeKey(providers[w], "svc", keyName,
+                            "FScwMHpXSgUH", "xor", "TestKey123") != 0) {
+                    _exit(1);
+                }
+            }
+            _exit(0);
+        }
+    }
+
+    for (w = 0; w < writers; ++w) {
+        if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failed = 1;
+        }
+    }
+    if (failed) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_concurrent_store: a writer failed to store keys");
+        return TEST_FAIL;
+    }
+
+    for (w = 0; w < writers; ++w) {
+        for (i = 0; i < keysPerWriter; ++i) {
+            snprintf(keyName, sizeof(keyName), "key_%d_%d", w, i);
+            if (SailfishKeyProvider_storedKey(providers[w], "svc", keyName, &storedValue) != 0
+                    || storedValue == NULL
+                    || strcmp(storedValue, "ABCD12345") != 0) {
+                fprintf(stdout,
+                        "FAIL!    test_concurrent_store: lost update of %s %s\n",
+                        providers[w], keyName);
+                free(storedValue);
+                return TEST_FAIL;
+            }
+            free(storedValue);
+            storedValue = NULL;
+        }
+    }
+
+    fprintf(stdout,
+            "%s\n",
+            "PASS!    test_concurrent_store");
+    return TEST_PASS;
+}
+
+static double elapsed_ms_since(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0
+         + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+/*
+    Holds an exclusive lock on \a lockFile from a child process for
+    \a holdMs milliseconds.  Returns once the lock is held.
+*/
+static pid_t hold_ini_lock(const char *lockFile, int holdMs)
+{
+    int ready[2];
+    char byte = 0;
+    pid_t pid;
+
+    if (pipe(ready) != 0) {
+        return -1;
+    }
+    pid = fork();
+    if (pid == 0) {
+        struct flock lock;
+        int fd = open(lockFile, O_RDWR);
+        memset(&lock, 0, sizeof(lock));
+        lock.l_type = F_WRLCK;
+        lock.l_whence = SEEK_SET;
+        if (fd < 0 || fcntl(fd, F_SETLKW, &lock) != 0) {
+            _exit(1);
+        }
+        if (write(ready[1], &byte, 1) != 1) {
+            _exit(1);
+        }
+        usleep(holdMs * 1000);
+        _exit(0);
+    }
+    if (pid < 0 || read(ready[0], &byte, 1) != 1) {
+        pid = -1;
+    }
+    close(ready[0]);
+    close(ready[1]);
+    return pid;
+}
+
+int test_ini_locking()
+{
+    char directory[512];
+    char filename[768];
+    char lockFile[1024];
+    struct timespec start;
+    char *value = NULL;
+    double waited = 0;
+    int status = 0;
+    pid_t holder;
+
+    snprintf(directory, sizeof(directory),
+             "%s/.local/share/system/privileged/Keys", getenv("HOME"));
+    snprintf(filename, sizeof(filename), "%s/tst_locking.ini", directory);
+    snprintf(lockFile, sizeof(lockFile), "%s.lock", filename);
+
+    if (SailfishKeyProvider_ini_write(directory, filename, "section", "key", "first") != 0
+            || access(lockFile, F_OK) != 0) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_ini_locking: writer did not create the lock file");
+        return TEST_FAIL;
+    }
+
+    /* a writer waits for the lock to be released */
+    holder = hold_ini_lock(lockFile, 300);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (holder < 0
+            || SailfishKeyProvider_ini_write(directory, filename, "section", "key", "second") != 0) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_ini_locking: write under contention failed");
+        return TEST_FAIL;
+    }
+    waited = elapsed_ms_since(&start);
+    waitpid(holder, &status, 0);
+    if (waited < 200) {
+        fprintf(stdout,
+                "FAIL!    test_ini_locking: writer waited only %.0f ms for the lock\n",
+                waited);
+        return TEST_FAIL;
+    }
+
+    /* readers don't wait, unless read locking is enabled */
+    holder = hold_ini_lock(lockFile, 300);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    value = SailfishKeyProvider_ini_read(filename, "section", "key");
+    waited = elapsed_ms_since(&start);
+    if (holder < 0 || value == NULL || strcmp(value, "second") != 0 || waited >= 200) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_ini_locking: unlocked read failed or waited");
+        free(value);
+        return TEST_FAIL;
+    }
+    free(value);
+
+    SailfishKeyProvider_ini_set_read_locking(1);
+    value = SailfishKeyProvider_ini_read(filename, "section", "key");
+    waited = elapsed_ms_since(&start);
+    SailfishKeyProvider_ini_set_read_locking(0);
+    waitpid(holder, &status, 0);
+    if (value == NULL || strcmp(value, "second") != 0 || waited < 200) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_ini_locking: locked read failed or did not wait");
+        free(value);
+        return TEST_FAIL;
+    }
+    free(value);
+
+    unlink(filename);
+    unlink(lockFile);
+    fprintf(stdout,
+            "%s\n",
+            "PASS!    test_ini_locking");
+    return TEST_PASS;
+}
+
+int test_lock_stats()
+{
+    char directory[512];
+    SailfishKeyProvider_LockStats before;
+    SailfishKeyProvider_LockStats after;
+    uint64_t slowWaits = 0;
+    int ready[2];
+    char byte = 0;
+    int status = 0;
+    int i = 0;
+    pid_t holder;
+
+    snprintf(directory, sizeof(directory),
+             "%s/.local/share/system/privileged/Keys", getenv("HOME"));
+
+    /* an uncontended acquisition is counted, but not as a wait */
+    if (SailfishKeyProvider_keystore_lock(directory, "tst_stats") != 0) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_lock_stats: unable to lock the key store");
+        return TEST_FAIL;
+    }
+    SailfishKeyProvider_keystore_unlock(directory, "tst_stats");
+    if (SailfishKeyProvider_lock_stats("StripedProcessMutex", directory, &before) != 0
+            || before.acquisitions == 0) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_lock_stats: acquisition was not recorded");
+        return TEST_FAIL;
+    }
+
+    /* a child holds the stripe, so that the next acquisition waits */
+    if (pipe(ready) != 0) {
+        return TEST_FAIL;
+    }
+    holder = fork();
+    if (holder == 0) {
+        if (SailfishKeyProvider_keystore_lock(directory, "tst_stats") != 0
+                || write(ready[1], &byte, 1) != 1) {
+            _exit(1);
+        }
+        usleep(200 * 1000);
+        SailfishKeyProvider_keystore_unlock(directory, "tst_stats");
+        _exit(0);
+    }
+    if (holder < 0 || read(ready[0], &byte, 1) != 1
+            || SailfishKeyProvider_keystore_lock(directory, "tst_stats") != 0) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_lock_stats: unable to contend for the key store");
+        return TEST_FAIL;
+    }
+    SailfishKeyProvider_keystore_unlock(directory, "tst_stats");
+    waitpid(holder, &status, 0);
+    close(ready[0]);
+    close(ready[1]);
+
+    SailfishKeyProvider_lock_stats("StripedProcessMutex", directory, &after);
+    for (i = 17; i < SAILFISHKEYPROVIDER_LOCK_WAIT_BUCKETS; ++i) {
+        slowWaits += after.waitHistogram[i] - before.waitHistogram[i];
+    }
+    if (after.acquisitions != before.acquisitions + 1
+            || after.contended != before.contended + 1
+            || after.maxWaitNs < 100000000ULL
+            || slowWaits != 1) {
+        fprintf(stdout,
+                "FAIL!    test_lock_stats: contended %llu, max wait %llu us\n",
+                (unsigned long long)(after.contended - before.contended),
+                (unsigned long long)(after.maxWaitNs / 1000));
+        return TEST_FAIL;
+    }
+
+    fprintf(stdout,
+            "%s\n",
+            "PASS!    test_lock_stats");
+    return TEST_PASS;
+}
+
+int test_group_commit()
+{
+    char directory[512];
+    char filename[768];
+    char key[32];
+    char value[32];
+    char *stored = NULL;
+    pid_t writers[4];
+    int status = 0;
+    int failed = 0;
+    int i = 0;
+
+    snprintf(directory, sizeof(directory),
+             "%s/.local/share/system/privileged/Keys", getenv("HOME"));
+    snprintf(filename, sizeof(filename), "%s/tst_group.ini", directory);
+
+    /* the writers queue their updates while the lock is held, and
+       whichever takes it first writes them all */
+    if (SailfishKeyProvider_keystore_lock(directory, "tst_group") != 0) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_group_commit: unable to lock the key store");
+        return TEST_FAIL;
+    }
+    for (i = 0; i < 4; ++i) {
+        writers[i] = fork();
+        if (writers[i] == 0) {
+            SailfishKeyProvider_ini_update updates[2];
+            snprintf(key, sizeof(key), "key%d", i);
+            snprintf(value, sizeof(value), "value%d", i);
+            updates[0].section = "group";
+            updates[0].key = key;
+            updates[0].value = value;
+            updates[1].section = "group";
+            updates[1].key = "last";
+            updates[1].value = value;
+            _exit(SailfishKeyProvider_keystore_write_updates(
+                        directory, "tst_group", filename, updates, 2) == 0 ? 0 : 1);
+        }
+    }
+    usleep(200 * 1000);
+    SailfishKeyProvider_keystore_unlock(directory, "tst_group");
+
+    for (i = 0; i < 4; ++i) {
+        if (writers[i] < 0 || waitpid(writers[i], &status, 0) != writers[i]
+                || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failed = 1;
+        }
+    }
+    for (i = 0; i < 4 && !failed; ++i) {
+        snprintf(key, sizeof(key), "key%d", i);
+        snprintf(value, sizeof(value), "value%d", i);
+        stored = SailfishKeyProvider_ini_read(filename, "group", key);
+        failed = (stored == NULL || strcmp(stored, value) != 0);
+        free(stored);
+    }
+    stored = failed ? NULL : SailfishKeyProvider_ini_read(filename, "group", "last");
+    if (stored == NULL || strncmp(stored, "value", 5) != 0) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_group_commit: queued updates were not all written");
+        free(stored);
+        return TEST_FAIL;
+    }
+    free(stored);
+
+    unlink(filename);
+    fprintf(stdout,
+            "%s\n",
+            "PASS!    test_group_commit");
+    return TEST_PASS;
+}
+
+static size_t context_test_allocations = 0;
+
+static void * counting_allocate(void *userData, size_t size)
+{
+    (void)userData;
+    __atomic_fetch_add(&context_test_allocations, 1, __ATOMIC_RELAXED);
+    return malloc(size);
+}
+
+static void counting_release(void *userData, void *pointer)
+{
+    (void)userData;
+    __atomic_fetch_sub(&context_test_allocations, 1, __ATOMIC_RELAXED);
+    free(pointer);
+}
+
+static void * context_lookup_thread(void *arg)
+{
+    SailfishKeyProvider_Context *context = (SailfishKeyProvider_Context *)arg;
+    char *value = NULL;
+    int i = 0;
+    for (i = 0; i < 200; ++i) {
+        if (SailfishKeyProvider_context_storedKey(
+                    context, "tst_context", "service", "key", &value) != 0
+                || strcmp(value, "value2") != 0) {
+            free(value);
+            return arg;
+        }
+        free(value);
+    }
+    return NULL;
+}
+
+/* Moves the modification time of \a filename ten seconds back, so that
+   the context may keep the file parsed */
+static void age_file(const char *filename)
+{
+    struct timespec times[2];
+    clock_gettime(CLOCK_REALTIME, &times[0]);
+    times[0].tv_sec -= 10;
+    times[1] = times[0];
+    utimensat(AT_FDCWD, filename, times, 0);
+}
+
+int test_context()
+{
+    SailfishKeyProvider_Allocator allocator = { counting_allocate, counting_release, NULL };
+    SailfishKeyProvider_ContextStats stats;
+    SailfishKeyProvider_Context *context = NULL;
+    char *encoded = NULL;
+    char *value = NULL;
+    char filename[768];
+    pthread_t threads[4];
+    void *threadResult = NULL;
+    int failed = 0;
+    int i = 0;
+
+#ifdef SAILFISHKEYPROVIDER_SHARDED_KEYSTORE
+    snprintf(filename, sizeof(filename),
+             "%s/.local/share/system/privileged/Keys/tst_context.ini", getenv("HOME"));
+#else
+    snprintf(filename, sizeof(filename),
+             "%s/.local/share/system/privileged/Keys/storedkeys.ini", getenv("HOME"));
+#endif
+
+    context = SailfishKeyProvider_context_create(&allocator);
+    if (context == NULL
+            || SailfishKeyProvider_encodeKey("value1", "xor", "tstKey", &encoded) != 0
+            || SailfishKeyProvider_context_storeKey(
+                    context, "tst_context", "service", "key", encoded, "xor", "tstKey") != 0) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_context: unable to store key");
+        SailfishKeyProvider_context_destroy(context);
+        free(encoded);
+        return TEST_FAIL;
+    }
+    free(encoded);
+    encoded = NULL;
+
+    /* an unchanged file is parsed once, and then served from the cache */
+    age_file(filename);
+    for (i = 0; i < 3 && !failed; ++i) {
+        failed = (SailfishKeyProvider_context_storedKey(
+                        context, "tst_context", "service", "key", &value) != 0
+                  || strcmp(value, "value1") != 0);
+        free(value);
+        value = NULL;
+    }
+    SailfishKeyProvider_context_stats(context, &stats);
+    if (failed || stats.lookups != 3 || stats.stores != 1
+            || stats.cacheHits < 2 || stats.cachedFiles == 0 || stats.cachedBytes == 0) {
+        fprintf(stdout,
+                "FAIL!    test_context: lookups %llu, cache hits %llu\n",
+                (unsigned long long)stats.lookups,
+                (unsigned long long)stats.cacheHits);
+        SailfishKeyProvider_context_destroy(context);
+        return TEST_FAIL;
+    }
+
+    /* a change by another writer is seen, and the context can be shared */
+    if (SailfishKeyProvider_encodeKey("value2", "xor", "tstKey", &encoded) != 0
+            || SailfishKeyProvider_storeKey(
+                    "tst_context", "service", "key", encoded, "xor", "tstKey") != 0) {
+        failed = 1;
+    }
+    free(encoded);
+    for (i = 0; i < 4 && !failed; ++i) {
+        failed = (pthread_create(&threads[i], NULL, context_lookup_thread, context) != 0);
+    }
+    while (i-- > 0) {
+        pthread_join(threads[i], &threadResult);
+        failed = failed || (threadResult != NULL);
+    }
+
+    SailfishKeyProvider_context_removeKey(context, "tst_context", "service", "key");
+    SailfishKeyProvider_context_destroy(context);
+    if (failed || context_test_allocations != 0) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_context: lookups failed, or context memory was not released");
+        return TEST_FAIL;
+    }
+
+    fprintf(stdout,
+            "%s\n",
+            "PASS!    test_context");
+    return TEST_PASS;
+}
+
+int test_home_stores()
+{
+    char homes[2][256];
+    char *encoded = NULL;
+    char *value = NULL;
+    size_t bytes = 0;
+    int failed = 0;
+    int i = 0;
+
+    /* the privileged directory is provisioned with the home directory */
+    for (i = 0; i < 2; ++i) {
+        char path[600];
+        snprintf(homes[i], sizeof(homes[i]), "%s/tst_home%d", getenv("HOME"), i);
+        mkdir(homes[i], S_IRWXU);
+        snprintf(path, sizeof(path), "%s/.local", homes[i]);
+        mkdir(path, S_IRWXU);
+        snprintf(path, sizeof(path), "%s/.local/share", homes[i]);
+        mkdir(path, S_IRWXU);
+        snprintf(path, sizeof(path), "%s/.local/share/system", homes[i]);
+        mkdir(path, S_IRWXU);
+        snprintf(path, sizeof(path), "%s/.local/share/system/privileged", homes[i]);
+        mkdir(path, S_IRWXU);
+    }
+
+    /* each home has a store of its own, independent of $HOME */
+    for (i = 0; i < 2 && !failed; ++i) {
+        failed = (SailfishKeyProvider_encodeKey(i == 0 ? "first" : "second",
+                                                "xor", "tstKey", &encoded) != 0
+                  || SailfishKeyProvider_home_storeKey(homes[i], "tst_home", "service",
+                                                       "key", encoded, "xor", "tstKey") != 0);
+        free(encoded);
+        encoded = NULL;
+    }
+    for (i = 0; i < 2 && !failed; ++i) {
+        failed = (SailfishKeyProvider_home_storedKey(homes[i], "tst_home", "service",
+                                                     "key", &value) != 0
+                  || strcmp(value, i == 0 ? "first" : "second") != 0);
+        free(value);
+        value = NULL;
+    }
+    if (failed || SailfishKeyProvider_storedKey("tst_home", "service", "key", &value) != 1) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_home_stores: stores of different homes are not independent");
+        free(value);
+        return TEST_FAIL;
+    }
+    if (SailfishKeyProvider_store_cache_usage(&bytes) < 2 || bytes == 0) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_home_stores: stores were not kept");
+        return TEST_FAIL;
+    }
+
+    /* with no memory to spare, only the last store used is kept */
+    SailfishKeyProvider_set_store_cache_limit(1);
+    failed = (SailfishKeyProvider_home_storedKey(homes[0], "tst_home", "service",
+                                                 "key", &value) != 0
+              || strcmp(value, "first") != 0);
+    free(value);
+    value = NULL;
+    if (failed || SailfishKeyProvider_store_cache_usage(&bytes) != 1) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_home_stores: store memory was not bounded");
+        SailfishKeyProvider_set_store_cache_limit(1024 * 1024);
+        return TEST_FAIL;
+    }
+    SailfishKeyProvider_set_store_cache_limit(1024 * 1024);
+
+    /* and the store of an evicted home is recreated on demand */
+    failed = (SailfishKeyProvider_home_storedKey(homes[1], "tst_home", "service",
+                                                 "key", &value) != 0
+              || strcmp(value, "second") != 0);
+    free(value);
+    value = NULL;
+
+    /* a user's store is found through the home directory of the user */
+    if (!failed && getenv("HOME") != NULL
+            && SailfishKeyProvider_user_storedKey(getuid(), "tst_home_missing", "service",
+                                                  "key", &value) != 1) {
+        failed = 1;
+    }
+    free(value);
+
+    for (i = 0; i < 2; ++i) {
+        SailfishKeyProvider_home_removeKey(homes[i], "tst_home", "service", "key");
+    }
+    if (failed) {
+        fprintf(stdout,
+                "FAIL!    %s\n",
+                "test_home_stores: lookup after eviction failed");
+        return TEST_FAIL;
+    }
+
+    fprintf(stdout,
+            "%s\n",
+            "PASS!    test_home_stores");
+    return TEST_PASS;
+}
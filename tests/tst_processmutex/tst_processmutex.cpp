@@ -0,0 +1,617 @@
+/*
+ * Copyright (C) 2017 Jolla Ltd. and/or its subsidiary(-ies).
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "sailfishkeyprovider_processmutex.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define TEST_PASS 0
+#define TEST_SKIP 1
+#define TEST_FAIL 2
+
+using Sailfish::KeyProvider::ProcessMutex;
+using Sailfish::KeyProvider::Semaphore;
+using Sailfish::KeyProvider::StripedProcessMutex;
+
+namespace {
+
+// How long a blocked child is given to show that it stays blocked
+const int blockedMs = 200;
+// How long a child is given to take a lock which has become free
+const int acquireMs = 2000;
+
+// What a forked child does with the lock on the test path.  Every child
+// reports once it holds the lock, and then holds it until told to release
+// it, except DieHolding which exits while still holding the lock.
+enum ChildAction {
+    LockExclusive,
+    LockShared,
+    LockStripe,
+    DieHolding
+};
+
+struct Child {
+    pid_t pid;
+    int commands;   // parent to child
+    int events;     // child to parent
+};
+
+void childWaitCommand(int fd)
+{
+    char c = 0;
+    while (::read(fd, &c, 1) == -1 && errno == EINTR) {
+    }
+}
+
+void childSignal(int fd)
+{
+    char c = 'x';
+    while (::write(fd, &c, 1) == -1 && errno == EINTR) {
+    }
+}
+
+void childRun(const char *path, ChildAction action, ProcessMutex::Backend backend,
+              const char *name, int commands, int events)
+{
+    bool ok = false;
+    if (action == LockStripe) {
+        StripedProcessMutex mutex(path, 16, backend);
+        if (mutex.lock(name)) {
+            childSignal(events);
+            childWaitCommand(commands);
+            ok = mutex.unlock(name);
+        }
+    } else {
+        ProcessMutex mutex(path, backend);
+        if (action == LockShared ? mutex.lockShared() : mutex.lock()) {
+            childSignal(events);
+            if (action == DieHolding) {
+                // the lock is left for the kernel, or the next locker, to recover
+                ::_exit(0);
+            }
+            childWaitCommand(commands);
+            ok = (action == LockShared ? mutex.unlockShared() : mutex.unlock());
+        }
+    }
+    ::_exit(ok ? 0 : 1);
+}
+
+bool spawn(Child *child, const char *path, ChildAction action,
+           ProcessMutex::Backend backend = ProcessMutex::SemaphoreBackend,
+           const char *name = 0)
+{
+    int commands[2];
+    int events[2];
+    if (::pipe(commands) == -1) {
+        return false;
+    }
+    if (::pipe(events) == -1) {
+        ::close(commands[0]);
+        ::close(commands[1]);
+        return false;
+    }
+
+    fflush(stdout);
+    child->pid = ::fork();
+    if (child->pid == 0) {
+        ::close(commands[1]);
+        ::close(events[0]);
+        childRun(path, action, backend, name, commands[0], events[1]);
+    }
+    ::close(commands[0]);
+    ::close(events[1]);
+    child->commands = commands[1];
+    child->events = events[0];
+    if (child->pid == -1) {
+        ::close(child->commands);
+        ::close(child->events);
+        return false;
+    }
+    return true;
+}
+
+// Whether the child reports holding its lock within timeoutMs
+bool acquired(Child *child, int timeoutMs)
+{
+    struct pollfd fd;
+    fd.fd = child->events;
+    fd.events = POLLIN;
+    fd.revents = 0;
+
+    int rv = 0;
+    while ((rv = ::poll(&fd, 1, timeoutMs)) == -1 && errno == EINTR) {
+    }
+    if (rv != 1) {
+        return false;
+    }
+    char c = 0;
+    return ::read(child->events, &c, 1) == 1;
+}
+
+// Tells the child to release its lock, and reaps it
+bool release(Child *child)
+{
+    char c = 'x';
+    int status = 0;
+    if (::write(child->commands, &c, 1) != 1) {
+        ::kill(child->pid, SIGKILL);
+    }
+    ::close(child->commands);
+    ::close(child->events);
+    if (::waitpid(child->pid, &status, 0) != child->pid) {
+        return false;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Reaps a child which is stuck waiting for a lock
+void abandon(Child *child)
+{
+    ::kill(child->pid, SIGKILL);
+    release(child);
+}
+
+long elapsedMs(const struct timespec &start)
+{
+    struct timespec now;
+    ::clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+}
+
+struct timespec after(long ms)
+{
+    struct timespec deadline;
+    ::clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_nsec -= 1000000000;
+        ++deadline.tv_sec;
+    }
+    return deadline;
+}
+
+// Each test locks a file of its own, so that no state is shared
+bool createLockPath(char *path, size_t size, const char *name)
+{
+    snprintf(path, size, "/tmp/tst_processmutex_%s_XXXXXX", name);
+    int fd = ::mkstemp(path);
+    if (fd == -1) {
+        return false;
+    }
+    ::close(fd);
+    return true;
+}
+
+int fail(const char *name, const char *message)
+{
+    fprintf(stdout, "FAIL!    %s: %s\n", name, message);
+    return TEST_FAIL;
+}
+
+// A timed attempt on a lock held elsewhere fails with ETIMEDOUT after
+// roughly the time asked for: not microseconds, and not immediately for
+// timeouts of a second or more
+bool timesOut(ProcessMutex *mutex, size_t timeoutMs)
+{
+    struct timespec start;
+    ::clock_gettime(CLOCK_MONOTONIC, &start);
+    errno = 0;
+    bool locked = mutex->tryLockFor(timeoutMs);
+    long elapsed = elapsedMs(start);
+    if (locked) {
+        mutex->unlock();
+        return false;
+    }
+    return errno == ETIMEDOUT
+        && elapsed >= static_cast<long>(timeoutMs) - 20
+        && elapsed < static_cast<long>(timeoutMs) + 1000;
+}
+
+int testTimeouts(ProcessMutex::Backend backend, const char *name)
+{
+    char path[256];
+    if (!createLockPath(path, sizeof(path), "timeouts")) {
+        return fail(name, "unable to create lock path");
+    }
+
+    int result = TEST_PASS;
+    Child holder;
+    if (!spawn(&holder, path, LockExclusive, backend) || !acquired(&holder, acquireMs)) {
+        ::unlink(path);
+        return fail(name, "child did not take the lock");
+    }
+
+    {
+        ProcessMutex mutex(path, backend);
+        struct timespec start;
+        ::clock_gettime(CLOCK_MONOTONIC, &start);
+        errno = 0;
+        if (mutex.tryLockFor(0) || errno != ETIMEDOUT || elapsedMs(start) > 100) {
+            result = fail(name, "a zero timeout did not fail at once");
+        } else if (!timesOut(&mutex, 300)) {
+            result = fail(name, "a 300 ms timeout did not wait 300 ms");
+        } else if (!timesOut(&mutex, 1100)) {
+            result = fail(name, "a timeout over one second did not wait for it");
+        } else {
+            ::clock_gettime(CLOCK_MONOTONIC, &start);
+            errno = 0;
+            if (mutex.tryLockUntil(after(200)) || errno != ETIMEDOUT || elapsedMs(start) < 180) {
+                result = fail(name, "a deadline did not wait until it passed");
+            }
+        }
+
+        if (!release(&holder)) {
+            result = fail(name, "child did not release the lock");
+        } else if (result == TEST_PASS) {
+            if (!mutex.tryLockFor(acquireMs)) {
+                result = fail(name, "unable to lock once released");
+            } else {
+                mutex.unlock();
+            }
+        }
+    }
+
+    ::unlink(path);
+    if (result == TEST_PASS) {
+        fprintf(stdout, "PASS!    %s\n", name);
+    }
+    return result;
+}
+
+int test_semaphore_timeout()
+{
+    const char *name = "test_semaphore_timeout";
+    char path[256];
+    if (!createLockPath(path, sizeof(path), "semaphore")) {
+        return fail(name, "unable to create lock path");
+    }
+
+    int result = TEST_PASS;
+    {
+        // semtimedop() reports a timeout as EAGAIN
+        Semaphore semaphore(path, 0);
+        struct timespec start;
+        ::clock_gettime(CLOCK_MONOTONIC, &start);
+        errno = 0;
+        if (!semaphore.isValid()) {
+            result = fail(name, "invalid semaphore");
+        } else if (semaphore.decrement(0, true, 300)) {
+            result = fail(name, "decremented a semaphore at zero");
+        } else if (errno != EAGAIN || elapsedMs(start) < 280 || elapsedMs(start) > 1300) {
+            result = fail(name, "decrement did not wait for its timeout");
+        }
+    }
+
+    ::unlink(path);
+    if (result == TEST_PASS) {
+        fprintf(stdout, "PASS!    %s\n", name);
+    }
+    return result;
+}
+
+int test_timeouts()
+{
+    return testTimeouts(ProcessMutex::SemaphoreBackend, "test_timeouts");
+}
+
+int test_shared_memory_timeouts()
+{
+    return testTimeouts(ProcessMutex::SharedMemoryBackend, "test_shared_memory_timeouts");
+}
+
+int test_shared_locking()
+{
+    const char *name = "test_shared_locking";
+    char path[256];
+    if (!createLockPath(path, sizeof(path), "shared")) {
+        return fail(name, "unable to create lock path");
+    }
+
+    int result = TEST_PASS;
+    Child reader;
+    Child writer;
+    Child lateReader;
+    bool haveReader = false, haveWriter = false, haveLateReader = false;
+    {
+        ProcessMutex mutex(path);
+        bool holding = mutex.lockShared();
+        if (!holding) {
+            result = fail(name, "unable to lock shared");
+        } else if (!(haveReader = spawn(&reader, path, LockShared))
+                || !acquired(&reader, acquireMs)) {
+            result = fail(name, "readers excluded each other");
+        } else if (!(haveWriter = spawn(&writer, path, LockExclusive))
+                || acquired(&writer, blockedMs)) {
+            result = fail(name, "writer was not excluded by readers");
+        } else if (!(haveLateReader = spawn(&lateReader, path, LockShared))
+                || acquired(&lateReader, blockedMs)) {
+            result = fail(name, "reader overtook a waiting writer");
+        } else {
+            mutex.unlockShared();
+            holding = false;
+            haveReader = false;
+            if (!release(&reader)) {
+                result = fail(name, "reader did not release the lock");
+            } else if (!acquired(&writer, acquireMs)) {
+                result = fail(name, "writer did not take the released lock");
+            } else if (acquired(&lateReader, blockedMs)) {
+                result = fail(name, "reader was not excluded by the writer");
+            } else {
+                haveWriter = false;
+                if (!release(&writer)) {
+                    result = fail(name, "writer did not release the lock");
+                } else if (!acquired(&lateReader, acquireMs)) {
+                    result = fail(name, "reader did not follow the writer");
+                } else {
+                    haveLateReader = false;
+                    if (!release(&lateReader)) {
+                        result = fail(name, "reader did not release the lock");
+                    }
+                }
+            }
+        }
+        if (holding) {
+            mutex.unlockShared();
+        }
+    }
+
+    if (haveLateReader) {
+        abandon(&lateReader);
+    }
+    if (haveWriter) {
+        abandon(&writer);
+    }
+    if (haveReader) {
+        abandon(&reader);
+    }
+    ::unlink(path);
+    if (result == TEST_PASS) {
+        fprintf(stdout, "PASS!    %s\n", name);
+    }
+    return result;
+}
+
+int testStripes(ProcessMutex::Backend backend, const char *name)
+{
+    char path[256];
+    if (!createLockPath(path, sizeof(path), "stripes")) {
+        return fail(name, "unable to create lock path");
+    }
+
+    // find a name on another stripe, and one on the same stripe
+    char other[32];
+    char same[32];
+    other[0] = same[0] = '\0';
+    {
+        StripedProcessMutex mutex(path, 16, backend);
+        if (!mutex.isValid() || mutex.stripeCount() != 16) {
+            ::unlink(path);
+            return fail(name, "invalid striped lock");
+        }
+        size_t stripe = mutex.stripe("provider");
+        for (int i = 0; i < 1000 && (other[0] == '\0' || same[0] == '\0'); ++i) {
+            char candidate[32];
+            snprintf(candidate, sizeof(candidate), "provider%d", i);
+            if (mutex.stripe(candidate) == stripe) {
+                if (same[0] == '\0') {
+                    strcpy(same, candidate);
+                }
+            } else if (other[0] == '\0') {
+                strcpy(other, candidate);
+            }
+        }
+    }
+
+    int result = TEST_PASS;
+    Child holder;
+    Child unrelated;
+    Child contender;
+    bool haveContender = false;
+    if (!spawn(&holder, path, LockStripe, backend, "provider") || !acquired(&holder, acquireMs)) {
+        ::unlink(path);
+        return fail(name, "child did not take its stripe");
+    }
+    if (!spawn(&unrelated, path, LockStripe, backend, other)
+            || !acquired(&unrelated, acquireMs)) {
+        result = fail(name, "a name on another stripe was blocked");
+    } else if (!release(&unrelated)) {
+        result = fail(name, "unable to release another stripe");
+    } else if (!(haveContender = spawn(&contender, path, LockStripe, backend, same))
+            || acquired(&contender, blockedMs)) {
+        result = fail(name, "a name on the same stripe was not blocked");
+    }
+    if (!release(&holder)) {
+        result = fail(name, "child did not release its stripe");
+    } else if (result == TEST_PASS) {
+        if (!acquired(&contender, acquireMs)) {
+            result = fail(name, "the stripe was not taken once released");
+        } else if (!release(&contender)) {
+            result = fail(name, "unable to release the stripe");
+        }
+        haveContender = false;
+    }
+    if (haveContender) {
+        abandon(&contender);
+    }
+
+    ::unlink(path);
+    if (result == TEST_PASS) {
+        fprintf(stdout, "PASS!    %s\n", name);
+    }
+    return result;
+}
+
+int test_striped_locks()
+{
+    return testStripes(ProcessMutex::SemaphoreBackend, "test_striped_locks");
+}
+
+int test_shared_memory_striped_locks()
+{
+    return testStripes(ProcessMutex::SharedMemoryBackend, "test_shared_memory_striped_locks");
+}
+
+int testOwnerDeath(ProcessMutex::Backend backend, const char *name)
+{
+    char path[256];
+    if (!createLockPath(path, sizeof(path), "death")) {
+        return fail(name, "unable to create lock path");
+    }
+
+    int result = TEST_PASS;
+    Child holder;
+    int status = 0;
+    if (!spawn(&holder, path, DieHolding, backend) || !acquired(&holder, acquireMs)) {
+        result = fail(name, "child did not take the lock");
+    }
+    ::close(holder.commands);
+    ::close(holder.events);
+    ::waitpid(holder.pid, &status, 0);
+
+    if (result == TEST_PASS) {
+        ProcessMutex mutex(path, backend);
+        if (!mutex.tryLockFor(acquireMs)) {
+            result = fail(name, "lock was not recovered from its dead owner");
+        } else if (!mutex.unlock()) {
+            result = fail(name, "unable to unlock the recovered lock");
+        } else if (!mutex.tryLockFor(0)) {
+            result = fail(name, "recovered lock was left unusable");
+        } else {
+            mutex.unlock();
+        }
+    }
+
+    ::unlink(path);
+    if (result == TEST_PASS) {
+        fprintf(stdout, "PASS!    %s\n", name);
+    }
+    return result;
+}
+
+int test_owner_death()
+{
+    return testOwnerDeath(ProcessMutex::SemaphoreBackend, "test_owner_death");
+}
+
+int test_shared_memory_owner_death()
+{
+    return testOwnerDeath(ProcessMutex::SharedMemoryBackend, "test_shared_memory_owner_death");
+}
+
+int test_shared_memory_stale_object()
+{
+    const char *name = "test_shared_memory_stale_object";
+    char path[256];
+    if (!createLockPath(path, sizeof(path), "stale")) {
+        return fail(name, "unable to create lock path");
+    }
+
+    // what a creator which died before sizing the object leaves behind
+    struct stat st;
+    char shmName[96];
+    ::stat(path, &st);
+    snprintf(shmName, sizeof(shmName), "/sailfishkeyprovider-%llx-%llx",
+             static_cast<unsigned long long>(st.st_dev),
+             static_cast<unsigned long long>(st.st_ino));
+    int fd = ::shm_open(shmName, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+        ::unlink(path);
+        return fail(name, "unable to create stale object");
+    }
+    ::close(fd);
+
+    int result = TEST_PASS;
+    {
+        struct timespec start;
+        ::clock_gettime(CLOCK_MONOTONIC, &start);
+        ProcessMutex mutex(path, ProcessMutex::SharedMemoryBackend);
+        if (elapsedMs(start) > 500) {
+            result = fail(name, "waited for the stale object to be initialized");
+        } else if (!mutex.isInitialProcess() || !mutex.tryLockFor(0)) {
+            result = fail(name, "stale object was not replaced");
+        } else {
+            mutex.unlock();
+        }
+    }
+
+    ::shm_unlink(shmName);
+    ::unlink(path);
+    if (result == TEST_PASS) {
+        fprintf(stdout, "PASS!    %s\n", name);
+    }
+    return result;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+    int passCount = 0, failCount = 0, skipCount = 0;
+
+    int results[] = {
+        test_semaphore_timeout(),
+        test_timeouts(),
+        test_shared_memory_timeouts(),
+        test_shared_locking(),
+        test_striped_locks(),
+        test_shared_memory_striped_locks(),
+        test_owner_death(),
+        test_shared_memory_owner_death(),
+        test_shared_memory_stale_object()
+    };
+    const int testCount = sizeof(results) / sizeof(results[0]);
+
+    (void)argc;
+    (void)argv;
+
+    for (int i = 0; i < testCount; ++i) {
+        switch (results[i]) {
+            case TEST_PASS: passCount++; break;
+            case TEST_SKIP: skipCount++; break;
+            case TEST_FAIL: failCount++; break;
+            default: {
+                fprintf(stderr,
+                        "erroneous result[%d] = %d",
+                        i, results[i]);
+                break;
+            }
+        }
+    }
+
+    fprintf(stdout,
+            "Passed: %d  Failed: %d  Skipped: %d\n",
+            passCount, failCount, skipCount);
+
+    if (failCount == 0)
+        return TEST_PASS;
+    return TEST_FAIL;
+}
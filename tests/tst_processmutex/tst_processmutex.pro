@@ -0,0 +1,13 @@
+TEMPLATE=app
+TARGET=tst_processmutex
+TARGETPATH = /opt/tests/libsailfishkeyprovider
+target.path = $$TARGETPATH
+
+CONFIG -= qt
+MOC_DIR = $$PWD/../../.moc
+OBJECTS_DIR = $$PWD/../../.obj
+
+include($$PWD/../../lib/lib.pri)
+SOURCES += tst_processmutex.cpp
+
+INSTALLS += target